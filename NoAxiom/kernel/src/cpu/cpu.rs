@@ -14,6 +14,9 @@ pub fn get_hartid() -> usize {
 pub struct Cpu {
     /// pointer of current task on this hart
     pub task: Option<Arc<Task>>,
+    /// task whose user space a kernel task works in, it's not the current
+    /// task but user page faults are fixed in its memory set
+    pub user_space: Option<Arc<Task>>,
     pub ktrap_depth: usize,
 }
 
@@ -21,6 +24,7 @@ impl Cpu {
     pub const fn new() -> Self {
         Self {
             task: None,
+            user_space: None,
             ktrap_depth: 0,
         }
     }
@@ -49,6 +53,12 @@ impl Cpu {
     pub fn current_task(&self) -> &Option<Arc<Task>> {
         &self.task
     }
+    pub fn set_user_space(&mut self, task: &Arc<Task>) {
+        self.user_space = Some(task.clone());
+    }
+    pub fn clear_user_space(&mut self) {
+        self.user_space = None;
+    }
 }
 
 const DEFAULT_CPU: SyncUnsafeCell<Cpu> = SyncUnsafeCell::new(Cpu::new());
@@ -61,3 +71,10 @@ pub fn current_cpu() -> &'static mut Cpu {
 pub fn current_task() -> Option<&'static Arc<Task>> {
     current_cpu().current_task().as_ref()
 }
+
+/// the task whose user memory is accessed on this hart, the current task or
+/// the one a kernel task works for
+pub fn current_user_task() -> Option<&'static Arc<Task>> {
+    let cpu = current_cpu();
+    cpu.task.as_ref().or(cpu.user_space.as_ref())
+}
@@ -13,7 +13,9 @@ use crate::{
         frame_init,
         heap::heap_init,
         memory_set::{kernel_space_activate, kernel_space_init},
+        zram::spawn_reclaimer,
     },
+    net::net_init,
     sched::utils::block_on,
     time::clock::ktime_init,
     utils::log::log_init,
@@ -88,8 +90,12 @@ pub extern "C" fn _boot_hart_init(_: usize, dtb: usize) -> ! {
     // fs init
     block_on(fs_init());
 
+    // net init
+    net_init();
+
     // spawn init_proc and wake other harts
     ktime_init();
+    spawn_reclaimer();
     schedule_spawn_with_path();
     #[cfg(feature = "multicore")]
     wake_other_hart(get_hartid());
@@ -79,5 +79,16 @@ pub const INIT_PROC_NAME: &'static str = "run_busybox";
 #[cfg(feature = "runtests")]
 pub const INIT_PROC_NAME: &'static str = "run_tests";
 
+#[cfg(feature = "bench")]
+pub const INIT_PROC_NAME: &'static str = "run_bench";
+
+#[cfg(not(feature = "bench"))]
 use_apps!("run_busybox", "run_tests",);
+#[cfg(not(feature = "bench"))]
 gen_get_content!("run_busybox", "run_tests");
+
+// run_bench is only in the user bin directory when built by `make bench`
+#[cfg(feature = "bench")]
+use_apps!("run_busybox", "run_tests", "run_bench");
+#[cfg(feature = "bench")]
+gen_get_content!("run_busybox", "run_tests", "run_bench");
@@ -1,113 +1,425 @@
 //! async block cache
+//!
+//! Sectors are hashed into [`BLOCK_CACHE_SHARDS`] shards, each protected by a
+//! spin lock that is never held across device io. Writes only dirty the
+//! cached copy, dirty sectors reach the disk when they are evicted, by the
+//! background flusher or by `sync_all`. A sector being written back is kept
+//! in the writeback map of its shard until the device write completes, so a
+//! concurrent miss never reads the stale disk copy.
+//!
+//! A miss only inserts what it read from the disk if the generation of the
+//! shard didn't move meanwhile, and sequential misses are detected per
+//! stream, so neither takes a lock shared by all sectors.
 
-use alloc::{boxed::Box, sync::Arc, vec::Vec};
-use core::num::NonZeroUsize;
+use alloc::{boxed::Box, collections::BTreeMap, sync::Arc, vec::Vec};
+use core::{future::pending, num::NonZeroUsize, time::Duration};
 
+use array_init::array_init;
 use async_trait::async_trait;
 use driver::{
     basic::{DevResult, Device},
-    block::BlockDevice,
+    block::{BlockDevice, BlockSegment},
     interrupt::InterruptDevice,
-    manager::DEV_BUS,
 };
-use ksync::{assert_no_lock, cell::SyncUnsafeCell, AsyncMutex};
+use kfuture::yield_fut::YieldFuture;
+use ksync::{assert_no_lock, mutex::SpinLock};
 use lru::LruCache;
 
-use crate::config::fs::{BLOCK_SIZE, MAX_LRU_CACHE_SIZE};
+use crate::{
+    config::fs::{
+        BLOCK_CACHE_FLUSH_INTERVAL_MS, BLOCK_CACHE_MAX_BATCH, BLOCK_CACHE_READ_AHEAD_STREAMS,
+        BLOCK_CACHE_SHARDS, BLOCK_SIZE, MAX_LRU_CACHE_SIZE,
+    },
+    fs::blockqueue::BLOCK_QUEUE,
+    sched::spawn::spawn_ktask,
+    time::timeout::TimeLimitedFuture,
+    utils::trace::BLOCK_CACHE_STAT,
+};
+
+type Block = [u8; BLOCK_SIZE];
 
 lazy_static::lazy_static! {
-    pub static ref BLOCK_CACHE: SyncUnsafeCell<AsyncBlockCache> = SyncUnsafeCell::new(AsyncBlockCache {
-        cache: AsyncMutex::new(LruCache::new(
-            NonZeroUsize::new(MAX_LRU_CACHE_SIZE).unwrap(),
-        )),
-        block_device: DEV_BUS.get_default_block_device().unwrap(),
-    });
+    pub static ref BLOCK_CACHE: AsyncBlockCache =
+        AsyncBlockCache::new(&*BLOCK_QUEUE);
 }
 
 pub fn get_block_cache() -> &'static dyn BlockDevice {
     log::debug!("[block_cache] use block cache");
-    BLOCK_CACHE.as_ref()
+    &*BLOCK_CACHE
+}
+
+/// spawn the kernel task that periodically writes dirty sectors back
+pub fn spawn_flusher() {
+    spawn_ktask(async {
+        let interval = Duration::from_millis(BLOCK_CACHE_FLUSH_INTERVAL_MS);
+        loop {
+            TimeLimitedFuture::new(pending::<()>(), Some(interval)).await;
+            BLOCK_CACHE.flush_dirty().await;
+        }
+    });
+}
+
+struct CacheEntry {
+    data: Arc<Block>,
+    dirty: bool,
+}
+
+struct Shard {
+    lru: LruCache<usize, CacheEntry>,
+    /// sectors whose write back is in flight, the latest data is kept here
+    /// and the task that inserted the sector owns the write back
+    writeback: BTreeMap<usize, Arc<Block>>,
+    /// bumped whenever a sector of the shard may become newer in the cache
+    /// than on the disk or its write back completes, a miss filled from the
+    /// disk is only inserted if no such event raced with the device read
+    gen: usize,
 }
 
-/// async block cache with LRU strategy  
+impl Shard {
+    fn new(cap: usize) -> Self {
+        Self {
+            lru: LruCache::new(NonZeroUsize::new(cap).unwrap()),
+            writeback: BTreeMap::new(),
+            gen: 0,
+        }
+    }
+
+    fn lookup(&mut self, sector: usize) -> Option<Arc<Block>> {
+        if let Some(entry) = self.lru.get(&sector) {
+            return Some(entry.data.clone());
+        }
+        self.writeback.get(&sector).cloned()
+    }
+
+    /// hand `data` over to the writeback map, returns whether the caller
+    /// owns the write back; otherwise the current owner picks up the data
+    fn start_writeback(&mut self, sector: usize, data: Arc<Block>) -> bool {
+        self.writeback.insert(sector, data).is_none()
+    }
+
+    /// replace the data of `sector` with a newer copy to write back later
+    fn dirty(&mut self, sector: usize, data: Arc<Block>, to_write: &mut Vec<(usize, Arc<Block>)>) {
+        match self.lru.get_mut(&sector) {
+            Some(entry) => {
+                entry.data = data;
+                entry.dirty = true;
+            }
+            None => self.insert(sector, data, true, to_write),
+        }
+        self.gen += 1;
+    }
+
+    fn insert(
+        &mut self,
+        sector: usize,
+        data: Arc<Block>,
+        dirty: bool,
+        to_write: &mut Vec<(usize, Arc<Block>)>,
+    ) {
+        if let Some((key, entry)) = self.lru.push(sector, CacheEntry { data, dirty }) {
+            if key != sector && entry.dirty && self.start_writeback(key, entry.data.clone()) {
+                to_write.push((key, entry.data));
+            }
+        }
+    }
+}
+
+/// a sequential stream of misses, its read-ahead window doubles on every
+/// miss right where the last read-ahead ended
+#[derive(Clone, Copy)]
+struct ReadAhead {
+    next: usize,
+    window: usize,
+}
+
+/// sharded write-back block cache with LRU strategy
 pub struct AsyncBlockCache {
-    cache: AsyncMutex<LruCache<usize, Arc<[u8; BLOCK_SIZE]>>>, /* todo: use async_mutex, or
-                                                                * doesn't need */
+    shards: [SpinLock<Shard>; BLOCK_CACHE_SHARDS],
+    /// streams hashed by the sector of their next miss
+    streams: [SpinLock<Option<ReadAhead>>; BLOCK_CACHE_READ_AHEAD_STREAMS],
     block_device: &'static dyn BlockDevice,
 }
 
-// impl Drop for CacheData {
-//     fn drop(&mut self) {
-//         if self.dirty {
-//             info!("CacheData Writeback sector: {}", self.sector);
-//         }
-//     }
-// }
-
 impl AsyncBlockCache {
-    /// read a block from the cache or block device  
+    pub fn new(block_device: &'static dyn BlockDevice) -> Self {
+        let cap = (MAX_LRU_CACHE_SIZE / BLOCK_CACHE_SHARDS).max(1);
+        Self {
+            shards: array_init(|_| SpinLock::new(Shard::new(cap))),
+            streams: array_init(|_| SpinLock::new(None)),
+            block_device,
+        }
+    }
+
+    /// sectors of one 4k group share a shard, so a fs block hits one lock
+    fn shard(&self, sector: usize) -> &SpinLock<Shard> {
+        &self.shards[(sector >> 3) % BLOCK_CACHE_SHARDS]
+    }
+
+    fn stream(&self, sector: usize) -> &SpinLock<Option<ReadAhead>> {
+        &self.streams[sector % BLOCK_CACHE_READ_AHEAD_STREAMS]
+    }
+
+    /// the sectors to read on a miss at `sector`, a miss continuing a stream
+    /// grows its window, any other starts a new stream
+    fn read_ahead(&self, sector: usize) -> usize {
+        let window = {
+            let mut stream = self.stream(sector).lock();
+            match *stream {
+                Some(ra) if ra.next == sector => {
+                    *stream = None;
+                    (ra.window * 2).min(BLOCK_CACHE_MAX_BATCH)
+                }
+                _ => 1,
+            }
+        };
+        let next = sector + window;
+        *self.stream(next).lock() = Some(ReadAhead { next, window });
+        window
+    }
+
+    /// read a block from the cache or block device
     /// mind that `sector` == `block`
-    pub async fn read_sector(&self, sector: usize) -> Arc<[u8; BLOCK_SIZE]> {
-        let mut cache_guard = self.cache.lock().await;
-        if let Some(data) = cache_guard.get(&sector) {
-            // if the data is in the cache, return immediately
-            return data.clone();
+    pub async fn read_sector(&self, sector: usize) -> DevResult<Arc<Block>> {
+        let mut missed = false;
+        loop {
+            if let Some(data) = self.shard(sector).lock().lookup(sector) {
+                if !missed {
+                    BLOCK_CACHE_STAT.hit();
+                }
+                return Ok(data);
+            }
+            if !missed {
+                BLOCK_CACHE_STAT.miss();
+                missed = true;
+            }
+            let count = self.read_ahead(sector);
+            if let Some(data) = self.fill(sector, count).await? {
+                return Ok(data);
+            }
         }
+    }
 
-        // else read the data from cache
-        let mut data = [0; BLOCK_SIZE];
+    /// the generations of the shards of `count` sectors from `start`
+    fn gens(&self, start: usize, count: usize) -> Vec<usize> {
+        (start..start + count)
+            .map(|sector| self.shard(sector).lock().gen)
+            .collect()
+    }
+
+    /// read `count` sectors from `start` with one device request and insert
+    /// the ones not cached yet, returns the data of `start`, or None if the
+    /// read raced with a write to its shard and should be retried
+    async fn fill(&self, start: usize, count: usize) -> DevResult<Option<Arc<Block>>> {
+        let mut buf = vec![0u8; count * BLOCK_SIZE];
+        let gens = self.gens(start, count);
         assert_no_lock!();
-        self.block_device
-            .read(sector, &mut data)
-            .await
-            .expect("read error");
-        let data = Arc::new(data);
-
-        // The key cannot exist in the cache
-        let write_back = cache_guard.push(sector, data.clone());
-        if let Some((key, value)) = write_back {
-            // trace!("read_sector: write back");
-            assert_no_lock!();
-            let _ = self.block_device.write(key, &*value).await;
+        let count = match self.block_device.read(start, &mut buf).await {
+            Ok(_) => count,
+            Err(_) if count > 1 => {
+                // read-ahead may run past the end of the disk
+                buf.truncate(BLOCK_SIZE);
+                assert_no_lock!();
+                self.block_device.read(start, &mut buf).await?;
+                1
+            }
+            Err(err) => return Err(err),
+        };
+
+        let mut to_write = Vec::new();
+        let mut res = None;
+        for (i, chunk) in buf.chunks_exact(BLOCK_SIZE).take(count).enumerate() {
+            let sector = start + i;
+            let mut shard = self.shard(sector).lock();
+            let data = match shard.lookup(sector) {
+                Some(data) => data,
+                None if shard.gen != gens[i] => continue,
+                None => {
+                    let data: Arc<Block> = Arc::new(chunk.try_into().unwrap());
+                    shard.insert(sector, data.clone(), false, &mut to_write);
+                    data
+                }
+            };
+            if i == 0 {
+                res = Some(data);
+            }
         }
-        data
+        self.write_out(to_write).await;
+        Ok(res)
     }
 
-    /// write a block to the cache and block device
+    /// write a block to the cache, it reaches the block device later
     /// mind that `sector` == `block`
-    pub async fn write_sector(&self, sector: usize, data: &[u8; BLOCK_SIZE]) {
-        let mut cache_guard = self.cache.lock().await;
-        let cache_data = cache_guard.get_mut(&sector);
+    pub async fn write_sector(&self, sector: usize, data: &Block) {
         let data = Arc::new(*data);
-        if let Some(cache_data) = cache_data {
-            *cache_data = data;
-            return;
+        let mut to_write = Vec::new();
+        self.shard(sector).lock().dirty(sector, data, &mut to_write);
+        self.write_out(to_write).await;
+    }
+
+    /// write back the sectors owned by the caller, consecutive sectors are
+    /// merged into one vectored request
+    async fn write_out(&self, mut items: Vec<(usize, Arc<Block>)>) {
+        while !items.is_empty() {
+            items.sort_unstable_by_key(|(sector, _)| *sector);
+            let mut next_round = Vec::new();
+            let mut rest = items.as_slice();
+            while !rest.is_empty() {
+                let mut len = 1;
+                while len < rest.len()
+                    && len < BLOCK_CACHE_MAX_BATCH
+                    && rest[len].0 == rest[0].0 + len
+                {
+                    len += 1;
+                }
+                let (run, tail) = rest.split_at(len);
+                rest = tail;
+                let segs: Vec<BlockSegment> = run
+                    .iter()
+                    .map(|(_, data)| BlockSegment::from_kernel_buf(&data[..]))
+                    .collect();
+                assert_no_lock!();
+                let res = self.block_device.write_vectored(run[0].0, &segs).await;
+                if res.is_err() {
+                    error!("[block_cache] write back failed at sector {}", run[0].0);
+                }
+                for (sector, data) in run {
+                    let mut shard = self.shard(*sector).lock();
+                    let latest = shard.writeback.get(sector).cloned();
+                    match latest {
+                        Some(latest) if !Arc::ptr_eq(&latest, data) => {
+                            // rewritten while in flight, write the new data
+                            next_round.push((*sector, latest));
+                            continue;
+                        }
+                        _ => {}
+                    }
+                    if res.is_err() {
+                        // keep the data dirty if it is still cached
+                        if let Some(entry) = shard.lru.peek_mut(sector) {
+                            if Arc::ptr_eq(&entry.data, data) {
+                                entry.dirty = true;
+                            }
+                        }
+                    }
+                    shard.writeback.remove(sector);
+                    shard.gen += 1;
+                }
+            }
+            items = next_round;
         }
+    }
 
-        // If the key already exists in the cache, write back the old data
-        let write_back = cache_guard.push(sector, data);
-        if let Some((key, value)) = write_back {
-            // trace!("write_sector: write back");
-            assert_no_lock!();
-            let _ = self.block_device.write(key, &*value).await;
+    /// write back every dirty sector, entries stay cached as clean
+    pub async fn flush_dirty(&self) {
+        let mut to_write = Vec::new();
+        for shard in self.shards.iter() {
+            let mut shard = shard.lock();
+            let mut dirty = Vec::new();
+            for (sector, entry) in shard.lru.iter_mut() {
+                if entry.dirty {
+                    entry.dirty = false;
+                    dirty.push((*sector, entry.data.clone()));
+                }
+            }
+            for (sector, data) in dirty {
+                if shard.start_writeback(sector, data.clone()) {
+                    to_write.push((sector, data));
+                }
+            }
         }
-        drop(cache_guard);
+        self.write_out(to_write).await;
     }
 
     /// flush all dirty data in the cache to the block device
     pub async fn sync_all(&self) {
         trace!("[AsyncBlockCache] cache sync all begin");
-        let cache_guard = self.cache.lock().await;
-        let mut dirty_data = Vec::new();
-        for (sector, cache) in cache_guard.iter() {
-            dirty_data.push((*sector, cache.clone()));
-        }
-        for (sector, data) in dirty_data {
-            assert_no_lock!();
-            let _ = self.block_device.write(sector, &*data).await;
+        self.flush_dirty().await;
+        // wait for write backs owned by other tasks
+        while self
+            .shards
+            .iter()
+            .any(|shard| !shard.lock().writeback.is_empty())
+        {
+            YieldFuture::new().await;
         }
         info!("[AsyncBlockCache] cache sync all!");
     }
+
+    /// vectored read, served from the cache when every sector is cached,
+    /// otherwise read from the device in one request and the cached sectors
+    /// override the disk data since they may be newer
+    pub async fn read_vectored(&self, id: usize, segs: &[BlockSegment]) -> DevResult<usize> {
+        let len = segs.iter().map(|seg| seg.len).sum();
+        let mut hit = true;
+        for_each_sector(id, segs, |sector, buf| {
+            if hit {
+                match self.shard(sector).lock().lookup(sector) {
+                    Some(data) => buf.copy_from_slice(&*data),
+                    None => hit = false,
+                }
+            }
+        });
+        if hit {
+            BLOCK_CACHE_STAT.hit();
+            return Ok(len);
+        }
+        BLOCK_CACHE_STAT.miss();
+
+        let gens = self.gens(id, len / BLOCK_SIZE);
+        assert_no_lock!();
+        self.block_device.read_vectored(id, segs).await?;
+        let mut stale = Vec::new();
+        let mut to_write = Vec::new();
+        for_each_sector(id, segs, |sector, buf| {
+            let mut shard = self.shard(sector).lock();
+            if let Some(data) = shard.lookup(sector) {
+                buf.copy_from_slice(&*data);
+            } else if shard.gen != gens[sector - id] {
+                stale.push(sector);
+            } else {
+                let data = Arc::new(buf.try_into().unwrap());
+                shard.insert(sector, data, false, &mut to_write);
+            }
+        });
+        self.write_out(to_write).await;
+        // only the sectors that raced with a write are read again
+        let mut fresh = Vec::with_capacity(stale.len());
+        for sector in stale {
+            fresh.push((sector, self.read_sector(sector).await?));
+        }
+        if !fresh.is_empty() {
+            for_each_sector(id, segs, |sector, buf| {
+                if let Ok(i) = fresh.binary_search_by_key(&sector, |(sector, _)| *sector) {
+                    buf.copy_from_slice(&*fresh[i].1);
+                }
+            });
+        }
+        Ok(len)
+    }
+
+    /// vectored write, every sector is dirtied in the cache
+    pub async fn write_vectored(&self, id: usize, segs: &[BlockSegment]) -> DevResult<usize> {
+        let len = segs.iter().map(|seg| seg.len).sum();
+        let mut to_write = Vec::new();
+        for_each_sector(id, segs, |sector, buf| {
+            let data: Arc<Block> = Arc::new((&*buf).try_into().unwrap());
+            self.shard(sector).lock().dirty(sector, data, &mut to_write);
+        });
+        self.write_out(to_write).await;
+        Ok(len)
+    }
+}
+
+/// visit every sector of the segments, `segs` should be block aligned
+fn for_each_sector(id: usize, segs: &[BlockSegment], mut f: impl FnMut(usize, &mut [u8])) {
+    let mut sector = id;
+    for seg in segs {
+        let buf = unsafe { seg.as_kernel_buf() };
+        for chunk in buf.chunks_exact_mut(BLOCK_SIZE) {
+            f(sector, chunk);
+            sector += 1;
+        }
+    }
 }
 
 impl Device for AsyncBlockCache {
@@ -129,7 +441,7 @@ impl InterruptDevice for AsyncBlockCache {
 impl BlockDevice for AsyncBlockCache {
     async fn read(&self, id: usize, buf: &mut [u8]) -> DevResult<usize> {
         assert_eq!(buf.len(), BLOCK_SIZE);
-        let data = self.read_sector(id).await;
+        let data = self.read_sector(id).await?;
         buf.copy_from_slice(&*data);
         Ok(buf.len())
     }
@@ -140,8 +452,15 @@ impl BlockDevice for AsyncBlockCache {
         self.write_sector(id, &data).await;
         Ok(buf.len())
     }
+    async fn read_vectored(&self, id: usize, segs: &[BlockSegment]) -> DevResult<usize> {
+        self.read_vectored(id, segs).await
+    }
+    async fn write_vectored(&self, id: usize, segs: &[BlockSegment]) -> DevResult<usize> {
+        self.write_vectored(id, segs).await
+    }
     async fn sync_all(&self) -> DevResult<()> {
         self.sync_all().await;
-        Ok(())
+        assert_no_lock!();
+        self.block_device.sync_all().await
     }
 }
@@ -0,0 +1,554 @@
+//! block layer request queue
+//!
+//! Sits between the block cache and the driver. Requests are queued per
+//! direction and sorted by sector. A submitter that finds the queue idle
+//! becomes the dispatcher: it plugs the queue for a few yields so that
+//! concurrent submitters can join, then merges contiguous requests into
+//! vectored device requests and dispatches them in C-LOOK order. Reads are
+//! preferred over writes, and a direction whose oldest request passed its
+//! deadline is served from that request first. When the dispatcher's own
+//! request completes it hands the queue over to another waiting submitter.
+//! A submitter dropped midway takes its request back, see [`Submit`].
+
+use alloc::{boxed::Box, collections::BTreeMap, sync::Arc, vec::Vec};
+use core::{
+    future::Future,
+    pin::Pin,
+    task::{Context, Poll, Waker},
+};
+
+use async_trait::async_trait;
+use driver::{
+    basic::{DevResult, Device},
+    block::{BlockDevice, BlockSegment},
+    interrupt::InterruptDevice,
+    manager::DEV_BUS,
+};
+use futures::future::join_all;
+use include::errno::Errno;
+use kfuture::yield_fut::YieldFuture;
+use ksync::{assert_no_lock, mutex::SpinLock};
+
+use crate::{
+    config::fs::{
+        BLOCK_QUEUE_DEPTH, BLOCK_QUEUE_MAX_SECTORS, BLOCK_QUEUE_PLUG_YIELDS,
+        BLOCK_QUEUE_READ_EXPIRE_MS, BLOCK_QUEUE_WRITE_EXPIRE_MS, BLOCK_SIZE,
+    },
+    time::gettime::get_time_ms,
+};
+
+lazy_static::lazy_static! {
+    pub static ref BLOCK_QUEUE: BlockQueue =
+        BlockQueue::new(DEV_BUS.get_default_block_device().unwrap());
+}
+
+#[derive(Clone, Copy, PartialEq, Eq)]
+enum Dir {
+    Read = 0,
+    Write = 1,
+}
+
+struct BioState {
+    res: Option<DevResult<()>>,
+    /// the dispatcher handed the queue over to this submitter
+    kicked: bool,
+    waker: Option<Waker>,
+}
+
+/// completion of a queued request
+struct BioDone(SpinLock<BioState>);
+
+impl BioDone {
+    fn new() -> Self {
+        Self(SpinLock::new(BioState {
+            res: None,
+            kicked: false,
+            waker: None,
+        }))
+    }
+    fn is_done(&self) -> bool {
+        self.0.lock().res.is_some()
+    }
+    fn complete(&self, res: DevResult<()>) {
+        let waker = {
+            let mut state = self.0.lock();
+            state.res = Some(res);
+            state.waker.take()
+        };
+        waker.map(Waker::wake);
+    }
+    fn kick(&self) {
+        let waker = {
+            let mut state = self.0.lock();
+            state.kicked = true;
+            state.waker.take()
+        };
+        waker.map(Waker::wake);
+    }
+    /// whether the queue was handed over and not taken yet
+    fn take_kick(&self) -> bool {
+        core::mem::replace(&mut self.0.lock().kicked, false)
+    }
+}
+
+/// wait until the request completes (Some) or the queue is handed over to
+/// the waiter (None)
+struct BioWaitFuture<'a>(&'a BioDone);
+
+impl Future for BioWaitFuture<'_> {
+    type Output = Option<DevResult<()>>;
+    fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Self::Output> {
+        let mut state = self.0 .0.lock();
+        if let Some(res) = state.res.take() {
+            return Poll::Ready(Some(res));
+        }
+        if state.kicked {
+            state.kicked = false;
+            return Poll::Ready(None);
+        }
+        state.waker = Some(cx.waker().clone());
+        Poll::Pending
+    }
+}
+
+/// a request queued by one submitter
+struct Bio {
+    sector: usize,
+    blocks: usize,
+    segs: Vec<BlockSegment>,
+    deadline: usize,
+    /// submission order, set when queued
+    seq: u64,
+    done: Arc<BioDone>,
+}
+
+/// contiguous requests merged into one device request, the requests are
+/// kept so they can be queued again if the dispatch is dropped
+struct Batch {
+    dir: Dir,
+    sector: usize,
+    blocks: usize,
+    segs: Vec<BlockSegment>,
+    bios: Vec<Bio>,
+}
+
+impl Batch {
+    fn new(dir: Dir, bio: Bio) -> Self {
+        Self {
+            dir,
+            sector: bio.sector,
+            blocks: bio.blocks,
+            segs: bio.segs.clone(),
+            bios: vec![bio],
+        }
+    }
+
+    fn overlaps(&self, sector: usize, blocks: usize) -> bool {
+        sector < self.sector + self.blocks && self.sector < sector + blocks
+    }
+
+    /// append the segments, physically contiguous ones are coalesced
+    fn push_segs(segs: &mut Vec<BlockSegment>, more: Vec<BlockSegment>) {
+        for seg in more {
+            match segs.last_mut() {
+                Some(last) if last.paddr + last.len == seg.paddr => last.len += seg.len,
+                _ => segs.push(seg),
+            }
+        }
+    }
+
+    fn push_back(&mut self, bio: Bio) {
+        self.blocks += bio.blocks;
+        Self::push_segs(&mut self.segs, bio.segs.clone());
+        self.bios.push(bio);
+    }
+
+    fn push_front(&mut self, bio: Bio) {
+        let mut segs = bio.segs.clone();
+        Self::push_segs(&mut segs, core::mem::take(&mut self.segs));
+        self.segs = segs;
+        self.sector = bio.sector;
+        self.blocks += bio.blocks;
+        self.bios.push(bio);
+    }
+}
+
+struct QueueInner {
+    /// pending requests of each direction keyed by (sector, seq), the seq
+    /// keeps requests of the same sector in submission order
+    pending: [BTreeMap<(usize, u64), Bio>; 2],
+    /// the sector after the last dispatched request
+    head: usize,
+    next_seq: u64,
+    /// whether some submitter is dispatching
+    dispatching: bool,
+}
+
+impl QueueInner {
+    fn is_empty(&self) -> bool {
+        self.pending.iter().all(|p| p.is_empty())
+    }
+
+    fn queued_sectors(&self) -> usize {
+        self.pending
+            .iter()
+            .flat_map(|p| p.values())
+            .map(|bio| bio.blocks)
+            .sum()
+    }
+
+    /// queue a new request, returns its key
+    fn push(&mut self, dir: Dir, mut bio: Bio) -> (usize, u64) {
+        bio.seq = self.next_seq;
+        self.next_seq += 1;
+        let key = (bio.sector, bio.seq);
+        self.pending[dir as usize].insert(key, bio);
+        key
+    }
+
+    /// queue a request taken out by a dropped dispatch again, in its old
+    /// place
+    fn requeue(&mut self, dir: Dir, bio: Bio) {
+        self.pending[dir as usize].insert((bio.sector, bio.seq), bio);
+    }
+
+    /// hand the dispatching over to a submitter with a pending request
+    fn hand_over(&mut self) {
+        match self.any_pending() {
+            Some(next) => next.kick(),
+            None => self.dispatching = false,
+        }
+    }
+
+    fn oldest(&self, dir: Dir) -> Option<((usize, u64), usize)> {
+        self.pending[dir as usize]
+            .iter()
+            .min_by_key(|(key, bio)| (bio.deadline, key.1))
+            .map(|(key, bio)| (*key, bio.deadline))
+    }
+
+    /// reads first, unless a write expired
+    fn pick_dir(&self, now: usize) -> Option<Dir> {
+        let write_expired =
+            matches!(self.oldest(Dir::Write), Some((_, deadline)) if deadline <= now);
+        match (self.pending[0].is_empty(), self.pending[1].is_empty()) {
+            (true, true) => None,
+            (false, _) if !write_expired => Some(Dir::Read),
+            (_, false) => Some(Dir::Write),
+            _ => Some(Dir::Read),
+        }
+    }
+
+    /// the oldest request if it expired, otherwise C-LOOK from the head
+    fn pick_start(&self, dir: Dir, now: usize) -> Option<(usize, u64)> {
+        let pending = &self.pending[dir as usize];
+        match self.oldest(dir) {
+            Some((key, deadline)) if deadline <= now => Some(key),
+            _ => pending
+                .range((self.head, 0)..)
+                .next()
+                .or_else(|| pending.iter().next())
+                .map(|(key, _)| *key),
+        }
+    }
+
+    /// take the request at `key` and merge its contiguous neighbours
+    fn take_batch(&mut self, dir: Dir, key: (usize, u64)) -> Batch {
+        let pending = &mut self.pending[dir as usize];
+        let mut batch = Batch::new(dir, pending.remove(&key).unwrap());
+        while batch.blocks < BLOCK_QUEUE_MAX_SECTORS {
+            let end = batch.sector + batch.blocks;
+            let Some(key) = pending
+                .range((end, 0)..(end + 1, 0))
+                .next()
+                .map(|(k, _)| *k)
+            else {
+                break;
+            };
+            batch.push_back(pending.remove(&key).unwrap());
+        }
+        while batch.blocks < BLOCK_QUEUE_MAX_SECTORS {
+            // the earliest request of the previous sector keeps the order
+            let Some(&(prev, _)) = pending
+                .range(..(batch.sector, 0))
+                .next_back()
+                .map(|(k, _)| k)
+            else {
+                break;
+            };
+            let Some(key) = pending
+                .range((prev, 0)..(prev + 1, 0))
+                .next()
+                .filter(|(_, bio)| bio.sector + bio.blocks == batch.sector)
+                .map(|(k, _)| *k)
+            else {
+                break;
+            };
+            batch.push_front(pending.remove(&key).unwrap());
+        }
+        self.head = batch.sector + batch.blocks;
+        batch
+    }
+
+    /// pick up to [`BLOCK_QUEUE_DEPTH`] batches that don't overlap, so the
+    /// device may complete them in any order
+    fn pick_batches(&mut self) -> Vec<Batch> {
+        let now = get_time_ms();
+        let mut batches: Vec<Batch> = Vec::new();
+        while batches.len() < BLOCK_QUEUE_DEPTH {
+            let Some(dir) = self.pick_dir(now) else { break };
+            let key = self.pick_start(dir, now).unwrap();
+            let bio = &self.pending[dir as usize][&key];
+            if batches.iter().any(|b| b.overlaps(bio.sector, bio.blocks)) {
+                break;
+            }
+            batches.push(self.take_batch(dir, key));
+        }
+        batches
+    }
+
+    /// some pending request to take over the dispatching
+    fn any_pending(&self) -> Option<Arc<BioDone>> {
+        self.pending
+            .iter()
+            .flat_map(|p| p.values())
+            .next()
+            .map(|bio| bio.done.clone())
+    }
+}
+
+/// a submitter's hold on the queue, dropping it before the request
+/// completes takes the request off the queue, or waits for it if the device
+/// already has it, so the buffers aren't used after the submitter is gone,
+/// and hands the dispatching on
+struct Submit<'a> {
+    queue: &'a BlockQueue,
+    dir: Dir,
+    key: (usize, u64),
+    done: Arc<BioDone>,
+    /// whether this submitter is the dispatcher
+    dispatching: bool,
+    /// batches the dispatcher handed to the device
+    in_flight: Vec<Batch>,
+    finished: bool,
+}
+
+impl Drop for Submit<'_> {
+    fn drop(&mut self) {
+        if self.finished {
+            return;
+        }
+        let mut inner = self.queue.inner.lock();
+        // the device requests were dropped with the dispatch
+        for batch in core::mem::take(&mut self.in_flight) {
+            for bio in batch.bios {
+                if !bio.done.is_done() {
+                    inner.requeue(batch.dir, bio);
+                }
+            }
+        }
+        let queued = inner.pending[self.dir as usize].remove(&self.key).is_some();
+        if self.done.take_kick() {
+            self.dispatching = true;
+        }
+        if self.dispatching {
+            inner.hand_over();
+        }
+        drop(inner);
+        if queued || self.done.is_done() {
+            return;
+        }
+        warn!(
+            "[block_queue] request at sector {} dropped in flight, wait for it",
+            self.key.0
+        );
+        while !self.done.is_done() {
+            // queued again by another dropped dispatch
+            let mut inner = self.queue.inner.lock();
+            if inner.pending[self.dir as usize].remove(&self.key).is_some() {
+                return;
+            }
+            drop(inner);
+            core::hint::spin_loop();
+        }
+    }
+}
+
+/// request queue merging and ordering the requests to a block device
+pub struct BlockQueue {
+    inner: SpinLock<QueueInner>,
+    block_device: &'static dyn BlockDevice,
+}
+
+impl BlockQueue {
+    pub fn new(block_device: &'static dyn BlockDevice) -> Self {
+        Self {
+            inner: SpinLock::new(QueueInner {
+                pending: [BTreeMap::new(), BTreeMap::new()],
+                head: 0,
+                next_seq: 0,
+                dispatching: false,
+            }),
+            block_device,
+        }
+    }
+
+    /// queue a request and wait for it, `segs` should be block aligned
+    async fn submit(&self, dir: Dir, sector: usize, segs: Vec<BlockSegment>) -> DevResult<usize> {
+        let len: usize = segs.iter().map(|seg| seg.len).sum();
+        if len % BLOCK_SIZE != 0 {
+            return Err(Errno::EINVAL);
+        }
+        if len == 0 {
+            return Ok(0);
+        }
+        let expire = match dir {
+            Dir::Read => BLOCK_QUEUE_READ_EXPIRE_MS,
+            Dir::Write => BLOCK_QUEUE_WRITE_EXPIRE_MS,
+        };
+        let done = Arc::new(BioDone::new());
+        let bio = Bio {
+            sector,
+            blocks: len / BLOCK_SIZE,
+            segs,
+            deadline: get_time_ms() + expire,
+            seq: 0,
+            done: done.clone(),
+        };
+        let mut submit = {
+            let mut inner = self.inner.lock();
+            let key = inner.push(dir, bio);
+            Submit {
+                queue: self,
+                dir,
+                key,
+                done: done.clone(),
+                dispatching: !core::mem::replace(&mut inner.dispatching, true),
+                in_flight: Vec::new(),
+                finished: false,
+            }
+        };
+        if submit.dispatching {
+            self.plug().await;
+            self.dispatch(&mut submit).await;
+        }
+        loop {
+            match BioWaitFuture(&done).await {
+                Some(res) => {
+                    submit.finished = true;
+                    return res.map(|_| len);
+                }
+                None => {
+                    submit.dispatching = true;
+                    self.dispatch(&mut submit).await;
+                }
+            }
+        }
+    }
+
+    /// give the submitters a short window to join an idle queue
+    async fn plug(&self) {
+        for _ in 0..BLOCK_QUEUE_PLUG_YIELDS {
+            if self.inner.lock().queued_sectors() >= BLOCK_QUEUE_MAX_SECTORS {
+                break;
+            }
+            YieldFuture::new().await;
+        }
+    }
+
+    /// dispatch until the submitter's own request completes, then hand the
+    /// queue over
+    async fn dispatch(&self, submit: &mut Submit<'_>) {
+        loop {
+            let batches = {
+                let mut inner = self.inner.lock();
+                if submit.done.is_done() || inner.is_empty() {
+                    inner.hand_over();
+                    submit.dispatching = false;
+                    return;
+                }
+                inner.pick_batches()
+            };
+            submit.in_flight = batches;
+            assert_no_lock!();
+            let results = join_all(submit.in_flight.iter().map(|batch| match batch.dir {
+                Dir::Read => self.block_device.read_vectored(batch.sector, &batch.segs),
+                Dir::Write => self.block_device.write_vectored(batch.sector, &batch.segs),
+            }))
+            .await;
+            for (batch, res) in core::mem::take(&mut submit.in_flight)
+                .into_iter()
+                .zip(results)
+            {
+                if res.is_err() {
+                    error!(
+                        "[block_queue] request at sector {} with {} blocks failed",
+                        batch.sector, batch.blocks
+                    );
+                }
+                for bio in batch.bios {
+                    bio.done.complete(res.clone().map(|_| ()));
+                }
+            }
+        }
+    }
+
+    /// wait until every queued request is dispatched
+    pub async fn drain(&self) {
+        loop {
+            {
+                let inner = self.inner.lock();
+                if inner.is_empty() && !inner.dispatching {
+                    return;
+                }
+            }
+            YieldFuture::new().await;
+        }
+    }
+}
+
+impl Device for BlockQueue {
+    fn device_name(&self) -> &'static str {
+        "BlockQueue"
+    }
+    fn device_type(&self) -> &'static driver::basic::DeviceType {
+        &driver::basic::DeviceType::Kernel
+    }
+}
+
+impl InterruptDevice for BlockQueue {
+    fn handle_irq(&self) -> DevResult<()> {
+        unreachable!("Block queue should not handle IRQs");
+    }
+}
+
+#[async_trait]
+impl BlockDevice for BlockQueue {
+    /// synchronous io bypasses the queue
+    fn sync_read(&self, id: usize, buf: &mut [u8]) -> DevResult<usize> {
+        self.block_device.sync_read(id, buf)
+    }
+    fn sync_write(&self, id: usize, buf: &[u8]) -> DevResult<usize> {
+        self.block_device.sync_write(id, buf)
+    }
+    async fn read(&self, id: usize, buf: &mut [u8]) -> DevResult<usize> {
+        self.submit(Dir::Read, id, vec![BlockSegment::from_kernel_buf_mut(buf)])
+            .await
+    }
+    async fn write(&self, id: usize, buf: &[u8]) -> DevResult<usize> {
+        self.submit(Dir::Write, id, vec![BlockSegment::from_kernel_buf(buf)])
+            .await
+    }
+    async fn read_vectored(&self, id: usize, segs: &[BlockSegment]) -> DevResult<usize> {
+        self.submit(Dir::Read, id, segs.to_vec()).await
+    }
+    async fn write_vectored(&self, id: usize, segs: &[BlockSegment]) -> DevResult<usize> {
+        self.submit(Dir::Write, id, segs.to_vec()).await
+    }
+    /// drain the queue, then flush the write cache of the device
+    async fn sync_all(&self) -> DevResult<()> {
+        self.drain().await;
+        assert_no_lock!();
+        self.block_device.sync_all().await
+    }
+}
@@ -2,11 +2,13 @@
 // #![allow(warnings)]
 
 pub mod blockcache;
+pub mod blockqueue;
 pub mod fdtable;
 pub mod manager;
 pub mod pagecache;
 pub mod path;
 pub mod pipe;
+pub mod readahead;
 pub mod vfs;
 
 use arch::{Arch, ArchInt};
@@ -22,6 +24,8 @@ pub async fn fs_init() {
         Arch::is_external_interrupt_enabled()
     );
     vfs::vfs_init().await;
+    blockcache::spawn_flusher();
+    pagecache::spawn_flusher();
 }
 
 #[allow(unused)]
@@ -36,7 +40,7 @@ pub fn test() {
 
 pub fn disk_sync() {
     println_debug!("[kernel] begin sync to the disk!");
-    pagecache::get_pagecache_wguard().sync_all();
+    pagecache::get_pagecache().sync_all();
     block_on(blockcache::get_block_cache().sync_all()).expect("[kernel] sync block cache failed!");
     println_debug!("[kernel] sync to the disk succeed!");
 }
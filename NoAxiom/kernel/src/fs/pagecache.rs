@@ -1,15 +1,41 @@
-use alloc::{sync::Arc, vec::Vec};
-use core::intrinsics::unlikely;
+//! page cache
+//!
+//! Every cached inode owns a [`PageMapping`], an ordered index from page
+//! offset to page behind its own lock. All cached pages are also linked into
+//! a global two-list clock: a page starts in the inactive list, a referenced
+//! page gets promoted to the active list, and only unreferenced clean pages
+//! at the inactive head are reclaimed. Dirty pages are never written back by
+//! the allocator, it kicks the flusher task and moves on.
+
+use alloc::{
+    collections::{BTreeMap, VecDeque},
+    sync::{Arc, Weak},
+    vec::Vec,
+};
+use core::{
+    future::Future,
+    intrinsics::unlikely,
+    pin::Pin,
+    sync::atomic::{AtomicBool, AtomicUsize, Ordering},
+    task::{Context, Poll, Waker},
+    time::Duration,
+};
 
 use arch::{Arch, ArchInt};
-use config::{fs::PAGE_CACHE_PROPORTION, mm::PAGE_SIZE};
+use config::{
+    fs::{PAGE_CACHE_FLUSH_INTERVAL_MS, PAGE_CACHE_PROPORTION, PAGE_CACHE_WRITEBACK_BATCH},
+    mm::PAGE_SIZE,
+};
 use hashbrown::HashMap;
 use kfuture::block::block_on;
+use ksync::mutex::SpinLock;
 use lazy_static::lazy_static;
-use memory::frame::{frame_alloc, FrameTracker, FRAME_ALLOCATOR};
-use spin::{RwLock, RwLockReadGuard, RwLockWriteGuard}; // FIXME: use ksync::mutex
+use memory::frame::{frame_alloc, frame_refcount, FrameTracker, FRAME_ALLOCATOR};
 
-use crate::{fs::vfs::basic::file::File, utils::is_aligned};
+use crate::{
+    fs::vfs::basic::file::File, sched::spawn::spawn_ktask, time::timeout::TimeLimitedFuture,
+    utils::is_aligned,
+};
 
 const PAGE_CACHE_CAPACITY_UNINITIALIZED: usize = 0;
 static mut PAGE_CACHE_CAPACITY: usize = PAGE_CACHE_CAPACITY_UNINITIALIZED;
@@ -27,17 +53,17 @@ fn get_page_cache_capacity() -> usize {
         PAGE_CACHE_CAPACITY
     }
 }
-fn get_page_cache_capacity_clean_threshold(page_cache_capacity: usize) -> usize {
-    page_cache_capacity / 2
+/// the number of pages reclaimed at once when the capacity is exceeded
+fn get_page_cache_reclaim_batch(page_cache_capacity: usize) -> usize {
+    (page_cache_capacity / 16).max(1)
 }
 
 lazy_static! {
-    pub static ref PAGE_CACHE_MANAGER: RwLock<PageCacheManager> =
-        RwLock::new(PageCacheManager::new());
+    pub static ref PAGE_CACHE_MANAGER: PageCacheManager = PageCacheManager::new();
 }
 
 /// Inspired by `MSI`
-#[derive(PartialEq)]
+#[derive(Debug, Clone, Copy, PartialEq)]
 pub enum PageState {
     Modified,
     Shared,
@@ -46,181 +72,434 @@ pub enum PageState {
 
 pub struct Page {
     data: FrameTracker,
-    state: PageState,
+    state: SpinLock<PageState>,
+    /// set on access, cleared by the clock hand
+    referenced: AtomicBool,
 }
 
 impl Page {
     pub fn new(state: PageState) -> Self {
         Self {
             data: frame_alloc().unwrap(),
-            state,
+            state: SpinLock::new(state),
+            referenced: AtomicBool::new(false),
         }
     }
     pub fn as_mut_bytes_array(&self) -> &'static mut [u8] {
         self.data.ppn().get_bytes_array()
     }
-    pub fn mark_dirty(&mut self) {
-        if self.state != PageState::Deleted {
-            self.state = PageState::Modified;
+    pub fn frame(&self) -> &FrameTracker {
+        &self.data
+    }
+    pub fn state(&self) -> PageState {
+        *self.state.lock()
+    }
+    pub fn mark_dirty(&self) {
+        let mut state = self.state.lock();
+        if *state != PageState::Deleted {
+            *state = PageState::Modified;
+        }
+    }
+    pub fn mark_deleted(&self) {
+        *self.state.lock() = PageState::Deleted;
+    }
+    /// mark the page clean before writing it back, returns whether it was
+    /// dirty; a write racing with the write back dirties it again
+    fn start_writeback(&self) -> bool {
+        let mut state = self.state.lock();
+        match *state {
+            PageState::Modified => {
+                *state = PageState::Shared;
+                true
+            }
+            _ => false,
+        }
+    }
+    fn touch(&self) {
+        if !self.referenced.load(Ordering::Relaxed) {
+            self.referenced.store(true, Ordering::Relaxed);
+        }
+    }
+}
+
+struct PageMappingInner {
+    pages: BTreeMap<usize, Arc<Page>>,
+    /// removed from the index, a new mapping should be created
+    dead: bool,
+}
+
+/// page index of one inode
+pub struct PageMapping {
+    /// the file used to write back dirty pages
+    file: Arc<dyn File>,
+    inner: SpinLock<PageMappingInner>,
+}
+
+impl PageMapping {
+    fn new(file: Arc<dyn File>) -> Self {
+        Self {
+            file,
+            inner: SpinLock::new(PageMappingInner {
+                pages: BTreeMap::new(),
+                dead: false,
+            }),
+        }
+    }
+
+    /// write back the dirty pages in offset order, ext4_rs misbehaves on
+    /// out of order access, consecutive pages go down together so the file
+    /// system can map and allocate the run at once
+    async fn writeback(&self) {
+        let file_size = self.file.size();
+        let dirty: Vec<(usize, Arc<Page>)> = {
+            let inner = self.inner.lock();
+            inner
+                .pages
+                .range(..file_size)
+                .filter(|(_, page)| page.state() == PageState::Modified)
+                .map(|(offset, page)| (*offset, page.clone()))
+                .collect()
+        };
+        let dirty: Vec<(usize, Arc<Page>)> = dirty
+            .into_iter()
+            .filter(|(_, page)| page.start_writeback())
+            .collect();
+        let runs = dirty.chunk_by(|(prev, _), (next, _)| prev + PAGE_SIZE == *next);
+        for batch in runs.flat_map(|run| run.chunks(PAGE_CACHE_WRITEBACK_BATCH)) {
+            let offset = batch[0].0;
+            let pages: Vec<&[u8]> = batch
+                .iter()
+                .map(|(_, page)| &*page.as_mut_bytes_array())
+                .collect();
+            assert_no_lock!();
+            if let Err(e) = self.file.base_write_pages(offset, &pages).await {
+                error!(
+                    "[PageCacheManager: writeback] file: {}, offset: {}, pages: {}, error: {}",
+                    self.file.name(),
+                    offset,
+                    batch.len(),
+                    e
+                );
+                for (_, page) in batch {
+                    page.mark_dirty();
+                }
+            }
+        }
+    }
+}
+
+/// a cached page linked into the global clock
+struct PageRef {
+    mapping: Weak<PageMapping>,
+    offset: usize,
+    page: Weak<Page>,
+}
+
+/// global two-list clock over every cached page
+struct PageClock {
+    active: VecDeque<PageRef>,
+    inactive: VecDeque<PageRef>,
+}
+
+impl PageClock {
+    /// pick the next reclaim candidate, referenced pages get a second chance
+    fn next_victim(&mut self) -> Option<(Arc<PageMapping>, usize, Arc<Page>)> {
+        let mut budget = self.active.len() + self.inactive.len();
+        while budget != 0 {
+            budget -= 1;
+            // keep the inactive list at least as long as the active one
+            if self.inactive.len() < self.active.len() {
+                let demoted = self.active.pop_front().unwrap();
+                match demoted.page.upgrade() {
+                    Some(page) if page.referenced.swap(false, Ordering::Relaxed) => {
+                        self.active.push_back(demoted)
+                    }
+                    Some(_) => self.inactive.push_back(demoted),
+                    None => {}
+                }
+                continue;
+            }
+            let candidate = self.inactive.pop_front()?;
+            let (mapping, page) = match (candidate.mapping.upgrade(), candidate.page.upgrade()) {
+                (Some(mapping), Some(page)) => (mapping, page),
+                _ => continue,
+            };
+            if page.referenced.swap(false, Ordering::Relaxed) {
+                self.active.push_back(candidate);
+                continue;
+            }
+            if page.state() == PageState::Modified {
+                // leave it to the flusher
+                self.inactive.push_back(candidate);
+                continue;
+            }
+            if frame_refcount(page.frame().ppn()) > 1 {
+                // mapped into user space, dropping it from the cache would
+                // split the mapping from the file
+                self.active.push_back(candidate);
+                continue;
+            }
+            return Some((mapping, candidate.offset, page));
+        }
+        None
+    }
+}
+
+/// wakes the flusher early when reclaim meets dirty pages
+struct FlushKick {
+    pending: AtomicBool,
+    waker: SpinLock<Option<Waker>>,
+}
+
+impl FlushKick {
+    fn kick(&self) {
+        self.pending.store(true, Ordering::Release);
+        if let Some(waker) = self.waker.lock().take() {
+            waker.wake();
         }
     }
-    pub fn mark_deleted(&mut self) {
-        self.state = PageState::Deleted;
+}
+
+struct FlushKickFuture<'a>(&'a FlushKick);
+
+impl Future for FlushKickFuture<'_> {
+    type Output = ();
+    fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Self::Output> {
+        *self.0.waker.lock() = Some(cx.waker().clone());
+        match self.0.pending.swap(false, Ordering::AcqRel) {
+            true => Poll::Ready(()),
+            false => Poll::Pending,
+        }
     }
 }
 
 pub struct PageCacheManager {
-    inner: HashMap<Arc<dyn File>, HashMap<usize, Page>>,
-    page_count: usize,
+    /// inode id -> page mapping
+    index: SpinLock<HashMap<usize, Arc<PageMapping>>>,
+    clock: SpinLock<PageClock>,
+    page_count: AtomicUsize,
+    flush_kick: FlushKick,
 }
 
 impl PageCacheManager {
     fn new() -> Self {
         Self {
-            inner: HashMap::new(),
-            page_count: 0,
+            index: SpinLock::new(HashMap::new()),
+            clock: SpinLock::new(PageClock {
+                active: VecDeque::new(),
+                inactive: VecDeque::new(),
+            }),
+            page_count: AtomicUsize::new(0),
+            flush_kick: FlushKick {
+                pending: AtomicBool::new(false),
+                waker: SpinLock::new(None),
+            },
         }
     }
 
-    // todo: use more efficient strategy to clean
-    fn clean(&mut self, thresold: usize) {
-        warn!("[PageCacheManager: clean], thresold: {}", thresold);
-        let mut count = 0;
-        for (file, page_cache) in self.inner.iter_mut() {
-            debug!(
-                "[PageCacheManager: clean] file: {}, page_cache size: {}",
-                file.name(),
-                page_cache.len()
-            );
-        }
-        for (file, page_cache) in self.inner.iter_mut() {
-            let file_size = file.size();
-            let mut sorted = Vec::new();
-            for (offset, page) in page_cache.iter() {
-                sorted.push((*offset, page));
+    fn mapping(&self, file: &Arc<dyn File>) -> Option<Arc<PageMapping>> {
+        self.index.lock().get(&file.inode().id()).cloned()
+    }
+
+    fn mapping_or_create(&self, file: &Arc<dyn File>) -> Arc<PageMapping> {
+        self.index
+            .lock()
+            .entry(file.inode().id())
+            .or_insert_with(|| Arc::new(PageMapping::new(file.clone())))
+            .clone()
+    }
+
+    /// drop the mapping from the index if it has no page left
+    fn try_remove_mapping(&self, mapping: &Arc<PageMapping>) {
+        let mut index = self.index.lock();
+        let mut inner = mapping.inner.lock();
+        if inner.pages.is_empty() && !inner.dead {
+            inner.dead = true;
+            let id = mapping.file.inode().id();
+            if index.get(&id).is_some_and(|m| Arc::ptr_eq(m, mapping)) {
+                index.remove(&id);
             }
-            sorted.sort_by_key(|(offset, _)| *offset); // for trash ext4_rs which has bug in out of order read
-
-            let mut offsets_to_remove = Vec::new();
-            for (offset, page) in &sorted {
-                if page.state == PageState::Modified {
-                    assert_no_lock!();
-                    assert!(Arch::is_external_interrupt_enabled());
-                    let len = PAGE_SIZE.min(file_size - offset);
-                    block_on(file.base_write(*offset, &page.data.ppn().get_bytes_array()[..len]))
-                        .unwrap();
-                }
-                offsets_to_remove.push(*offset);
-                count += 1;
-                if count >= thresold {
-                    break;
+        }
+    }
+
+    /// reclaim up to `count` clean pages from the clock
+    fn reclaim(&self, count: usize) {
+        debug!("[PageCacheManager: reclaim] count: {}", count);
+        let mut reclaimed = 0;
+        while reclaimed < count {
+            let victim = self.clock.lock().next_victim();
+            let Some((mapping, offset, page)) = victim else {
+                break;
+            };
+            let (emptied, relink) = {
+                let mut inner = mapping.inner.lock();
+                match inner.pages.get(&offset) {
+                    Some(cur) if Arc::ptr_eq(cur, &page) => match page.state() {
+                        // dirtied after being picked
+                        PageState::Modified => (false, true),
+                        _ => {
+                            inner.pages.remove(&offset);
+                            reclaimed += 1;
+                            self.page_count.fetch_sub(1, Ordering::Relaxed);
+                            (inner.pages.is_empty(), false)
+                        }
+                    },
+                    _ => (false, false),
                 }
+            };
+            if relink {
+                self.clock.lock().inactive.push_back(PageRef {
+                    mapping: Arc::downgrade(&mapping),
+                    offset,
+                    page: Arc::downgrade(&page),
+                });
             }
-            for offset in offsets_to_remove {
-                page_cache.remove(&offset);
-            }
-            if count >= thresold {
-                self.page_count -= count;
-                return;
+            if emptied {
+                self.try_remove_mapping(&mapping);
             }
         }
+        if reclaimed < count {
+            self.flush_kick.kick();
+        }
     }
 
-    pub fn alloc(&mut self, state: PageState) -> Page {
+    pub fn alloc(&self, state: PageState) -> Page {
         let sys_capacity = get_page_cache_capacity();
-        let sys_thresold = get_page_cache_capacity_clean_threshold(sys_capacity);
-        if self.page_count > sys_capacity {
-            self.clean(sys_thresold);
+        if self.page_count.load(Ordering::Relaxed) >= sys_capacity {
+            self.reclaim(get_page_cache_reclaim_batch(sys_capacity));
         }
-        self.page_count += 1;
         Page::new(state)
     }
 
-    pub fn get_page(&self, file: &Arc<dyn File>, offset_align: usize) -> Option<&Page> {
+    pub fn get_page(&self, file: &Arc<dyn File>, offset_align: usize) -> Option<Arc<Page>> {
         assert!(is_aligned(offset_align, PAGE_SIZE));
-        if let Some(page_cache) = self.inner.get(file) {
-            if let Some(page) = page_cache.get(&offset_align) {
-                return Some(page);
-            }
-        }
-        None
+        let mapping = self.mapping(file)?;
+        let page = mapping.inner.lock().pages.get(&offset_align).cloned()?;
+        page.touch();
+        Some(page)
     }
 
-    pub fn get_page_mut(&mut self, file: &Arc<dyn File>, offset_align: usize) -> Option<&mut Page> {
+    /// insert `page` unless the offset is already cached, returns the page
+    /// that ends up in the cache
+    pub fn fill_page(&self, file: &Arc<dyn File>, offset_align: usize, page: Page) -> Arc<Page> {
         assert!(is_aligned(offset_align, PAGE_SIZE));
-        if let Some(page_cache) = self.inner.get_mut(file) {
-            if let Some(page) = page_cache.get_mut(&offset_align) {
-                return Some(page);
+        let page = Arc::new(page);
+        let mapping = loop {
+            let mapping = self.mapping_or_create(file);
+            let mut inner = mapping.inner.lock();
+            if inner.dead {
+                continue;
+            }
+            if let Some(cur) = inner.pages.get(&offset_align) {
+                cur.touch();
+                return cur.clone();
             }
+            inner.pages.insert(offset_align, page.clone());
+            drop(inner);
+            break mapping;
+        };
+        self.page_count.fetch_add(1, Ordering::Relaxed);
+        let mut clock = self.clock.lock();
+        if clock.active.len() + clock.inactive.len() > 2 * get_page_cache_capacity() {
+            // drop the links of truncated pages
+            clock.active.retain(|r| r.page.strong_count() != 0);
+            clock.inactive.retain(|r| r.page.strong_count() != 0);
         }
-        None
+        clock.inactive.push_back(PageRef {
+            mapping: Arc::downgrade(&mapping),
+            offset: offset_align,
+            page: Arc::downgrade(&page),
+        });
+        page
     }
 
-    pub fn fill_page(&mut self, file: &Arc<dyn File>, offset_align: usize, page: Page) {
+    /// copy `buf` into the cached page at `offset_align` and dirty it,
+    /// returns false if the page is not cached
+    pub fn write_page(
+        &self,
+        file: &Arc<dyn File>,
+        offset_align: usize,
+        offset_in: usize,
+        buf: &[u8],
+    ) -> bool {
         assert!(is_aligned(offset_align, PAGE_SIZE));
-        self.inner
-            .entry(file.clone())
-            .or_insert_with(HashMap::new)
-            .insert(offset_align, page);
+        let Some(mapping) = self.mapping(file) else {
+            return false;
+        };
+        let inner = mapping.inner.lock();
+        let Some(page) = inner.pages.get(&offset_align) else {
+            return false;
+        };
+        page.as_mut_bytes_array()[offset_in..offset_in + buf.len()].copy_from_slice(buf);
+        page.mark_dirty();
+        page.touch();
+        true
     }
 
-    pub fn mark_deleted(&mut self, file: &Arc<dyn File>) {
-        self.inner.get_mut(file).map(|cache| {
-            cache.iter_mut().for_each(|(_, page)| {
-                page.mark_deleted();
-            })
-        });
+    pub fn mark_deleted(&self, file: &Arc<dyn File>) {
+        if let Some(mapping) = self.mapping(file) {
+            mapping
+                .inner
+                .lock()
+                .pages
+                .values()
+                .for_each(|page| page.mark_deleted());
+        }
     }
 
-    pub fn truncate(&mut self, file: &Arc<dyn File>, length: usize) {
-        if let Some(page_cache) = self.inner.get_mut(file) {
-            let init_size = page_cache.len();
-            page_cache.retain(|&offset, _| offset < length);
-            let removed = init_size - page_cache.len();
-            self.page_count -= removed;
+    pub fn truncate(&self, file: &Arc<dyn File>, length: usize) {
+        if let Some(mapping) = self.mapping(file) {
+            let removed = mapping.inner.lock().pages.split_off(&length);
+            self.page_count.fetch_sub(removed.len(), Ordering::Relaxed);
         }
     }
 
-    pub fn sync_all(&mut self) {
-        for (file, page_cache) in self.inner.iter_mut() {
-            let file_size = file.size();
-            let mut sorted = Vec::new();
-            for (offset, page) in page_cache.iter() {
-                sorted.push((*offset, page));
-            }
-            sorted.sort_by_key(|(offset, _)| *offset);
-            for (offset, page) in &sorted {
-                if page.state == PageState::Modified {
-                    assert_no_lock!();
-                    assert!(Arch::is_external_interrupt_enabled());
-                    let len = PAGE_SIZE.min(file_size - offset);
-                    match block_on(
-                        file.base_write(*offset, &page.data.ppn().get_bytes_array()[..len]),
-                    ) {
-                        Ok(_) => {}
-                        Err(e) => {
-                            error!(
-                                "[PageCacheManager: sync_all] file: {}, offset: {}, error: {}",
-                                file.name(),
-                                offset,
-                                e
-                            );
-                        }
-                    }
-                }
-            }
-            page_cache.clear();
+    fn mappings(&self) -> Vec<Arc<PageMapping>> {
+        self.index.lock().values().cloned().collect()
+    }
+
+    /// write back the dirty pages of `file`, pages stay cached
+    pub async fn writeback(&self, file: &Arc<dyn File>) {
+        if let Some(mapping) = self.mapping(file) {
+            mapping.writeback().await;
+        }
+    }
+
+    /// write back every dirty page, pages stay cached
+    pub async fn flush_dirty(&self) {
+        for mapping in self.mappings() {
+            mapping.writeback().await;
+        }
+    }
+
+    pub fn sync_all(&self) {
+        assert!(Arch::is_external_interrupt_enabled());
+        for mapping in self.mappings() {
+            block_on(mapping.writeback());
+            let removed = {
+                let mut inner = mapping.inner.lock();
+                core::mem::take(&mut inner.pages).len()
+            };
+            self.page_count.fetch_sub(removed, Ordering::Relaxed);
+            self.try_remove_mapping(&mapping);
         }
-        self.page_count = 0;
     }
 }
 
 #[inline(always)]
-pub fn get_pagecache_rguard() -> RwLockReadGuard<'static, PageCacheManager> {
-    PAGE_CACHE_MANAGER.read()
+pub fn get_pagecache() -> &'static PageCacheManager {
+    &PAGE_CACHE_MANAGER
 }
 
-#[inline(always)]
-pub fn get_pagecache_wguard() -> RwLockWriteGuard<'static, PageCacheManager> {
-    PAGE_CACHE_MANAGER.write()
+/// spawn the kernel task writing dirty pages back, it runs periodically or
+/// when reclaim is blocked by dirty pages
+pub fn spawn_flusher() {
+    spawn_ktask(async {
+        let manager = get_pagecache();
+        let interval = Duration::from_millis(PAGE_CACHE_FLUSH_INTERVAL_MS);
+        loop {
+            TimeLimitedFuture::new(FlushKickFuture(&manager.flush_kick), Some(interval)).await;
+            manager.flush_dirty().await;
+        }
+    });
 }
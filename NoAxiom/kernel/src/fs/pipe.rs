@@ -15,12 +15,14 @@ use alloc::{boxed::Box, sync::Arc, vec::Vec};
 use core::{
     future::Future,
     pin::Pin,
-    sync::atomic::Ordering,
+    sync::atomic::{AtomicBool, AtomicUsize, Ordering},
     task::{Context, Poll, Waker},
 };
 
+use array_init::array_init;
 use async_trait::async_trait;
-use ksync::mutex::SpinLock;
+use config::mm::PAGE_SIZE;
+use ksync::{cell::SyncUnsafeCell, mutex::SpinLock, AsyncMutex, AsyncMutexGuard};
 use memory::frame::{frame_alloc, FrameTracker};
 
 use super::vfs::{
@@ -48,195 +50,276 @@ use crate::{
     utils::global_alloc,
 };
 
-#[derive(PartialEq)]
-enum PipeBufferStatus {
-    Empty,
-    Full,
-    Normal,
-}
+/// pages a pipe holds at most
+const PIPE_SLOTS: usize = PIPE_BUF_SIZE / PAGE_SIZE;
 
-/// Ring buffer that max size is PIPE_BUF_SIZE
-struct PipeBuffer {
-    data: FrameTracker,
-    head: usize,
-    tail: usize,
-    status: PipeBufferStatus,
-    read_wakers: Vec<(usize, Waker)>,
-    write_wakers: Vec<(usize, Waker)>,
-    read_end: bool,
-    write_end: bool,
+/// a page of data in the pipe, either one of the pipe's own that the writer
+/// may still append to while it's the newest, or one lent by splice
+struct PipeSlot {
+    frame: SyncUnsafeCell<Option<FrameTracker>>,
+    /// read position, only the reader moves it
+    start: AtomicUsize,
+    /// write position, only the writer moves it
+    end: AtomicUsize,
+    mergeable: AtomicBool,
 }
 
-impl PipeBuffer {
+impl PipeSlot {
     fn new() -> Self {
         Self {
-            data: frame_alloc().unwrap(),
-            head: 0,
-            tail: 0,
-            status: PipeBufferStatus::Empty,
-            read_wakers: Vec::new(),
-            write_wakers: Vec::new(),
-            read_end: false,
-            write_end: false,
+            frame: SyncUnsafeCell::new(None),
+            start: AtomicUsize::new(0),
+            end: AtomicUsize::new(0),
+            mergeable: AtomicBool::new(false),
         }
     }
-    fn add_read_event(&mut self, read_len: usize, waker: Waker) {
-        self.read_wakers.push((read_len, waker));
+    /// the data of the page goes through raw pointers only, the reader and
+    /// the writer work on disjoint ranges of it at the same time
+    fn ptr(&self) -> *mut u8 {
+        let frame = self.frame.as_ref().as_ref().unwrap();
+        frame.kernel_vpn().as_va_usize() as *mut u8
+    }
+    /// copy `src` to `pos`, writer side, only past `end`
+    fn write_bytes(&self, pos: usize, src: &[u8]) {
+        assert!(pos + src.len() <= PAGE_SIZE);
+        unsafe { core::ptr::copy_nonoverlapping(src.as_ptr(), self.ptr().add(pos), src.len()) };
     }
-    fn add_write_event(&mut self, write_len: usize, waker: Waker) {
-        self.write_wakers.push((write_len, waker));
+    /// copy from `pos` to `dst`, reader side, only below `end`
+    fn read_bytes(&self, pos: usize, dst: &mut [u8]) {
+        assert!(pos + dst.len() <= PAGE_SIZE);
+        unsafe { core::ptr::copy_nonoverlapping(self.ptr().add(pos), dst.as_mut_ptr(), dst.len()) };
     }
-    fn read_available(&self) -> bool {
-        match self.status {
-            PipeBufferStatus::Empty => false,
-            PipeBufferStatus::Full => true,
-            PipeBufferStatus::Normal => true,
+}
+
+/// tasks waiting for a side of the pipe, `waiting` is raised before the
+/// last check of the condition, so the other side only takes the lock when
+/// someone may be asleep, i.e. on empty -> non-empty and full -> non-full
+struct PipeWaitQueue {
+    waiting: AtomicBool,
+    wakers: SpinLock<Vec<Waker>>,
+}
+
+impl PipeWaitQueue {
+    fn new() -> Self {
+        Self {
+            waiting: AtomicBool::new(false),
+            wakers: SpinLock::new(Vec::new()),
         }
     }
-    fn write_available(&self) -> bool {
-        match self.status {
-            PipeBufferStatus::Empty => true,
-            PipeBufferStatus::Full => false,
-            PipeBufferStatus::Normal => true,
+    /// queue `waker` unless `ready` turns true, return `ready`
+    fn wait(&self, waker: &Waker, ready: impl Fn() -> bool) -> bool {
+        let mut wakers = self.wakers.lock();
+        self.waiting.store(true, Ordering::SeqCst);
+        if ready() {
+            return true;
+        }
+        wakers.push(waker.clone());
+        false
+    }
+    /// queue `waker` for the next change even if `ready`, for pollers like
+    /// edge triggered epoll that only hear of a ready file once, return
+    /// `ready`
+    fn watch(&self, waker: &Waker, ready: impl Fn() -> bool) -> bool {
+        let mut wakers = self.wakers.lock();
+        self.waiting.store(true, Ordering::SeqCst);
+        if !wakers.iter().any(|queued| queued.will_wake(waker)) {
+            wakers.push(waker.clone());
         }
+        ready()
     }
-    fn read_available_len(&self) -> usize {
-        match self.status {
-            PipeBufferStatus::Empty => 0,
-            PipeBufferStatus::Full => PIPE_BUF_SIZE,
-            PipeBufferStatus::Normal => {
-                if self.head <= self.tail {
-                    self.tail - self.head
-                } else {
-                    PIPE_BUF_SIZE - self.head + self.tail
-                }
-            }
+    fn notify(&self) {
+        if !self.waiting.load(Ordering::SeqCst) {
+            return;
         }
+        let mut wakers = self.wakers.lock();
+        self.waiting.store(false, Ordering::SeqCst);
+        let wakers = core::mem::take(&mut *wakers);
+        wakers.into_iter().for_each(Waker::wake);
     }
-    fn write_available_len(&self) -> usize {
-        match self.status {
-            PipeBufferStatus::Empty => PIPE_BUF_SIZE,
-            PipeBufferStatus::Full => 0,
-            PipeBufferStatus::Normal => {
-                if self.head <= self.tail {
-                    PIPE_BUF_SIZE - self.tail + self.head
-                } else {
-                    self.head - self.tail
-                }
-            }
+}
+
+/// ring of page slots, the reader and the writer each own one index and
+/// never take a common lock, concurrent readers or writers are serialized
+/// by a mutex per side which is uncontended for one reader and one writer
+struct PipeRing {
+    slots: [PipeSlot; PIPE_SLOTS],
+    /// oldest slot in use
+    head: AtomicUsize,
+    /// one past the newest slot
+    tail: AtomicUsize,
+    /// bytes in the pipe
+    len: AtomicUsize,
+    reader: AsyncMutex<()>,
+    writer: AsyncMutex<()>,
+    read_wait: PipeWaitQueue,
+    write_wait: PipeWaitQueue,
+    read_end: AtomicBool,
+    write_end: AtomicBool,
+}
+
+impl PipeRing {
+    fn new() -> Self {
+        Self {
+            slots: array_init(|_| PipeSlot::new()),
+            head: AtomicUsize::new(0),
+            tail: AtomicUsize::new(0),
+            len: AtomicUsize::new(0),
+            reader: AsyncMutex::new(()),
+            writer: AsyncMutex::new(()),
+            read_wait: PipeWaitQueue::new(),
+            write_wait: PipeWaitQueue::new(),
+            read_end: AtomicBool::new(true),
+            write_end: AtomicBool::new(true),
         }
     }
-    fn notify_read_waker(&mut self) {
-        let mut read_available = self.read_available_len();
-        if read_available == 0 {
-            return;
+    fn slot(&self, idx: usize) -> &PipeSlot {
+        &self.slots[idx % PIPE_SLOTS]
+    }
+    fn readable(&self) -> bool {
+        self.len.load(Ordering::SeqCst) != 0
+    }
+    fn writable(&self) -> bool {
+        if self.len.load(Ordering::SeqCst) >= PIPE_BUF_SIZE {
+            return false;
         }
-        while let Some((len, waker)) = self.read_wakers.pop() {
-            if read_available >= len {
-                read_available -= len;
-                waker.wake();
-            } else {
-                waker.wake();
+        let tail = self.tail.load(Ordering::Acquire);
+        if tail - self.head.load(Ordering::Acquire) < PIPE_SLOTS {
+            return true;
+        }
+        let last = self.slot(tail - 1);
+        last.mergeable.load(Ordering::Relaxed) && last.end.load(Ordering::Relaxed) < PAGE_SIZE
+    }
+    /// whether a page of `len` bytes can be lent, which takes a slot of its
+    /// own, unlike [`Self::writable`] that may merge into the newest one
+    fn lendable(&self, len: usize) -> bool {
+        let tail = self.tail.load(Ordering::Acquire);
+        tail - self.head.load(Ordering::Acquire) < PIPE_SLOTS
+            && self.len.load(Ordering::SeqCst) + len <= PIPE_BUF_SIZE
+    }
+
+    /// publish a new slot, writer side
+    fn push_slot(&self, frame: FrameTracker, start: usize, end: usize, mergeable: bool) {
+        let tail = self.tail.load(Ordering::Relaxed);
+        let slot = self.slot(tail);
+        *slot.frame.as_ref_mut() = Some(frame);
+        slot.start.store(start, Ordering::Relaxed);
+        slot.end.store(end, Ordering::Relaxed);
+        slot.mergeable.store(mergeable, Ordering::Relaxed);
+        self.tail.store(tail + 1, Ordering::Release);
+    }
+
+    /// copy as much of `buf` as fits into the pipe, writer side
+    fn write(&self, buf: &[u8]) -> usize {
+        let mut done = 0;
+        while done < buf.len() {
+            let room = PIPE_BUF_SIZE.saturating_sub(self.len.load(Ordering::SeqCst));
+            if room == 0 {
                 break;
             }
+            let tail = self.tail.load(Ordering::Relaxed);
+            let head = self.head.load(Ordering::Acquire);
+            let last = (tail != head).then(|| self.slot(tail - 1));
+            let slot = match last {
+                Some(last)
+                    if last.mergeable.load(Ordering::Relaxed)
+                        && last.end.load(Ordering::Relaxed) < PAGE_SIZE =>
+                {
+                    last
+                }
+                _ if tail - head < PIPE_SLOTS => {
+                    let Some(frame) = frame_alloc() else {
+                        break;
+                    };
+                    self.push_slot(frame, 0, 0, true);
+                    self.slot(tail)
+                }
+                _ => break,
+            };
+            let end = slot.end.load(Ordering::Relaxed);
+            let n = (PAGE_SIZE - end).min(buf.len() - done).min(room);
+            slot.write_bytes(end, &buf[done..done + n]);
+            slot.end.store(end + n, Ordering::Release);
+            self.len.fetch_add(n, Ordering::SeqCst);
+            done += n;
         }
+        done
     }
-    fn notify_write_waker(&mut self) {
-        let mut write_available = self.write_available_len();
-        if write_available == 0 {
-            return;
+
+    /// lend `len` bytes at `offset` of `frame` to the pipe, writer side
+    fn write_page(&self, frame: FrameTracker, offset: usize, len: usize) -> bool {
+        if !self.lendable(len) {
+            return false;
         }
-        while let Some((len, waker)) = self.write_wakers.pop() {
-            if write_available >= len {
-                write_available -= len;
-                waker.wake();
-            } else if write_available > 0 {
-                waker.wake();
-                break;
+        self.push_slot(frame, offset, offset + len, false);
+        self.len.fetch_add(len, Ordering::SeqCst);
+        true
+    }
+
+    /// drop the oldest slot, reader side
+    fn pop_slot(&self, head: usize) {
+        *self.slot(head).frame.as_ref_mut() = None;
+        self.head.store(head + 1, Ordering::Release);
+    }
+
+    /// the oldest unread bytes as (slot, start, end), drained slots but the
+    /// newest are dropped on the way, reader side
+    fn front(&self) -> Option<(&PipeSlot, usize, usize)> {
+        loop {
+            let head = self.head.load(Ordering::Relaxed);
+            let tail = self.tail.load(Ordering::Acquire);
+            if head == tail {
+                return None;
             }
+            let slot = self.slot(head);
+            let start = slot.start.load(Ordering::Relaxed);
+            let end = slot.end.load(Ordering::Acquire);
+            if start != end {
+                return Some((slot, start, end));
+            }
+            // the writer may still append to the newest one
+            if head + 1 == tail {
+                return None;
+            }
+            self.pop_slot(head);
         }
     }
-    /// Read `len` bytes as much as possible from the buffer, make sure buffer's
-    /// size >= len, return the number of bytes read
-    fn read(&mut self, buf: &mut [u8]) -> usize {
-        trace!("[PipeBuffer] read buf");
-        let len = buf.len();
-        let data = self.data.ppn().get_bytes_array();
-        let res = match self.status {
-            PipeBufferStatus::Empty => 0,
-            _ => {
-                if self.head < self.tail {
-                    let res = core::cmp::min(len, self.tail - self.head);
-                    buf[..res].copy_from_slice(&data[self.head..self.head + res]);
-                    res
-                } else {
-                    // maybe full
-                    let res = core::cmp::min(len, PIPE_BUF_SIZE - self.head + self.tail);
-                    if res <= PIPE_BUF_SIZE - self.head {
-                        buf[..res].copy_from_slice(&data[self.head..self.head + res]);
-                    } else {
-                        buf[..PIPE_BUF_SIZE - self.head].copy_from_slice(&data[self.head..]);
-                        buf[PIPE_BUF_SIZE - self.head..res]
-                            .copy_from_slice(&data[..self.head + res - PIPE_BUF_SIZE]);
-                    }
-                    res
-                }
-            }
-        };
-        self.head = (self.head + res) % PIPE_BUF_SIZE;
-        if self.head == self.tail {
-            self.status = PipeBufferStatus::Empty;
-        } else {
-            self.status = PipeBufferStatus::Normal;
+
+    /// mark `n` bytes of the oldest slot read, reader side
+    fn consume(&self, n: usize) {
+        let head = self.head.load(Ordering::Relaxed);
+        let slot = self.slot(head);
+        let start = slot.start.load(Ordering::Relaxed) + n;
+        slot.start.store(start, Ordering::Relaxed);
+        if start == slot.end.load(Ordering::Acquire)
+            && head + 1 != self.tail.load(Ordering::Acquire)
+        {
+            self.pop_slot(head);
         }
-        res
+        self.len.fetch_sub(n, Ordering::SeqCst);
     }
-    /// Write `buf` as much as possible to the buffer
-    fn write(&mut self, buf: &[u8]) -> usize {
-        trace!(
-            "[PipeBuffer] write buf as string: {}",
-            alloc::string::String::from_utf8_lossy(buf)
-        );
-        let len = buf.len();
-        let data = self.data.ppn().get_bytes_array();
-        let res = match self.status {
-            PipeBufferStatus::Full => 0,
-            _ => {
-                if self.head <= self.tail {
-                    // maybe empty
-                    trace!("[PipeBuffer] write maybe empty");
-                    let res = core::cmp::min(len, self.head + PIPE_BUF_SIZE - self.tail);
-                    if res <= PIPE_BUF_SIZE - self.tail {
-                        data[self.tail..self.tail + res].copy_from_slice(&buf[..res]);
-                    } else {
-                        data[self.tail..].copy_from_slice(&buf[..PIPE_BUF_SIZE - self.tail]);
-                        data[..self.tail + res - PIPE_BUF_SIZE]
-                            .copy_from_slice(&buf[PIPE_BUF_SIZE - self.tail..res]);
-                    }
-                    res
-                } else {
-                    debug!("[PipeBuffer] write normal");
-                    let res = core::cmp::min(len, self.head - self.tail);
-                    data[self.tail..self.tail + res].copy_from_slice(&buf[..res]);
-                    res
-                }
-            }
-        };
-        self.tail = (self.tail + res) % PIPE_BUF_SIZE;
-        if self.head == self.tail {
-            self.status = PipeBufferStatus::Full;
-        } else {
-            self.status = PipeBufferStatus::Normal;
+
+    /// copy out as much as `buf` takes, reader side
+    fn read(&self, buf: &mut [u8]) -> usize {
+        let mut done = 0;
+        while done < buf.len() {
+            let Some((slot, start, end)) = self.front() else {
+                break;
+            };
+            let n = (end - start).min(buf.len() - done);
+            slot.read_bytes(start, &mut buf[done..done + n]);
+            self.consume(n);
+            done += n;
         }
-        res
+        done
     }
 }
 
-impl Drop for PipeBuffer {
+impl Drop for PipeRing {
     fn drop(&mut self) {
         debug!(
-            "[PipeBuffer] dropped!! has_readend: {}, has_writend: {}",
-            self.read_end, self.write_end
+            "[PipeRing] dropped!! has_readend: {}, has_writend: {}",
+            self.read_end.load(Ordering::Relaxed),
+            self.write_end.load(Ordering::Relaxed)
         );
     }
 }
@@ -341,35 +424,27 @@ impl Inode for PipeInode {
 }
 
 pub struct PipeFile {
-    buffer: Arc<SpinLock<PipeBuffer>>,
+    ring: Arc<PipeRing>,
     meta: FileMeta,
 }
 
 impl PipeFile {
-    fn new_read_end(
-        buffer: Arc<SpinLock<PipeBuffer>>,
-        name: &str,
-        file_flags: &FileFlags,
-    ) -> Arc<Self> {
+    fn new_read_end(ring: Arc<PipeRing>, name: &str, file_flags: &FileFlags) -> Arc<Self> {
         let name = format!("{}-read", name);
         let dentry = PipeDentry::new(&name).into_dyn();
         let inode = Arc::new(PipeInode::new());
         dentry.set_inode(inode.clone());
         let meta = FileMeta::new(dentry, inode, &(*file_flags | FileFlags::O_RDONLY));
-        let res = Arc::new(Self { buffer, meta });
+        let res = Arc::new(Self { ring, meta });
         res
     }
-    fn new_write_end(
-        buffer: Arc<SpinLock<PipeBuffer>>,
-        name: &str,
-        file_flags: &FileFlags,
-    ) -> Arc<Self> {
+    fn new_write_end(ring: Arc<PipeRing>, name: &str, file_flags: &FileFlags) -> Arc<Self> {
         let name = format!("{}-write", name);
         let dentry = PipeDentry::new(&name).into_dyn();
         let inode = Arc::new(PipeInode::new());
         dentry.set_inode(inode.clone());
         let meta = FileMeta::new(dentry, inode, &(*file_flags | FileFlags::O_WRONLY));
-        let res = Arc::new(Self { buffer, meta });
+        let res = Arc::new(Self { ring, meta });
         res
     }
     fn is_read_end(&self) -> bool {
@@ -380,14 +455,106 @@ impl PipeFile {
     }
     /// Create a new pipe, return (read end, write end)
     pub fn new_pipe(file_flags: &FileFlags) -> (Arc<Self>, Arc<Self>) {
-        let buffer = Arc::new(SpinLock::new(PipeBuffer::new()));
+        let ring = Arc::new(PipeRing::new());
         let name = format!("pipe-{}", global_alloc());
-        let read_end = Self::new_read_end(buffer.clone(), &name, file_flags);
-        let write_end = Self::new_write_end(buffer.clone(), &name, file_flags);
-        buffer.lock().read_end = true;
-        buffer.lock().write_end = true;
+        let read_end = Self::new_read_end(ring.clone(), &name, file_flags);
+        let write_end = Self::new_write_end(ring.clone(), &name, file_flags);
         (read_end, write_end)
     }
+
+    /// wait until there's data or no write end
+    async fn wait_readable(&self) -> SysResult<()> {
+        PipeWaitFuture::new(&self.ring, PipeWait::Read, self.meta.is_nonblocking()).await
+    }
+
+    /// wait until there's room, fails with EPIPE if there's no read end
+    async fn wait_writable(&self) -> SysResult<()> {
+        PipeWaitFuture::new(&self.ring, PipeWait::Write, self.meta.is_nonblocking()).await
+    }
+
+    /// wait until a page of `len` bytes can be lent
+    async fn wait_lendable(&self, len: usize) -> SysResult<()> {
+        PipeWaitFuture::new(&self.ring, PipeWait::Lend(len), self.meta.is_nonblocking()).await
+    }
+
+    /// lock the reader side with the oldest data in the pipe, for splicing
+    /// it out without a copy, `None` at end of file
+    ///
+    /// with `block` unset, `None` is returned instead of waiting
+    pub async fn read_chunk(&self, block: bool) -> SysResult<Option<PipeChunk<'_>>> {
+        assert!(self.is_read_end());
+        loop {
+            let closed = !self.ring.write_end.load(Ordering::SeqCst);
+            let reader = self.ring.reader.lock().await;
+            if let Some((slot, start, end)) = self.ring.front() {
+                return Ok(Some(PipeChunk {
+                    ring: &self.ring,
+                    _reader: reader,
+                    frame: slot.frame.as_ref().clone().unwrap(),
+                    start,
+                    end,
+                }));
+            }
+            drop(reader);
+            if closed || !block {
+                return Ok(None);
+            }
+            self.wait_readable().await?;
+        }
+    }
+
+    /// lend `len` bytes at `offset` of `frame` to the pipe without a copy,
+    /// waits for a free slot, fails with EAGAIN if the pipe is nonblocking
+    ///
+    /// with `block` unset, 0 is returned instead of waiting
+    pub async fn write_page(
+        &self,
+        frame: &FrameTracker,
+        offset: usize,
+        len: usize,
+        block: bool,
+    ) -> SyscallResult {
+        assert!(self.is_write_end());
+        assert!(len <= PAGE_SIZE);
+        loop {
+            let writer = self.ring.writer.lock().await;
+            if self.ring.write_page(frame.clone(), offset, len) {
+                drop(writer);
+                self.ring.read_wait.notify();
+                return Ok(len as isize);
+            }
+            drop(writer);
+            if !block && self.ring.read_end.load(Ordering::SeqCst) {
+                return Ok(0);
+            }
+            self.wait_lendable(len).await?;
+        }
+    }
+}
+
+/// the oldest data in a pipe, see [`PipeFile::read_chunk`]
+pub struct PipeChunk<'a> {
+    ring: &'a PipeRing,
+    _reader: AsyncMutexGuard<'a, ()>,
+    frame: FrameTracker,
+    start: usize,
+    end: usize,
+}
+
+impl PipeChunk<'_> {
+    pub fn data(&self) -> &[u8] {
+        // the writer only appends past `end`
+        let ptr = self.frame.kernel_vpn().as_va_usize() as *const u8;
+        unsafe { core::slice::from_raw_parts(ptr.add(self.start), self.end - self.start) }
+    }
+    /// mark the first `n` bytes read
+    pub fn consume(self, n: usize) {
+        assert!(n <= self.end - self.start);
+        if n != 0 {
+            self.ring.consume(n);
+            self.ring.write_wait.notify();
+        }
+    }
 }
 
 #[async_trait]
@@ -401,14 +568,20 @@ impl File for PipeFile {
     async fn base_read(&self, _offset: usize, buf: &mut [u8]) -> SyscallResult {
         assert!(self.is_read_end());
         debug!("[pipe] {} read, {}", self.meta.dentry().name(), buf.len());
-        let non_block = self.meta.is_nonblocking();
-        PipeReadFuture::new(buf.len(), self.buffer.clone(), non_block).await?;
-        let mut buffer = self.buffer.lock();
-        let ret = buffer.read(buf);
-        if ret != 0 {
-            buffer.notify_write_waker();
+        loop {
+            // data written before the write end closed is still read
+            let closed = !self.ring.write_end.load(Ordering::SeqCst);
+            let reader = self.ring.reader.lock().await;
+            let ret = self.ring.read(buf);
+            drop(reader);
+            if ret != 0 {
+                self.ring.write_wait.notify();
+            }
+            if ret != 0 || buf.is_empty() || closed {
+                return Ok(ret as isize);
+            }
+            self.wait_readable().await?;
         }
-        Ok(ret as isize)
     }
     async fn base_readlink(&self, _buf: &mut [u8]) -> SyscallResult {
         unreachable!()
@@ -416,14 +589,18 @@ impl File for PipeFile {
     async fn base_write(&self, _offset: usize, buf: &[u8]) -> SyscallResult {
         assert!(self.is_write_end());
         debug!("[pipe] {} write, {}", self.meta.dentry().name(), buf.len());
-        let non_block = self.meta.is_nonblocking();
-        PipeWriteFuture::new(buf.len(), self.buffer.clone(), non_block).await?;
-        let mut buffer = self.buffer.lock();
-        let ret = buffer.write(buf);
-        if ret != 0 {
-            buffer.notify_read_waker();
+        loop {
+            self.wait_writable().await?;
+            let writer = self.ring.writer.lock().await;
+            let ret = self.ring.write(buf);
+            drop(writer);
+            if ret != 0 {
+                self.ring.read_wait.notify();
+            }
+            if ret != 0 || buf.is_empty() {
+                return Ok(ret as isize);
+            }
         }
-        Ok(ret as isize)
     }
     async fn load_dir(&self) -> Result<(), Errno> {
         Err(Errno::ENOTDIR)
@@ -435,33 +612,28 @@ impl File for PipeFile {
         Err(Errno::ENOTTY)
     }
     fn poll(&self, req: &PollEvent, waker: Waker) -> PollEvent {
-        let mut buffer = self.buffer.lock();
+        let ring = &self.ring;
         let mut ret = PollEvent::empty();
         if self.is_read_end() {
             debug!("[PipeFile] poll read end, req: {:?}", req);
-            if !buffer.write_end {
+            if !ring.write_end.load(Ordering::SeqCst) {
                 debug!("[PipeFile] read end has no write end");
                 ret |= PollEvent::POLLHUP;
             }
-            if req.contains(PollEvent::POLLIN) && buffer.read_available() {
+            if req.contains(PollEvent::POLLIN) && ring.read_wait.watch(&waker, || ring.readable()) {
                 debug!("[PipeFile] read end has data");
                 ret |= PollEvent::POLLIN;
-            } else {
-                debug!("[PipeFile] read end has no data");
-                buffer.add_read_event(0, waker);
             }
         } else {
             debug!("[PipeFile] poll write end, req: {:?}", req);
-            if !buffer.read_end {
+            if !ring.read_end.load(Ordering::SeqCst) {
                 debug!("[PipeFile] write end has no read end");
                 ret |= PollEvent::POLLERR;
             }
-            if req.contains(PollEvent::POLLOUT) && buffer.write_available() {
+            if req.contains(PollEvent::POLLOUT) && ring.write_wait.watch(&waker, || ring.writable())
+            {
                 debug!("[PipeFile] write end has space");
                 ret |= PollEvent::POLLOUT;
-            } else {
-                debug!("[PipeFile] write end has no space");
-                buffer.add_write_event(0, waker);
             }
         }
         ret
@@ -470,113 +642,80 @@ impl File for PipeFile {
 
 impl Drop for PipeFile {
     fn drop(&mut self) {
-        let mut buffer = self.buffer.lock();
+        let dentry = self.meta.dentry();
+        let name = dentry.name();
+        warn!("[PipeFile] {} dropped!", name);
+        root_dentry().remove_child(&name);
         if self.is_read_end() {
-            let dentry = self.meta.dentry();
-            let name = dentry.name();
-            warn!("[PipeFile] {} dropped!", name);
-            root_dentry().remove_child(&name);
-            buffer.read_end = false;
-            for (_, waker) in buffer.write_wakers.drain(..) {
-                waker.wake();
-            }
+            self.ring.read_end.store(false, Ordering::SeqCst);
+            self.ring.write_wait.notify();
         } else {
-            let dentry = self.meta.dentry();
-            let name = dentry.name();
-            warn!("[PipeFile] {} dropped!", name);
-            root_dentry().remove_child(&name);
-            buffer.write_end = false;
-            for (_, waker) in buffer.read_wakers.drain(..) {
-                waker.wake();
-            }
+            self.ring.write_end.store(false, Ordering::SeqCst);
+            self.ring.read_wait.notify();
         }
     }
 }
 
-/// Pipe read future, only continue if it can be read
-struct PipeReadFuture {
-    read_len: usize,
-    pipe_buffer: Arc<SpinLock<PipeBuffer>>,
-    non_block: bool,
-}
-
-impl PipeReadFuture {
-    fn new(read_len: usize, pipe_buffer: Arc<SpinLock<PipeBuffer>>, non_block: bool) -> Self {
-        Self {
-            read_len,
-            pipe_buffer,
-            non_block,
-        }
-    }
+#[derive(Clone, Copy)]
+enum PipeWait {
+    Read,
+    Write,
+    /// a free slot for a lent page of this many bytes
+    Lend(usize),
 }
 
-impl Future for PipeReadFuture {
-    // just for error handling
-    type Output = SysResult<()>;
-
-    fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Self::Output> {
-        let mut buffer = self.pipe_buffer.lock();
-        if buffer.write_end {
-            // only continue if it can be read
-            debug!("[PipeReadFile] available: {}", buffer.read_available());
-            if buffer.read_available() {
-                Poll::Ready(Ok(()))
-            } else if self.non_block {
-                Poll::Ready(Err(Errno::EAGAIN))
-            } else {
-                buffer.add_read_event(self.read_len, cx.waker().clone());
-                Poll::Pending
-            }
-        } else {
-            Poll::Ready(Ok(()))
-        }
-    }
-}
-
-/// Pipe write future, only continue if it can be written
-struct PipeWriteFuture {
-    write_len: usize,
-    pipe_buffer: Arc<SpinLock<PipeBuffer>>,
+/// wait for one side of a pipe, only continue if it can be read or written
+struct PipeWaitFuture<'a> {
+    ring: &'a PipeRing,
+    wait: PipeWait,
     non_block: bool,
 }
 
-impl PipeWriteFuture {
-    fn new(write_len: usize, pipe_buffer: Arc<SpinLock<PipeBuffer>>, non_block: bool) -> Self {
+impl<'a> PipeWaitFuture<'a> {
+    fn new(ring: &'a PipeRing, wait: PipeWait, non_block: bool) -> Self {
         Self {
-            write_len,
-            pipe_buffer,
+            ring,
+            wait,
             non_block,
         }
     }
 }
 
-impl Future for PipeWriteFuture {
+impl Future for PipeWaitFuture<'_> {
     // just for error handling
     type Output = SysResult<()>;
 
     fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Self::Output> {
-        let mut buffer = self.pipe_buffer.lock();
-        if buffer.read_end {
-            debug!("[PipeWriteFile] available: {}", buffer.write_available());
-            // only continue if it can be written
-            if buffer.write_available() {
-                trace!("[PipeWriteFile] write available");
-                Poll::Ready(Ok(()))
-            } else if self.non_block {
-                Poll::Ready(Err(Errno::EAGAIN))
-            } else {
-                trace!("[PipeWriteFile] write pending, save waker");
-                buffer.add_write_event(self.write_len, cx.waker().clone());
-                Poll::Pending
-            }
-        } else {
+        let ring = self.ring;
+        let read = matches!(self.wait, PipeWait::Read);
+        if !read && !ring.read_end.load(Ordering::SeqCst) {
             // No read end - send SIGPIPE to current process
             warn!("[PipeWriteFile] no read end, sending SIGPIPE");
             if let Some(task) = current_task() {
                 let siginfo = SigInfo::new_simple(Signal::SIGPIPE, SigCode::Kernel);
                 task.recv_siginfo(siginfo, false);
             }
-            Poll::Ready(Err(Errno::EPIPE))
+            return Poll::Ready(Err(Errno::EPIPE));
+        }
+        let wait = self.wait;
+        let ready = || match wait {
+            PipeWait::Read => ring.readable() || !ring.write_end.load(Ordering::SeqCst),
+            PipeWait::Write => ring.writable() || !ring.read_end.load(Ordering::SeqCst),
+            PipeWait::Lend(len) => ring.lendable(len) || !ring.read_end.load(Ordering::SeqCst),
+        };
+        if ready() {
+            Poll::Ready(Ok(()))
+        } else if self.non_block {
+            Poll::Ready(Err(Errno::EAGAIN))
+        } else {
+            let queue = match read {
+                true => &ring.read_wait,
+                false => &ring.write_wait,
+            };
+            match queue.wait(cx.waker(), ready) {
+                true => Poll::Ready(Ok(())),
+                false => Poll::Pending,
+            }
         }
     }
 }
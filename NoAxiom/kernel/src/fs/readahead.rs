@@ -0,0 +1,233 @@
+//! per-open-file read-ahead, a simplified version of linux `file_ra_state`
+//!
+//! A sequential stream owns a window `[start, start + size)` of pages. The
+//! last `async_size` pages of the window are the lookahead part, hitting the
+//! first of them submits the next, larger window in a kernel task, so the
+//! reader rarely waits for the disk. Random access disables read-ahead.
+//! A miss inside the window still in flight waits for it instead of
+//! reading the same pages again.
+
+use alloc::{sync::Arc, vec::Vec};
+use core::{
+    future::poll_fn,
+    sync::atomic::{AtomicBool, Ordering},
+    task::{Poll, Waker},
+};
+
+use config::{
+    fs::{READ_AHEAD_MAX_PAGES, READ_AHEAD_MIN_PAGES},
+    mm::PAGE_SIZE,
+};
+use ksync::mutex::SpinLock;
+
+use crate::{
+    fs::{
+        pagecache::{get_pagecache, Page, PageState},
+        vfs::basic::{file::File, inode::InodeState},
+    },
+    sched::spawn::spawn_ktask,
+    syscall::SysResult,
+};
+
+/// a window read by a kernel task
+pub struct AsyncWindow {
+    start: usize,
+    count: usize,
+    done: AtomicBool,
+    waiters: SpinLock<Vec<Waker>>,
+}
+
+impl AsyncWindow {
+    fn new(start: usize, count: usize) -> Arc<Self> {
+        Arc::new(Self {
+            start,
+            count,
+            done: AtomicBool::new(false),
+            waiters: SpinLock::new(Vec::new()),
+        })
+    }
+
+    fn is_done(&self) -> bool {
+        self.done.load(Ordering::Acquire)
+    }
+
+    fn complete(&self) {
+        let waiters = {
+            let mut waiters = self.waiters.lock();
+            self.done.store(true, Ordering::Release);
+            core::mem::take(&mut *waiters)
+        };
+        waiters.into_iter().for_each(Waker::wake);
+    }
+
+    /// wait until the read of the window finished, successful or not
+    pub async fn wait(&self) {
+        poll_fn(|cx| {
+            let mut waiters = self.waiters.lock();
+            if self.is_done() {
+                return Poll::Ready(());
+            }
+            waiters.push(cx.waker().clone());
+            Poll::Pending
+        })
+        .await
+    }
+}
+
+pub enum ReadAheadMiss {
+    /// read the window `(start, count)` synchronously
+    Read(usize, usize),
+    /// the page is in a window still in flight
+    Wait(Arc<AsyncWindow>),
+}
+
+pub struct ReadAheadState {
+    /// first page of the current window
+    start: usize,
+    /// pages of the current window, 0 means no window
+    size: usize,
+    /// pages of the lookahead part at the end of the window
+    async_size: usize,
+    /// the page expected by a sequential reader
+    next: usize,
+    /// the last window submitted asynchronously
+    inflight: Option<Arc<AsyncWindow>>,
+}
+
+fn init_window(req: usize) -> usize {
+    (req.next_power_of_two() * 2).clamp(READ_AHEAD_MIN_PAGES, READ_AHEAD_MAX_PAGES)
+}
+
+fn next_window(size: usize) -> usize {
+    match size < READ_AHEAD_MAX_PAGES / 16 {
+        true => size * 4,
+        false => size * 2,
+    }
+    .min(READ_AHEAD_MAX_PAGES)
+}
+
+impl ReadAheadState {
+    pub const fn new() -> Self {
+        Self {
+            start: 0,
+            size: 0,
+            async_size: 0,
+            next: 0,
+            inflight: None,
+        }
+    }
+
+    fn set_window(&mut self, start: usize, size: usize, async_size: usize) -> (usize, usize) {
+        self.start = start;
+        self.size = size;
+        self.async_size = async_size;
+        (start, size)
+    }
+
+    /// a miss on page `index` while `req` pages are wanted, returns the
+    /// window to read synchronously or the window in flight to wait for
+    pub fn on_miss(&mut self, index: usize, req: usize) -> ReadAheadMiss {
+        let req = req.max(1);
+        let last_next = core::mem::replace(&mut self.next, index + 1);
+        match self.inflight.clone() {
+            Some(window) if window.is_done() => self.inflight = None,
+            Some(window) if (window.start..window.start + window.count).contains(&index) => {
+                return ReadAheadMiss::Wait(window);
+            }
+            _ => {}
+        }
+        let (start, count) = self.window_on_miss(index, req, last_next);
+        ReadAheadMiss::Read(start, count)
+    }
+
+    fn window_on_miss(&mut self, index: usize, req: usize, last_next: usize) -> (usize, usize) {
+        if self.size != 0 && (self.start..self.start + self.size).contains(&index) {
+            // the async read of this window landed, but not this page
+            return (index, self.start + self.size - index);
+        }
+        if self.size != 0 && index == self.start + self.size {
+            // the reader outran the lookahead
+            let size = next_window(self.size).max(req);
+            return self.set_window(index, size, size - req.min(size));
+        }
+        if index == 0 || index == last_next {
+            let size = init_window(req).max(req);
+            return self.set_window(index, size, size - req);
+        }
+        // random access, read exactly what is wanted
+        self.set_window(index, req, 0)
+    }
+
+    /// a hit on page `index`, returns the next window to read asynchronously
+    /// if the lookahead marker is reached
+    pub fn on_hit(&mut self, index: usize) -> Option<Arc<AsyncWindow>> {
+        self.next = index + 1;
+        if self.async_size == 0 || index != self.start + self.size - self.async_size {
+            return None;
+        }
+        let size = next_window(self.size);
+        let (start, count) = self.set_window(self.start + self.size, size, size);
+        let window = AsyncWindow::new(start, count);
+        self.inflight = Some(window.clone());
+        Some(window)
+    }
+}
+
+/// read the pages `[start, start + count)` with one `base_read_pages` and
+/// insert them into the page cache, returns the cached page at `start`
+pub async fn fill_window(file: &Arc<dyn File>, start: usize, count: usize) -> SysResult<Arc<Page>> {
+    let size = file.size();
+    let offset = start * PAGE_SIZE;
+    let count = count.min((size.saturating_sub(offset) + PAGE_SIZE - 1) / PAGE_SIZE);
+    // trailing pages already cached need no read
+    let mut count = count.max(1);
+    while count > 1
+        && get_pagecache()
+            .get_page(file, (start + count - 1) * PAGE_SIZE)
+            .is_some()
+    {
+        count -= 1;
+    }
+
+    let page_state = if file.inode().state() == InodeState::Deleted {
+        PageState::Deleted
+    } else {
+        PageState::Shared
+    };
+    let pages: Vec<Page> = (0..count)
+        .map(|_| get_pagecache().alloc(page_state))
+        .collect();
+    let mut bufs: Vec<&mut [u8]> = pages.iter().map(|page| page.as_mut_bytes_array()).collect();
+    file.base_read_pages(offset, &mut bufs).await?;
+
+    let mut first = None;
+    for (i, page) in pages.into_iter().enumerate() {
+        let page = get_pagecache().fill_page(file, (start + i) * PAGE_SIZE, page);
+        if i == 0 {
+            first = Some(page);
+        }
+    }
+    Ok(first.unwrap())
+}
+
+/// submit the lookahead window in a kernel task
+pub fn async_fill_window(file: &Arc<dyn File>, window: Arc<AsyncWindow>) {
+    let (start, count) = (window.start, window.count);
+    if start * PAGE_SIZE >= file.size() {
+        window.complete();
+        return;
+    }
+    let file = file.clone();
+    spawn_ktask(async move {
+        if let Err(e) = fill_window(&file, start, count).await {
+            warn!(
+                "[readahead] {} window {}+{} failed: {:?}",
+                file.name(),
+                start,
+                count,
+                e
+            );
+        }
+        window.complete();
+    });
+}
@@ -0,0 +1,130 @@
+//! dentry cache
+//!
+//! path components are looked up in a global table hashed by the parent
+//! dentry and the component name, the parent's children map stays the
+//! authoritative copy and every change to it goes through [`DentryCache`],
+//! lookups only share the read lock of a single bucket
+
+use alloc::{
+    string::{String, ToString},
+    sync::{Arc, Weak},
+    vec::Vec,
+};
+
+use array_init::array_init;
+use config::fs::{DCACHE_BUCKETS, DCACHE_BUCKET_CAP};
+use ksync::mutex::RwLock;
+use lazy_static::lazy_static;
+
+use super::dentry::Dentry;
+
+/// result of a [`DentryCache::lookup`]
+pub enum DcacheLookup {
+    Positive(Arc<dyn Dentry>),
+    /// known not to exist, the directory was fully loaded
+    Negative,
+    Miss,
+}
+
+struct DcacheEntry {
+    /// the weak pointer keeps the parent's allocation, so its address
+    /// can't be reused by another dentry while the entry lives
+    parent: Weak<dyn Dentry>,
+    hash: u64,
+    name: String,
+    /// None for a negative entry
+    dentry: Option<Arc<dyn Dentry>>,
+}
+
+impl DcacheEntry {
+    fn matches(&self, parent: *const (), hash: u64, name: &str) -> bool {
+        self.hash == hash && self.parent.as_ptr() as *const () == parent && self.name == name
+    }
+}
+
+#[repr(align(64))]
+struct DcacheBucket(RwLock<Vec<DcacheEntry>>);
+
+pub struct DentryCache {
+    buckets: [DcacheBucket; DCACHE_BUCKETS],
+}
+
+lazy_static! {
+    pub static ref DCACHE: DentryCache = DentryCache::new();
+}
+
+/// fnv-1a, names are short so it beats anything fancier
+fn name_hash(name: &str) -> u64 {
+    name.bytes().fold(0xcbf2_9ce4_8422_2325, |hash, byte| {
+        (hash ^ byte as u64).wrapping_mul(0x0000_0100_0000_01b3)
+    })
+}
+
+fn parent_key(parent: &Arc<dyn Dentry>) -> *const () {
+    Arc::as_ptr(parent) as *const ()
+}
+
+impl DentryCache {
+    fn new() -> Self {
+        Self {
+            buckets: array_init(|_| DcacheBucket(RwLock::new(Vec::new()))),
+        }
+    }
+
+    fn bucket(&self, parent: *const (), hash: u64) -> &RwLock<Vec<DcacheEntry>> {
+        let key = hash ^ (parent as usize as u64 >> 4).wrapping_mul(0x9e37_79b9_7f4a_7c15);
+        &self.buckets[(key >> 32) as usize % DCACHE_BUCKETS].0
+    }
+
+    pub fn lookup(&self, parent: &Arc<dyn Dentry>, name: &str) -> DcacheLookup {
+        let (key, hash) = (parent_key(parent), name_hash(name));
+        let bucket = self.bucket(key, hash).read();
+        match bucket.iter().find(|entry| entry.matches(key, hash, name)) {
+            Some(entry) => match &entry.dentry {
+                Some(dentry) => DcacheLookup::Positive(dentry.clone()),
+                None => DcacheLookup::Negative,
+            },
+            None => DcacheLookup::Miss,
+        }
+    }
+
+    fn set(&self, parent: &Arc<dyn Dentry>, name: &str, dentry: Option<Arc<dyn Dentry>>) {
+        let (key, hash) = (parent_key(parent), name_hash(name));
+        let mut bucket = self.bucket(key, hash).write();
+        if let Some(entry) = bucket
+            .iter_mut()
+            .find(|entry| entry.matches(key, hash, name))
+        {
+            entry.dentry = dentry;
+            return;
+        }
+        // entries of dropped directories go first, then the oldest
+        bucket.retain(|entry| entry.parent.strong_count() > 0);
+        if bucket.len() >= DCACHE_BUCKET_CAP {
+            bucket.remove(0);
+        }
+        bucket.push(DcacheEntry {
+            parent: Arc::downgrade(parent),
+            hash,
+            name: name.to_string(),
+            dentry,
+        });
+    }
+
+    pub fn insert(&self, parent: &Arc<dyn Dentry>, name: &str, dentry: Arc<dyn Dentry>) {
+        self.set(parent, name, Some(dentry));
+    }
+
+    /// only for directories whose whole content is loaded and which change
+    /// only through the vfs
+    pub fn insert_negative(&self, parent: &Arc<dyn Dentry>, name: &str) {
+        self.set(parent, name, None);
+    }
+
+    pub fn invalidate(&self, parent: &Arc<dyn Dentry>, name: &str) {
+        let (key, hash) = (parent_key(parent), name_hash(name));
+        self.bucket(key, hash)
+            .write()
+            .retain(|entry| !entry.matches(key, hash, name));
+    }
+}
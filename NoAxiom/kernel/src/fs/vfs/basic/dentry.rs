@@ -38,6 +38,7 @@ type Mutex<T> = SpinLock<T>;
 type MutexGuard<'a, T> = SpinLockGuard<'a, T>;
 
 use super::{
+    dcache::{DcacheLookup, DCACHE},
     file::File,
     inode::Inode,
     superblock::{EmptySuperBlock, SuperBlock},
@@ -170,7 +171,8 @@ impl dyn Dentry {
         self.meta().parent.as_ref().and_then(|p| p.upgrade())
     }
 
-    /// Get the children of the dentry
+    /// Get the children of the dentry, only for reading, changes must go
+    /// through the child methods below to keep the dcache coherent
     pub fn children(&self) -> MutexGuard<BTreeMap<String, Arc<dyn Dentry>>> {
         self.meta().children.lock()
     }
@@ -179,6 +181,20 @@ impl dyn Dentry {
         self.meta().children.lock().get(name).cloned()
     }
 
+    /// look `name` up in the children map and remember the answer in the
+    /// dcache, a miss is only remembered if `negative`, done with the map
+    /// locked so a concurrent insert or remove can't be overwritten
+    fn get_child_cached(self: &Arc<Self>, name: &str, negative: bool) -> Option<Arc<dyn Dentry>> {
+        let children = self.meta().children.lock();
+        let child = children.get(name).cloned();
+        match &child {
+            Some(child) => DCACHE.insert(self, name, child.clone()),
+            None if negative => DCACHE.insert_negative(self, name),
+            None => {}
+        }
+        child
+    }
+
     /// Get super block of the dentry
     pub fn super_block(&self) -> Arc<dyn SuperBlock> {
         self.meta().super_block.clone()
@@ -202,6 +218,7 @@ impl dyn Dentry {
             let child = self.clone().from_name(name);
             child.set_inode(child_inode);
             children.insert(name.to_string(), child.clone());
+            DCACHE.insert(self, name, child.clone());
             child
         };
         res
@@ -211,9 +228,16 @@ impl dyn Dentry {
     /// Add a child dentry with `child` directly, for fs which doesn't
     /// support create or used in different type fs (like mount).
     pub fn add_child(self: &Arc<Self>, child: Arc<dyn Dentry>) {
-        let mut children = self.meta().children.lock();
         let name = child.name().to_string();
-        if let Some(old) = children.insert(name.clone(), child) {
+        self.insert_child(&name, child);
+    }
+
+    /// Add `child` under `name`, which may differ from the child's own
+    /// name after a rename.
+    pub fn insert_child(self: &Arc<Self>, name: &str, child: Arc<dyn Dentry>) {
+        let mut children = self.meta().children.lock();
+        DCACHE.insert(self, name, child.clone());
+        if let Some(old) = children.insert(name.to_string(), child) {
             warn!(
                 "add child {} to {} already has child {}, replace it",
                 name,
@@ -231,7 +255,18 @@ impl dyn Dentry {
     pub fn remove_child(self: &Arc<Self>, name: &str) -> Option<Arc<dyn Dentry>> {
         let path = self.clone().path();
         crate::fs::path::PATH_CACHE.lock().remove(&path);
-        self.children().remove(name)
+        let mut children = self.meta().children.lock();
+        DCACHE.invalidate(self, name);
+        children.remove(name)
+    }
+
+    /// Remove all the child dentries, for dirs rebuilt on every load.
+    pub fn clear_children(self: &Arc<Self>) {
+        let mut children = self.meta().children.lock();
+        for name in children.keys() {
+            DCACHE.invalidate(self, name);
+        }
+        children.clear();
     }
 
     /// walk through the path, return ENOENT when not found.
@@ -351,7 +386,14 @@ impl dyn Dentry {
                         }
                     }
                 }
-                if let Some(child) = self.get_child(name) {
+                match DCACHE.lookup(self, name) {
+                    DcacheLookup::Positive(child) => {
+                        return child.__walk_path(task, path, step + 1, jumps);
+                    }
+                    DcacheLookup::Negative => return Err(Errno::ENOENT),
+                    DcacheLookup::Miss => {}
+                }
+                if let Some(child) = self.get_child_cached(name, false) {
                     return child.__walk_path(task, path, step + 1, jumps);
                 }
                 debug!(
@@ -380,7 +422,10 @@ impl dyn Dentry {
                         return Err(Errno::ENOENT);
                     }
                 }
-                if let Some(child) = self.get_child(name) {
+                // a loaded disk dir changes only through the vfs, virtual
+                // ones may grow entries on every load
+                let negative = !self.super_block().meta().is_virtual();
+                if let Some(child) = self.get_child_cached(name, negative) {
                     return child.__walk_path(task, path, step + 1, jumps);
                 }
                 #[cfg(feature = "debug_sig")]
@@ -576,7 +621,8 @@ impl dyn Dentry {
         if euid == 0 {
             return true;
         }
-        let i_mode = self.inode().unwrap().inode_mode().bits();
+        let inode = self.inode().unwrap();
+        let i_mode = inode.inode_mode().bits();
         debug!(
             "[can_search] Checking search permission for {}, mode: {:o}, euid: {}, egid: {}",
             self.path(),
@@ -586,9 +632,9 @@ impl dyn Dentry {
         );
         let (user_perm, group_perm, other_perm) =
             ((i_mode >> 6) & 0o7, (i_mode >> 3) & 0o7, i_mode & 0o7);
-        let perm = if euid == self.inode().unwrap().uid() {
+        let perm = if euid == inode.uid() {
             user_perm
-        } else if egid == self.inode().unwrap().gid() {
+        } else if egid == inode.gid() {
             group_perm
         } else {
             other_perm
@@ -16,6 +16,8 @@ use core::{
 use async_trait::async_trait;
 use config::mm::PAGE_SIZE;
 use downcast_rs::{impl_downcast, DowncastSync};
+use ksync::mutex::SpinLock;
+use memory::frame::FrameTracker;
 
 use super::{
     dentry::{self, Dentry},
@@ -24,7 +26,8 @@ use super::{
 use crate::{
     constant::fs::LEN_BEFORE_NAME,
     fs::{
-        pagecache::{get_pagecache_rguard, get_pagecache_wguard, PageState},
+        pagecache::{get_pagecache, Page, PageState},
+        readahead::{async_fill_window, fill_window, ReadAheadMiss, ReadAheadState},
         vfs::basic::{
             dentry::{DENTRY_FRONT, DENTRY_HERE},
             inode::InodeState,
@@ -36,7 +39,7 @@ use crate::{
         result::Errno,
     },
     syscall::{SysResult, SyscallResult},
-    utils::align_offset,
+    utils::{align_offset, trace::PAGE_CACHE_STAT},
 };
 
 pub struct FileMeta {
@@ -48,6 +51,8 @@ pub struct FileMeta {
     dentry: Arc<dyn Dentry>,
     /// Pointer to the Inode
     pub inode: Arc<dyn Inode>,
+    /// Read-ahead state of this open file
+    pub ra: SpinLock<ReadAheadState>,
 }
 
 impl FileMeta {
@@ -57,6 +62,7 @@ impl FileMeta {
             pos: AtomicUsize::new(0),
             dentry,
             inode,
+            ra: SpinLock::new(ReadAheadState::new()),
         }
     }
     #[allow(unused)]
@@ -111,6 +117,11 @@ pub trait File: Send + Sync + DowncastSync {
     fn is_interruptable(&self) -> bool {
         false
     }
+    /// Frame to map at `offset` for files whose content lives in kernel
+    /// memory shared with user space, mmap copies the file otherwise
+    fn mmap_frame(&self, _offset: usize) -> Option<FrameTracker> {
+        None
+    }
     /// Get the meta of the file
     fn meta(&self) -> &FileMeta;
     /// Read data from file at `offset` to `buf`, not for kernel other modules
@@ -119,6 +130,36 @@ pub trait File: Send + Sync + DowncastSync {
     async fn base_readlink(&self, buf: &mut [u8]) -> SyscallResult;
     /// Write data to file at `offset` from `buf`, not for kernel other modules
     async fn base_write(&self, offset: usize, buf: &[u8]) -> SyscallResult;
+    /// Read the whole pages of the file from the page aligned `offset` on
+    /// for the page cache, the default reads them with one `base_read`
+    /// through a bounce buffer
+    async fn base_read_pages(&self, offset: usize, pages: &mut [&mut [u8]]) -> SyscallResult {
+        if let [page] = pages {
+            return self.base_read(offset, page).await;
+        }
+        let mut buf = vec![0u8; pages.len() * PAGE_SIZE];
+        let len = self.base_read(offset, &mut buf).await?;
+        for (page, data) in pages.iter_mut().zip(buf.chunks_exact(PAGE_SIZE)) {
+            page.copy_from_slice(data);
+        }
+        Ok(len)
+    }
+    /// Write back the whole pages of the page cache to the page aligned
+    /// `offset` on, what lies past the end of file is left out, the default
+    /// writes them one by one
+    async fn base_write_pages(&self, offset: usize, pages: &[&[u8]]) -> SyscallResult {
+        let size = self.size();
+        let mut total = 0;
+        for (i, page) in pages.iter().enumerate() {
+            let offset = offset + i * PAGE_SIZE;
+            if offset >= size {
+                break;
+            }
+            let len = PAGE_SIZE.min(size - offset);
+            total += self.base_write(offset, &page[..len]).await?;
+        }
+        Ok(total)
+    }
     /// Load directory into memory, must be called before read/write explicitly,
     /// only for directories
     async fn load_dir(&self) -> Result<(), Errno>;
@@ -187,7 +228,8 @@ impl dyn File {
     /// by using the page cache  
     ///
     /// if missing, using the `base_read` to fill the
-    /// page cache
+    /// page cache, the read-ahead state of the file decides how many pages
+    /// are fetched at once and when the next window is read asynchronously
     ///
     /// return the exact num of bytes read
     pub async fn read_at(self: &Arc<dyn File>, offset: usize, buf: &mut [u8]) -> SyscallResult {
@@ -218,50 +260,75 @@ impl dyn File {
             // maybe the buf is not enough
             let len = buf.len().min(page_len);
 
-            let r_guard = get_pagecache_rguard();
-            if let Some(page) = r_guard.get_page(&self.clone(), offset_align) {
-                unsafe {
-                    core::ptr::copy_nonoverlapping(
-                        page.as_mut_bytes_array().as_ptr().add(offset_in),
-                        buf.as_mut_ptr(),
-                        len,
-                    );
-                }
-                // debug!(
-                //     "[read_at] {} at {offset_align}, file_ino: {}, file_size: {}, content:
-                // {:?}",     self.name(),
-                //     self.meta().inode.id(),
-                //     size,
-                //     &page.as_mut_bytes_array()[..10],
-                // );
-
-                buf = &mut buf[len..];
-                current_offset += len;
-
-                if buf.is_empty() || current_offset == size {
-                    break;
-                }
-
-                continue;
+            let req = (offset_in + buf.len()).div_ceil(PAGE_SIZE);
+            let page = self.get_cached_page(offset_align, req).await?;
+            unsafe {
+                core::ptr::copy_nonoverlapping(
+                    page.as_mut_bytes_array().as_ptr().add(offset_in),
+                    buf.as_mut_ptr(),
+                    len,
+                );
+            }
+            // debug!(
+            //     "[read_at] {} at {offset_align}, file_ino: {}, file_size: {}, content:
+            // {:?}",     self.name(),
+            //     self.meta().inode.id(),
+            //     size,
+            //     &page.as_mut_bytes_array()[..10],
+            // );
+
+            buf = &mut buf[len..];
+            current_offset += len;
+
+            if buf.is_empty() || current_offset == size {
+                break;
             }
-            drop(r_guard);
-            let page_state = if self.inode().state() == InodeState::Deleted {
-                PageState::Deleted
-            } else {
-                PageState::Shared
-            };
-            let mut w_guard = get_pagecache_wguard();
-            let page = w_guard.alloc(page_state);
-            drop(w_guard);
-            self.base_read(offset_align, page.as_mut_bytes_array())
-                .await?;
-            let mut w_guard = get_pagecache_wguard();
-            w_guard.fill_page(&self.clone(), offset_align, page);
         }
 
         Ok((current_offset - offset) as isize)
     }
 
+    /// **FOR KERNEL!**  
+    /// get the cached page at `offset_align`, filling it on a miss, `req` is
+    /// the number of pages the caller is going to read from here
+    ///
+    /// the file must be backed by the page cache
+    pub async fn get_cached_page(
+        self: &Arc<dyn File>,
+        offset_align: usize,
+        req: usize,
+    ) -> SysResult<Arc<Page>> {
+        let index = offset_align / PAGE_SIZE;
+        match get_pagecache().get_page(self, offset_align) {
+            Some(page) => {
+                PAGE_CACHE_STAT.hit();
+                let window = self.meta().ra.lock().on_hit(index);
+                if let Some(window) = window {
+                    async_fill_window(self, window);
+                }
+                Ok(page)
+            }
+            None => {
+                PAGE_CACHE_STAT.miss();
+                loop {
+                    let miss = self.meta().ra.lock().on_miss(index, req);
+                    assert_no_lock!();
+                    match miss {
+                        ReadAheadMiss::Read(start, count) => {
+                            return fill_window(self, start, count).await;
+                        }
+                        ReadAheadMiss::Wait(window) => {
+                            window.wait().await;
+                            if let Some(page) = get_pagecache().get_page(self, offset_align) {
+                                return Ok(page);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
     pub async fn read(self: &Arc<dyn File>, buf: &mut [u8]) -> SyscallResult {
         let offset = self.meta().pos.load(Ordering::Acquire);
         let len = self.read_at(offset, buf).await?;
@@ -302,8 +369,6 @@ impl dyn File {
             self.inode().set_size(end_size);
         }
 
-        let mut w_guard = get_pagecache_wguard();
-
         // if the last page is not full,
         // if the buf is run out
         loop {
@@ -314,16 +379,7 @@ impl dyn File {
             let page_len = PAGE_SIZE - offset_in;
             // maybe the buf is not enough
             let len = buf.len().min(page_len);
-            if let Some(page) = w_guard.get_page_mut(&self.clone(), offset_align) {
-                unsafe {
-                    core::ptr::copy_nonoverlapping(
-                        buf.as_ptr(),
-                        page.as_mut_bytes_array().as_mut_ptr().add(offset_in),
-                        len,
-                    );
-                }
-                page.mark_dirty();
-
+            if get_pagecache().write_page(self, offset_align, offset_in, &buf[..len]) {
                 buf = &buf[len..];
                 current_offset += len;
 
@@ -339,10 +395,10 @@ impl dyn File {
             } else {
                 PageState::Shared
             };
-            let page = w_guard.alloc(page_state);
+            let page = get_pagecache().alloc(page_state);
             self.base_read(offset_align, page.as_mut_bytes_array())
                 .await?;
-            w_guard.fill_page(&self.clone(), offset_align, page);
+            get_pagecache().fill_page(self, offset_align, page);
         }
 
         Ok(ret as isize)
@@ -387,8 +443,7 @@ impl dyn File {
     }
 
     pub fn truncate_pagecache(self: &Arc<dyn File>, length: usize) {
-        let mut w_guard = get_pagecache_wguard();
-        w_guard.truncate(&self.clone(), length);
+        get_pagecache().truncate(self, length);
     }
 
     /// Reference: Phoenix  
@@ -1,4 +1,5 @@
 //! provide standard vfs structs, referrence from Phoenix OS
+pub mod dcache;
 pub mod dentry;
 pub mod file;
 pub mod inode;
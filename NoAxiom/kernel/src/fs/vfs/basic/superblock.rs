@@ -33,6 +33,16 @@ impl SuperBlockMeta {
             root: Once::new(),
         }
     }
+
+    /// The block device of the file system, None if it is virtual
+    pub fn device(&self) -> Option<&'static dyn BlockDevice> {
+        self.device
+    }
+
+    /// Not backed by a block device, like procfs or devfs
+    pub fn is_virtual(&self) -> bool {
+        self.device.is_none()
+    }
 }
 
 #[async_trait]
@@ -1,7 +1,7 @@
 use alloc::{boxed::Box, vec::Vec};
 
 use async_trait::async_trait;
-use driver::block::BlockDevice;
+use driver::block::{BlockDevice, BlockSegment};
 use fatfs::*;
 
 use crate::config::fs::BLOCK_SIZE;
@@ -33,7 +33,7 @@ impl DiskCursor {
     }
 
     /// mention that ext4_rs use 4k block size
-    /// so we use 4 times read 512 block to represent 4k block
+    /// so we read the covering 512 blocks with one vectored request
     ///
     /// only use for ext4_rs
     ///
@@ -55,33 +55,15 @@ impl DiskCursor {
 
         match offset {
             0 => {
-                let mut data = [[0u8; BLOCK_SIZE]; BLK_NUMS];
-                for i in 0..BLK_NUMS {
-                    blk.read(blk_id + i, &mut data[i]).await.unwrap();
-                }
-                for i in 0..BLK_NUMS {
-                    res[i * BLOCK_SIZE..(i + 1) * BLOCK_SIZE].copy_from_slice(&data[i]);
-                }
+                let segs = [BlockSegment::from_kernel_buf_mut(&mut res)];
+                blk.read_vectored(blk_id, &segs).await.unwrap();
             }
             _ => {
-                let mut data = [[0u8; BLOCK_SIZE]; BLK_NUMS + 1];
-                for i in 0..BLK_NUMS + 1 {
-                    blk.read(blk_id + i, &mut data[i]).await.unwrap();
-                }
-
-                // sector 0
-                res[..BLOCK_SIZE - offset].copy_from_slice(&data[0][offset..]);
-
-                let offset = BLOCK_SIZE - offset;
-                // sector 1 ~ BLK_NUMS - 1
-                for i in 0..BLK_NUMS - 1 {
-                    res[offset + i * BLOCK_SIZE..offset + (i + 1) * BLOCK_SIZE]
-                        .copy_from_slice(&data[i + 1]);
-                }
-
-                // sector BLK_NUMS
-                res[offset + (BLK_NUMS - 1) * BLOCK_SIZE..]
-                    .copy_from_slice(&data[BLK_NUMS][..BLOCK_SIZE - offset]);
+                // read the unaligned head and tail sectors along with the body
+                let mut data = vec![0u8; (BLK_NUMS + 1) * BLOCK_SIZE];
+                let segs = [BlockSegment::from_kernel_buf_mut(&mut data)];
+                blk.read_vectored(blk_id, &segs).await.unwrap();
+                res.copy_from_slice(&data[offset..offset + EXT4_RS_BLOCK_SIZE]);
             }
         }
         log::trace!("base_read_exact_block_size ok");
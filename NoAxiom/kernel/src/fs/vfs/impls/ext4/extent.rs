@@ -0,0 +1,283 @@
+//! extent map of an ext4 file
+//!
+//! ext4_rs resolves and copies one 4K block at a time through a bounce
+//! buffer. The data path of a file parses the extent tree of its inode once
+//! into a sorted map cached on the inode until the library changes the
+//! layout, so a contiguous file range becomes one multi-block device request
+//! straight into the buffers of the caller. Blocks the file doesn't have yet
+//! are still allocated by the library.
+
+use alloc::{vec, vec::Vec};
+
+use driver::block::{BlockDevice, BlockSegment};
+use include::errno::Errno;
+use memory::utils::kernel_va_to_pa;
+
+use crate::{config::fs::BLOCK_SIZE, syscall::SysResult};
+
+/// the inode maps its blocks with an extent tree
+const EXT4_EXTENTS_FL: u32 = 0x80000;
+const EXT4_EXT_MAGIC: u16 = 0xF30A;
+/// an extent longer than this is preallocated but not written yet
+const EXT4_EXT_INIT_MAX_LEN: u16 = 1 << 15;
+const EXT4_EXT_MAX_DEPTH: u16 = 5;
+/// the header and every entry of a tree node take 12 bytes
+const EXT4_EXT_ENTRY_SIZE: usize = 12;
+
+#[inline(always)]
+fn le16(buf: &[u8], pos: usize) -> u16 {
+    u16::from_le_bytes([buf[pos], buf[pos + 1]])
+}
+
+#[inline(always)]
+fn le32(buf: &[u8], pos: usize) -> u32 {
+    u32::from_le_bytes(buf[pos..pos + 4].try_into().unwrap())
+}
+
+#[derive(Clone, Copy)]
+struct Extent {
+    lblock: usize,
+    pblock: usize,
+    len: usize,
+}
+
+/// file blocks contiguous on the device too
+struct Run {
+    lblock: usize,
+    len: usize,
+    /// None for a hole
+    pblock: Option<usize>,
+}
+
+/// the pieces of the buffers `iov` concatenated in `[start, start + len)`
+fn pieces(iov: &[(usize, usize)], start: usize, len: usize) -> Vec<(usize, usize)> {
+    let (mut start, mut len) = (start, len);
+    let mut res = Vec::new();
+    for &(addr, size) in iov {
+        if len == 0 {
+            break;
+        }
+        if start >= size {
+            start -= size;
+            continue;
+        }
+        let take = (size - start).min(len);
+        res.push((addr + start, take));
+        start = 0;
+        len -= take;
+    }
+    res
+}
+
+fn zero(parts: &[(usize, usize)]) {
+    for &(addr, len) in parts {
+        unsafe { core::ptr::write_bytes(addr as *mut u8, 0, len) };
+    }
+}
+
+fn segments(parts: &[(usize, usize)]) -> Vec<BlockSegment> {
+    parts
+        .iter()
+        .map(|&(addr, len)| BlockSegment::new(kernel_va_to_pa(addr), len))
+        .collect()
+}
+
+pub struct ExtentMap {
+    dev: &'static dyn BlockDevice,
+    /// initialized extents sorted by logical block
+    extents: Vec<Extent>,
+    block_size: usize,
+    /// the file size on disk when the tree was read
+    size: usize,
+}
+
+impl ExtentMap {
+    /// parse the extent tree rooted in the `i_block` of an inode, None if
+    /// the inode maps its blocks indirectly or the tree looks corrupted
+    pub async fn load(
+        dev: &'static dyn BlockDevice,
+        root: &[u32; 15],
+        flags: u32,
+        block_size: usize,
+        size: usize,
+    ) -> SysResult<Option<Self>> {
+        if flags & EXT4_EXTENTS_FL == 0 || block_size % BLOCK_SIZE != 0 {
+            return Ok(None);
+        }
+        let root: Vec<u8> = root.iter().flat_map(|word| word.to_le_bytes()).collect();
+        let mut extents = Vec::new();
+        // nodes to visit with the depth their parent expects
+        let mut nodes = vec![(root, None)];
+        while let Some((node, expected)) = nodes.pop() {
+            let depth = le16(&node, 6);
+            let entries = le16(&node, 2) as usize;
+            if le16(&node, 0) != EXT4_EXT_MAGIC
+                || depth > EXT4_EXT_MAX_DEPTH
+                || expected.is_some_and(|expected| expected != depth)
+                || (entries + 1) * EXT4_EXT_ENTRY_SIZE > node.len()
+            {
+                return Ok(None);
+            }
+            for i in 1..=entries {
+                let entry = &node[i * EXT4_EXT_ENTRY_SIZE..(i + 1) * EXT4_EXT_ENTRY_SIZE];
+                let lblock = le32(entry, 0) as usize;
+                if depth == 0 {
+                    // uninitialized extents read as holes
+                    let len = le16(entry, 4);
+                    if len <= EXT4_EXT_INIT_MAX_LEN {
+                        extents.push(Extent {
+                            lblock,
+                            pblock: (le16(entry, 6) as usize) << 32 | le32(entry, 8) as usize,
+                            len: len as usize,
+                        });
+                    }
+                } else {
+                    let pblock = (le16(entry, 8) as usize) << 32 | le32(entry, 4) as usize;
+                    let mut child = vec![0u8; block_size];
+                    let segs = [BlockSegment::from_kernel_buf_mut(&mut child)];
+                    dev.read_vectored(pblock * (block_size / BLOCK_SIZE), &segs)
+                        .await
+                        .map_err(|_| Errno::EIO)?;
+                    nodes.push((child, Some(depth - 1)));
+                }
+            }
+        }
+        extents.sort_unstable_by_key(|extent| extent.lblock);
+        Ok(Some(Self {
+            dev,
+            extents,
+            block_size,
+            size,
+        }))
+    }
+
+    pub fn block_size(&self) -> usize {
+        self.block_size
+    }
+
+    /// split the blocks `[lblock, lblock + count)` into runs
+    fn runs(&self, lblock: usize, count: usize) -> Vec<Run> {
+        fn push(runs: &mut Vec<Run>, run: Run) {
+            if let Some(last) = runs.last_mut() {
+                let contiguous = match (last.pblock, run.pblock) {
+                    (None, None) => true,
+                    (Some(last_pblock), Some(pblock)) => last_pblock + last.len == pblock,
+                    _ => false,
+                };
+                if contiguous && last.lblock + last.len == run.lblock {
+                    last.len += run.len;
+                    return;
+                }
+            }
+            runs.push(run);
+        }
+        let end = lblock + count;
+        let mut runs = Vec::new();
+        let mut cur = lblock;
+        let first = self
+            .extents
+            .partition_point(|extent| extent.lblock + extent.len <= lblock);
+        for extent in &self.extents[first..] {
+            if cur == end || extent.lblock >= end {
+                break;
+            }
+            if extent.lblock + extent.len <= cur {
+                continue;
+            }
+            if extent.lblock > cur {
+                let len = extent.lblock - cur;
+                push(
+                    &mut runs,
+                    Run {
+                        lblock: cur,
+                        len,
+                        pblock: None,
+                    },
+                );
+                cur = extent.lblock;
+            }
+            let skip = cur - extent.lblock;
+            let len = (extent.len - skip).min(end - cur);
+            let pblock = Some(extent.pblock + skip);
+            push(
+                &mut runs,
+                Run {
+                    lblock: cur,
+                    len,
+                    pblock,
+                },
+            );
+            cur += len;
+        }
+        if cur < end {
+            let len = end - cur;
+            push(
+                &mut runs,
+                Run {
+                    lblock: cur,
+                    len,
+                    pblock: None,
+                },
+            );
+        }
+        runs
+    }
+
+    /// read the file from the block aligned `offset` into the kernel
+    /// buffers `iov` of whole sectors, given as address and length, holes
+    /// and bytes past the end of file read as zeros, returns the bytes of
+    /// the file read
+    pub async fn read(&self, offset: usize, iov: &[(usize, usize)]) -> SysResult<usize> {
+        let total: usize = iov.iter().map(|&(_, len)| len).sum();
+        let valid = total.min(self.size.saturating_sub(offset));
+        let lblock = offset / self.block_size;
+        let count = valid.div_ceil(self.block_size);
+        for run in self.runs(lblock, count) {
+            let start = (run.lblock - lblock) * self.block_size;
+            let parts = pieces(iov, start, (run.len * self.block_size).min(total - start));
+            match run.pblock {
+                Some(pblock) => {
+                    let id = pblock * (self.block_size / BLOCK_SIZE);
+                    self.dev
+                        .read_vectored(id, &segments(&parts))
+                        .await
+                        .map_err(|_| Errno::EIO)?;
+                }
+                None => zero(&parts),
+            }
+        }
+        zero(&pieces(iov, valid, total - valid));
+        Ok(valid)
+    }
+
+    /// write the first `len` bytes of the kernel buffers `iov` of whole
+    /// sectors to the file at the block aligned `offset`, returns false
+    /// without any io if a block isn't allocated or initialized yet or the
+    /// file grows, which the library has to do
+    pub async fn write(
+        &self,
+        offset: usize,
+        iov: &[(usize, usize)],
+        len: usize,
+    ) -> SysResult<bool> {
+        if len == 0 || offset + len > self.size {
+            return Ok(false);
+        }
+        let lblock = offset / self.block_size;
+        let runs = self.runs(lblock, len.div_ceil(self.block_size));
+        if runs.iter().any(|run| run.pblock.is_none()) {
+            return Ok(false);
+        }
+        let total = len.next_multiple_of(BLOCK_SIZE);
+        for run in runs {
+            let start = (run.lblock - lblock) * self.block_size;
+            let parts = pieces(iov, start, (run.len * self.block_size).min(total - start));
+            let id = run.pblock.unwrap() * (self.block_size / BLOCK_SIZE);
+            self.dev
+                .write_vectored(id, &segments(&parts))
+                .await
+                .map_err(|_| Errno::EIO)?;
+        }
+        Ok(true)
+    }
+}
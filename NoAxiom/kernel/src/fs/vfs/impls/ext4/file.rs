@@ -1,13 +1,15 @@
-use alloc::{boxed::Box, sync::Arc};
+use alloc::{boxed::Box, sync::Arc, vec::Vec};
 use core::task::Waker;
 
-use arch::{Arch, ArchInt};
+use arch::{consts::KERNEL_ADDR_OFFSET, Arch, ArchInt};
 use async_trait::async_trait;
+use config::mm::PAGE_SIZE;
 use ext4_rs::InodeFileType;
 use ksync::assert_no_lock;
 
 use super::{dentry::Ext4Dentry, inode::Ext4FileInode, superblock::Ext4SuperBlock};
 use crate::{
+    config::fs::BLOCK_SIZE,
     fs::vfs::{
         basic::{
             file::{File, FileMeta},
@@ -30,6 +32,19 @@ pub struct Ext4File {
     /// the file struct in ext4, multi threads read/write the same file should
     /// ensure the atomicity, which provided by the fs lock
     ino: u32,
+    /// keeps the extent map of the file
+    inode: Arc<Ext4FileInode>,
+}
+
+/// the buffers as address and length, None unless all of them are kernel
+/// memory of whole sectors the device can transfer into directly
+fn iovec<'a>(bufs: impl Iterator<Item = &'a [u8]>) -> Option<Vec<(usize, usize)>> {
+    bufs.map(|buf| {
+        let addr = buf.as_ptr() as usize;
+        let direct = addr & KERNEL_ADDR_OFFSET == KERNEL_ADDR_OFFSET && buf.len() % BLOCK_SIZE == 0;
+        direct.then_some((addr, buf.len()))
+    })
+    .collect()
 }
 
 impl Ext4File {
@@ -37,26 +52,18 @@ impl Ext4File {
         Self {
             meta: FileMeta::new(dentry.clone(), inode.clone(), file_flags),
             ino: block_on(inode.get_inode().lock()).inode_num,
+            inode,
         }
     }
-}
-
-#[async_trait]
-impl File for Ext4File {
-    fn meta(&self) -> &FileMeta {
-        &self.meta
-    }
 
-    // offset:
-    //  - offset == cursor.offset: normal read
-    //  - offset != cursor.offset: seek and read
-    async fn base_read(&self, offset: usize, buf: &mut [u8]) -> SyscallResult {
+    /// read from `offset` into `bufs` one after another, through the
+    /// extent map if possible
+    async fn read_bufs(&self, offset: usize, bufs: &mut [&mut [u8]]) -> SyscallResult {
         assert_no_lock!();
         assert!(Arch::is_interrupt_enabled());
         if offset > self.meta.inode.size() {
             return Ok(0);
         }
-        let inode = &self.meta.inode;
         let super_block = self.meta.dentry().super_block();
         trace!("[ext4file] read try to get lock");
         let ext4 = super_block
@@ -66,16 +73,82 @@ impl File for Ext4File {
             .await;
         trace!("[ext4file] read get lock succeed");
 
-        match inode.file_type() {
-            InodeMode::FILE => {
-                assert_no_lock!();
-                assert!(Arch::is_interrupt_enabled());
-                let x = ext4.read_at(self.ino, offset, buf).await.map_err(fs_err)? as isize;
-                Ok(x)
+        let map = self.inode.extent_map(&ext4, self.ino).await?;
+        if let (Some(map), Some(iov)) = (map, iovec(bufs.iter().map(|buf| &**buf))) {
+            if offset % map.block_size() == 0 {
+                return Ok(map.read(offset, &iov).await? as isize);
+            }
+        }
+        let mut total = 0;
+        for buf in bufs.iter_mut() {
+            assert_no_lock!();
+            let len = ext4
+                .read_at(self.ino, offset + total, buf)
+                .await
+                .map_err(fs_err)?;
+            total += len;
+            if len < buf.len() {
+                break;
             }
-            InodeMode::DIR => {
-                return Err(Errno::EISDIR);
+        }
+        Ok(total as isize)
+    }
+
+    /// write the first `len` bytes of `bufs` concatenated to `offset`, the
+    /// blocks already allocated go straight to the device, otherwise the
+    /// whole range is handed to ext4_rs at once so that it allocates the new
+    /// blocks together
+    async fn write_bufs(&self, offset: usize, bufs: &[&[u8]], len: usize) -> SyscallResult {
+        assert_no_lock!();
+        assert!(Arch::is_interrupt_enabled());
+        let super_block = self.meta.dentry().super_block();
+        trace!("[ext4file] write try to get lock");
+        let ext4 = super_block
+            .downcast_ref::<Ext4SuperBlock>()
+            .unwrap()
+            .get_fs()
+            .await;
+        trace!("[ext4file] write get lock succeed");
+
+        let map = self.inode.extent_map(&ext4, self.ino).await?;
+        if let (Some(map), Some(iov)) = (map, iovec(bufs.iter().copied())) {
+            if offset % map.block_size() == 0 && map.write(offset, &iov, len).await? {
+                return Ok(len as isize);
             }
+        }
+        self.inode.invalidate_extents();
+        assert_no_lock!();
+        let written = match bufs {
+            [buf] => ext4.write_at(self.ino, offset, &buf[..len]).await,
+            _ => ext4.write_at(self.ino, offset, &bufs.concat()[..len]).await,
+        };
+        Ok(written.map_err(fs_err)? as isize)
+    }
+}
+
+#[async_trait]
+impl File for Ext4File {
+    fn meta(&self) -> &FileMeta {
+        &self.meta
+    }
+
+    // offset:
+    //  - offset == cursor.offset: normal read
+    //  - offset != cursor.offset: seek and read
+    async fn base_read(&self, offset: usize, buf: &mut [u8]) -> SyscallResult {
+        match self.meta.inode.file_type() {
+            InodeMode::FILE => self.read_bufs(offset, &mut [buf]).await,
+            InodeMode::DIR => Err(Errno::EISDIR),
+            _ => unreachable!(),
+        }
+    }
+
+    /// the pages land straight in the page cache with one request per
+    /// contiguous run of blocks
+    async fn base_read_pages(&self, offset: usize, pages: &mut [&mut [u8]]) -> SyscallResult {
+        match self.meta.inode.file_type() {
+            InodeMode::FILE => self.read_bufs(offset, pages).await,
+            InodeMode::DIR => Err(Errno::EISDIR),
             _ => unreachable!(),
         }
     }
@@ -87,36 +160,36 @@ impl File for Ext4File {
 
     /// write all the buf content, extend the file if necessary
     async fn base_write(&self, offset: usize, buf: &[u8]) -> SyscallResult {
-        assert_no_lock!();
-        assert!(Arch::is_interrupt_enabled());
         let inode = &self.meta.inode;
         if inode.state() == InodeState::Deleted {
             return Ok(0);
         }
-        let super_block = self.meta.dentry().super_block();
-        trace!("[ext4file] write try to get lock");
-        let ext4 = super_block
-            .downcast_ref::<Ext4SuperBlock>()
-            .unwrap()
-            .get_fs()
-            .await;
-        trace!("[ext4file] write get lock succeed");
         let size = inode.size();
         if offset + buf.len() > size {
             inode.set_size(offset + buf.len());
         }
         match inode.file_type() {
-            InodeMode::FILE => {
-                assert_no_lock!();
-                assert!(Arch::is_interrupt_enabled());
-                Ok(ext4.write_at(self.ino, offset, buf).await.map_err(fs_err)? as isize)
-            }
-            InodeMode::DIR => {
-                return Err(Errno::EISDIR);
-            }
+            InodeMode::FILE => self.write_bufs(offset, &[buf], buf.len()).await,
+            InodeMode::DIR => Err(Errno::EISDIR),
             _ => unreachable!(),
         }
     }
+
+    /// the write back of a run of dirty pages, the pages past the end of
+    /// file are left out
+    async fn base_write_pages(&self, offset: usize, pages: &[&[u8]]) -> SyscallResult {
+        let inode = &self.meta.inode;
+        let len = (pages.len() * PAGE_SIZE).min(inode.size().saturating_sub(offset));
+        if inode.state() == InodeState::Deleted || len == 0 {
+            return Ok(0);
+        }
+        match inode.file_type() {
+            InodeMode::FILE => self.write_bufs(offset, pages, len).await,
+            InodeMode::DIR => Err(Errno::EISDIR),
+            _ => unreachable!(),
+        }
+    }
+
     async fn load_dir(&self) -> Result<(), Errno> {
         Err(Errno::ENOTDIR)
     }
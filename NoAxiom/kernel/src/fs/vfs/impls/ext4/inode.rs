@@ -6,7 +6,7 @@ use async_trait::async_trait;
 use include::errno::Errno;
 use ksync::{mutex::SpinLock, AsyncMutex};
 
-use super::{fs_err, superblock::Ext4SuperBlock, IExtInode};
+use super::{extent::ExtentMap, fs_err, superblock::Ext4SuperBlock, IExtFs, IExtInode};
 use crate::{
     config::fs::BLOCK_SIZE,
     fs::vfs::basic::{
@@ -20,6 +20,8 @@ use crate::{
 pub struct Ext4FileInode {
     meta: InodeMeta,
     ino: Arc<AsyncMutex<IExtInode>>,
+    /// the block layout of the file, dropped whenever ext4_rs may change it
+    extents: SpinLock<Option<Arc<ExtentMap>>>,
 }
 
 impl Ext4FileInode {
@@ -28,6 +30,7 @@ impl Ext4FileInode {
         Self {
             meta: InodeMeta::new(superblock, InodeMode::FILE | mode, file_size as usize, true),
             ino: Arc::new(AsyncMutex::new(inode)),
+            extents: SpinLock::new(None),
         }
     }
 
@@ -50,11 +53,42 @@ impl Ext4FileInode {
         Self {
             meta,
             ino: Arc::new(AsyncMutex::new(inode)),
+            extents: SpinLock::new(None),
         }
     }
     pub fn get_inode(&self) -> Arc<AsyncMutex<IExtInode>> {
         self.ino.clone()
     }
+
+    /// the extent map of inode `ino`, read again after ext4_rs touched the
+    /// layout, None if the library has to map the blocks itself
+    ///
+    /// the caller holds the fs lock, so the library can't change it meanwhile
+    pub async fn extent_map(&self, ext4: &IExtFs, ino: u32) -> SysResult<Option<Arc<ExtentMap>>> {
+        if let Some(map) = self.extents.lock().clone() {
+            return Ok(Some(map));
+        }
+        let Some(dev) = self.meta.super_block.meta().device() else {
+            return Ok(None);
+        };
+        let inode = ext4.get_inode_ref(ino).await.inode;
+        let map = ExtentMap::load(
+            dev,
+            &inode.block,
+            inode.flags,
+            ext4.super_block.block_size() as usize,
+            inode.size() as usize,
+        )
+        .await?
+        .map(Arc::new);
+        *self.extents.lock() = map.clone();
+        Ok(map)
+    }
+
+    /// called under the fs lock before ext4_rs writes or truncates the file
+    pub fn invalidate_extents(&self) {
+        *self.extents.lock() = None;
+    }
 }
 
 #[async_trait]
@@ -108,6 +142,7 @@ impl Inode for Ext4FileInode {
         assert!(Arch::is_interrupt_enabled());
 
         let old_size = inode.inode.size() as usize;
+        self.invalidate_extents();
         if new <= old_size {
             ext4.truncate_inode(&mut inode, new as u64)
                 .await
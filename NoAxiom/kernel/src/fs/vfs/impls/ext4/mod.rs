@@ -4,6 +4,7 @@ use crate::{fs::vfs::impls::disk_cursor::DiskCursor, include::result::Errno};
 
 pub mod dentry;
 mod disk_cursor;
+mod extent;
 pub mod file;
 pub mod filesystem;
 pub mod inode;
@@ -72,7 +72,7 @@ impl File for FdDir {
         };
 
         let superblock = self.meta.dentry().super_block();
-        self.dentry().children().clear();
+        self.dentry().clear_children();
         let fd_table = task.fd_table();
         for (fd, entry) in fd_table.table.iter().enumerate() {
             if let Some(entry) = entry {
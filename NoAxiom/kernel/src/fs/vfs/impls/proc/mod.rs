@@ -15,6 +15,10 @@ use crate::{
                 maps::{dentry::MapsDentry, inode::MapsInode},
                 mounts::inode::MountsInode,
                 stat::{dentry::ProcStatDentry, inode::ProcStatInode},
+                trace::{
+                    cache::CacheStatDentry, latency::SyscallLatencyDentry, lock::LockStatDentry,
+                    schedstat::SchedStatDentry, TraceInode,
+                },
             },
             ramfs::{
                 dentry::RamFsDentry,
@@ -36,6 +40,7 @@ mod mounts;
 pub mod stat;
 pub mod status;
 mod superblock;
+mod trace;
 
 pub use interrupts::inc_interrupts_count;
 
@@ -83,6 +88,36 @@ pub async fn init(fs_root: Arc<dyn Dentry>) -> SysResult<()> {
     interrupts_dentry.into_dyn().set_inode(interrupts_inode);
     fs_root.add_child(interrupts_dentry);
 
+    info!("[fs] create /proc/syscall_latency");
+    let latency_dentry = Arc::new(SyscallLatencyDentry::new(
+        Some(fs_root.clone()),
+        "syscall_latency",
+        fs_root.super_block(),
+    ));
+    let latency_inode = Arc::new(TraceInode::new(fs_root.super_block()));
+    latency_dentry.into_dyn().set_inode(latency_inode);
+    fs_root.add_child(latency_dentry);
+
+    info!("[fs] create /proc/lock_stat");
+    let lock_stat_dentry = Arc::new(LockStatDentry::new(
+        Some(fs_root.clone()),
+        "lock_stat",
+        fs_root.super_block(),
+    ));
+    let lock_stat_inode = Arc::new(TraceInode::new(fs_root.super_block()));
+    lock_stat_dentry.into_dyn().set_inode(lock_stat_inode);
+    fs_root.add_child(lock_stat_dentry);
+
+    info!("[fs] create /proc/cache_stat");
+    let cache_stat_dentry = Arc::new(CacheStatDentry::new(
+        Some(fs_root.clone()),
+        "cache_stat",
+        fs_root.super_block(),
+    ));
+    let cache_stat_inode = Arc::new(TraceInode::new(fs_root.super_block()));
+    cache_stat_dentry.into_dyn().set_inode(cache_stat_inode);
+    fs_root.add_child(cache_stat_dentry);
+
     info!("[fs] create /proc/sys/kernel/pid_max, write 32768");
     let kernel_inode = Arc::new(RamFsDirInode::new(sys_dentry.super_block(), 0));
     let kernel_dentry = sys_dentry.add_child_with_inode("kernel", kernel_inode);
@@ -154,5 +189,15 @@ pub async fn init(fs_root: Arc<dyn Dentry>) -> SysResult<()> {
     maps_dentry.into_dyn().set_inode(maps_inode);
     self_dentry.add_child(maps_dentry);
 
+    info!("[fs] create /proc/self/schedstat");
+    let schedstat_dentry = Arc::new(SchedStatDentry::new(
+        Some(self_dentry.clone()),
+        "schedstat",
+        fs_root.super_block(),
+    ));
+    let schedstat_inode = Arc::new(TraceInode::new(fs_root.super_block()));
+    schedstat_dentry.into_dyn().set_inode(schedstat_inode);
+    self_dentry.add_child(schedstat_dentry);
+
     Ok(())
 }
@@ -0,0 +1,53 @@
+use alloc::{format, string::String};
+use core::fmt::Write;
+
+use crate::{
+    dentry_default, file_default,
+    utils::trace::{CacheStat, BLOCK_CACHE_STAT, PAGE_CACHE_STAT},
+};
+
+/*
+cache           hits     misses  hit_ratio
+block          11830        407      96.6%
+page            5120         96      98.1%
+*/
+
+fn render() -> String {
+    let mut res = format!(
+        "{:<8} {:>12} {:>12} {:>10}\n",
+        "cache", "hits", "misses", "hit_ratio"
+    );
+    let mut line = |name: &str, stat: &CacheStat| {
+        let (hits, misses) = stat.sum();
+        let permille = match hits + misses {
+            0 => 0,
+            total => hits * 1000 / total,
+        };
+        let _ = writeln!(
+            res,
+            "{:<8} {:>12} {:>12} {:>10}",
+            name,
+            hits,
+            misses,
+            format!("{}.{}%", permille / 10, permille % 10)
+        );
+    };
+    line("block", &BLOCK_CACHE_STAT);
+    line("page", &PAGE_CACHE_STAT);
+    res
+}
+
+file_default!(
+    CacheStatFile,
+    async fn base_read(&self, offset: usize, buf: &mut [u8]) -> SyscallResult {
+        let text = super::render();
+        Ok(crate::fs::vfs::impls::proc::trace::read_text(
+            &text, offset, buf,
+        ))
+    },
+    async fn base_write(&self, _offset: usize, _buf: &[u8]) -> SyscallResult {
+        Err(Errno::EACCES)
+    }
+);
+
+dentry_default!(CacheStatDentry, CacheStatFile);
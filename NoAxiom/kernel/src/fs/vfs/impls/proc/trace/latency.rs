@@ -0,0 +1,65 @@
+use alloc::{format, string::String};
+use core::fmt::Write;
+
+use crate::{
+    dentry_default, file_default,
+    include::syscall_id::SyscallID,
+    utils::trace::{syscall_latency, LATENCY_BUCKETS, SYSCALL_SLOTS},
+};
+
+/*
+syscall           count     avg_ns     max_ns <1us <2us .. >=16384us
+SYS_READ            120       3400       9000    0    3 ..         0
+*/
+
+fn render() -> String {
+    let mut res = format!(
+        "{:<24} {:>10} {:>12} {:>12}",
+        "syscall", "count", "avg_ns", "max_ns"
+    );
+    for bucket in 0..LATENCY_BUCKETS - 1 {
+        let _ = write!(res, " {:>8}", format!("<{}us", 1usize << bucket));
+    }
+    let _ = writeln!(
+        res,
+        " {:>8}",
+        format!(">={}us", 1usize << (LATENCY_BUCKETS - 2))
+    );
+    for slot in 0..SYSCALL_SLOTS {
+        let Some(latency) = syscall_latency(slot) else {
+            continue;
+        };
+        let name = match SyscallID::from_repr(slot as isize) {
+            Some(id) if slot != SYSCALL_SLOTS - 1 => format!("{:?}", id),
+            _ => String::from("other"),
+        };
+        let _ = write!(
+            res,
+            "{:<24} {:>10} {:>12} {:>12}",
+            name,
+            latency.count,
+            latency.total_ns / latency.count,
+            latency.max_ns
+        );
+        for count in latency.hist {
+            let _ = write!(res, " {:>8}", count);
+        }
+        res.push('\n');
+    }
+    res
+}
+
+file_default!(
+    SyscallLatencyFile,
+    async fn base_read(&self, offset: usize, buf: &mut [u8]) -> SyscallResult {
+        let text = super::render();
+        Ok(crate::fs::vfs::impls::proc::trace::read_text(
+            &text, offset, buf,
+        ))
+    },
+    async fn base_write(&self, _offset: usize, _buf: &[u8]) -> SyscallResult {
+        Err(Errno::EACCES)
+    }
+);
+
+dentry_default!(SyscallLatencyDentry, SyscallLatencyFile);
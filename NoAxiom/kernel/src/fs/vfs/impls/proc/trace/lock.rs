@@ -0,0 +1,52 @@
+use alloc::{format, string::String};
+use core::fmt::Write;
+
+use ksync::{async_mutex::ASYNC_MUTEX_STAT, mutex::SPIN_LOCK_STAT, stat::LockStatSnapshot};
+
+use super::ticks_to_ns;
+use crate::{dentry_default, file_default};
+
+/*
+lock          acquired  contended    wait_ns    hold_ns max_hold_ns
+spin_lock         8188          0          0     512000        3200
+async_mutex        397         12      40000     880000       91000
+*/
+
+fn render() -> String {
+    let mut res = format!(
+        "{:<12} {:>12} {:>12} {:>14} {:>14} {:>12}\n",
+        "lock", "acquired", "contended", "wait_ns", "hold_ns", "max_hold_ns"
+    );
+    let mut line = |name: &str, stat: LockStatSnapshot| {
+        let _ = writeln!(
+            res,
+            "{:<12} {:>12} {:>12} {:>14} {:>14} {:>12}",
+            name,
+            stat.acquired,
+            stat.contended,
+            ticks_to_ns(stat.wait_ticks),
+            ticks_to_ns(stat.hold_ticks),
+            ticks_to_ns(stat.max_hold_ticks)
+        );
+    };
+    // spin locks can't tell a contended acquire, their hold time includes
+    // the spinning
+    line("spin_lock", SPIN_LOCK_STAT.snapshot());
+    line("async_mutex", ASYNC_MUTEX_STAT.snapshot());
+    res
+}
+
+file_default!(
+    LockStatFile,
+    async fn base_read(&self, offset: usize, buf: &mut [u8]) -> SyscallResult {
+        let text = super::render();
+        Ok(crate::fs::vfs::impls::proc::trace::read_text(
+            &text, offset, buf,
+        ))
+    },
+    async fn base_write(&self, _offset: usize, _buf: &[u8]) -> SyscallResult {
+        Err(Errno::EACCES)
+    }
+);
+
+dentry_default!(LockStatDentry, LockStatFile);
@@ -0,0 +1,95 @@
+//! tracing counters, see [`crate::utils::trace`]
+//!
+//! - /proc/syscall_latency: latency histogram of every syscall called
+//! - /proc/lock_stat: spin lock sections and async mutex contention
+//! - /proc/cache_stat: block cache and page cache hit ratios
+//! - /proc/self/schedstat: run time, run queue wait time and slices
+//!
+//! syscall latencies and lock times stay zero unless the kernel is built
+//! with `TRACE_STAT=1`
+
+use alloc::sync::Arc;
+
+use arch::{Arch, ArchTime};
+
+use crate::{
+    config::fs::BLOCK_SIZE,
+    constant::time::NSEC_PER_SEC,
+    fs::vfs::basic::{
+        inode::{Inode, InodeMeta},
+        superblock::SuperBlock,
+    },
+    include::fs::{InodeMode, Stat},
+};
+
+pub mod cache;
+pub mod latency;
+pub mod lock;
+pub mod schedstat;
+
+/// copy the part of `text` from `offset` into `buf`
+fn read_text(text: &str, offset: usize, buf: &mut [u8]) -> isize {
+    let bytes = text.as_bytes();
+    if offset >= bytes.len() {
+        return 0;
+    }
+    let len = buf.len().min(bytes.len() - offset);
+    buf[..len].copy_from_slice(&bytes[offset..offset + len]);
+    len as isize
+}
+
+fn ticks_to_ns(ticks: usize) -> usize {
+    ticks * (NSEC_PER_SEC / Arch::get_freq())
+}
+
+/// inode shared by the tracing files, the content is generated on read
+pub struct TraceInode {
+    meta: InodeMeta,
+}
+
+impl TraceInode {
+    pub fn new(superblock: Arc<dyn SuperBlock>) -> Self {
+        Self {
+            meta: InodeMeta::new(
+                superblock,
+                InodeMode::FILE | InodeMode::from_bits(0o444).unwrap(),
+                BLOCK_SIZE,
+                false,
+            ),
+        }
+    }
+}
+
+impl Inode for TraceInode {
+    fn meta(&self) -> &InodeMeta {
+        &self.meta
+    }
+    fn stat(&self) -> Result<crate::include::fs::Stat, crate::include::result::Errno> {
+        let inner = self.meta.inner.lock();
+        let mode = self
+            .meta
+            .inode_mode
+            .load(core::sync::atomic::Ordering::SeqCst);
+        Ok(Stat {
+            st_dev: 0,
+            st_ino: self.meta.id as u64,
+            st_mode: mode,
+            st_nlink: 1,
+            st_uid: self.meta.uid.load(core::sync::atomic::Ordering::SeqCst),
+            st_gid: self.meta.gid.load(core::sync::atomic::Ordering::SeqCst),
+            st_rdev: 0,
+            __pad: 0,
+            st_size: inner.size as u64,
+            st_blksize: BLOCK_SIZE as u32,
+            __pad2: 0,
+            st_blocks: (inner.size / 512) as u64,
+            st_atime_sec: inner.atime_sec as u64,
+            st_atime_nsec: inner.atime_nsec as u64,
+            st_mtime_sec: inner.mtime_sec as u64,
+            st_mtime_nsec: inner.mtime_nsec as u64,
+            st_ctime_sec: inner.ctime_sec as u64,
+            st_ctime_nsec: inner.ctime_nsec as u64,
+            unused: 0,
+        })
+    }
+}
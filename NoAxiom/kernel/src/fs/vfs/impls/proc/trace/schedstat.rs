@@ -0,0 +1,32 @@
+use alloc::{format, string::String};
+
+use super::ticks_to_ns;
+use crate::{cpu::current_task, dentry_default, file_default};
+
+/// same fields as linux: time spent on the cpu and waiting on a run queue
+/// in ns, then the number of slices run
+fn render() -> String {
+    let task = current_task().unwrap();
+    let stat = &task.sched_entity().sched_stat;
+    format!(
+        "{} {} {}\n",
+        task.time_stat().cpu_time().as_nanos(),
+        ticks_to_ns(stat.wait_ticks()),
+        stat.slices()
+    )
+}
+
+file_default!(
+    SchedStatFile,
+    async fn base_read(&self, offset: usize, buf: &mut [u8]) -> SyscallResult {
+        let text = super::render();
+        Ok(crate::fs::vfs::impls::proc::trace::read_text(
+            &text, offset, buf,
+        ))
+    },
+    async fn base_write(&self, _offset: usize, _buf: &[u8]) -> SyscallResult {
+        Err(Errno::EACCES)
+    }
+);
+
+dentry_default!(SchedStatDentry, SchedStatFile);
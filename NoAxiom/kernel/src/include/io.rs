@@ -1,4 +1,5 @@
 use bitflags::bitflags;
+use strum::FromRepr;
 
 use crate::{constant::io::FD_SET_LEN, utils::align_offset};
 
@@ -84,3 +85,226 @@ impl FdSet {
         self.fd_list[idx] & mask != 0
     }
 }
+
+bitflags! {
+    /// epoll 事件类型，低位与 [`PollEvent`] 一致。
+    #[derive(Debug, Copy, Clone)]
+    pub struct EpollEventFlags: u32 {
+        const EPOLLIN = 0x001;
+        const EPOLLPRI = 0x002;
+        const EPOLLOUT = 0x004;
+        const EPOLLERR = 0x008;
+        const EPOLLHUP = 0x010;
+        const EPOLLNVAL = 0x020;
+        const EPOLLRDNORM = 0x040;
+        const EPOLLRDBAND = 0x080;
+        const EPOLLWRNORM = 0x100;
+        const EPOLLWRBAND = 0x200;
+        const EPOLLMSG = 0x400;
+        const EPOLLRDHUP = 0x2000;
+        /// 独占唤醒。
+        const EPOLLEXCLUSIVE = 1 << 28;
+        const EPOLLWAKEUP = 1 << 29;
+        /// 报告一次后停用，直到 `EPOLL_CTL_MOD` 重新启用。
+        const EPOLLONESHOT = 1 << 30;
+        /// 边沿触发。
+        const EPOLLET = 1 << 31;
+    }
+}
+
+impl EpollEventFlags {
+    /// 总是报告的事件。
+    pub const ALWAYS: Self = Self::EPOLLERR.union(Self::EPOLLHUP);
+    /// 控制位，不是事件。
+    pub const CONTROL: Self = Self::EPOLLEXCLUSIVE
+        .union(Self::EPOLLWAKEUP)
+        .union(Self::EPOLLONESHOT)
+        .union(Self::EPOLLET);
+
+    pub fn poll_event(&self) -> PollEvent {
+        PollEvent::from_bits_truncate(self.difference(Self::CONTROL).bits() as u16)
+    }
+    pub fn from_poll_event(event: PollEvent) -> Self {
+        Self::from_bits_truncate(event.bits() as u32)
+    }
+}
+
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct EpollEvent {
+    pub events: u32,
+    pub data: u64,
+}
+
+#[repr(usize)]
+#[derive(FromRepr, Debug, Clone, Copy)]
+pub enum EpollCtlOp {
+    Add = 1,
+    Del = 2,
+    Mod = 3,
+}
+
+/// io_uring 队列的最大 sqe 数，cq 最多为它的两倍。
+pub const IORING_MAX_ENTRIES: u32 = 32768;
+/// mmap 偏移：sq 环。
+pub const IORING_OFF_SQ_RING: usize = 0;
+/// mmap 偏移：cq 环，与 sq 环同一块内存。
+pub const IORING_OFF_CQ_RING: usize = 0x8000000;
+/// mmap 偏移：sqe 数组。
+pub const IORING_OFF_SQES: usize = 0x10000000;
+
+bitflags! {
+    /// io_uring_setup 的标志。
+    #[derive(Debug, Copy, Clone)]
+    pub struct IoUringSetupFlags: u32 {
+        const IORING_SETUP_IOPOLL = 1 << 0;
+        const IORING_SETUP_SQPOLL = 1 << 1;
+        const IORING_SETUP_SQ_AFF = 1 << 2;
+        /// cq 大小由 `cq_entries` 指定。
+        const IORING_SETUP_CQSIZE = 1 << 3;
+        /// 过大的队列长度截断为最大值，而不是返回 EINVAL。
+        const IORING_SETUP_CLAMP = 1 << 4;
+    }
+}
+
+bitflags! {
+    /// 内核在 `features` 中报告的特性。
+    #[derive(Debug, Copy, Clone)]
+    pub struct IoUringFeatures: u32 {
+        /// sq 环和 cq 环只需一次 mmap。
+        const IORING_FEAT_SINGLE_MMAP = 1 << 0;
+        /// cq 满时完成事件不会丢弃。
+        const IORING_FEAT_NODROP = 1 << 1;
+        /// 偏移为 -1 的读写使用并更新文件位置。
+        const IORING_FEAT_RW_CUR_POS = 1 << 3;
+    }
+}
+
+bitflags! {
+    /// io_uring_enter 的标志。
+    #[derive(Debug, Copy, Clone)]
+    pub struct IoUringEnterFlags: u32 {
+        /// 等待至少 `min_complete` 个完成事件。
+        const IORING_ENTER_GETEVENTS = 1 << 0;
+        const IORING_ENTER_SQ_WAKEUP = 1 << 1;
+        const IORING_ENTER_SQ_WAIT = 1 << 2;
+        const IORING_ENTER_EXT_ARG = 1 << 3;
+    }
+}
+
+bitflags! {
+    /// sqe 的标志。
+    #[derive(Debug, Copy, Clone)]
+    pub struct IoSqeFlags: u8 {
+        const IOSQE_FIXED_FILE = 1 << 0;
+        const IOSQE_IO_DRAIN = 1 << 1;
+        /// 下一个 sqe 在本 sqe 完成后执行，本 sqe 失败则取消后续 sqe。
+        const IOSQE_IO_LINK = 1 << 2;
+        /// 同 IOSQE_IO_LINK，但失败不取消后续 sqe。
+        const IOSQE_IO_HARDLINK = 1 << 3;
+        const IOSQE_ASYNC = 1 << 4;
+        const IOSQE_BUFFER_SELECT = 1 << 5;
+        /// 成功时不产生完成事件。
+        const IOSQE_CQE_SKIP_SUCCESS = 1 << 6;
+    }
+}
+
+/// sq 环标志：有完成事件因 cq 满而积压在内核中。
+pub const IORING_SQ_CQ_OVERFLOW: u32 = 1 << 1;
+
+/// io_uring 支持的操作码。
+#[repr(u8)]
+#[derive(FromRepr, Debug, Clone, Copy)]
+pub enum IoUringOp {
+    Nop = 0,
+    Readv = 1,
+    Writev = 2,
+    Fsync = 3,
+    Openat = 18,
+    Close = 19,
+    Read = 22,
+    Write = 23,
+    Send = 26,
+    Recv = 27,
+}
+
+/// 提交队列项。
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct IoUringSqe {
+    pub opcode: u8,
+    pub flags: u8,
+    pub ioprio: u16,
+    pub fd: i32,
+    /// 文件偏移，-1 表示当前位置。
+    pub off: u64,
+    /// 缓冲区、iovec 数组或路径的地址。
+    pub addr: u64,
+    /// 缓冲区长度、iovec 个数或 openat 的 mode。
+    pub len: u32,
+    /// 操作相关的标志，如 open_flags、msg_flags。
+    pub op_flags: u32,
+    /// 原样带回完成事件。
+    pub user_data: u64,
+    pub buf_index: u16,
+    pub personality: u16,
+    pub splice_fd_in: i32,
+    pub addr3: u64,
+    pub pad: u64,
+}
+
+/// 完成队列项。
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct IoUringCqe {
+    pub user_data: u64,
+    /// 与对应系统调用的返回值相同，错误为负的 errno。
+    pub res: i32,
+    pub flags: u32,
+}
+
+/// sq 环中各字段相对 [`IORING_OFF_SQ_RING`] 的偏移。
+#[repr(C)]
+#[derive(Debug, Default, Copy, Clone)]
+pub struct IoSqringOffsets {
+    pub head: u32,
+    pub tail: u32,
+    pub ring_mask: u32,
+    pub ring_entries: u32,
+    pub flags: u32,
+    pub dropped: u32,
+    pub array: u32,
+    pub resv1: u32,
+    pub user_addr: u64,
+}
+
+/// cq 环中各字段相对 [`IORING_OFF_CQ_RING`] 的偏移。
+#[repr(C)]
+#[derive(Debug, Default, Copy, Clone)]
+pub struct IoCqringOffsets {
+    pub head: u32,
+    pub tail: u32,
+    pub ring_mask: u32,
+    pub ring_entries: u32,
+    pub overflow: u32,
+    pub cqes: u32,
+    pub flags: u32,
+    pub resv1: u32,
+    pub user_addr: u64,
+}
+
+/// io_uring_setup 的参数，`flags` 等由用户传入，其余由内核填写。
+#[repr(C)]
+#[derive(Debug, Default, Copy, Clone)]
+pub struct IoUringParams {
+    pub sq_entries: u32,
+    pub cq_entries: u32,
+    pub flags: u32,
+    pub sq_thread_cpu: u32,
+    pub sq_thread_idle: u32,
+    pub features: u32,
+    pub wq_fd: u32,
+    pub resv: [u32; 3],
+    pub sq_off: IoSqringOffsets,
+    pub cq_off: IoCqringOffsets,
+}
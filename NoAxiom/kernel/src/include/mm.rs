@@ -68,6 +68,20 @@ bitflags! {
     }
 }
 
+bitflags! {
+    #[derive(Clone, Copy, Debug)]
+    /// see [man msync](https://man7.org/linux/man-pages/man2/msync.2.html)
+    pub struct MsyncFlags: usize {
+        /// Schedule the write back and return at once.
+        const MS_ASYNC = 1;
+        /// Invalidate other mappings of the same file, they are coherent
+        /// through the page cache anyway.
+        const MS_INVALIDATE = 2;
+        /// Write back and wait for it to complete.
+        const MS_SYNC = 4;
+    }
+}
+
 #[derive(FromRepr, Debug, Eq, PartialEq)]
 #[allow(non_camel_case_types)]
 #[repr(i32)]
@@ -150,6 +150,7 @@ pub mod auxv {
     pub const AT_CLKTCK: usize = 17; // frequency at which times() increments
     pub const AT_SECURE: usize = 23; // secure mode boolean
     pub const AT_RANDOM: usize = 25; // address of 16 random bytes
+    pub const AT_SYSINFO_EHDR: usize = 33; // address of the vdso image
 }
 
 pub mod robust_list {
@@ -291,6 +291,8 @@ pub enum SyscallID {
     SYS_STATX = 291,
 
     // additional
+    SYS_IO_URING_SETUP = 425,
+    SYS_IO_URING_ENTER = 426,
     SYS_CLONE3 = 435,
     SYS_FACCESSAT2 = 439,
 
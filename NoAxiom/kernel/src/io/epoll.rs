@@ -0,0 +1,280 @@
+//! epoll
+//!
+//! every registration owns a waker, a file that isn't ready keeps it through
+//! `File::poll` just like for ppoll, and waking it queues the registration on
+//! the ready list, so a wait only polls the ready registrations
+//!
+//! pipes and sockets keep the waker even while they are ready, so an edge
+//! triggered registration hears the next change after it fired, files that
+//! are always ready only fire once
+
+use alloc::{
+    boxed::Box,
+    collections::{btree_map::BTreeMap, vec_deque::VecDeque},
+    sync::{Arc, Weak},
+    task::Wake,
+    vec::Vec,
+};
+use core::{
+    future::Future,
+    pin::Pin,
+    sync::atomic::{AtomicBool, Ordering},
+    task::{Context, Poll, Waker},
+};
+
+use async_trait::async_trait;
+use ksync::mutex::SpinLock;
+
+use crate::{
+    fs::vfs::basic::file::{File, FileMeta},
+    include::{
+        io::{EpollEvent, EpollEventFlags, PollEvent},
+        result::Errno,
+    },
+    syscall::{SysResult, SyscallResult},
+};
+
+/// a registered fd
+struct EpollItem {
+    file: Weak<dyn File>,
+    /// interest and user data, events are cleared by a fired EPOLLONESHOT
+    event: SpinLock<(EpollEventFlags, u64)>,
+    /// on the ready list
+    queued: AtomicBool,
+    /// removed by EPOLL_CTL_DEL
+    removed: AtomicBool,
+    epoll: Weak<EpollInner>,
+}
+
+impl Wake for EpollItem {
+    fn wake(self: Arc<Self>) {
+        self.wake_by_ref();
+    }
+    fn wake_by_ref(self: &Arc<Self>) {
+        if let Some(epoll) = self.epoll.upgrade() {
+            epoll.push_ready(self);
+        }
+    }
+}
+
+struct ReadyList {
+    items: VecDeque<Arc<EpollItem>>,
+    /// tasks in epoll_pwait and pollers of the epoll fd itself
+    waiters: Vec<Waker>,
+}
+
+struct EpollInner {
+    interest: SpinLock<BTreeMap<usize, Arc<EpollItem>>>,
+    ready: SpinLock<ReadyList>,
+}
+
+impl EpollInner {
+    fn push_ready(&self, item: &Arc<EpollItem>) {
+        if item.queued.swap(true, Ordering::AcqRel) {
+            return;
+        }
+        let mut ready = self.ready.lock();
+        ready.items.push_back(item.clone());
+        let waiters = core::mem::take(&mut ready.waiters);
+        drop(ready);
+        waiters.into_iter().for_each(Waker::wake);
+    }
+
+    fn pop_ready(&self) -> Option<Arc<EpollItem>> {
+        let item = self.ready.lock().items.pop_front()?;
+        item.queued.store(false, Ordering::Release);
+        Some(item)
+    }
+
+    /// poll the ready items queued now for at most `max` events, level
+    /// triggered ones that fire are queued again for the next wait
+    fn collect(&self, max: usize) -> Vec<EpollEvent> {
+        let mut res = Vec::new();
+        let mut pending = self.ready.lock().items.len();
+        while pending > 0 && res.len() < max {
+            pending -= 1;
+            let Some(item) = self.pop_ready() else {
+                break;
+            };
+            if item.removed.load(Ordering::Acquire) {
+                continue;
+            }
+            let Some(file) = item.file.upgrade() else {
+                continue;
+            };
+            let (events, data) = *item.event.lock();
+            let req = events.poll_event();
+            if req.is_empty() {
+                continue;
+            }
+            // registers the item waker again if the file isn't ready, or
+            // for the next change on files that keep it anyway
+            let revents =
+                EpollEventFlags::from_poll_event(file.poll(&req, Waker::from(item.clone())))
+                    & (events | EpollEventFlags::ALWAYS);
+            if revents.is_empty() {
+                continue;
+            }
+            res.push(EpollEvent {
+                events: revents.bits(),
+                data,
+            });
+            if events.contains(EpollEventFlags::EPOLLONESHOT) {
+                item.event.lock().0 = EpollEventFlags::empty();
+            } else if !events.contains(EpollEventFlags::EPOLLET) {
+                self.push_ready(&item);
+            }
+        }
+        res
+    }
+}
+
+pub struct EpollFile {
+    inner: Arc<EpollInner>,
+    meta: FileMeta,
+}
+
+impl EpollFile {
+    pub fn new() -> Arc<Self> {
+        Arc::new(Self {
+            inner: Arc::new(EpollInner {
+                interest: SpinLock::new(BTreeMap::new()),
+                ready: SpinLock::new(ReadyList {
+                    items: VecDeque::new(),
+                    waiters: Vec::new(),
+                }),
+            }),
+            meta: FileMeta::empty(),
+        })
+    }
+
+    fn new_item(&self, file: &Arc<dyn File>, event: &EpollEvent) -> Arc<EpollItem> {
+        Arc::new(EpollItem {
+            file: Arc::downgrade(file),
+            event: SpinLock::new((
+                EpollEventFlags::from_bits_truncate(event.events),
+                event.data,
+            )),
+            queued: AtomicBool::new(false),
+            removed: AtomicBool::new(false),
+            epoll: Arc::downgrade(&self.inner),
+        })
+    }
+
+    /// EPOLL_CTL_ADD, the file is polled once so it's reported if already
+    /// ready
+    pub fn add(&self, fd: usize, file: &Arc<dyn File>, event: &EpollEvent) -> SysResult<()> {
+        let mut interest = self.inner.interest.lock();
+        if interest
+            .get(&fd)
+            .is_some_and(|item| item.file.strong_count() > 0)
+        {
+            return Err(Errno::EEXIST);
+        }
+        let item = self.new_item(file, event);
+        if let Some(old) = interest.insert(fd, item.clone()) {
+            old.removed.store(true, Ordering::Release);
+        }
+        drop(interest);
+        self.inner.push_ready(&item);
+        Ok(())
+    }
+
+    /// EPOLL_CTL_MOD, also rearms an EPOLLONESHOT item
+    pub fn modify(&self, fd: usize, event: &EpollEvent) -> SysResult<()> {
+        let item = self
+            .inner
+            .interest
+            .lock()
+            .get(&fd)
+            .cloned()
+            .ok_or(Errno::ENOENT)?;
+        *item.event.lock() = (
+            EpollEventFlags::from_bits_truncate(event.events),
+            event.data,
+        );
+        self.inner.push_ready(&item);
+        Ok(())
+    }
+
+    /// EPOLL_CTL_DEL, a queued item is dropped when it's popped
+    pub fn delete(&self, fd: usize) -> SysResult<()> {
+        let item = self
+            .inner
+            .interest
+            .lock()
+            .remove(&fd)
+            .ok_or(Errno::ENOENT)?;
+        item.removed.store(true, Ordering::Release);
+        Ok(())
+    }
+
+    pub fn wait(&self, max: usize) -> EpollWaitFuture {
+        EpollWaitFuture {
+            inner: self.inner.clone(),
+            max,
+        }
+    }
+}
+
+pub struct EpollWaitFuture {
+    inner: Arc<EpollInner>,
+    max: usize,
+}
+
+impl Future for EpollWaitFuture {
+    type Output = Vec<EpollEvent>;
+
+    fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Self::Output> {
+        loop {
+            let res = self.inner.collect(self.max);
+            if !res.is_empty() {
+                return Poll::Ready(res);
+            }
+            let mut ready = self.inner.ready.lock();
+            if ready.items.is_empty() {
+                ready.waiters.push(cx.waker().clone());
+                return Poll::Pending;
+            }
+            // queued again while collecting
+        }
+    }
+}
+
+#[async_trait]
+impl File for EpollFile {
+    fn meta(&self) -> &FileMeta {
+        &self.meta
+    }
+    async fn base_read(&self, _offset: usize, _buf: &mut [u8]) -> SyscallResult {
+        Err(Errno::EINVAL)
+    }
+    async fn base_readlink(&self, _buf: &mut [u8]) -> SyscallResult {
+        Err(Errno::EINVAL)
+    }
+    async fn base_write(&self, _offset: usize, _buf: &[u8]) -> SyscallResult {
+        Err(Errno::EINVAL)
+    }
+    async fn load_dir(&self) -> Result<(), Errno> {
+        Err(Errno::ENOTDIR)
+    }
+    async fn delete_child(&self, _name: &str) -> Result<(), Errno> {
+        Err(Errno::ENOTDIR)
+    }
+    fn ioctl(&self, _cmd: usize, _arg: usize) -> SyscallResult {
+        Err(Errno::ENOTTY)
+    }
+    /// readable while the ready list isn't empty, the items aren't polled
+    fn poll(&self, req: &PollEvent, waker: Waker) -> PollEvent {
+        let mut ready = self.inner.ready.lock();
+        if !req.contains(PollEvent::POLLIN) {
+            return PollEvent::empty();
+        }
+        if ready.items.is_empty() {
+            ready.waiters.push(waker);
+            PollEvent::empty()
+        } else {
+            PollEvent::POLLIN
+        }
+    }
+}
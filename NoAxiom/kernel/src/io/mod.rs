@@ -1,2 +1,4 @@
+pub mod epoll;
 pub mod ppoll;
 pub mod pselect;
+pub mod uring;
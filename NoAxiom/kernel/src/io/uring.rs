@@ -0,0 +1,500 @@
+//! io_uring
+//!
+//! the rings live in kernel frames which mmap maps straight into the
+//! process, so io_uring_enter only has to pick up the new sqes: each chain of
+//! linked sqes runs as a kernel task inside the submitter's address space and
+//! posts its cqes to the shared ring, reaping them needs no syscall
+
+use alloc::{boxed::Box, collections::vec_deque::VecDeque, sync::Arc, vec::Vec};
+use core::{
+    future::Future,
+    mem::size_of,
+    pin::Pin,
+    sync::atomic::{AtomicU32, Ordering},
+    task::{Context, Poll, Waker},
+};
+
+use async_trait::async_trait;
+use config::mm::PAGE_SIZE;
+use ksync::mutex::SpinLock;
+use memory::frame::{frame_alloc_some_zero_inited, FrameTracker};
+
+use crate::{
+    cpu::current_cpu,
+    fs::vfs::basic::file::{File, FileMeta},
+    include::{
+        fs::FileFlags,
+        io::{
+            IoCqringOffsets, IoSqeFlags, IoSqringOffsets, IoUringCqe, IoUringFeatures, IoUringOp,
+            IoUringParams, IoUringSetupFlags, IoUringSqe, PollEvent, IORING_MAX_ENTRIES,
+            IORING_OFF_CQ_RING, IORING_OFF_SQES, IORING_OFF_SQ_RING, IORING_SQ_CQ_OVERFLOW,
+        },
+        result::Errno,
+    },
+    mm::{memory_set::kernel_space_activate, user_ptr::UserPtr},
+    sched::spawn::spawn_ktask,
+    syscall::{SysResult, Syscall, SyscallResult},
+    task::{status::TaskStatus, Task},
+    with_interrupt_off,
+};
+
+// byte offsets in the rings region, the heads and tails written by the two
+// sides get their own cache lines
+const SQ_HEAD: usize = 0;
+const SQ_TAIL: usize = 4;
+const CQ_HEAD: usize = 64;
+const CQ_TAIL: usize = 68;
+const SQ_RING_MASK: usize = 128;
+const CQ_RING_MASK: usize = 132;
+const SQ_RING_ENTRIES: usize = 136;
+const CQ_RING_ENTRIES: usize = 140;
+const SQ_DROPPED: usize = 144;
+const SQ_FLAGS: usize = 148;
+const CQ_FLAGS: usize = 152;
+const CQ_OVERFLOW: usize = 156;
+const CQES: usize = 192;
+
+/// physically contiguous frames, seen by the kernel as one buffer
+struct RingRegion {
+    frames: Vec<FrameTracker>,
+}
+
+impl RingRegion {
+    fn new(len: usize) -> SysResult<Self> {
+        let frames = frame_alloc_some_zero_inited(len.div_ceil(PAGE_SIZE)).ok_or(Errno::ENOMEM)?;
+        Ok(Self { frames })
+    }
+    fn ptr(&self, offset: usize) -> *mut u8 {
+        (self.frames[0].kernel_vpn().as_va_usize() + offset) as *mut u8
+    }
+    fn u32_at(&self, offset: usize) -> &AtomicU32 {
+        unsafe { &*(self.ptr(offset) as *const AtomicU32) }
+    }
+    fn frame(&self, offset: usize) -> Option<FrameTracker> {
+        self.frames.get(offset / PAGE_SIZE).cloned()
+    }
+}
+
+struct CqState {
+    /// cqes that didn't fit into the ring
+    backlog: VecDeque<IoUringCqe>,
+    /// tasks in io_uring_enter and pollers of the ring fd
+    waiters: Vec<Waker>,
+}
+
+pub struct IoUringFile {
+    /// sq and cq rings and the sq index array
+    rings: RingRegion,
+    sqes: RingRegion,
+    sq_entries: u32,
+    cq_entries: u32,
+    sq_array: usize,
+    /// the kernel's sq head, the user side may scribble over the shared one
+    sq_head: SpinLock<u32>,
+    cq: SpinLock<CqState>,
+    meta: FileMeta,
+}
+
+impl IoUringFile {
+    /// check `params` and fill in the ring sizes and offsets
+    pub fn new(entries: u32, params: &mut IoUringParams) -> SysResult<Arc<Self>> {
+        let flags = IoUringSetupFlags::from_bits(params.flags).ok_or(Errno::EINVAL)?;
+        if !(IoUringSetupFlags::IORING_SETUP_CQSIZE | IoUringSetupFlags::IORING_SETUP_CLAMP)
+            .contains(flags)
+        {
+            // no polling threads
+            return Err(Errno::EINVAL);
+        }
+        let clamp = flags.contains(IoUringSetupFlags::IORING_SETUP_CLAMP);
+        let clamped = |entries: u32, max: u32| match entries {
+            0 => Err(Errno::EINVAL),
+            entries if entries > max && !clamp => Err(Errno::EINVAL),
+            entries => Ok(entries.min(max).next_power_of_two()),
+        };
+        let sq_entries = clamped(entries, IORING_MAX_ENTRIES)?;
+        let cq_entries = match flags.contains(IoUringSetupFlags::IORING_SETUP_CQSIZE) {
+            true => clamped(params.cq_entries, IORING_MAX_ENTRIES * 2)?,
+            false => sq_entries * 2,
+        };
+        if cq_entries < sq_entries {
+            return Err(Errno::EINVAL);
+        }
+
+        let sq_array = CQES + cq_entries as usize * size_of::<IoUringCqe>();
+        let rings = RingRegion::new(sq_array + sq_entries as usize * size_of::<u32>())?;
+        let sqes = RingRegion::new(sq_entries as usize * size_of::<IoUringSqe>())?;
+        rings
+            .u32_at(SQ_RING_MASK)
+            .store(sq_entries - 1, Ordering::Relaxed);
+        rings
+            .u32_at(CQ_RING_MASK)
+            .store(cq_entries - 1, Ordering::Relaxed);
+        rings
+            .u32_at(SQ_RING_ENTRIES)
+            .store(sq_entries, Ordering::Relaxed);
+        rings
+            .u32_at(CQ_RING_ENTRIES)
+            .store(cq_entries, Ordering::Relaxed);
+
+        params.sq_entries = sq_entries;
+        params.cq_entries = cq_entries;
+        params.features = (IoUringFeatures::IORING_FEAT_SINGLE_MMAP
+            | IoUringFeatures::IORING_FEAT_NODROP
+            | IoUringFeatures::IORING_FEAT_RW_CUR_POS)
+            .bits();
+        params.sq_off = IoSqringOffsets {
+            head: SQ_HEAD as u32,
+            tail: SQ_TAIL as u32,
+            ring_mask: SQ_RING_MASK as u32,
+            ring_entries: SQ_RING_ENTRIES as u32,
+            flags: SQ_FLAGS as u32,
+            dropped: SQ_DROPPED as u32,
+            array: sq_array as u32,
+            ..Default::default()
+        };
+        params.cq_off = IoCqringOffsets {
+            head: CQ_HEAD as u32,
+            tail: CQ_TAIL as u32,
+            ring_mask: CQ_RING_MASK as u32,
+            ring_entries: CQ_RING_ENTRIES as u32,
+            overflow: CQ_OVERFLOW as u32,
+            cqes: CQES as u32,
+            flags: CQ_FLAGS as u32,
+            ..Default::default()
+        };
+
+        let meta = FileMeta::empty();
+        meta.set_flags(FileFlags::O_RDWR);
+        Ok(Arc::new(Self {
+            rings,
+            sqes,
+            sq_entries,
+            cq_entries,
+            sq_array,
+            sq_head: SpinLock::new(0),
+            cq: SpinLock::new(CqState {
+                backlog: VecDeque::new(),
+                waiters: Vec::new(),
+            }),
+            meta,
+        }))
+    }
+
+    /// take at most `to_submit` new sqes, split into chains of linked ones
+    fn take_sqes(&self, to_submit: usize) -> Vec<Vec<IoUringSqe>> {
+        let mut head = self.sq_head.lock();
+        let tail = self.rings.u32_at(SQ_TAIL).load(Ordering::Acquire);
+        let count = (tail.wrapping_sub(*head) as usize)
+            .min(self.sq_entries as usize)
+            .min(to_submit);
+        let (mut chains, mut chain) = (Vec::new(), Vec::new());
+        for _ in 0..count {
+            let slot = (*head & (self.sq_entries - 1)) as usize;
+            let index = self
+                .rings
+                .u32_at(self.sq_array + slot * size_of::<u32>())
+                .load(Ordering::Relaxed);
+            *head = head.wrapping_add(1);
+            if index >= self.sq_entries {
+                self.rings
+                    .u32_at(SQ_DROPPED)
+                    .fetch_add(1, Ordering::Relaxed);
+                continue;
+            }
+            let sqe = unsafe {
+                (self.sqes.ptr(index as usize * size_of::<IoUringSqe>()) as *const IoUringSqe)
+                    .read_volatile()
+            };
+            let flags = IoSqeFlags::from_bits_truncate(sqe.flags);
+            chain.push(sqe);
+            if !flags.intersects(IoSqeFlags::IOSQE_IO_LINK | IoSqeFlags::IOSQE_IO_HARDLINK) {
+                chains.push(core::mem::take(&mut chain));
+            }
+        }
+        // an unterminated chain ends at the last sqe submitted
+        if !chain.is_empty() {
+            chains.push(chain);
+        }
+        self.rings.u32_at(SQ_HEAD).store(*head, Ordering::Release);
+        chains
+    }
+
+    /// spawn a kernel task for every chain of new sqes, return how many
+    /// sqes were consumed
+    pub fn submit(self: &Arc<Self>, task: &Arc<Task>, to_submit: usize) -> usize {
+        let chains = self.take_sqes(to_submit);
+        let submitted = chains.iter().map(Vec::len).sum();
+        for chain in chains {
+            let ring = self.clone();
+            let task = task.clone();
+            spawn_ktask(InUserSpaceFuture::new(task.clone(), async move {
+                ring.run_chain(&task, chain).await;
+            }));
+        }
+        submitted
+    }
+
+    async fn run_chain(&self, task: &Arc<Task>, chain: Vec<IoUringSqe>) {
+        let mut canceled = false;
+        for sqe in chain {
+            let flags = IoSqeFlags::from_bits_truncate(sqe.flags);
+            // nothing is started for a submitter that has exited
+            let res = match canceled || has_exited(task) {
+                true => Err(Errno::ECANCELED),
+                false => RingOpFuture::new(task, run_sqe(task, &sqe)).await,
+            };
+            // a failed op cancels the rest of the chain unless hard linked
+            if res.is_err() && !flags.contains(IoSqeFlags::IOSQE_IO_HARDLINK) {
+                canceled = true;
+            }
+            if res.is_ok() && flags.contains(IoSqeFlags::IOSQE_CQE_SKIP_SUCCESS) {
+                continue;
+            }
+            self.post(IoUringCqe {
+                user_data: sqe.user_data,
+                res: res.map_or_else(|err| -(err as i32), |res| res as i32),
+                flags: 0,
+            });
+        }
+    }
+
+    fn post(&self, cqe: IoUringCqe) {
+        let mut cq = self.cq.lock();
+        cq.backlog.push_back(cqe);
+        self.flush(&mut cq);
+        let waiters = core::mem::take(&mut cq.waiters);
+        drop(cq);
+        waiters.into_iter().for_each(Waker::wake);
+    }
+
+    /// move backlogged cqes into the slots the user side has freed
+    fn flush(&self, cq: &mut CqState) {
+        let head = self.rings.u32_at(CQ_HEAD).load(Ordering::Acquire);
+        let mut tail = self.rings.u32_at(CQ_TAIL).load(Ordering::Relaxed);
+        while tail.wrapping_sub(head) < self.cq_entries {
+            let Some(cqe) = cq.backlog.pop_front() else {
+                break;
+            };
+            let slot = (tail & (self.cq_entries - 1)) as usize;
+            unsafe {
+                (self.rings.ptr(CQES + slot * size_of::<IoUringCqe>()) as *mut IoUringCqe)
+                    .write_volatile(cqe);
+            }
+            tail = tail.wrapping_add(1);
+        }
+        self.rings.u32_at(CQ_TAIL).store(tail, Ordering::Release);
+        let flags = self.rings.u32_at(SQ_FLAGS);
+        match cq.backlog.is_empty() {
+            true => flags.fetch_and(!IORING_SQ_CQ_OVERFLOW, Ordering::Relaxed),
+            false => flags.fetch_or(IORING_SQ_CQ_OVERFLOW, Ordering::Relaxed),
+        };
+    }
+
+    /// cqes in the ring the user side hasn't consumed yet
+    fn cq_ready(&self) -> u32 {
+        let head = self.rings.u32_at(CQ_HEAD).load(Ordering::Acquire);
+        let tail = self.rings.u32_at(CQ_TAIL).load(Ordering::Relaxed);
+        tail.wrapping_sub(head).min(self.cq_entries)
+    }
+
+    /// wait until at least `min_complete` cqes are in the ring
+    pub fn wait(self: &Arc<Self>, min_complete: u32) -> IoUringWaitFuture {
+        IoUringWaitFuture {
+            ring: self.clone(),
+            min_complete: min_complete.min(self.cq_entries),
+        }
+    }
+}
+
+/// run one sqe, reads, writes and socket ops go to the file or socket
+/// directly since the syscall bodies wait through `interruptable`, which
+/// works on the signal state of the submitter
+async fn run_sqe(task: &Arc<Task>, sqe: &IoUringSqe) -> SyscallResult {
+    let flags = IoSqeFlags::from_bits_truncate(sqe.flags);
+    if flags.intersects(
+        IoSqeFlags::IOSQE_FIXED_FILE | IoSqeFlags::IOSQE_IO_DRAIN | IoSqeFlags::IOSQE_BUFFER_SELECT,
+    ) {
+        return Err(Errno::EINVAL);
+    }
+    let op = IoUringOp::from_repr(sqe.opcode).ok_or(Errno::EINVAL)?;
+    let (fd, addr, len) = (sqe.fd as usize, sqe.addr as usize, sqe.len as usize);
+    // -1 reads and writes at the file position
+    let off = (sqe.off != u64::MAX).then_some(sqe.off as usize);
+    let syscall = Syscall::new(task);
+    match (op, off) {
+        (IoUringOp::Nop, _) => Ok(0),
+        (IoUringOp::Read, None) => {
+            let file = task.fd_table().get(fd).ok_or(Errno::EBADF)?;
+            if !file.meta().readable() {
+                return Err(Errno::EBADF);
+            }
+            let buf = UserPtr::<u8>::new(addr).as_slice_mut_checked(len).await?;
+            file.read(buf).await
+        }
+        (IoUringOp::Read, Some(off)) => syscall.sys_pread64(fd, addr, len, off).await,
+        (IoUringOp::Write, None) => {
+            let file = task.fd_table().get(fd).ok_or(Errno::EBADF)?;
+            if !file.meta().writable() {
+                return Err(Errno::EBADF);
+            }
+            let buf = UserPtr::<u8>::new(addr).as_slice_const_checked(len).await?;
+            file.write(buf).await
+        }
+        (IoUringOp::Write, Some(off)) => syscall.sys_pwrite64(fd, addr, len, off).await,
+        (IoUringOp::Readv, None) => syscall.sys_readv(fd, addr, len).await,
+        (IoUringOp::Readv, Some(off)) => syscall.sys_preadv(fd, addr, len, off).await,
+        (IoUringOp::Writev, None) => syscall.sys_writev(fd, addr, len).await,
+        (IoUringOp::Writev, Some(off)) => syscall.sys_pwritev(fd, addr, len, off).await,
+        // same as fsync(2), the data already went through the page cache
+        (IoUringOp::Fsync, _) => task.fd_table().get(fd).map(|_| 0).ok_or(Errno::EBADF),
+        (IoUringOp::Openat, _) => {
+            syscall
+                .sys_openat(sqe.fd as isize, addr, sqe.op_flags as i32, sqe.len)
+                .await
+        }
+        (IoUringOp::Close, _) => syscall.sys_close(fd),
+        (IoUringOp::Send, _) => {
+            let socket_file = task.fd_table().get_socketfile(fd)?;
+            let mut socket = socket_file.socket().await;
+            let buf = UserPtr::<u8>::new(addr).as_slice_const_checked(len).await?;
+            socket.write(buf, None).await.map(|n| n as isize)
+        }
+        (IoUringOp::Recv, _) => {
+            let socket_file = task.fd_table().get_socketfile(fd)?;
+            let mut socket = socket_file.socket().await;
+            let buf = UserPtr::<u8>::new(addr).as_slice_mut_checked(len).await?;
+            socket.read(buf).await.0.map(|n| n as isize)
+        }
+    }
+}
+
+fn has_exited(task: &Task) -> bool {
+    task.pcb().status() == TaskStatus::Zombie
+}
+
+/// an op running for `task`, it ends with EINTR once the submitter has
+/// exited, checked whenever the op is woken
+struct RingOpFuture<'a, F: Future<Output = SyscallResult>> {
+    task: &'a Arc<Task>,
+    future: F,
+}
+
+impl<'a, F: Future<Output = SyscallResult>> RingOpFuture<'a, F> {
+    fn new(task: &'a Arc<Task>, future: F) -> Self {
+        Self { task, future }
+    }
+}
+
+impl<F: Future<Output = SyscallResult>> Future for RingOpFuture<'_, F> {
+    type Output = SyscallResult;
+
+    fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Self::Output> {
+        let this = unsafe { self.get_unchecked_mut() };
+        if has_exited(this.task) {
+            return Poll::Ready(Err(Errno::EINTR));
+        }
+        unsafe { Pin::new_unchecked(&mut this.future).poll(cx) }
+    }
+}
+
+/// polls a kernel future in the address space of `task`, so the user
+/// buffers of the ops can be accessed and faulted in, `task` isn't made
+/// the current task: it may be running on another hart meanwhile
+struct InUserSpaceFuture<F: Future + Send + 'static> {
+    task: Arc<Task>,
+    future: F,
+}
+
+impl<F: Future + Send + 'static> InUserSpaceFuture<F> {
+    fn new(task: Arc<Task>, future: F) -> Self {
+        Self { task, future }
+    }
+}
+
+impl<F: Future + Send + 'static> Future for InUserSpaceFuture<F> {
+    type Output = F::Output;
+
+    fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Self::Output> {
+        let this = unsafe { self.get_unchecked_mut() };
+        let task = &this.task;
+        with_interrupt_off!({
+            current_cpu().set_user_space(task);
+            task.memory_activate();
+        });
+        let ret = unsafe { Pin::new_unchecked(&mut this.future).poll(cx) };
+        with_interrupt_off!({
+            current_cpu().clear_user_space();
+            kernel_space_activate();
+        });
+        ret
+    }
+}
+
+pub struct IoUringWaitFuture {
+    ring: Arc<IoUringFile>,
+    min_complete: u32,
+}
+
+impl Future for IoUringWaitFuture {
+    type Output = ();
+
+    fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Self::Output> {
+        let mut cq = self.ring.cq.lock();
+        self.ring.flush(&mut cq);
+        if self.ring.cq_ready() >= self.min_complete {
+            return Poll::Ready(());
+        }
+        cq.waiters.push(cx.waker().clone());
+        Poll::Pending
+    }
+}
+
+#[async_trait]
+impl File for IoUringFile {
+    fn meta(&self) -> &FileMeta {
+        &self.meta
+    }
+    /// the sq ring, cq ring and sqes are mmapped at their fixed offsets,
+    /// both rings share one region
+    fn mmap_frame(&self, offset: usize) -> Option<FrameTracker> {
+        if offset >= IORING_OFF_SQES {
+            self.sqes.frame(offset - IORING_OFF_SQES)
+        } else if offset >= IORING_OFF_CQ_RING {
+            self.rings.frame(offset - IORING_OFF_CQ_RING)
+        } else {
+            self.rings.frame(offset - IORING_OFF_SQ_RING)
+        }
+    }
+    async fn base_read(&self, _offset: usize, _buf: &mut [u8]) -> SyscallResult {
+        Err(Errno::EINVAL)
+    }
+    async fn base_readlink(&self, _buf: &mut [u8]) -> SyscallResult {
+        Err(Errno::EINVAL)
+    }
+    async fn base_write(&self, _offset: usize, _buf: &[u8]) -> SyscallResult {
+        Err(Errno::EINVAL)
+    }
+    async fn load_dir(&self) -> Result<(), Errno> {
+        Err(Errno::ENOTDIR)
+    }
+    async fn delete_child(&self, _name: &str) -> Result<(), Errno> {
+        Err(Errno::ENOTDIR)
+    }
+    fn ioctl(&self, _cmd: usize, _arg: usize) -> SyscallResult {
+        Err(Errno::ENOTTY)
+    }
+    /// readable while the cq ring isn't empty
+    fn poll(&self, req: &PollEvent, waker: Waker) -> PollEvent {
+        if !req.contains(PollEvent::POLLIN) {
+            return PollEvent::empty();
+        }
+        let mut cq = self.cq.lock();
+        self.flush(&mut cq);
+        if self.cq_ready() > 0 {
+            PollEvent::POLLIN
+        } else {
+            cq.waiters.push(waker);
+            PollEvent::empty()
+        }
+    }
+}
@@ -1,19 +1,24 @@
 //! map area
 
-use alloc::collections::btree_map::BTreeMap;
+use alloc::{collections::btree_map::BTreeMap, sync::Arc};
 
-use arch::{Arch, ArchMemory, ArchPageTableEntry};
+use arch::{
+    consts::{INDEX_LEVELS, SUPERPAGE},
+    Arch, ArchMemory, ArchPageTableEntry,
+};
 use include::errno::Errno;
 
 use super::{
     address::{VirtAddr, VirtPageNum, VpnRange},
-    frame::{frame_alloc, FrameTracker},
+    frame::{frame_alloc, frame_alloc_some_zero_inited, FrameTracker},
     memory_set::MapAreaLoadDataInfo,
-    page_table::PageTable,
+    page_table::{level_pages, PageTable},
     permission::{MapPermission, MapType},
+    zram::ZramPage,
 };
 use crate::{
     config::mm::PAGE_SIZE,
+    fs::vfs::basic::file::File,
     mm::address::{PhysPageNum, StepOne},
     syscall::SysResult,
 };
@@ -28,6 +33,37 @@ pub enum MapAreaType {
     Shared,
 }
 
+/// file backing of a demand-paged area, pages are filled from the page
+/// cache of `file` on fault instead of being copied in at exec time
+#[derive(Clone)]
+pub struct MapAreaFileInfo {
+    /// the backing file
+    pub file: Arc<dyn File>,
+
+    /// file offset of the first page of the area, page aligned
+    pub offset: usize,
+
+    /// end va of the file-backed bytes, the rest is zero-filled
+    pub file_end: usize,
+
+    /// end va of the area in memory
+    pub mem_end: usize,
+}
+
+/// how a faulting page of a file-backed area should be filled
+pub struct MapAreaFilePage {
+    pub file: Arc<dyn File>,
+
+    /// page aligned file offset of the page
+    pub offset: usize,
+
+    /// bytes of the page backed by the file
+    pub len: usize,
+
+    /// whether the page cache frame could be mapped as is
+    pub shared: bool,
+}
+
 /// map area, saves program data mapping information
 pub struct MapArea {
     /// The range of the virtual page number
@@ -38,6 +74,9 @@ pub struct MapArea {
     /// use Arc because we share it in copy-on-write fork
     pub frame_map: BTreeMap<VirtPageNum, FrameTracker>,
 
+    /// pages swapped out to zram, they are not in `frame_map` meanwhile
+    pub swapped: BTreeMap<VirtPageNum, ZramPage>,
+
     /// address mapping type
     pub map_type: MapType,
 
@@ -46,6 +85,9 @@ pub struct MapArea {
 
     /// area type
     pub area_type: MapAreaType,
+
+    /// file backing, only for demand-paged areas
+    pub file_info: Option<MapAreaFileInfo>,
 }
 
 impl MapArea {
@@ -53,9 +95,11 @@ impl MapArea {
         Self {
             vpn_range: VpnRange::new(VirtPageNum::from(0), VirtPageNum::from(0)).unwrap(),
             frame_map: BTreeMap::new(),
+            swapped: BTreeMap::new(),
             map_permission: MapPermission::empty(),
             map_type: MapType::Identical,
             area_type: MapAreaType::None,
+            file_info: None,
         }
     }
 
@@ -71,20 +115,93 @@ impl MapArea {
         Ok(Self {
             vpn_range,
             frame_map: BTreeMap::new(),
+            swapped: BTreeMap::new(),
             map_permission,
             map_type,
             area_type: map_area_type,
+            file_info: None,
         })
     }
 
+    /// create a demand-paged area backed by a file,
+    /// no page is mapped until it is accessed
+    pub fn new_file_backed(
+        start_va: VirtAddr,
+        end_va: VirtAddr,
+        map_permission: MapPermission,
+        map_area_type: MapAreaType,
+        file: Arc<dyn File>,
+        file_offset: usize,
+        file_size: usize,
+    ) -> SysResult<Self> {
+        let mut area = Self::new(
+            start_va,
+            end_va,
+            MapType::Framed,
+            map_permission,
+            map_area_type,
+        )?;
+        assert_eq!(file_offset % PAGE_SIZE, start_va.offset());
+        area.file_info = Some(MapAreaFileInfo {
+            file,
+            offset: file_offset - start_va.offset(),
+            file_end: start_va.raw() + file_size,
+            mem_end: end_va.raw(),
+        });
+        Ok(area)
+    }
+
     /// create new from another map area
     pub fn from_another(other: &MapArea) -> Self {
         Self {
             vpn_range: other.vpn_range.clone(),
             frame_map: BTreeMap::new(),
+            swapped: BTreeMap::new(),
             map_permission: other.map_permission.clone(),
             map_type: other.map_type.clone(),
             area_type: other.area_type.clone(),
+            file_info: other.file_info.clone(),
+        }
+    }
+
+    /// locate the backing of `vpn` in a file-backed area
+    ///
+    /// a page is shared with the page cache only when the area is read-only
+    /// and no zero-filled tail falls into it; otherwise it gets a private copy
+    pub fn file_page(&self, vpn: VirtPageNum) -> Option<MapAreaFilePage> {
+        let info = self.file_info.as_ref()?;
+        let page_va = vpn.as_va_usize();
+        let page_index = vpn.raw() - self.vpn_range.start().raw();
+        let len = info.file_end.saturating_sub(page_va).min(PAGE_SIZE);
+        let shared = len != 0
+            && !self.map_permission.contains(MapPermission::W)
+            && (len == PAGE_SIZE || info.file_end == info.mem_end);
+        Some(MapAreaFilePage {
+            file: info.file.clone(),
+            offset: info.offset + page_index * PAGE_SIZE,
+            len,
+            shared,
+        })
+    }
+
+    /// split the area at `vpn`, the part from `vpn` on is returned with
+    /// its frames and the file backing moved along
+    pub fn split_off(&mut self, vpn: VirtPageNum) -> Self {
+        let (start, end) = (self.vpn_range.start(), self.vpn_range.end());
+        assert!(start < vpn && vpn < end);
+        self.vpn_range = VpnRange::new(start, vpn).unwrap();
+        let mut file_info = self.file_info.clone();
+        if let Some(info) = file_info.as_mut() {
+            info.offset += (vpn.raw() - start.raw()) * PAGE_SIZE;
+        }
+        Self {
+            vpn_range: VpnRange::new(vpn, end).unwrap(),
+            frame_map: self.frame_map.split_off(&vpn),
+            swapped: self.swapped.split_off(&vpn),
+            map_type: self.map_type.clone(),
+            map_permission: self.map_permission.clone(),
+            area_type: self.area_type.clone(),
+            file_info,
         }
     }
 
@@ -105,7 +222,10 @@ impl MapArea {
             }
             // framed: user space
             MapType::Framed => {
-                let frame = frame_alloc().unwrap();
+                let frame = match self.swapped.remove(&vpn) {
+                    Some(page) => page.load().ok_or(Errno::ENOMEM)?,
+                    None => frame_alloc().unwrap(),
+                };
                 let ppn = frame.ppn();
                 if self.frame_map.contains_key(&vpn) {
                     error!("vm area overlap");
@@ -152,12 +272,72 @@ impl MapArea {
             self.vpn_range.start().iovpn_into_ppn().raw(),
             self.vpn_range.end().iovpn_into_ppn().raw(),
         );
+        if SUPERPAGE && self.map_type == MapType::Direct {
+            return self.map_each_huge(page_table);
+        }
         for vpn in self.vpn_range.into_iter() {
             self.map_one(vpn, page_table)?;
         }
         Ok(())
     }
 
+    /// map a direct area with the largest leaves that fit, falling back to
+    /// 4 KiB pages at unaligned edges or where the range is already in use
+    fn map_each_huge(&mut self, page_table: &mut PageTable) -> SysResult<()> {
+        let end = self.vpn_range.end().raw();
+        let mut vpn = self.vpn_range.start().raw();
+        let flags = self.map_permission.into();
+        'outer: while vpn < end {
+            let ppn = VirtPageNum::from(vpn).kernel_translate_into_ppn();
+            for level in (1..INDEX_LEVELS).rev() {
+                let pages = level_pages(level);
+                if vpn % pages == 0
+                    && ppn.raw() % pages == 0
+                    && vpn + pages <= end
+                    && page_table.try_map_huge(vpn.into(), ppn, level, flags)
+                {
+                    vpn += pages;
+                    continue 'outer;
+                }
+            }
+            self.map_one(vpn.into(), page_table)?;
+            vpn += 1;
+        }
+        Ok(())
+    }
+
+    /// map the 2 MiB block around `vpn` as one transparent huge page, only
+    /// if the area covers the whole block, nothing inside is mapped yet and
+    /// a contiguous run of frames is available, returns whether it's mapped
+    pub fn try_map_huge(&mut self, vpn: VirtPageNum, page_table: &mut PageTable) -> bool {
+        if !SUPERPAGE || self.map_type != MapType::Framed {
+            return false;
+        }
+        let pages = level_pages(1);
+        let start = VirtPageNum::from(vpn.raw() & !(pages - 1));
+        let end = VirtPageNum::from(start.raw() + pages);
+        if start < self.vpn_range.start() || end > self.vpn_range.end() {
+            return false;
+        }
+        if self.frame_map.range(start..end).next().is_some()
+            || self.swapped.range(start..end).next().is_some()
+        {
+            return false;
+        }
+        let Some(frames) = frame_alloc_some_zero_inited(pages) else {
+            return false;
+        };
+        let flags = self.map_permission.into();
+        if !page_table.try_map_huge(start, frames[0].ppn(), 1, flags) {
+            return false;
+        }
+        for (i, frame) in frames.into_iter().enumerate() {
+            self.frame_map
+                .insert(VirtPageNum::from(start.raw() + i), frame);
+        }
+        true
+    }
+
     /// unmap one page at `vpn`
     pub fn unmap_one(&mut self, vpn: VirtPageNum, page_table: &mut PageTable) {
         trace!("unmap_one: vpn = {:?}", vpn);
@@ -167,6 +347,7 @@ impl MapArea {
             }
             MapType::Framed => {
                 self.frame_map.remove(&vpn);
+                self.swapped.remove(&vpn);
                 page_table.unmap(vpn);
             }
             _ => {
@@ -1,7 +1,8 @@
 use alloc::{string::String, sync::Arc, vec::Vec};
+use core::sync::atomic::{AtomicUsize, Ordering};
 
-use arch::{Arch, ArchInt, ArchMemory, ArchPageTableEntry, ArchTime, MappingFlags, PageTableEntry};
-use config::mm::{DL_INTERP_OFFSET, SIG_TRAMPOLINE, USER_HEAP_SIZE};
+use arch::{Arch, ArchInt, ArchMemory, ArchPageTableEntry, ArchTime, PageTableEntry};
+use config::mm::{DL_INTERP_OFFSET, SIG_TRAMPOLINE, USER_HEAP_SIZE, VDSO_BASE, VDSO_DATA};
 use include::errno::Errno;
 use ksync::cell::SyncUnsafeCell;
 use memory::frame::can_frame_alloc_loosely;
@@ -9,15 +10,19 @@ use spin::Once;
 use xmas_elf::ElfFile;
 
 use super::{
-    address::{PhysAddr, PhysPageNum},
-    frame::{frame_alloc, frame_refcount, FrameTracker},
+    address::{PhysAddr, PhysPageNum, VpnRange},
+    frame::{frame_alloc_raw, frame_refcount},
     map_area::MapArea,
     mmap_manager::MmapManager,
     page_table::{flags_switch_to_rw, PageTable},
     shm::{ShmInfo, ShmTracker},
 };
 use crate::{
-    config::mm::{PAGE_SIZE, PAGE_WIDTH, USER_STACK_SIZE},
+    config::{
+        cpu::CPU_NUM,
+        mm::{PAGE_SIZE, PAGE_WIDTH, USER_STACK_SIZE},
+    },
+    cpu::get_hartid,
     fs::{
         path::kopen,
         vfs::basic::{dentry::Dentry, file::File},
@@ -27,13 +32,13 @@ use crate::{
     mm::{
         address::{VirtAddr, VirtPageNum},
         map_area::MapAreaType,
-        page_table::flags_switch_to_cow,
-        permission::MapType,
+        permission::{MapPermission, MapType},
         shm::SHM_MANAGER,
     },
     pte_flags, return_errno,
     syscall::SysResult,
     task::signal::user_sigreturn,
+    time::vdso::VDSO_DATA_PAGE,
 };
 
 #[allow(unused)]
@@ -41,6 +46,7 @@ extern "C" {
     fn stext();
     fn ssignal();
     fn esignal();
+    fn svdso();
     fn etext();
     fn srodata();
     fn erodata();
@@ -53,6 +59,15 @@ extern "C" {
 
 pub static KERNEL_SPACE: Once<MemorySet> = Once::new();
 
+/// root ppn of the page table each hart runs on, a root is only replaced
+/// after the switch away from it flushed the tlb, without a kernel space
+/// the last user table stays loaded and counts as active until the next
+static ACTIVE_ROOTS: [AtomicUsize; CPU_NUM] = {
+    #[allow(clippy::declare_interior_mutable_const)]
+    const NONE: AtomicUsize = AtomicUsize::new(0);
+    [NONE; CPU_NUM]
+};
+
 pub fn kernel_space_activate() {
     if Arch::HAS_KERNEL_SPACE {
         KERNEL_SPACE.get().unwrap().memory_activate();
@@ -115,6 +130,10 @@ pub struct MemorySet {
     /// map_areas tracks user data
     pub areas: Vec<MapArea>,
 
+    /// index of the area last found by [`Self::find_area`], faults of one
+    /// buffer mostly land in the same area
+    area_hint: usize,
+
     /// stack
     pub stack: MapArea,
 
@@ -126,6 +145,9 @@ pub struct MemorySet {
 
     /// shm manager
     pub shm: ShmInfo,
+
+    /// where the next zram reclaim of this space starts
+    pub swap_hand: VirtPageNum,
 }
 
 impl MemorySet {
@@ -159,10 +181,56 @@ impl MemorySet {
         Self {
             page_table,
             areas,
+            area_hint: 0,
             stack,
             brk,
             mmap_manager,
             shm,
+            swap_hand: VirtPageNum::from(0),
+        }
+    }
+
+    /// find the area containing `vpn`, the last hit is tried first
+    pub fn find_area(&mut self, vpn: VirtPageNum) -> Option<&MapArea> {
+        let hint = self.area_hint;
+        if !self
+            .areas
+            .get(hint)
+            .is_some_and(|area| area.vpn_range.is_in_range(vpn))
+        {
+            self.area_hint = self
+                .areas
+                .iter()
+                .position(|area| area.vpn_range.is_in_range(vpn))?;
+        }
+        self.areas.get(self.area_hint)
+    }
+
+    /// add `perm` to the file-backed areas overlapping `range`, areas
+    /// straddling its edges are split so pages faulted in later outside the
+    /// range keep the old permission
+    pub fn protect_file_areas(&mut self, range: &VpnRange, perm: MapPermission) {
+        let mut i = 0;
+        while i < self.areas.len() {
+            let area = &mut self.areas[i];
+            let (start, end) = (area.vpn_range.start(), area.vpn_range.end());
+            if area.file_info.is_none() || end <= range.start() || start >= range.end() {
+                i += 1;
+                continue;
+            }
+            if start < range.start() {
+                let tail = area.split_off(range.start());
+                self.areas.insert(i + 1, tail);
+                i += 1;
+                continue;
+            }
+            if end > range.end() {
+                let tail = area.split_off(range.end());
+                self.areas.insert(i + 1, tail);
+            }
+            let area = &mut self.areas[i];
+            area.map_permission = area.map_permission | perm;
+            i += 1;
         }
     }
 
@@ -176,6 +244,7 @@ impl MemorySet {
         let kernel_pt = KERNEL_SPACE.get().unwrap().page_table();
         let mut user_space = Self::new(kernel_pt.new_root_cloned());
         user_space.map_sig_trampoline();
+        user_space.map_vdso();
         user_space
     }
 
@@ -187,7 +256,27 @@ impl MemorySet {
     /// switch into this memory set
     #[inline(always)]
     pub fn memory_activate(&self) {
-        self.page_table().memory_activate();
+        let page_table = self.page_table();
+        page_table.memory_activate();
+        ACTIVE_ROOTS[get_hartid()].store(page_table.root_ppn().raw(), Ordering::SeqCst);
+    }
+
+    /// whether any hart runs on this address space
+    pub fn is_active(&self) -> bool {
+        let root = self.page_table().root_ppn().raw();
+        ACTIVE_ROOTS
+            .iter()
+            .any(|active| active.load(Ordering::SeqCst) == root)
+    }
+
+    /// whether another hart runs on this address space, its tlb may keep
+    /// entries this hart can't flush
+    pub fn is_active_elsewhere(&self) -> bool {
+        let root = self.page_table().root_ppn().raw();
+        ACTIVE_ROOTS
+            .iter()
+            .enumerate()
+            .any(|(hart, active)| hart != get_hartid() && active.load(Ordering::SeqCst) == root)
     }
 
     /// push a map area into current memory set
@@ -316,7 +405,23 @@ impl MemorySet {
                 false => Errno::ENOEXEC,
             }
         };
-        let elf_buf = elf_file.read_all().await?;
+        // only the elf header and the program headers are read here,
+        // segments are paged in from the page cache on demand
+        let mut elf_buf = vec![0u8; PAGE_SIZE.min(elf_file.size())];
+        let len = elf_file.read_at(0, &mut elf_buf).await? as usize;
+        elf_buf.truncate(len);
+        let ph_end = {
+            let elf = ElfFile::new(elf_buf.as_slice()).map_err(handler)?;
+            elf.header.pt2.ph_offset() as usize
+                + elf.header.pt2.ph_count() as usize * elf.header.pt2.ph_entry_size() as usize
+        };
+        if ph_end > elf_buf.len() {
+            elf_buf.resize(ph_end, 0);
+            let len = elf_file.read_at(0, &mut elf_buf).await? as usize;
+            if len < ph_end {
+                return Err(handler("truncated program headers"));
+            }
+        }
         let elf = ElfFile::new(elf_buf.as_slice()).map_err(handler)?;
 
         // check: magic
@@ -349,33 +454,54 @@ impl MemorySet {
                         head_va = Some(start_va);
                     }
                     let permission = map_permission!(U).merge_from_elf_flags(ph.flags());
-                    let map_area = MapArea::new(
-                        start_va,
-                        end_va,
-                        MapType::Framed,
-                        permission,
-                        MapAreaType::ElfBinary,
-                    )?;
+                    let file_offset = ph.offset() as usize;
+                    let file_size = ph.file_size() as usize;
                     info!(
                         "[map_elf] [{:#x}, {:#x}], permission: {:?}, ph offset {:#x}, file size {:#x}, mem size {:#x}",
                         start_va.raw(), end_va.raw(), permission,
-                        ph.offset(),
-                        ph.file_size(),
+                        file_offset,
+                        file_size,
                         ph.mem_size()
                     );
-                    end_vpn = Some(map_area.vpn_range.end());
-                    // we won't map the area immediately
-                    // alloc it after all checks are done
-                    frame_req_num += map_area.vpn_range.page_count();
-                    areas.push((
-                        map_area,
-                        Some(MapAreaLoadDataInfo {
-                            start: ph.offset() as usize,
-                            len: ph.file_size() as usize,
-                            offset: start_va.offset(),
-                            slice: &elf_buf,
-                        }),
-                    ));
+                    // map the segment from the page cache if its file pages
+                    // line up with its virtual pages, otherwise copy it in
+                    if file_offset % PAGE_SIZE == start_va.offset()
+                        && elf_file.page_cache().is_some()
+                    {
+                        let map_area = MapArea::new_file_backed(
+                            start_va,
+                            end_va,
+                            permission,
+                            MapAreaType::ElfBinary,
+                            elf_file.clone(),
+                            file_offset,
+                            file_size,
+                        )?;
+                        end_vpn = Some(map_area.vpn_range.end());
+                        // read-only pages are shared with the page cache
+                        if permission.contains(MapPermission::W) {
+                            frame_req_num += map_area.vpn_range.page_count();
+                        }
+                        areas.push((map_area, None));
+                    } else {
+                        let map_area = MapArea::new(
+                            start_va,
+                            end_va,
+                            MapType::Framed,
+                            permission,
+                            MapAreaType::ElfBinary,
+                        )?;
+                        let mut data = vec![0u8; file_size];
+                        let len = elf_file.read_at(file_offset, &mut data).await? as usize;
+                        if len < file_size {
+                            return Err(handler("truncated segment"));
+                        }
+                        end_vpn = Some(map_area.vpn_range.end());
+                        // we won't map the area immediately
+                        // alloc it after all checks are done
+                        frame_req_num += map_area.vpn_range.page_count();
+                        areas.push((map_area, Some((start_va.offset(), data))));
+                    }
                 }
                 Interp => {
                     if is_dl_interp {
@@ -454,8 +580,20 @@ impl MemorySet {
         let entry_point = elf.header.pt2.entry_point() as usize + base_offset;
 
         // checks are done! now push areas into memory set
-        for (area, info) in areas {
-            self.push_area(area, info)?;
+        for (area, data) in areas {
+            match data {
+                Some((offset, data)) => self.push_area(
+                    area,
+                    Some(MapAreaLoadDataInfo {
+                        start: 0,
+                        len: data.len(),
+                        offset,
+                        slice: &data,
+                    }),
+                )?,
+                // file-backed areas are mapped on page fault
+                None => self.areas.push(area),
+            }
         }
 
         Ok(RawElfInfo {
@@ -518,6 +656,7 @@ impl MemorySet {
         auxs.push(AuxEntry(AT_PHENT, elf.ph_entry_size as usize)); // ELF64 header 64bytes
         auxs.push(AuxEntry(AT_PHNUM, elf.ph_count as usize));
         auxs.push(AuxEntry(AT_PAGESZ, PAGE_SIZE as usize));
+        auxs.push(AuxEntry(AT_SYSINFO_EHDR, VDSO_BASE));
         if let Some(dentry) = elf.dl_interp {
             auxs.push(AuxEntry(AT_BASE, DL_INTERP_OFFSET));
             let dl_interp_file = dentry.open(&FileFlags::O_RDWR)?;
@@ -554,132 +693,69 @@ impl MemorySet {
     /// clone current memory set,
     /// and mark the new memory set as copy-on-write
     /// used in sys_fork
+    ///
+    /// leaf page tables are shared with the child instead of being rebuilt
+    /// page by page, see [`PageTable::fork_into`], so fork only pays for the
+    /// directories and the frame references
     pub fn clone_cow(&mut self) -> Self {
         trace!("[clone_cow] start");
-        let mut new_set = Self::new_user_space();
-        fn remap_cow(
-            old_set: &MemorySet,
-            vpn: VirtPageNum,
-            new_set: &mut MemorySet,
-            new_area: &mut MapArea,
-            frame_tracker: &FrameTracker,
-        ) {
-            let old_pte = old_set.page_table().find_pte(vpn).unwrap();
-            let old_flags = old_pte.flags();
-            if old_flags.contains(MappingFlags::W) {
-                let new_flags = flags_switch_to_cow(&old_flags);
-                old_pte.set_flags(new_flags);
-                new_set
-                    .page_table()
-                    .map(vpn, old_pte.ppn().into(), new_flags);
-            } else {
-                new_set
-                    .page_table()
-                    .map(vpn, old_pte.ppn().into(), old_flags);
-            }
-            new_area.frame_map.insert(vpn, frame_tracker.clone());
-        }
+        // the sig trampoline comes with the shared tables
+        let kernel_pt = KERNEL_SPACE.get().unwrap().page_table();
+        let mut new_set = Self::new(kernel_pt.new_root_cloned());
+        let shm = &self.shm;
+        let mmap_map = &self.mmap_manager.mmap_map;
+        self.page_table
+            .as_ref_mut()
+            .fork_into(new_set.page_table(), |vpn| {
+                // shared memory stays writable in both
+                shm.shm_areas
+                    .iter()
+                    .any(|area| area.vpn_range.is_in_range(vpn))
+                    || mmap_map
+                        .get(&vpn)
+                        .is_some_and(|page| page.flags.contains(MmapFlags::MAP_SHARED))
+            });
 
         // normal areas
         for area in self.areas.iter() {
-            match area.area_type {
-                MapAreaType::ElfBinary => {
-                    let mut new_area = MapArea::from_another(area);
-                    for vpn in area.vpn_range {
-                        let frame_tracker = area.frame_map.get(&vpn).unwrap();
-                        remap_cow(self, vpn, &mut new_set, &mut new_area, frame_tracker);
-                    }
-                    new_set.areas.push(new_area);
-                }
-                _ => {
-                    warn!("[clone_cow] IGNORED area: {:?}", area.vpn_range);
-                }
-            }
+            let mut new_area = MapArea::from_another(area);
+            // pages of file-backed areas not faulted in yet are
+            // left for the child to fault in as well
+            new_area.frame_map = area.frame_map.clone();
+            new_area.swapped = area.swapped.clone();
+            new_set.areas.push(new_area);
         }
 
         // stack
-        let area = &self.stack;
-        let mut new_area = MapArea::from_another(area);
-        for vpn in self.stack.vpn_range {
-            if let Some(frame_tracker) = area.frame_map.get(&vpn) {
-                remap_cow(self, vpn, &mut new_set, &mut new_area, frame_tracker);
-            }
-        }
+        let mut new_area = MapArea::from_another(&self.stack);
+        new_area.frame_map = self.stack.frame_map.clone();
+        new_area.swapped = self.stack.swapped.clone();
         new_set.stack = new_area;
 
         // heap
-        let area = &self.brk.area;
         new_set.brk.start = self.brk.start;
         new_set.brk.end = self.brk.end;
-        let mut new_area = MapArea::from_another(area);
-        for vpn in area.vpn_range {
-            if let Some(frame_tracker) = area.frame_map.get(&vpn) {
-                remap_cow(self, vpn, &mut new_set, &mut new_area, frame_tracker);
-            }
-        }
+        let mut new_area = MapArea::from_another(&self.brk.area);
+        new_area.frame_map = self.brk.area.frame_map.clone();
+        new_area.swapped = self.brk.area.swapped.clone();
         new_set.brk.area = new_area;
 
         // mmap
         new_set.mmap_manager = self.mmap_manager.clone();
-        for (vpn, frame_tracker) in self.mmap_manager.frame_trackers.iter() {
-            let vpn = vpn.clone();
-            let old_pte = self.page_table().find_pte(vpn).unwrap();
-            let old_flags = old_pte.flags();
-            if !self
-                .mmap_manager
-                .mmap_map
-                .get(&vpn)
-                .unwrap()
-                .flags
-                .contains(MmapFlags::MAP_SHARED)
-            {
-                if old_flags.contains(MappingFlags::W) {
-                    let new_flags = flags_switch_to_cow(&old_flags);
-                    old_pte.set_flags(new_flags);
-                    new_set
-                        .page_table()
-                        .map(vpn, old_pte.ppn().into(), new_flags);
-                } else {
-                    new_set
-                        .page_table()
-                        .map(vpn, old_pte.ppn().into(), old_flags);
-                }
-            } else {
-                new_set
-                    .page_table()
-                    .map(vpn, old_pte.ppn().into(), old_flags);
-            }
-            new_set
-                .mmap_manager
-                .frame_trackers
-                .insert(vpn, frame_tracker.clone());
-        }
+        new_set.mmap_manager.frame_trackers = self.mmap_manager.frame_trackers.clone();
+        new_set.mmap_manager.cached_pages = self.mmap_manager.cached_pages.clone();
         debug!(
             "[clone_cow] mmap_start: {:#x}, mmap_top: {:#x}",
             new_set.mmap_manager.mmap_start.raw(),
             new_set.mmap_manager.mmap_top.raw(),
         );
 
-        // shm: map it directly since shared memory needn't extra alloc
+        // shm: already mapped through the shared tables
         for shm_area in self.shm.shm_areas.iter() {
             // we save data slice in shm manager, so the frame map is empty
             assert!(shm_area.frame_map.is_empty());
-            let new_area = MapArea::from_another(shm_area);
-            info!(
-                "[clone_cow] shm area: {:?} is mapped as cow",
-                shm_area.vpn_range
-            );
-            for vpn in shm_area.vpn_range {
-                let pte = self.page_table().find_pte(vpn).unwrap();
-                let flag = pte.flags();
-                new_set.page_table().map(vpn, pte.ppn().into(), flag);
-                // trace!(
-                //     "new_set: {:#x} flags: {:?}",
-                //     new_set.page_table().find_pte(vpn).unwrap().ppn(),
-                //     new_set.page_table().find_pte(vpn).unwrap().flags()
-                // );
-            }
-            new_set.shm.shm_areas.push(new_area);
+            info!("[clone_cow] shm area: {:?} is shared", shm_area.vpn_range);
+            new_set.shm.shm_areas.push(MapArea::from_another(shm_area));
         }
         new_set.shm.shm_top = self.shm.shm_top;
         for (va, shm_tracker) in self.shm.shm_trackers.iter() {
@@ -698,6 +774,27 @@ impl MemorySet {
             .map(sig_vpn.into(), sig_ppn.into(), pte_flags!(R, X, U));
     }
 
+    /// map the vdso image and its data page, both come from the kernel image
+    pub fn map_vdso(&mut self) {
+        let image_ppn = VirtAddr::from(svdso as usize)
+            .floor()
+            .kernel_translate_into_ppn();
+        let data_ppn = VirtAddr::from(&VDSO_DATA_PAGE as *const _ as usize)
+            .floor()
+            .kernel_translate_into_ppn();
+        let page_table = self.page_table();
+        page_table.map(
+            VirtAddr::from(VDSO_BASE).floor().into(),
+            image_ppn.into(),
+            pte_flags!(R, X, U),
+        );
+        page_table.map(
+            VirtAddr::from(VDSO_DATA).floor().into(),
+            data_ppn.into(),
+            pte_flags!(R, U),
+        );
+    }
+
     pub fn lazy_alloc_stack(&mut self, vpn: VirtPageNum) -> SysResult<()> {
         self.stack.map_one(vpn, self.page_table.as_ref_mut())?;
         Arch::tlb_flush();
@@ -705,7 +802,10 @@ impl MemorySet {
     }
 
     pub fn lazy_alloc_brk(&mut self, vpn: VirtPageNum) -> SysResult<()> {
-        self.brk.area.map_one(vpn, self.page_table.as_ref_mut())?;
+        let page_table = self.page_table.as_ref_mut();
+        if !self.brk.area.try_map_huge(vpn, page_table) {
+            self.brk.area.map_one(vpn, page_table)?;
+        }
         Arch::tlb_flush();
         Ok(())
     }
@@ -726,7 +826,8 @@ impl MemorySet {
             trace!("[realloc_cow] refcount is 1, set flags to RW: {new_flags:?}");
             self.page_table().set_flags(vpn, new_flags);
         } else {
-            let frame = frame_alloc().unwrap();
+            // remap_cow overwrites the whole page, don't clear it first
+            let frame = unsafe { frame_alloc_raw().keep_uninited() };
             let new_ppn = frame.ppn();
             let mut target = None;
             for area in self.areas.iter_mut() {
@@ -812,3 +913,11 @@ impl MemorySet {
         SHM_MANAGER.lock().get_nattch(key)
     }
 }
+
+impl Drop for MemorySet {
+    /// the shared file pages written are left dirty in the page cache
+    fn drop(&mut self) {
+        self.mmap_manager
+            .sync_dirty(.., self.page_table.as_ref_mut(), false);
+    }
+}
@@ -1,21 +1,20 @@
-use alloc::{collections::btree_map::BTreeMap, string::String, sync::Arc};
+use alloc::{collections::btree_map::BTreeMap, string::String, sync::Arc, vec::Vec};
+use core::ops::RangeBounds;
 
-use arch::ArchPageTableEntry;
+use arch::{consts::SUPERPAGE, Arch, ArchMemory, ArchPageTableEntry, MappingFlags};
 use include::errno::Errno;
-use kfuture::block::block_on;
 
 use super::{
     address::{VirtAddr, VirtPageNum, VpnRange},
-    frame::FrameTracker,
-    page_table::PageTable,
+    frame::{frame_alloc_some_zero_inited, FrameTracker},
+    page_table::{flags_switch_to_cow, level_pages, PageTable},
 };
 use crate::{
     config::mm::{MMAP_BASE_ADDR, PAGE_SIZE},
-    fs::vfs::basic::file::File,
+    fs::{pagecache::Page, vfs::basic::file::File},
     include::mm::{MmapFlags, MmapProts},
     pte_flags,
     syscall::SysResult,
-    with_interrupt_on,
 };
 
 /// single mmap page struct
@@ -27,9 +26,6 @@ pub struct MmapPage {
     /// mmap flags
     pub flags: MmapFlags,
 
-    /// kernel vpn with validity, indicating whether the page is acutally mapped
-    pub kvpn: Option<VirtPageNum>,
-
     /// mmapped file
     pub file: Option<Arc<dyn File>>,
 
@@ -38,39 +34,6 @@ pub struct MmapPage {
 }
 
 impl MmapPage {
-    /// mmap alloc
-    pub async fn lazy_map_page(&mut self, kvpn: VirtPageNum) -> SysResult<()> {
-        if let Some(file) = self.file.clone() {
-            let buf_slice: &mut [u8] = unsafe {
-                core::slice::from_raw_parts_mut(kvpn.as_va_usize() as *mut u8, PAGE_SIZE)
-            };
-            warn!("mmap read file, offset: {:#x}", self.offset);
-            let res = with_interrupt_on!(block_on(file.read_at(self.offset, buf_slice)));
-            if let Err(res) = res {
-                error!("ERROR at mmap read file, msg: {:?}", res);
-            }
-        }
-        self.kvpn = Some(kvpn);
-        Ok(())
-    }
-    /// msync
-    pub async fn msync(&mut self) -> SysResult<()> {
-        if let Some(file) = self.file.clone()
-            && self.prot.contains(MmapProts::PROT_WRITE)
-        {
-            if let Some(kvpn) = self.kvpn {
-                let buf_slice: &mut [u8] = unsafe {
-                    core::slice::from_raw_parts_mut(kvpn.as_va_usize() as *mut u8, PAGE_SIZE)
-                };
-                warn!("mmap write file, offset: {:#x}", self.offset);
-                let res = with_interrupt_on!(file.write_at(self.offset, buf_slice).await);
-                if let Err(res) = res {
-                    error!("ERROR at mmap write file, msg: {:?}", res);
-                }
-            }
-        }
-        Ok(())
-    }
     pub fn get_maps_string(&self) -> String {
         let mut res = String::new();
         if self.prot.contains(MmapProts::PROT_READ) {
@@ -97,12 +60,6 @@ impl MmapPage {
     }
 }
 
-impl Drop for MmapPage {
-    fn drop(&mut self) {
-        let _ = block_on(self.msync());
-    }
-}
-
 pub struct MmapManager {
     /// base of mmap space
     pub mmap_start: VirtAddr,
@@ -115,6 +72,11 @@ pub struct MmapManager {
 
     /// frame trackers for already allocated mmap pages
     pub frame_trackers: BTreeMap<VirtPageNum, FrameTracker>,
+
+    /// page cache pages mapped by shared file mappings, they are mapped
+    /// clean and their dirty bits are moved to the page cache on msync and
+    /// unmap, see [`Self::sync_dirty`]
+    pub cached_pages: BTreeMap<VirtPageNum, Arc<Page>>,
 }
 
 impl Clone for MmapManager {
@@ -124,6 +86,7 @@ impl Clone for MmapManager {
             mmap_top: self.mmap_top,
             mmap_map: self.mmap_map.clone(),
             frame_trackers: BTreeMap::new(),
+            cached_pages: BTreeMap::new(),
         }
     }
 }
@@ -135,6 +98,7 @@ impl MmapManager {
             mmap_top,
             mmap_map: BTreeMap::new(),
             frame_trackers: BTreeMap::new(),
+            cached_pages: BTreeMap::new(),
         }
     }
 
@@ -171,7 +135,6 @@ impl MmapManager {
             let mmap_page = MmapPage {
                 prot,
                 flags,
-                kvpn: None,
                 file: file.clone(),
                 offset,
             };
@@ -184,26 +147,108 @@ impl MmapManager {
         Ok(start_va.raw())
     }
 
-    /// remove a mmap range in mmap space
-    pub fn remove(&mut self, start_va: VirtAddr, length: usize) -> SysResult<()> {
+    /// remove a mmap range in mmap space and unmap it, the shared pages
+    /// modified are left dirty in the page cache
+    ///
+    /// the frames are only released once the tlb is flushed, a page cache
+    /// frame the user could still reach must not look unmapped to reclaim
+    pub fn remove(
+        &mut self,
+        start_va: VirtAddr,
+        length: usize,
+        page_table: &mut PageTable,
+    ) -> SysResult<()> {
         let end_va = VirtAddr::from(start_va.raw() + length);
         debug!(
             "[mmap] remove range: {:#x} - {:#x}",
             start_va.raw(),
             end_va.raw()
         );
-        for vpn in VpnRange::new_from_va(start_va, end_va)? {
+        let range = VpnRange::new_from_va(start_va, end_va)?;
+        self.sync_dirty(range.start()..range.end(), page_table, false);
+        let mut released = Vec::new();
+        for vpn in range {
+            page_table.unmap(vpn);
             self.mmap_map.remove(&vpn);
-            self.frame_trackers.remove(&vpn);
+            released.push((
+                self.frame_trackers.remove(&vpn),
+                self.cached_pages.remove(&vpn),
+            ));
         }
+        Arch::tlb_flush();
+        drop(released);
         Ok(())
     }
 
+    /// mark the page cache pages of the shared mappings in `range` dirty if
+    /// their ptes are, so only what was written goes back to the file, the
+    /// ptes are cleaned for the next round if `clean`, returns whether any
+    /// was cleaned and the tlb needs a flush
+    pub fn sync_dirty(
+        &self,
+        range: impl RangeBounds<VirtPageNum>,
+        page_table: &mut PageTable,
+        clean: bool,
+    ) -> bool {
+        let mut cleaned = false;
+        for (&vpn, page) in self.cached_pages.range(range) {
+            if page_table.test_dirty(vpn, clean) {
+                page.mark_dirty();
+                cleaned |= clean;
+            }
+        }
+        cleaned
+    }
+
     /// is a va in mmap space
     pub fn is_in_space(&self, vpn: VirtPageNum) -> bool {
         self.mmap_map.contains_key(&vpn)
     }
 
+    /// map the 2 MiB block around `vpn` as one transparent huge page, only
+    /// if the whole block is anonymous mmap space with the same prot and
+    /// flags and nothing inside is allocated yet, returns whether it's mapped
+    pub fn try_map_huge(&mut self, vpn: VirtPageNum, page_table: &mut PageTable) -> bool {
+        if !SUPERPAGE {
+            return false;
+        }
+        let pages = level_pages(1);
+        let start = VirtPageNum::from(vpn.raw() & !(pages - 1));
+        let end = VirtPageNum::from(start.raw() + pages);
+        if self.frame_trackers.range(start..end).next().is_some() {
+            return false;
+        }
+        let Some(first) = self.mmap_map.get(&start) else {
+            return false;
+        };
+        let (prot, flags) = (first.prot, first.flags);
+        let mut count = 0;
+        for (_, page) in self.mmap_map.range(start..end) {
+            if page.file.is_some()
+                || page.prot.bits() != prot.bits()
+                || page.flags.bits() != flags.bits()
+            {
+                return false;
+            }
+            count += 1;
+        }
+        if count != pages {
+            return false;
+        }
+        let Some(frames) = frame_alloc_some_zero_inited(pages) else {
+            return false;
+        };
+        let pte_flags = MappingFlags::from(prot) | MappingFlags::U;
+        if !page_table.try_map_huge(start, frames[0].ppn(), 1, pte_flags) {
+            return false;
+        }
+        for (i, frame) in frames.into_iter().enumerate() {
+            self.frame_trackers
+                .insert(VirtPageNum::from(start.raw() + i), frame);
+        }
+        true
+    }
+
     /// mprotect
     pub fn mprotect(
         &mut self,
@@ -215,9 +260,26 @@ impl MmapManager {
         let old_prot = page.prot;
         let new_prot = old_prot | add_prot;
         if self.frame_trackers.contains_key(&vpn) {
-            if let Some(pte) = page_table.find_pte(vpn) {
-                let flags = pte_flags!(U) | new_prot.into();
-                pte.set_flags(flags);
+            if let Some(old_flags) = page_table.find_pte(vpn).map(|pte| pte.flags()) {
+                let mut flags = old_flags | pte_flags!(U) | new_prot.into();
+                // a private file page mapped without write is still the page
+                // cache frame, it's copied on the first write
+                if page.file.is_some()
+                    && !page.flags.contains(MmapFlags::MAP_SHARED)
+                    && !old_flags.contains(MappingFlags::W)
+                    && flags.contains(MappingFlags::W)
+                {
+                    flags = flags_switch_to_cow(&(flags | pte_flags!(V, A, D)));
+                }
+                // the dirty bit of a shared page is moved to the page cache,
+                // so the next write marks it again
+                if let Some(cached) = self.cached_pages.get(&vpn) {
+                    if page_table.test_dirty(vpn, false) {
+                        cached.mark_dirty();
+                    }
+                    flags -= MappingFlags::D;
+                }
+                page_table.set_flags(vpn, flags);
             } else {
                 warn!(
                     "[mprotect] not in table, vpn: {:#x}, old_prot: {:?}, add_prot: {:?}",
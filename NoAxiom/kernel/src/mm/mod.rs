@@ -8,6 +8,7 @@ pub mod permission;
 pub mod shm;
 pub mod user_ptr;
 pub mod validate;
+pub mod zram;
 
 pub use memory::*;
 use memory::{frame::global_frame_init, utils::kernel_va_to_pa};
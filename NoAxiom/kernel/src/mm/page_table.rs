@@ -1,16 +1,24 @@
 //! page table under sv39
 
-use alloc::vec::Vec;
+use alloc::{collections::btree_set::BTreeSet, vec::Vec};
 
 use arch::{
-    consts::INDEX_LEVELS, Arch, ArchMemory, ArchPageTableEntry, MappingFlags, PageTableEntry,
+    consts::{INDEX_LEVELS, SUPERPAGE},
+    Arch, ArchMemory, ArchPageTableEntry, MappingFlags, PageTableEntry,
 };
 
 use super::{
     address::{PhysAddr, PhysPageNum, VirtAddr, VirtPageNum},
-    frame::{frame_alloc, FrameTracker},
+    frame::{frame_alloc, frame_refcount, FrameTracker},
 };
-use crate::pte_flags;
+use crate::{config::mm::PAGE_NUM_WIDTH, pte_flags};
+
+/// pages covered by a leaf at `level`, level 0 being the last level,
+/// so level 1 is a 2 MiB and level 2 a 1 GiB superpage under sv39
+#[inline(always)]
+pub const fn level_pages(level: usize) -> usize {
+    1 << (PAGE_NUM_WIDTH * level)
+}
 
 #[derive(Debug)]
 enum PageTableRoot {
@@ -88,13 +96,19 @@ impl PageTable {
 
     /// insert new pte into the page table trie
     fn create_pte(&mut self, vpn: VirtPageNum) -> &mut PageTableEntry {
+        self.create_pte_at(vpn, 0)
+    }
+
+    /// insert new pte at `level` into the page table trie,
+    /// superpages met on the way are split
+    fn create_pte_at(&mut self, vpn: VirtPageNum, level: usize) -> &mut PageTableEntry {
         let index = vpn.get_index();
         let mut ppn = self.root_ppn();
         let mut result: Option<&mut PageTableEntry> = None;
         for (i, idx) in index.iter().enumerate() {
             let arr = ppn.get_pte_array();
             let pte = &mut arr[*idx];
-            if i == INDEX_LEVELS - 1 {
+            if i == INDEX_LEVELS - 1 - level {
                 result = Some(pte);
                 break;
             }
@@ -103,12 +117,168 @@ impl PageTable {
                 let frame = frame_alloc().unwrap();
                 *pte = PageTableEntry::new(frame.ppn().raw(), pte_flags!(PT));
                 self.frames.push(frame);
+            } else if SUPERPAGE && pte.is_huge() {
+                self.split_pte(pte, INDEX_LEVELS - 1 - i);
+            }
+            if i == INDEX_LEVELS - 2 {
+                self.unshare_table(pte);
             }
             ppn = PhysPageNum::from(pte.ppn());
         }
         result.unwrap()
     }
 
+    /// give this page table a private copy of the leaf table `pte` points
+    /// to if it's still shared with another one since fork
+    fn unshare_table(&mut self, pte: &mut PageTableEntry) {
+        let old_ppn = PhysPageNum::from(pte.ppn());
+        if frame_refcount(old_ppn) <= 1 {
+            return;
+        }
+        let frame = frame_alloc().unwrap();
+        frame
+            .ppn()
+            .get_bytes_array()
+            .copy_from_slice(old_ppn.get_bytes_array());
+        *pte = PageTableEntry::new(frame.ppn().raw(), pte_flags!(PT));
+        let pos = self.frames.iter().position(|f| f.ppn() == old_ppn).unwrap();
+        self.frames[pos] = frame;
+    }
+
+    /// make the leaf table holding vpn private before writing its entry
+    fn unshare_leaf(&mut self, vpn: VirtPageNum) {
+        let index = vpn.get_index();
+        let mut ppn = self.root_ppn();
+        for (i, idx) in index.iter().take(INDEX_LEVELS - 1).enumerate() {
+            let pte = &mut ppn.get_pte_array()[*idx];
+            if !pte.is_allocated() || (SUPERPAGE && pte.is_huge()) {
+                return;
+            }
+            if i == INDEX_LEVELS - 2 {
+                self.unshare_table(pte);
+                return;
+            }
+            ppn = PhysPageNum::from(pte.ppn());
+        }
+    }
+
+    /// set up `child` for fork by sharing the leaf tables of the user part,
+    /// writable pages are marked copy-on-write in place unless `shared`
+    /// says they stay writable in both, the tables themselves are copied
+    /// lazily by whichever side writes an entry first
+    pub fn fork_into(&mut self, child: &mut PageTable, shared: impl Fn(VirtPageNum) -> bool) {
+        let mut leaves = BTreeSet::new();
+        self.fork_dir(
+            child,
+            self.root_ppn(),
+            child.root_ppn(),
+            INDEX_LEVELS - 1,
+            0,
+            &shared,
+            &mut leaves,
+        );
+        for frame in self.frames.iter() {
+            if leaves.contains(&frame.ppn().raw()) {
+                child.frames.push(frame.clone());
+            }
+        }
+    }
+
+    fn fork_dir(
+        &mut self,
+        child: &mut PageTable,
+        dir: PhysPageNum,
+        child_dir: PhysPageNum,
+        level: usize,
+        base: usize,
+        shared: &impl Fn(VirtPageNum) -> bool,
+        leaves: &mut BTreeSet<usize>,
+    ) {
+        let child_ptes = child_dir.get_pte_array();
+        for (idx, pte) in dir.get_pte_array().iter_mut().enumerate() {
+            // entries the child already has are the shared kernel part
+            if !pte.is_allocated() || child_ptes[idx].is_allocated() {
+                continue;
+            }
+            let vpn = base + (idx << (PAGE_NUM_WIDTH * level));
+            if SUPERPAGE && pte.is_huge() {
+                self.split_pte(pte, level);
+            }
+            if level == 1 {
+                protect_leaf_table(PhysPageNum::from(pte.ppn()), vpn, shared);
+                child_ptes[idx] = pte.clone();
+                leaves.insert(pte.ppn());
+            } else {
+                let frame = frame_alloc().unwrap();
+                child_ptes[idx] = PageTableEntry::new(frame.ppn().raw(), pte_flags!(PT));
+                let next = frame.ppn();
+                child.frames.push(frame);
+                self.fork_dir(
+                    child,
+                    PhysPageNum::from(pte.ppn()),
+                    next,
+                    level - 1,
+                    vpn,
+                    shared,
+                    leaves,
+                );
+            }
+        }
+    }
+
+    /// replace the superpage leaf `pte` at `level` with a table of leaves
+    /// one level down mapping the same frames with the same flags
+    fn split_pte(&mut self, pte: &mut PageTableEntry, level: usize) {
+        let frame = frame_alloc().unwrap();
+        let flags = pte.flags();
+        let step = level_pages(level - 1);
+        for (i, child) in frame.ppn().get_pte_array().iter_mut().enumerate() {
+            *child = PageTableEntry::new(pte.ppn() + i * step, flags);
+        }
+        *pte = PageTableEntry::new(frame.ppn().raw(), pte_flags!(PT));
+        self.frames.push(frame);
+    }
+
+    /// split any superpage covering vpn down to 4 KiB leaves,
+    /// must be called on the page table owning the directory frames
+    pub fn split_huge(&mut self, vpn: VirtPageNum) {
+        if !SUPERPAGE {
+            return;
+        }
+        let index = vpn.get_index();
+        let mut ppn = self.root_ppn();
+        for (i, idx) in index.iter().take(INDEX_LEVELS - 1).enumerate() {
+            let pte = &mut ppn.get_pte_array()[*idx];
+            if !pte.is_allocated() {
+                return;
+            }
+            if pte.is_huge() {
+                self.split_pte(pte, INDEX_LEVELS - 1 - i);
+            }
+            ppn = PhysPageNum::from(pte.ppn());
+        }
+    }
+
+    /// map a superpage vpn -> ppn at `level`, both aligned to it,
+    /// returns false if anything is already mapped in the range
+    pub fn try_map_huge(
+        &mut self,
+        vpn: VirtPageNum,
+        ppn: PhysPageNum,
+        level: usize,
+        flags: MappingFlags,
+    ) -> bool {
+        let pages = level_pages(level);
+        assert!(SUPERPAGE && level > 0 && level < INDEX_LEVELS);
+        assert!(vpn.raw() % pages == 0 && ppn.raw() % pages == 0);
+        let pte = self.create_pte_at(vpn, level);
+        if pte.is_allocated() {
+            return false;
+        }
+        *pte = PageTableEntry::new(ppn.raw(), flags | pte_flags!(V, D, A));
+        true
+    }
+
     /// try to find pte, returns None at failure
     #[inline(always)]
     pub fn find_pte(&self, vpn: VirtPageNum) -> Option<&mut PageTableEntry> {
@@ -148,6 +318,34 @@ impl PageTable {
         *pte = PageTableEntry::new(ppn.raw(), flags | pte_flags!(V, D, A));
     }
 
+    /// map a page clean, the first store to it sets the dirty bit, by the
+    /// hardware or in the store fault, see [`Self::test_dirty`]
+    pub fn map_clean(&mut self, vpn: VirtPageNum, ppn: PhysPageNum, flags: MappingFlags) {
+        let pte = self.create_pte(vpn);
+        assert!(
+            !pte.is_allocated(),
+            "{:#x?} is mapped before mapping, flags: {:?}, ppn: {:#x}",
+            vpn,
+            pte.flags(),
+            pte.ppn()
+        );
+        *pte = PageTableEntry::new(ppn.raw(), flags | pte_flags!(V, A));
+    }
+
+    /// whether the page at `vpn` was written since it was mapped or last
+    /// cleaned, the dirty bit is cleared if `clean`, the tlb is left to the
+    /// caller
+    pub fn test_dirty(&mut self, vpn: VirtPageNum, clean: bool) -> bool {
+        let Some(flags) = self.find_pte(vpn).map(|pte| pte.flags()) else {
+            return false;
+        };
+        let dirty = flags.contains(MappingFlags::D);
+        if dirty && clean {
+            self.set_flags(vpn, flags - MappingFlags::D);
+        }
+        dirty
+    }
+
     /// map unchecked
     #[allow(unused)]
     pub fn map_unchecked(&mut self, vpn: VirtPageNum, ppn: PhysPageNum, flags: MappingFlags) {
@@ -155,9 +353,11 @@ impl PageTable {
         *pte = PageTableEntry::new(ppn.raw(), flags | pte_flags!(V, D, A));
     }
 
-    /// unmap a vpn
+    /// unmap a vpn, a superpage covering it is split first
     pub fn unmap(&mut self, vpn: VirtPageNum) {
         // warn!("unmap vpn: {:#x}", vpn.0);
+        self.split_huge(vpn);
+        self.unshare_leaf(vpn);
         if let Some(pte) = self.find_pte(vpn) {
             pte.reset();
         }
@@ -167,17 +367,20 @@ impl PageTable {
     /// returns None if nothing is mapped
     pub fn translate_va(&self, va: VirtAddr) -> Option<PhysAddr> {
         let vpn = va.clone().floor();
-        let res = self.find_pte(vpn);
-        res.map(|pte| {
-            let aligned_pa: PhysAddr = pte.ppn().into();
+        let res = translate_vpn_into_leaf(self.root_ppn(), vpn);
+        res.map(|(pte, level)| {
+            let ppn = pte.ppn() + (vpn.raw() & (level_pages(level) - 1));
+            let aligned_pa: PhysAddr = PhysPageNum::from(ppn).into();
             let offset = va.offset();
             let aligned_pa_usize: usize = aligned_pa.into();
             (aligned_pa_usize + offset).into()
         })
     }
 
-    /// set flags for a vpn
+    /// set flags for a vpn, a superpage covering it is split first
     pub fn set_flags(&mut self, vpn: VirtPageNum, flags: MappingFlags) {
+        self.split_huge(vpn);
+        self.unshare_leaf(vpn);
         self.find_pte(vpn).unwrap().set_flags(flags);
     }
 
@@ -203,6 +406,19 @@ impl PageTable {
     }
 }
 
+/// mark the private writable entries of a leaf table copy-on-write
+fn protect_leaf_table(table: PhysPageNum, base: usize, shared: &impl Fn(VirtPageNum) -> bool) {
+    for (i, pte) in table.get_pte_array().iter_mut().enumerate() {
+        if !pte.is_allocated() {
+            continue;
+        }
+        let flags = pte.flags();
+        if flags.contains(MappingFlags::W) && !shared(VirtPageNum::from(base + i)) {
+            pte.set_flags(flags_switch_to_cow(&flags));
+        }
+    }
+}
+
 // pub fn memory_activate_by_ppn(root_ppn: usize) {
 //     Arch::activate(root_ppn);
 //     Arch::tlb_flush();
@@ -210,26 +426,32 @@ impl PageTable {
 
 /// translate the vpn into PTE entry (sv39)
 /// it won't use memory_set to translate the vpn
-/// note that this is read only
+/// note that this is read only, and a superpage leaf is returned as is
 pub fn translate_vpn_into_pte<'a>(
     root_ppn: PhysPageNum,
     vpn: VirtPageNum,
 ) -> Option<&'a mut PageTableEntry> {
+    translate_vpn_into_leaf(root_ppn, vpn).map(|(pte, _)| pte)
+}
+
+/// translate the vpn into its leaf PTE entry and the level of the leaf
+pub fn translate_vpn_into_leaf<'a>(
+    root_ppn: PhysPageNum,
+    vpn: VirtPageNum,
+) -> Option<(&'a mut PageTableEntry, usize)> {
     let index = vpn.get_index();
     let mut ppn = root_ppn;
-    let mut result: Option<&mut PageTableEntry> = None;
     for (i, idx) in index.iter().enumerate() {
         let pte = &mut ppn.get_pte_array()[*idx];
         if !pte.is_allocated() {
             return None;
         }
-        if i == INDEX_LEVELS - 1 {
-            result = Some(pte);
-            break;
+        if i == INDEX_LEVELS - 1 || (SUPERPAGE && pte.is_huge()) {
+            return Some((pte, INDEX_LEVELS - 1 - i));
         }
         ppn = pte.ppn().into();
     }
-    result
+    None
 }
 
 #[allow(unused)]
@@ -10,15 +10,85 @@ use include::errno::Errno;
 use ksync::mutex::check_no_lock;
 use memory::address::PhysAddr;
 
-use super::{address::VirtAddr, page_table::PageTable, validate::validate};
+use super::{
+    address::{VirtAddr, VirtPageNum},
+    page_table::PageTable,
+};
 use crate::{
-    cpu::current_task,
+    cpu::current_user_task,
     mm::address::VpnRange,
     return_errno,
     sched::utils::block_on,
     syscall::{utils::current_syscall, SysResult},
 };
 
+/// max bytes copied with interrupts off between two checks
+const USER_COPY_CHUNK: usize = 16 * PAGE_SIZE;
+
+/// handle a page fault the kernel took at user `addr`
+async fn fix_user_fault(addr: usize, pf: PageFaultType) -> SysResult<()> {
+    let task = current_user_task().unwrap();
+    if check_no_lock() {
+        task.memory_validate(addr, pf, false).await
+    } else {
+        warn!(
+            "[user_fault] block on addr {:#x} during syscall {:?}",
+            addr,
+            current_syscall()
+        );
+        block_on(task.memory_validate(addr, pf, true))
+    }
+}
+
+/// whether a user store to `vpn` goes through without a fault, i.e. no
+/// lazy, copy-on-write or clean page is behind it
+fn is_user_writable(vpn: VirtPageNum) -> bool {
+    PageTable::from_ppn(Arch::current_root_ppn())
+        .find_pte(vpn)
+        .is_some_and(|pte| {
+            let flags = pte.flags();
+            flags.contains(MappingFlags::V | MappingFlags::U | MappingFlags::W | MappingFlags::D)
+                && !flags.contains(MappingFlags::COW)
+        })
+}
+
+/// copy `len` bytes from `src` to `dst`, one of them in user space, no page
+/// is walked beforehand: a fault is fixed up and the copy goes on from the
+/// faulting address
+async fn copy_user(dst: usize, src: usize, len: usize) -> SysResult<()> {
+    let mut done = 0;
+    while done < len {
+        let chunk = (len - done).min(USER_COPY_CHUNK);
+        match Arch::copy_user(dst + done, src + done, chunk) {
+            Ok(()) => done += chunk,
+            Err(TrapType::Exception(ExceptionType::PageFault(
+                pf @ (PageFaultType::LoadPageFault(addr) | PageFaultType::StorePageFault(addr)),
+            ))) => {
+                done = if (src..src + len).contains(&addr) {
+                    addr - src
+                } else if (dst..dst + len).contains(&addr) {
+                    addr - dst
+                } else {
+                    return_errno!(
+                        Errno::EFAULT,
+                        "[copy_user] fault at {:#x} out of range",
+                        addr
+                    );
+                };
+                fix_user_fault(addr, pf).await?;
+            }
+            Err(trap_type) => {
+                return_errno!(
+                    Errno::EFAULT,
+                    "[copy_user] trigger unexpected trap, trap_type: {:?}",
+                    trap_type
+                );
+            }
+        }
+    }
+    Ok(())
+}
+
 /// the UserPtr is a wrapper for user-space pointer
 /// NOTE THAT: it will NOT validate the pointer
 /// and will probably trigger pagefault when accessing userspace
@@ -141,18 +211,7 @@ impl<T> UserPtr<T> {
                                 self.addr(),
                                 current_syscall()
                             );
-                            let task = current_task().unwrap();
-                            if check_no_lock() {
-                                task.memory_validate(addr, pf, false).await?;
-                            } else {
-                                warn!(
-                                    "[read] block on addr {:#x} during syscall {:?}",
-                                    self.addr(),
-                                    current_syscall()
-                                );
-                                block_on(task.memory_validate(addr, pf, true))?;
-                            }
-                            return Ok(());
+                            return fix_user_fault(addr, pf).await;
                         }
                         _ => {}
                     },
@@ -216,18 +275,7 @@ impl<T> UserPtr<T> {
                                 self.addr(),
                                 current_syscall()
                             );
-                            let task = current_task().unwrap();
-                            if check_no_lock() {
-                                task.memory_validate(addr, pf, false).await?;
-                            } else {
-                                warn!(
-                                    "[write] block on addr {:#x} during syscall {:?}",
-                                    self.addr(),
-                                    current_syscall()
-                                );
-                                block_on(task.memory_validate(addr, pf, true))?;
-                            }
-                            return Ok(());
+                            return fix_user_fault(addr, pf).await;
                         }
                         _ => {}
                     },
@@ -257,6 +305,55 @@ impl<T> UserPtr<T> {
         }
     }
 
+    /// copy `buf.len()` values from user space
+    pub async fn read_slice(&self, buf: &mut [T]) -> SysResult<()>
+    where
+        T: Copy,
+    {
+        let len = core::mem::size_of_val(buf);
+        if len == 0 {
+            return Ok(());
+        }
+        if self.is_null() {
+            return Err(Errno::EFAULT);
+        }
+        copy_user(buf.as_mut_ptr() as usize, self.addr(), len).await
+    }
+
+    /// read `len` values from user space, e.g. a whole iovec array at once
+    pub async fn read_vec(&self, len: usize) -> SysResult<Vec<T>>
+    where
+        T: Copy,
+    {
+        let mut res = Vec::with_capacity(len);
+        if len == 0 {
+            return Ok(res);
+        }
+        if self.is_null() {
+            return Err(Errno::EFAULT);
+        }
+        let size = len * core::mem::size_of::<T>();
+        copy_user(res.as_mut_ptr() as usize, self.addr(), size).await?;
+        // every byte has been copied
+        unsafe { res.set_len(len) };
+        Ok(res)
+    }
+
+    /// copy `buf` to user space
+    pub async fn write_slice(&self, buf: &[T]) -> SysResult<()>
+    where
+        T: Copy,
+    {
+        let len = core::mem::size_of_val(buf);
+        if len == 0 {
+            return Ok(());
+        }
+        if self.is_null() {
+            return Err(Errno::EFAULT);
+        }
+        copy_user(self.addr(), buf.as_ptr() as usize, len).await
+    }
+
     /// get user slice until the checker returns true
     pub fn clone_as_vec_until(&self, checker: impl Fn(&T) -> bool) -> SysResult<Vec<T>>
     where
@@ -334,7 +431,7 @@ impl<T> UserPtr<T> {
                 self.addr(),
                 current_syscall()
             );
-            let task = current_task().unwrap();
+            let task = current_user_task().unwrap();
             if check_no_lock() {
                 task.memory_validate(self.addr(), pf, false).await?;
             } else {
@@ -360,27 +457,36 @@ impl UserPtr<u8> {
         Ok(res)
     }
 
-    /// convert ptr into an slice
+    /// borrow the user buffer in place, for large buffers handed straight
+    /// to a file, every page is checked once and only a faulting page is
+    /// validated: a read is probed with a load, a write is checked in the
+    /// page table, since storing a probed byte back could undo a concurrent
+    /// write of another thread
     async fn as_slice_checked_raw<'a>(&self, len: usize, is_write: bool) -> SysResult<&mut [u8]> {
-        let page_table = PageTable::from_ppn(Arch::current_root_ppn());
-        let memory_set = current_task().unwrap().memory_set();
         let range = VpnRange::new_from_va(
             VirtAddr::from(self.addr()),
             VirtAddr::from(self.addr() + len),
         )?;
         for vpn in range {
-            let pte = page_table.find_pte(vpn);
-            let should_validate = if pte.is_none() {
-                true
-            } else {
-                is_write && !pte.unwrap().flags().contains(MappingFlags::W)
-            };
-            if should_validate {
-                let trap_type = match is_write {
-                    true => PageFaultType::StorePageFault(vpn.as_va_usize()),
-                    false => PageFaultType::LoadPageFault(vpn.as_va_usize()),
-                };
-                validate(memory_set, vpn, trap_type, None).await?;
+            let addr = vpn.as_va_usize().max(self.addr());
+            if is_write {
+                if !is_user_writable(vpn) {
+                    fix_user_fault(addr, PageFaultType::StorePageFault(addr)).await?;
+                }
+                continue;
+            }
+            match Arch::check_read(addr) {
+                Ok(()) => {}
+                Err(TrapType::Exception(ExceptionType::PageFault(
+                    pf @ (PageFaultType::LoadPageFault(addr) | PageFaultType::StorePageFault(addr)),
+                ))) => fix_user_fault(addr, pf).await?,
+                Err(trap_type) => {
+                    return_errno!(
+                        Errno::EFAULT,
+                        "[user_ptr] trigger unexpected trap in borrow, trap_type: {:?}",
+                        trap_type
+                    );
+                }
             }
         }
         Ok(unsafe { core::slice::from_raw_parts_mut(self.ptr(), len) })
@@ -7,10 +7,17 @@ use arch::{
 use ksync::mutex::SpinLock;
 use memory::{address::VirtAddr, frame::frame_alloc};
 
-use super::{address::VirtPageNum, memory_set::MemorySet};
+use super::{
+    address::VirtPageNum, map_area::MapAreaFilePage, memory_set::MemorySet, mmap_manager::MmapPage,
+};
 use crate::{
-    cpu::current_task, include::result::Errno, mm::page_table::PageTable, sched::utils::yield_now,
-    syscall::SysResult, task::Task,
+    cpu::current_user_task,
+    include::{mm::MmapFlags, result::Errno},
+    mm::page_table::PageTable,
+    sched::utils::yield_now,
+    syscall::SysResult,
+    task::Task,
+    with_interrupt_on,
 };
 
 /// # memory validate
@@ -40,6 +47,17 @@ pub async fn validate(
             trace!("[validate] realloc COW, vpn={:#x}", vpn.raw());
             memory_set.lock().realloc_cow(vpn, pte)?;
             Ok(())
+        } else if matches!(pf, PageFaultType::StorePageFault(_))
+            && flags.contains(MappingFlags::W)
+            && !flags.contains(MappingFlags::D)
+        {
+            // the first store to a page mapped clean, on harts that don't
+            // set the dirty bit themselves
+            trace!("[validate] set dirty, vpn={:#x}", vpn.raw());
+            let _ms = memory_set.lock();
+            pte.set_flags(flags | MappingFlags::D);
+            Arch::tlb_flush();
+            Ok(())
         } else {
             if flag_match_with_trap_type(flags, pf) {
                 error!(
@@ -53,7 +71,7 @@ pub async fn validate(
                 error!(
                     "[validate] store at invalid area, flags: {:?}, tid: {}",
                     flags,
-                    current_task().unwrap().tid(),
+                    current_user_task().unwrap().tid(),
                 );
                 Err(Errno::EFAULT)
             } else {
@@ -69,8 +87,37 @@ pub async fn validate(
         }
     } else {
         let mut ms = memory_set.lock();
-        if ms.stack.vpn_range.is_in_range(vpn) {
-            let task = current_task().unwrap();
+        if let Some((file_page, flags)) = ms
+            .find_area(vpn)
+            .and_then(|area| Some((area.file_page(vpn)?, area.map_permission.into())))
+        {
+            if !flag_match_with_trap_type(flags, pf) {
+                error!(
+                    "[validate] file-backed prot mismatch, vpn: {:#x}, flags: {:?}, trap_type: {:?}",
+                    vpn.raw(),
+                    flags,
+                    pf
+                );
+                return Err(Errno::EFAULT);
+            }
+            trace!(
+                "[validate] file-backed, tid: {}, vpn: {:#x}, offset: {:#x}, shared: {}",
+                current_user_task().unwrap().tid(),
+                vpn.raw(),
+                file_page.offset,
+                file_page.shared,
+            );
+            drop(ms);
+            demand_page(memory_set, vpn, flags, file_page).await
+        } else if ms.is_swapped(vpn) {
+            trace!(
+                "[validate] swapped, tid: {}, vpn: {:#x}",
+                current_user_task().unwrap().tid(),
+                vpn.raw(),
+            );
+            ms.swap_in(vpn)
+        } else if ms.stack.vpn_range.is_in_range(vpn) {
+            let task = current_user_task().unwrap();
             trace!(
                 "[validate] stack, tid: {}, vpn: {:#x?}, epc: {:#x}",
                 task.tid(),
@@ -82,22 +129,22 @@ pub async fn validate(
         } else if ms.brk.area.vpn_range.is_in_range(vpn) {
             trace!(
                 "[validate] brk, tid: {}, vpn: {:x?}, epc: {:#x}",
-                current_task().unwrap().tid(),
+                current_user_task().unwrap().tid(),
                 vpn.raw(),
-                current_task().unwrap().trap_context()[arch::TrapArgs::EPC],
+                current_user_task().unwrap().trap_context()[arch::TrapArgs::EPC],
             );
             ms.lazy_alloc_brk(vpn)?;
             Ok(())
         } else if ms.mmap_manager.is_in_space(vpn) {
             trace!(
                 "[validate] mmap, tid: {}, vpn: {:x?}, epc: {:#x}",
-                current_task().unwrap().tid(),
+                current_user_task().unwrap().tid(),
                 vpn.raw(),
-                current_task().unwrap().trap_context()[arch::TrapArgs::EPC],
+                current_user_task().unwrap().trap_context()[arch::TrapArgs::EPC],
             );
             // lazy alloc mmap
             if !ms.mmap_manager.frame_trackers.contains_key(&vpn) {
-                let mut mmap_page = ms.mmap_manager.mmap_map.get(&vpn).cloned().unwrap();
+                let mmap_page = ms.mmap_manager.mmap_map.get(&vpn).cloned().unwrap();
                 let pte_flags: MappingFlags = MappingFlags::from(mmap_page.prot) | MappingFlags::U;
                 if !flag_match_with_trap_type(pte_flags, pf) {
                     error!(
@@ -108,23 +155,31 @@ pub async fn validate(
                     );
                     return Err(Errno::EFAULT);
                 }
+                let page_table = unsafe { &mut *ms.page_table.get() };
+                if ms.mmap_manager.try_map_huge(vpn, page_table) {
+                    Arch::tlb_flush();
+                    return Ok(());
+                }
+
+                if let Some(frame) = mmap_page
+                    .file
+                    .as_ref()
+                    .and_then(|file| file.mmap_frame(mmap_page.offset))
+                {
+                    page_table.map(vpn, frame.ppn(), pte_flags);
+                    ms.mmap_manager.frame_trackers.insert(vpn, frame);
+                    Arch::tlb_flush();
+                    return Ok(());
+                }
 
-                let frame = frame_alloc().unwrap();
-                let ppn = frame.ppn();
-                let kvpn = frame.kernel_vpn();
+                if mmap_page.file.is_some() {
+                    drop(ms);
+                    return mmap_file_page(memory_set, vpn, pte_flags, mmap_page).await;
+                }
+                let frame = frame_alloc().ok_or(Errno::ENOMEM)?;
+                page_table.map(vpn, frame.ppn(), pte_flags);
                 ms.mmap_manager.frame_trackers.insert(vpn, frame);
-                drop(ms);
-                mmap_page.lazy_map_page(kvpn).await?;
-                let ms = memory_set.lock();
-                ms.page_table().map(vpn, ppn, pte_flags);
-                info!(
-                    "mmap done! vpn: {:#x}, ppn: {:#x}, pte: {:?}",
-                    vpn.raw(),
-                    ppn.raw(),
-                    pte_flags
-                );
                 Arch::tlb_flush();
-                drop(ms);
             } else {
                 // todo: use suspend
                 warn!(
@@ -146,6 +201,111 @@ pub async fn validate(
     }
 }
 
+/// fault in a page of a file-backed area, see
+/// [`super::map_area::MapArea::file_page`]
+async fn demand_page(
+    memory_set: &Arc<SpinLock<MemorySet>>,
+    vpn: VirtPageNum,
+    flags: MappingFlags,
+    file_page: MapAreaFilePage,
+) -> SysResult<()> {
+    let page = match file_page.len {
+        0 => None,
+        _ => Some(with_interrupt_on!(
+            file_page.file.get_cached_page(file_page.offset, 1).await
+        )?),
+    };
+    let frame = match &page {
+        Some(page) if file_page.shared => page.frame().clone(),
+        _ => {
+            let frame = frame_alloc().ok_or(Errno::ENOMEM)?;
+            if let Some(page) = &page {
+                frame.ppn().get_bytes_array()[..file_page.len]
+                    .copy_from_slice(&page.as_mut_bytes_array()[..file_page.len]);
+            }
+            frame
+        }
+    };
+
+    // the lock is dropped during the io, so the area may have changed
+    let mut ms = memory_set.lock();
+    let ms = &mut *ms;
+    let Some(area) = ms
+        .areas
+        .iter_mut()
+        .find(|area| area.vpn_range.is_in_range(vpn) && area.file_info.is_some())
+    else {
+        error!("[validate] file-backed area gone, vpn: {:#x}", vpn.raw());
+        return Err(Errno::EFAULT);
+    };
+    // another thread faulted it in first
+    if area.frame_map.contains_key(&vpn) {
+        Arch::tlb_flush();
+        return Ok(());
+    }
+    ms.page_table.as_ref_mut().map(vpn, frame.ppn(), flags);
+    area.frame_map.insert(vpn, frame);
+    Arch::tlb_flush();
+    Ok(())
+}
+
+/// fault in a page of a file mmap, shared mappings and read-only private
+/// ones map the page cache page itself, a writable private mapping gets a
+/// copy of it
+async fn mmap_file_page(
+    memory_set: &Arc<SpinLock<MemorySet>>,
+    vpn: VirtPageNum,
+    flags: MappingFlags,
+    mmap_page: MmapPage,
+) -> SysResult<()> {
+    let file = mmap_page.file.as_ref().unwrap();
+    let shared = mmap_page.flags.contains(MmapFlags::MAP_SHARED);
+    // nothing is cached past the end of file, such a page reads as zeros
+    let page = match mmap_page.offset < file.size() {
+        true => Some(with_interrupt_on!(
+            file.get_cached_page(mmap_page.offset, 1).await
+        )?),
+        false => None,
+    };
+    let frame = match &page {
+        Some(page) if shared || !flags.contains(MappingFlags::W) => page.frame().clone(),
+        _ => {
+            let frame = frame_alloc().ok_or(Errno::ENOMEM)?;
+            if let Some(page) = &page {
+                frame
+                    .ppn()
+                    .get_bytes_array()
+                    .copy_from_slice(page.as_mut_bytes_array());
+            }
+            frame
+        }
+    };
+
+    // the lock is dropped during the io, so the range may have changed
+    let mut ms = memory_set.lock();
+    let ms = &mut *ms;
+    if !ms.mmap_manager.is_in_space(vpn) {
+        error!("[validate] mmap page gone, vpn: {:#x}", vpn.raw());
+        return Err(Errno::EFAULT);
+    }
+    // another thread faulted it in first
+    if ms.mmap_manager.frame_trackers.contains_key(&vpn) {
+        Arch::tlb_flush();
+        return Ok(());
+    }
+    let page_table = ms.page_table.as_ref_mut();
+    match page {
+        Some(page) if shared => {
+            page_table.map_clean(vpn, frame.ppn(), flags);
+            ms.mmap_manager.cached_pages.insert(vpn, page);
+        }
+        _ => page_table.map(vpn, frame.ppn(), flags),
+    }
+    ms.mmap_manager.frame_trackers.insert(vpn, frame);
+    Arch::tlb_flush();
+    Ok(())
+}
+
 impl Task {
     pub async fn memory_validate(
         self: &Arc<Self>,
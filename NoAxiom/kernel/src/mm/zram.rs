@@ -0,0 +1,345 @@
+//! compressed in-memory swap
+//!
+//! Once the free frames fall below the low watermark, the reclaim task
+//! walks the address spaces no hart is running and compresses their private
+//! anonymous pages into the zram pool until the high watermark is reached.
+//! The pool cuts frames into slots of a few size classes, so a compressed
+//! page only takes what it needs. A swapped page is kept by its area in
+//! place of its frame and the pte is cleared, the next fault decompresses
+//! it in [`MapArea::map_one`]. Pages filled with a single word are kept
+//! without any data, and pages that don't shrink enough stay resident.
+//!
+//! Without accessed bits to rely on, every address space has a clock hand
+//! sweeping its pages, a hot page swapped out comes straight back on fault.
+
+use alloc::{
+    collections::{BTreeMap, BTreeSet},
+    sync::Arc,
+    vec,
+    vec::Vec,
+};
+use core::{
+    future::pending,
+    sync::atomic::{AtomicUsize, Ordering},
+    time::Duration,
+};
+
+use arch::{Arch, ArchMemory};
+use config::mm::{
+    PAGE_SIZE, ZRAM_CLASS_ALIGN, ZRAM_HIGH_WATERMARK_PROPORTION, ZRAM_LOW_WATERMARK_PROPORTION,
+    ZRAM_MAX_COMPRESSED, ZRAM_RECLAIM_BATCH, ZRAM_RECLAIM_INTERVAL_MS,
+};
+use include::errno::Errno;
+use ksync::mutex::SpinLock;
+
+use super::{
+    address::{PhysPageNum, VirtPageNum},
+    frame::{frame_alloc, frame_refcount, FrameTracker, FRAME_ALLOCATOR},
+    map_area::{MapArea, MapAreaType},
+    memory_set::MemorySet,
+    page_table::translate_vpn_into_leaf,
+    permission::MapType,
+};
+use crate::{
+    sched::spawn::spawn_ktask, syscall::SysResult, task::manager::TASK_MANAGER,
+    time::timeout::TimeLimitedFuture, utils::lz4,
+};
+
+const ZRAM_CLASSES: usize = ZRAM_MAX_COMPRESSED / ZRAM_CLASS_ALIGN;
+
+#[inline(always)]
+const fn class_size(class: usize) -> usize {
+    (class + 1) * ZRAM_CLASS_ALIGN
+}
+
+/// slots of one size, carved out of whole frames
+struct SizeClass {
+    /// ppn -> the frame and its used slots
+    frames: BTreeMap<usize, (FrameTracker, usize)>,
+    /// free (ppn, slot), the lowest goes first so sparse frames drain
+    free: BTreeSet<(usize, usize)>,
+}
+
+impl SizeClass {
+    const fn new() -> Self {
+        Self {
+            frames: BTreeMap::new(),
+            free: BTreeSet::new(),
+        }
+    }
+
+    fn alloc(&mut self, slots: usize) -> Option<(usize, usize)> {
+        if self.free.is_empty() {
+            let frame = frame_alloc()?;
+            let ppn = frame.ppn().raw();
+            self.free.extend((0..slots).map(|slot| (ppn, slot)));
+            self.frames.insert(ppn, (frame, 0));
+        }
+        let (ppn, slot) = self.free.pop_first()?;
+        self.frames.get_mut(&ppn).unwrap().1 += 1;
+        Some((ppn, slot))
+    }
+
+    fn dealloc(&mut self, ppn: usize, slot: usize) {
+        let used = &mut self.frames.get_mut(&ppn).unwrap().1;
+        *used -= 1;
+        if *used == 0 {
+            self.frames.remove(&ppn);
+            self.free.retain(|&(free_ppn, _)| free_ppn != ppn);
+        } else {
+            self.free.insert((ppn, slot));
+        }
+    }
+}
+
+struct ZramPool {
+    classes: [SpinLock<SizeClass>; ZRAM_CLASSES],
+    /// pages swapped out
+    pages: AtomicUsize,
+    /// bytes their compressed data takes
+    bytes: AtomicUsize,
+}
+
+#[allow(clippy::declare_interior_mutable_const)]
+const EMPTY_CLASS: SpinLock<SizeClass> = SpinLock::new(SizeClass::new());
+
+static ZRAM: ZramPool = ZramPool {
+    classes: [EMPTY_CLASS; ZRAM_CLASSES],
+    pages: AtomicUsize::new(0),
+    bytes: AtomicUsize::new(0),
+};
+
+enum ZramData {
+    /// every word of the page has this value
+    Filled(u64),
+    Compressed {
+        class: usize,
+        ppn: usize,
+        slot: usize,
+        len: usize,
+    },
+}
+
+struct ZramEntry(ZramData);
+
+impl Drop for ZramEntry {
+    fn drop(&mut self) {
+        ZRAM.pages.fetch_sub(1, Ordering::Relaxed);
+        if let ZramData::Compressed {
+            class,
+            ppn,
+            slot,
+            len,
+        } = self.0
+        {
+            ZRAM.classes[class].lock().dealloc(ppn, slot);
+            ZRAM.bytes.fetch_sub(len, Ordering::Relaxed);
+        }
+    }
+}
+
+/// a swapped out page, forks of the address space share it until each of
+/// them faults it back in
+#[derive(Clone)]
+pub struct ZramPage(Arc<ZramEntry>);
+
+impl ZramPage {
+    /// compress the content of `frame` with `scratch` of a page, None if
+    /// it isn't worth keeping compressed or the pool is out of frames
+    fn store(frame: &FrameTracker, scratch: &mut [u8]) -> Option<Self> {
+        let data = frame.ppn().get_bytes_array();
+        let mut words = data
+            .chunks_exact(8)
+            .map(|word| u64::from_ne_bytes(word.try_into().unwrap()));
+        let first = words.next().unwrap();
+        let data = match words.all(|word| word == first) {
+            true => ZramData::Filled(first),
+            false => {
+                let len = lz4::compress(data, &mut scratch[..ZRAM_MAX_COMPRESSED])?;
+                let class = (len - 1) / ZRAM_CLASS_ALIGN;
+                let size = class_size(class);
+                let (ppn, slot) = ZRAM.classes[class].lock().alloc(PAGE_SIZE / size)?;
+                PhysPageNum::from(ppn).get_bytes_array()[slot * size..slot * size + len]
+                    .copy_from_slice(&scratch[..len]);
+                ZRAM.bytes.fetch_add(len, Ordering::Relaxed);
+                ZramData::Compressed {
+                    class,
+                    ppn,
+                    slot,
+                    len,
+                }
+            }
+        };
+        ZRAM.pages.fetch_add(1, Ordering::Relaxed);
+        Some(Self(Arc::new(ZramEntry(data))))
+    }
+
+    /// a new frame holding the content of the page
+    pub fn load(&self) -> Option<FrameTracker> {
+        let frame = frame_alloc()?;
+        let dst = frame.ppn().get_bytes_array();
+        match self.0 .0 {
+            ZramData::Filled(0) => {}
+            ZramData::Filled(word) => {
+                for chunk in dst.chunks_exact_mut(8) {
+                    chunk.copy_from_slice(&word.to_ne_bytes());
+                }
+            }
+            ZramData::Compressed {
+                class,
+                ppn,
+                slot,
+                len,
+            } => {
+                let offset = slot * class_size(class);
+                let src = &PhysPageNum::from(ppn).get_bytes_array()[offset..offset + len];
+                assert_eq!(lz4::decompress(src, dst), Some(PAGE_SIZE));
+            }
+        }
+        Some(frame)
+    }
+}
+
+/// pages swapped out and the bytes they take compressed
+pub fn zram_stat() -> (usize, usize) {
+    (
+        ZRAM.pages.load(Ordering::Relaxed),
+        ZRAM.bytes.load(Ordering::Relaxed),
+    )
+}
+
+impl MapArea {
+    /// private anonymous pages only, the others have a backing of their own
+    fn is_swappable(&self) -> bool {
+        self.map_type == MapType::Framed
+            && self.file_info.is_none()
+            && self.area_type != MapAreaType::Shared
+    }
+}
+
+impl MemorySet {
+    /// whether `vpn` of a normal area is swapped out, swapped pages of the
+    /// stack and brk come back through their lazy allocation
+    pub fn is_swapped(&self, vpn: VirtPageNum) -> bool {
+        self.areas
+            .iter()
+            .any(|area| area.swapped.contains_key(&vpn))
+    }
+
+    /// fault a swapped out page of a normal area back in
+    pub fn swap_in(&mut self, vpn: VirtPageNum) -> SysResult<()> {
+        let page_table = self.page_table.as_ref_mut();
+        let area = self
+            .areas
+            .iter_mut()
+            .find(|area| area.swapped.contains_key(&vpn))
+            .ok_or(Errno::EFAULT)?;
+        area.map_one(vpn, page_table)?;
+        Arch::tlb_flush();
+        Ok(())
+    }
+
+    /// swap out up to `budget` pages from the clock hand on, pages still
+    /// shared with a fork or mapped by a huge leaf are skipped, returns the
+    /// pages swapped out
+    ///
+    /// the address space must not be active on any hart, so no tlb keeps
+    /// an entry of the pages taken
+    pub fn swap_out(&mut self, budget: usize, scratch: &mut [u8]) -> usize {
+        let page_table = self.page_table.as_ref_mut();
+        let root = page_table.root_ppn();
+        let hand = self.swap_hand;
+        let mut areas: Vec<&mut MapArea> = self
+            .areas
+            .iter_mut()
+            .chain([&mut self.stack, &mut self.brk.area])
+            .filter(|area| area.is_swappable())
+            .collect();
+        let mut picked = Vec::new();
+        for wrapped in [false, true] {
+            for (index, area) in areas.iter().enumerate() {
+                let pages = match wrapped {
+                    false => area.frame_map.range(hand..),
+                    true => area.frame_map.range(..hand),
+                };
+                let candidates = pages
+                    .filter(|(vpn, frame)| {
+                        frame_refcount(frame.ppn()) == 1
+                            && translate_vpn_into_leaf(root, **vpn)
+                                .is_some_and(|(_, level)| level == 0)
+                    })
+                    .map(|(&vpn, _)| (index, vpn));
+                picked.extend(candidates.take(budget - picked.len()));
+            }
+        }
+        let mut count = 0;
+        for (index, vpn) in picked {
+            let area = &mut areas[index];
+            let Some(page) = ZramPage::store(&area.frame_map[&vpn], scratch) else {
+                continue;
+            };
+            page_table.unmap(vpn);
+            area.frame_map.remove(&vpn);
+            area.swapped.insert(vpn, page);
+            self.swap_hand = VirtPageNum::from(vpn.raw() + 1);
+            count += 1;
+        }
+        count
+    }
+}
+
+fn free_frames() -> (usize, usize) {
+    let allocator = FRAME_ALLOCATOR.lock();
+    (allocator.stat_remain(), allocator.stat_total())
+}
+
+/// swap out pages round robin over the idle address spaces until the free
+/// frames reach the high watermark or nothing is left to take
+fn reclaim(scratch: &mut [u8]) {
+    let (free, total) = free_frames();
+    if free >= total / ZRAM_LOW_WATERMARK_PROPORTION {
+        return;
+    }
+    let target = total / ZRAM_HIGH_WATERMARK_PROPORTION;
+    let mut spaces: Vec<_> = TASK_MANAGER
+        .0
+        .lock()
+        .values()
+        .filter_map(|task| task.upgrade())
+        .map(|task| task.memory_set().clone())
+        .collect();
+    spaces.sort_by_key(|space| Arc::as_ptr(space));
+    spaces.dedup_by(|a, b| Arc::ptr_eq(a, b));
+    loop {
+        let mut swapped = 0;
+        for space in spaces.iter() {
+            if free_frames().0 >= target {
+                return;
+            }
+            // a busy address space is likely a hot one
+            let Some(mut ms) = space.try_lock() else {
+                continue;
+            };
+            if !ms.is_active() {
+                swapped += ms.swap_out(ZRAM_RECLAIM_BATCH, scratch);
+            }
+        }
+        if swapped == 0 {
+            return;
+        }
+        let (pages, bytes) = zram_stat();
+        debug!("[zram] {} pages swapped out in {} bytes", pages, bytes);
+    }
+}
+
+/// spawn the kernel task swapping out anonymous pages under memory pressure
+pub fn spawn_reclaimer() {
+    spawn_ktask(async {
+        let interval = Duration::from_millis(ZRAM_RECLAIM_INTERVAL_MS);
+        let mut scratch = vec![0u8; PAGE_SIZE];
+        loop {
+            TimeLimitedFuture::new(pending::<()>(), Some(interval)).await;
+            reclaim(&mut scratch);
+        }
+    });
+}
@@ -10,6 +10,7 @@ use socket_set::SocketSet;
 
 // mod handle;
 // mod poll;
+mod netpoll;
 mod port_manager;
 mod socket;
 mod socket_set;
@@ -38,6 +39,11 @@ lazy_static::lazy_static! {
     };
 }
 
+/// start polling the interfaces
+pub fn net_init() {
+    netpoll::spawn_poller();
+}
+
 pub fn get_old_socket_fd(port: u16) -> usize {
     let port_manager = UDP_PORT_MANAGER.lock();
     if let Some(port_item) = port_manager.inner.get(&port) {
@@ -0,0 +1,91 @@
+//! network poll task
+//!
+//! the interfaces are only polled by one kernel task, when a socket queued
+//! something to send or consumed what it received, or smoltcp's poll delay
+//! expired, the sockets whose state changed are woken through the wakers
+//! they registered with smoltcp, so socket ops never poll the interfaces
+//!
+//! only the loopback interface exists, its packets are looped back within
+//! the poll that sent them, a nic driver would call [`net_kick`] from its
+//! rx interrupt
+
+use core::{
+    future::Future,
+    pin::Pin,
+    sync::atomic::{AtomicBool, Ordering},
+    task::{Context, Poll, Waker},
+    time::Duration,
+};
+
+use ksync::mutex::SpinLock;
+use lazy_static::lazy_static;
+use smoltcp::time::Instant;
+
+use super::{NET_DEVICES, SOCKET_SET};
+use crate::{
+    sched::spawn::spawn_ktask,
+    time::{gettime::get_time_ms, timeout::TimeLimitedFuture},
+};
+
+struct NetKick {
+    pending: AtomicBool,
+    waker: SpinLock<Option<Waker>>,
+}
+
+lazy_static! {
+    static ref NET_KICK: NetKick = NetKick {
+        pending: AtomicBool::new(false),
+        waker: SpinLock::new(None),
+    };
+}
+
+struct NetKickFuture;
+
+impl Future for NetKickFuture {
+    type Output = ();
+    fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Self::Output> {
+        *NET_KICK.waker.lock() = Some(cx.waker().clone());
+        match NET_KICK.pending.swap(false, Ordering::AcqRel) {
+            true => Poll::Ready(()),
+            false => Poll::Pending,
+        }
+    }
+}
+
+/// ask the poll task for a round, called after queueing tx or consuming rx
+/// of a socket
+pub fn net_kick() {
+    if NET_KICK.pending.swap(true, Ordering::AcqRel) {
+        return;
+    }
+    if let Some(waker) = NET_KICK.waker.lock().take() {
+        waker.wake();
+    }
+}
+
+/// poll every interface once, return how long smoltcp can wait before its
+/// timers need the next poll
+pub fn poll_ifaces() -> Option<Duration> {
+    let devices = NET_DEVICES.read();
+    let mut sockets = SOCKET_SET.lock();
+    let mut delay: Option<Duration> = None;
+    for (_, iface) in devices.iter() {
+        iface.poll(&mut sockets).ok();
+        let now = Instant::from_millis(get_time_ms() as i64);
+        if let Some(next) = iface.inner_iface().lock().poll_delay(now, &sockets) {
+            let next = Duration::from_micros(next.total_micros());
+            delay = Some(delay.map_or(next, |delay| delay.min(next)));
+        }
+    }
+    delay
+}
+
+/// spawn the kernel task polling the interfaces
+pub fn spawn_poller() {
+    spawn_ktask(async {
+        loop {
+            let delay = poll_ifaces();
+            TimeLimitedFuture::new(NetKickFuture, delay).await;
+        }
+    });
+}
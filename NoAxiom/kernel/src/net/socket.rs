@@ -4,7 +4,7 @@ use async_trait::async_trait;
 use downcast_rs::{impl_downcast, DowncastSync};
 use smoltcp::wire::IpEndpoint;
 
-use super::{tcpsocket::TcpSocket, NET_DEVICES, SOCKET_SET};
+use super::tcpsocket::TcpSocket;
 use crate::{
     include::net::{ShutdownType, SocketOptions, SocketType},
     syscall::SysResult,
@@ -114,26 +114,3 @@ pub trait Socket: Send + Sync + DowncastSync {
 }
 
 impl_downcast!(sync Socket);
-
-pub fn poll_ifaces() {
-    let devices = NET_DEVICES.read();
-    let mut sockets = SOCKET_SET.lock();
-    for (_, iface) in devices.iter() {
-        iface.poll(&mut sockets).ok();
-    }
-    // for (handle, socket) in sockets.iter_mut() {
-    //     match socket {
-    //         Tcp(socket) => {
-    //             debug!(
-    //                 "[poll_ifaces] poll Tcp socket {}, state: {:?}",
-    //                 handle,
-    //                 socket.state()
-    //             );
-    //         }
-    //         Udp(_) => {
-    //             debug!("[poll_ifaces] poll Udp socket {}", handle);
-    //         }
-    //         _ => unreachable!(),
-    //     }
-    // }
-}
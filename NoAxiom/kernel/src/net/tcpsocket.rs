@@ -1,6 +1,9 @@
 //! Network Layer
 use alloc::{boxed::Box, vec::Vec};
-use core::task::Waker;
+use core::{
+    future::poll_fn,
+    task::{Poll, Waker},
+};
 
 use async_trait::async_trait;
 use smoltcp::{
@@ -10,7 +13,8 @@ use smoltcp::{
 };
 
 use super::{
-    socket::{poll_ifaces, Socket, SocketMeta},
+    netpoll::{net_kick, poll_ifaces},
+    socket::{Socket, SocketMeta},
     NET_DEVICES, SOCKET_SET, TCP_PORT_MANAGER,
 };
 use crate::{
@@ -20,7 +24,6 @@ use crate::{
         net::{ShutdownType, SocketOptions, SocketType},
         result::Errno,
     },
-    sched::utils::yield_now,
     syscall::SysResult,
     utils::hack::is_ltp,
 };
@@ -149,28 +152,16 @@ impl TcpSocket {
     }
 
     pub fn poll(&self, req: &PollEvent, waker: Waker) -> PollEvent {
-        poll_ifaces();
         let mut res = PollEvent::empty();
         let mut sockets = SOCKET_SET.lock();
-        for (handle, s) in sockets.iter() {
-            match s {
-                smoltcp::socket::Socket::Tcp(tcp) => {
-                    debug!(
-                        "[Tcp {}] poll: socket handle {}, state {:?}",
-                        self.handles[0],
-                        handle,
-                        tcp.state()
-                    );
-                }
-                _ => {}
-            }
-        }
         let socket = sockets.get_mut::<tcp::Socket>(self.handles[0]);
         if req.contains(PollEvent::POLLIN) {
             debug!("[Tcp {}] poll: req has POLLIN", self.handles[0]);
             if socket.can_recv() {
                 debug!("[Tcp {}] poll: POLLIN is ready 1", self.handles[0]);
                 res |= PollEvent::POLLIN | PollEvent::POLLRDNORM;
+                // also when ready, so more data wakes an epoll edge
+                socket.register_recv_waker(&waker);
             } else {
                 match socket.state() {
                     tcp::State::CloseWait
@@ -230,14 +221,15 @@ impl Socket for TcpSocket {
     /// - Failure: Error code
     async fn read(&self, buf: &mut [u8]) -> (SysResult<usize>, Option<IpEndpoint>) {
         debug!("[Tcp {}] read", self.handles[0]);
-        loop {
-            poll_ifaces();
+        // the recv waker is registered with the set locked, so the poll task
+        // can't change the socket in between
+        poll_fn(|cx| {
             let mut sockets = SOCKET_SET.lock();
             let socket = sockets.get_mut::<tcp::Socket>(self.handles[0]);
 
             match socket.state() {
                 tcp::State::CloseWait | tcp::State::TimeWait => {
-                    return (Ok(0), None);
+                    return Poll::Ready((Ok(0), None));
                 }
                 state => {
                     debug!("[Tcp {}] read: socket state {:?}", self.handles[0], state);
@@ -250,45 +242,44 @@ impl Socket for TcpSocket {
                     "[Tcp {}] Socket Read Error, socket is closed",
                     self.handles[0]
                 );
-                return (Err(Errno::ENOTCONN), None);
+                return Poll::Ready((Err(Errno::ENOTCONN), None));
             }
 
-            if socket.may_recv() {
-                match socket.recv_slice(buf) {
-                    Ok(size) => {
-                        if size > 0 {
-                            let remote_endpoint = socket.remote_endpoint();
-                            if remote_endpoint.is_none() {
-                                return (Err(Errno::ENOTCONN), None);
-                            }
-                            drop(sockets);
-                            poll_ifaces();
-                            debug!(
-                                "[Tcp {}] read receive: {:?}",
-                                self.handles[0],
-                                alloc::string::String::from_utf8_lossy(&buf[..10.min(buf.len())])
-                            );
-                            return (Ok(size), Some(remote_endpoint.unwrap()));
-                        } else {
-                            debug!("[Tcp {}] read receive: 0, yield!", self.handles[0]);
-                        }
-                    }
-                    Err(tcp::RecvError::InvalidState) => {
-                        warn!("Tcp Socket Read Error, InvalidState");
-                        return (Err(Errno::ENOTCONN), None);
-                    }
-                    Err(tcp::RecvError::Finished) => {
-                        // remote write end is closed, we should close the read end
-                        debug!("[Tcp {}] read receive: Finished", self.handles[0]);
-                        return (Err(Errno::ENOTCONN), None);
-                    }
+            if !socket.may_recv() {
+                return Poll::Ready((Err(Errno::ENOTCONN), None));
+            }
+            match socket.recv_slice(buf) {
+                Ok(0) => {
+                    debug!("[Tcp {}] read receive: 0, wait!", self.handles[0]);
+                    socket.register_recv_waker(cx.waker());
+                    Poll::Pending
+                }
+                Ok(size) => {
+                    let Some(remote_endpoint) = socket.remote_endpoint() else {
+                        return Poll::Ready((Err(Errno::ENOTCONN), None));
+                    };
+                    drop(sockets);
+                    // the window opened
+                    net_kick();
+                    debug!(
+                        "[Tcp {}] read receive: {:?}",
+                        self.handles[0],
+                        alloc::string::String::from_utf8_lossy(&buf[..10.min(buf.len())])
+                    );
+                    Poll::Ready((Ok(size), Some(remote_endpoint)))
+                }
+                Err(tcp::RecvError::InvalidState) => {
+                    warn!("Tcp Socket Read Error, InvalidState");
+                    Poll::Ready((Err(Errno::ENOTCONN), None))
+                }
+                Err(tcp::RecvError::Finished) => {
+                    // remote write end is closed, we should close the read end
+                    debug!("[Tcp {}] read receive: Finished", self.handles[0]);
+                    Poll::Ready((Err(Errno::ENOTCONN), None))
                 }
-            } else {
-                return (Err(Errno::ENOTCONN), None);
             }
-            drop(sockets);
-            yield_now().await;
-        }
+        })
+        .await
     }
 
     /// Write data to the socket, sync funciton.
@@ -308,13 +299,12 @@ impl Socket for TcpSocket {
                 match socket.send_slice(buf) {
                     Ok(size) => {
                         drop(sockets);
-                        poll_ifaces();
+                        net_kick();
                         debug!(
                             "[Tcp {}] write send: {:?}",
                             self.handles[0],
                             alloc::string::String::from_utf8_lossy(&buf[..10.min(buf.len())])
                         );
-                        yield_now().await; // fixme: yield to let other task to run! why?? amazing?!
                         Ok(size)
                     }
                     Err(e) => {
@@ -411,11 +401,13 @@ impl Socket for TcpSocket {
         drop(sockets);
         drop(iface_inner);
 
+        net_kick();
+
         let mut retry_cnt = 0;
         const MAX_CONNECT_RETRIES: u32 = 100;
 
-        loop {
-            poll_ifaces();
+        // woken by every state change of the socket
+        poll_fn(|cx| {
             let mut sockets = SOCKET_SET.lock();
             let local_socket = sockets.get_mut::<tcp::Socket>(self.handles[0]);
 
@@ -440,23 +432,22 @@ impl Socket for TcpSocket {
                             "[Tcp {}] connect timeout: connection refused after {} retries",
                             self.handles[0], MAX_CONNECT_RETRIES
                         );
-                        return Err(Errno::ETIMEDOUT);
+                        return Poll::Ready(Err(Errno::ETIMEDOUT));
                     }
                     error!("[Tcp {}] connect loop: Closed", self.handles[0]);
-                    let driver_write_guard = NET_DEVICES.write();
-                    let iface = *driver_write_guard.get(&0).unwrap(); // now we only have one net device
-                    drop(driver_write_guard);
+                    let driver_read_guard = NET_DEVICES.read();
+                    let iface = *driver_read_guard.get(&0).unwrap(); // now we only have one net device
+                    drop(driver_read_guard);
 
                     let mut iface_inner = iface.inner_iface().lock();
-                    local_socket
-                        .connect(iface_inner.context(), remote, temp_port)
-                        .map_err(|e| match e {
+                    if let Err(e) = local_socket.connect(iface_inner.context(), remote, temp_port) {
+                        return Poll::Ready(Err(match e {
                             tcp::ConnectError::InvalidState => Errno::EISCONN,
                             tcp::ConnectError::Unaddressable => Errno::EADDRNOTAVAIL,
-                        })?;
-                    drop(sockets);
+                        }));
+                    }
                     drop(iface_inner);
-                    yield_now().await;
+                    net_kick();
                 }
                 tcp::State::SynSent => {
                     debug!("[Tcp {}] connect loop: Synsent", self.handles[0]);
@@ -466,23 +457,25 @@ impl Socket for TcpSocket {
                             "[Tcp {}] connect loop: Server doesn't accept!",
                             self.handles[0]
                         );
-                        return Err(Errno::ECONNREFUSED);
+                        return Poll::Ready(Err(Errno::ECONNREFUSED));
                     }
-                    drop(sockets);
                 }
                 tcp::State::Established => {
                     debug!("[Tcp {}] connect loop: Established", self.handles[0]);
-                    return Ok(());
+                    return Poll::Ready(Ok(()));
                 }
                 state => {
                     error!(
                         "[Tcp {}] connect loop: InvalidState: {:?}",
                         self.handles[0], state
                     );
-                    return Err(Errno::ECONNREFUSED);
+                    return Poll::Ready(Err(Errno::ECONNREFUSED));
                 }
             }
-        }
+            local_socket.register_send_waker(cx.waker());
+            Poll::Pending
+        })
+        .await
     }
 
     /// It is used to accept a new incoming connection.
@@ -492,52 +485,54 @@ impl Socket for TcpSocket {
             return Err(Errno::EINVAL);
         }
 
-        loop {
-            poll_ifaces();
+        // every listening socket wakes the acceptor when a connection
+        // leaves its listen state
+        poll_fn(|cx| {
             let mut sockets = SOCKET_SET.lock();
             let chosen_handle_index = self.handles.iter().position(|handle| {
                 let socket = sockets.get::<tcp::Socket>(*handle);
                 socket.is_active()
             });
 
-            if let Some(handle_index) = chosen_handle_index {
-                for (handle, socket) in sockets.iter() {
-                    if let smoltcp::socket::Socket::Tcp(tcp_socket) = socket {
-                        debug!(
-                            "[Tcp {}] accept: socket {}'s state: {:?}",
-                            self.handles[0],
-                            handle,
-                            tcp_socket.state()
-                        );
-                    }
+            let Some(handle_index) = chosen_handle_index else {
+                for handle in self.handles.iter() {
+                    sockets
+                        .get_mut::<tcp::Socket>(*handle)
+                        .register_recv_waker(cx.waker());
                 }
-
-                // replace the handle vector
-                let new_socket = Self::new_socket();
-                let new_socket_handle = sockets.add(new_socket);
-                let old_socket_handle =
-                    core::mem::replace(&mut self.handles[handle_index], new_socket_handle);
-                let ret_old_socket = TcpSocket::from_handle(
-                    old_socket_handle,
-                    self.meta.options,
-                    self.local_endpoint,
-                );
-
-                let old_socket = sockets.get::<tcp::Socket>(old_socket_handle);
-                let remote_endpoint = old_socket.remote_endpoint().ok_or(Errno::ENOTCONN)?;
-
-                // relisten the new socket
-                let new_socket = sockets.get_mut::<tcp::Socket>(new_socket_handle);
-                if !new_socket.is_listening() {
-                    self.do_listen(new_socket)?;
+                return Poll::Pending;
+            };
+
+            // replace the handle vector
+            let new_socket = Self::new_socket();
+            let new_socket_handle = sockets.add(new_socket);
+            let old_socket_handle =
+                core::mem::replace(&mut self.handles[handle_index], new_socket_handle);
+            debug!(
+                "[Tcp {}] accept: socket {}'s state: {:?}",
+                self.handles[0],
+                old_socket_handle,
+                sockets.get::<tcp::Socket>(old_socket_handle).state()
+            );
+            let ret_old_socket =
+                TcpSocket::from_handle(old_socket_handle, self.meta.options, self.local_endpoint);
+
+            let old_socket = sockets.get::<tcp::Socket>(old_socket_handle);
+            let Some(remote_endpoint) = old_socket.remote_endpoint() else {
+                return Poll::Ready(Err(Errno::ENOTCONN));
+            };
+
+            // relisten the new socket
+            let new_socket = sockets.get_mut::<tcp::Socket>(new_socket_handle);
+            if !new_socket.is_listening() {
+                if let Err(e) = self.do_listen(new_socket) {
+                    return Poll::Ready(Err(e));
                 }
-
-                return Ok((ret_old_socket, remote_endpoint));
             }
 
-            drop(sockets);
-            yield_now().await;
-        }
+            Poll::Ready(Ok((ret_old_socket, remote_endpoint)))
+        })
+        .await
     }
 
     /// return: whether the operation is successful
@@ -557,7 +552,7 @@ impl Socket for TcpSocket {
             local_socket.state()
         );
         drop(sockets);
-        poll_ifaces();
+        net_kick();
         Ok(())
     }
 
@@ -589,7 +584,6 @@ impl Drop for TcpSocket {
             drop(port_manager);
         }
 
-        poll_ifaces();
         let mut sockets = SOCKET_SET.lock();
         let handle = self.handles[0];
         let socket = sockets.get_mut::<tcp::Socket>(handle);
@@ -603,6 +597,7 @@ impl Drop for TcpSocket {
             socket.state()
         );
         drop(sockets);
+        // the fin goes out before the socket leaves the set
         poll_ifaces();
 
         let mut sockets = SOCKET_SET.lock();
@@ -1,5 +1,10 @@
 use alloc::{boxed::Box, vec};
-use core::{error, f32::consts::E, task::Waker};
+use core::{
+    error,
+    f32::consts::E,
+    future::poll_fn,
+    task::{Poll, Waker},
+};
 
 use async_trait::async_trait;
 use smoltcp::{
@@ -9,7 +14,8 @@ use smoltcp::{
 };
 
 use super::{
-    socket::{poll_ifaces, Socket, SocketMeta},
+    netpoll::net_kick,
+    socket::{Socket, SocketMeta},
     tcpsocket::TcpSocket,
 };
 use crate::{
@@ -20,7 +26,6 @@ use crate::{
         result::Errno,
     },
     net::{SOCKET_SET, UDP_PORT_MANAGER},
-    sched::utils::yield_now,
     syscall::SysResult,
 };
 
@@ -64,7 +69,6 @@ impl UdpSocket {
     }
 
     pub fn poll(&self, req: &PollEvent, waker: Waker) -> PollEvent {
-        poll_ifaces();
         let mut res = PollEvent::empty();
         let mut sockets = SOCKET_SET.lock();
         let socket = sockets.get_mut::<udp::Socket>(self.handle);
@@ -74,10 +78,10 @@ impl UdpSocket {
             if socket.can_recv() {
                 debug!("[Udp {}] poll: POLLIN is ready", self.handle);
                 res |= PollEvent::POLLIN | PollEvent::POLLRDNORM;
-            } else {
-                debug!("[Udp {}] poll: register recv_waker", self.handle);
-                socket.register_recv_waker(&waker);
             }
+            // also when ready, so the next datagram wakes an epoll edge
+            debug!("[Udp {}] poll: register recv_waker", self.handle);
+            socket.register_recv_waker(&waker);
         }
 
         if req.contains(PollEvent::POLLOUT) {
@@ -112,31 +116,27 @@ impl Socket for UdpSocket {
             self.local_endpoint(),
             self.remote_endpoint
         );
-        loop {
-            poll_ifaces();
+        poll_fn(|cx| {
             let mut sockets = SOCKET_SET.lock();
             let socket = sockets.get_mut::<udp::Socket>(self.handle);
 
-            if socket.can_recv() {
-                if let Ok((size, metadata)) = socket.recv_slice(buf) {
-                    drop(sockets);
-                    poll_ifaces();
-                    debug!(
-                        "[Udp {}] read {} bytes, receive: {:?}, raw: {:?}",
-                        self.handle,
-                        size,
-                        alloc::string::String::from_utf8_lossy(&buf[..10.min(size)]),
-                        &buf[..10.min(size)]
-                    );
-                    return (Ok(size), Some(metadata.endpoint));
-                }
+            if let Ok((size, metadata)) = socket.recv_slice(buf) {
+                drop(sockets);
+                debug!(
+                    "[Udp {}] read {} bytes, receive: {:?}, raw: {:?}",
+                    self.handle,
+                    size,
+                    alloc::string::String::from_utf8_lossy(&buf[..10.min(size)]),
+                    &buf[..10.min(size)]
+                );
+                return Poll::Ready((Ok(size), Some(metadata.endpoint)));
             }
 
-            drop(sockets);
-            debug!("[Udp {}] read: no data, yield", self.handle);
-            // intermit(|| error!("[Udp {}] read: no data, yielding", self.handle));
-            yield_now().await;
-        }
+            debug!("[Udp {}] read: no data, wait", self.handle);
+            socket.register_recv_waker(cx.waker());
+            Poll::Pending
+        })
+        .await
     }
 
     /// Write data to the socket, sync funciton.
@@ -174,7 +174,7 @@ impl Socket for UdpSocket {
             match socket.send_slice(buf, *remote_endpoint) {
                 Ok(()) => {
                     drop(sockets);
-                    poll_ifaces();
+                    net_kick();
                     debug!(
                         "[Udp {}] write send: {:?}",
                         self.handle,
@@ -275,7 +275,6 @@ impl Socket for UdpSocket {
             socket.bind(temp_port).map_err(|_| Errno::EINVAL)?;
         }
         drop(sockets);
-        poll_ifaces(); // fixme: maybe can in the `if` block
         Ok(())
     }
 
@@ -335,7 +334,6 @@ impl Drop for UdpSocket {
             drop(port_manager);
         }
 
-        poll_ifaces();
         let mut sockets = SOCKET_SET.lock();
         let handle = self.handle;
         let socket = sockets.get_mut::<udp::Socket>(handle);
@@ -345,6 +343,5 @@ impl Drop for UdpSocket {
         }
         sockets.remove(handle);
         drop(sockets);
-        poll_ifaces();
     }
 }
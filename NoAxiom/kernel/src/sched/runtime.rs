@@ -1,11 +1,16 @@
-use alloc::{collections::vec_deque::VecDeque, sync::Arc};
-use core::time::Duration;
+use alloc::{collections::vec_deque::VecDeque, sync::Arc, vec::Vec};
+use core::{
+    sync::atomic::{fence, AtomicBool, AtomicUsize, Ordering},
+    time::Duration,
+};
 
-use arch::{Arch, ArchInt};
+use arch::{Arch, ArchAsm, ArchInt};
+use array_init::array_init;
 use async_task::{Builder, Runnable, WithInfo};
-use config::task::INIT_PROCESS_ID;
+use config::{cpu::CPU_NUM, task::INIT_PROCESS_ID};
 use ksync::mutex::SpinLock;
 use lazy_static::lazy_static;
+use memory::frame::frame_zero_pool_refill;
 
 use super::{
     sched_entity::SchedMetadata,
@@ -13,33 +18,93 @@ use super::{
     vsched::{Runtime, Scheduler},
 };
 use crate::{
+    cpu::get_hartid,
     task::Task,
     time::{
-        time_slice::{set_next_trigger, TimeSliceInfo},
-        timer::timer_handler,
+        gettime::{get_time, get_time_duration},
+        time_slice::{set_idle_trigger, set_next_trigger, TimeSliceInfo, TIME_SLICE_DURATION},
+        timer::{timer_handler, TIMER_MANAGER},
     },
 };
 
 type SchedulerImpl = MultiLevelScheduler;
-pub struct MultiLevelRuntime {
+
+/// run queue of a single hart
+#[repr(align(64))]
+struct HartQueue {
     scheduler: SpinLock<SchedulerImpl>,
+    /// queued tasks, read without the lock when looking for a victim
+    len: AtomicUsize,
+    /// the hart sleeps in [`MultiLevelRuntime::idle`]
+    idle: AtomicBool,
 }
 
-impl Runtime<Info> for MultiLevelRuntime {
+impl HartQueue {
     fn new() -> Self {
         Self {
             scheduler: SpinLock::new(SchedulerImpl::new()),
+            len: AtomicUsize::new(0),
+            idle: AtomicBool::new(false),
+        }
+    }
+}
+
+/// per-hart run queues, a hart that runs out of tasks steals about half of
+/// the queued normal tasks of the nearest loaded hart
+pub struct MultiLevelRuntime {
+    queues: [HartQueue; CPU_NUM],
+}
+
+impl Runtime<Info> for MultiLevelRuntime {
+    fn new() -> Self {
+        Self {
+            queues: array_init(|_| HartQueue::new()),
         }
     }
     fn run(&self) {
-        let runnable = self.scheduler.lock().pop();
+        let hart = get_hartid();
+        let runnable = self.pop(hart).or_else(|| self.steal(hart));
         if let Some(runnable) = runnable {
+            if let Some(entity) = runnable.metadata().sched_entity() {
+                entity.set_last_hart(hart);
+                entity.sched_stat.on_dequeue(get_time());
+            }
             set_next_trigger(None);
             runnable.run();
+        } else {
+            self.idle(hart);
         }
     }
+    /// woken tasks go back to the hart they last ran on, where their cache
+    /// lines most likely still are, unless that hart is idle and can't be
+    /// kicked, then they stay on the current one
     fn schedule(&self, runnable: Runnable<Info>, info: async_task::ScheduleInfo) {
-        self.scheduler.lock().push(runnable, info);
+        let current = get_hartid();
+        let mut hart = runnable
+            .metadata()
+            .sched_entity()
+            .and_then(|entity| entity.last_hart())
+            .unwrap_or(current);
+        if !CAN_WAKE_HART
+            && hart != current
+            && self.queues[hart].idle.load(Ordering::SeqCst)
+            && runnable
+                .metadata()
+                .sched_entity()
+                .map_or(true, |entity| entity.cpu_mask.get(current))
+        {
+            hart = current;
+        }
+        if let Some(entity) = runnable.metadata().sched_entity() {
+            entity.sched_stat.on_enqueue(get_time());
+        }
+        let queue = &self.queues[hart];
+        let mut scheduler = queue.scheduler.lock();
+        scheduler.push(runnable, info);
+        queue.len.fetch_add(1, Ordering::Relaxed);
+        drop(scheduler);
+        fence(Ordering::SeqCst);
+        self.kick(hart);
     }
     fn spawn<F>(self: &'static Self, future: F, task: Option<&Arc<Task>>)
     where
@@ -58,10 +123,125 @@ impl Runtime<Info> for MultiLevelRuntime {
 }
 
 impl MultiLevelRuntime {
+    fn pop(&self, hart: usize) -> Option<Runnable<Info>> {
+        let queue = &self.queues[hart];
+        if queue.len.load(Ordering::Relaxed) == 0 {
+            return None;
+        }
+        let mut scheduler = queue.scheduler.lock();
+        let runnable = scheduler.pop();
+        if runnable.is_some() {
+            queue.len.fetch_sub(1, Ordering::Relaxed);
+        }
+        runnable
+    }
+
+    /// steal for an idle `hart`, harts with close ids are tried first since
+    /// they are the likeliest to share a cache, only one lock is held at a
+    /// time and a busy victim is skipped instead of waited for
+    fn steal(&self, hart: usize) -> Option<Runnable<Info>> {
+        let accept = |runnable: &Runnable<Info>| {
+            runnable
+                .metadata()
+                .sched_entity()
+                .map_or(true, |entity| entity.cpu_mask.get(hart))
+        };
+        let mut stolen = Vec::new();
+        for dist in 1..CPU_NUM.next_power_of_two() {
+            let victim = hart ^ dist;
+            if victim >= CPU_NUM {
+                continue;
+            }
+            let queue = &self.queues[victim];
+            let len = queue.len.load(Ordering::Relaxed);
+            if len == 0 {
+                continue;
+            }
+            let Some(mut scheduler) = queue.scheduler.try_lock() else {
+                continue;
+            };
+            scheduler.steal((len + 1) / 2, &accept, &mut stolen);
+            queue.len.fetch_sub(stolen.len(), Ordering::Relaxed);
+            drop(scheduler);
+            if !stolen.is_empty() {
+                trace!(
+                    "[steal] hart {} took {} from {}",
+                    hart,
+                    stolen.len(),
+                    victim
+                );
+                break;
+            }
+        }
+        // the one stolen last would have run first on the victim
+        let first = stolen.pop()?;
+        if !stolen.is_empty() {
+            let queue = &self.queues[hart];
+            let mut scheduler = queue.scheduler.lock();
+            queue.len.fetch_add(stolen.len(), Ordering::Relaxed);
+            for runnable in stolen.into_iter().rev() {
+                scheduler.push_stolen(runnable);
+            }
+        }
+        Some(first)
+    }
+
+    /// nothing to run or steal: zero frames for the page faults to come,
+    /// then sleep until the next local timer is due, another hart kicks this
+    /// one or any interrupt arrives, no periodic slice timer is armed
+    /// meanwhile
+    fn idle(&self, hart: usize) {
+        let queue = &self.queues[hart];
+        queue.idle.store(true, Ordering::SeqCst);
+        // a batch is short, so the queues are checked again after each one
+        if self.all_empty() && frame_zero_pool_refill() == 0 {
+            // a task queued or a timer added by an interrupt between the
+            // check and the wait would sleep until the idle trigger, so
+            // both are looked at again with interrupts off, pending ones
+            // still end the wait
+            Arch::disable_interrupt();
+            if self.all_empty() {
+                let now = get_time_duration();
+                let sleep = TIMER_MANAGER
+                    .next_deadline()
+                    .map_or(TIME_SLICE_DURATION, |deadline| deadline.saturating_sub(now))
+                    .min(TIME_SLICE_DURATION);
+                if !sleep.is_zero() {
+                    set_idle_trigger(sleep);
+                    Arch::set_idle();
+                }
+            }
+            Arch::enable_interrupt();
+        }
+        queue.idle.store(false, Ordering::SeqCst);
+    }
+
+    /// no hart has a queued task
+    fn all_empty(&self) -> bool {
+        self.queues
+            .iter()
+            .all(|queue| queue.len.load(Ordering::SeqCst) == 0)
+    }
+
+    /// after queueing on `hart`: wake it if it's idle, or if it now has more
+    /// than the task it's going to run, wake an idle hart to steal from it
+    fn kick(&self, hart: usize) {
+        let target = match self.queues[hart].idle.load(Ordering::SeqCst) {
+            true => Some(hart),
+            false if self.queues[hart].len.load(Ordering::Relaxed) > 1 => (0..CPU_NUM)
+                .find(|&other| other != hart && self.queues[other].idle.load(Ordering::SeqCst)),
+            false => None,
+        };
+        match target {
+            Some(target) if target != get_hartid() => wake_hart(target),
+            _ => {}
+        }
+    }
+
     #[deprecated(note = "use RUNTIME.run() instead")]
     #[allow(dead_code)]
     pub fn handle_realtime(&self) {
-        let mut sched = self.scheduler.lock();
+        let mut sched = self.queues[get_hartid()].scheduler.lock();
         let mut tasks = VecDeque::new();
         while let Some(task) = sched.pop_realtime() {
             tasks.push_back(task);
@@ -75,6 +255,18 @@ impl MultiLevelRuntime {
     }
 }
 
+/// whether [`wake_hart`] can end the idle wait of another hart
+const CAN_WAKE_HART: bool = cfg!(target_arch = "riscv64");
+
+/// end the idle wait of `hart`, la64 takes no software interrupts yet so
+/// its idle harts only wake on their bounded idle timer
+fn wake_hart(hart: usize) {
+    #[cfg(target_arch = "riscv64")]
+    crate::trap::soft_int::send_ipi(hart, crate::trap::soft_int::IpiType::LoadBalance);
+    #[cfg(not(target_arch = "riscv64"))]
+    let _ = hart;
+}
+
 type RuntimeImpl = MultiLevelRuntime;
 lazy_static! {
     pub static ref RUNTIME: RuntimeImpl = RuntimeImpl::new();
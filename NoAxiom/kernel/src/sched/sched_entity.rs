@@ -1,4 +1,5 @@
 use alloc::sync::Arc;
+use core::sync::atomic::{AtomicUsize, Ordering};
 
 use include::errno::{Errno, SysResult};
 
@@ -11,12 +12,43 @@ pub enum SchedPrio {
     IdlePrio,
 }
 
+/// run queue statistics, times are in timer ticks
+#[derive(Default)]
+pub struct SchedStat {
+    enqueued_at: AtomicUsize,
+    wait_ticks: AtomicUsize,
+    slices: AtomicUsize,
+}
+
+impl SchedStat {
+    /// the task got queued at `now`
+    pub fn on_enqueue(&self, now: usize) {
+        self.enqueued_at.store(now, Ordering::Relaxed);
+    }
+    /// the task got picked to run at `now`
+    pub fn on_dequeue(&self, now: usize) {
+        let waited = now.saturating_sub(self.enqueued_at.load(Ordering::Relaxed));
+        self.wait_ticks.fetch_add(waited, Ordering::Relaxed);
+        self.slices.fetch_add(1, Ordering::Relaxed);
+    }
+    /// time spent runnable but queued
+    pub fn wait_ticks(&self) -> usize {
+        self.wait_ticks.load(Ordering::Relaxed)
+    }
+    /// times the task got picked to run
+    pub fn slices(&self) -> usize {
+        self.slices.load(Ordering::Relaxed)
+    }
+}
+
 pub struct SchedEntity {
-    pub nice: i32,             // nice priority
-    pub sched_prio: SchedPrio, // scheduling priority
-    pub time_stat: TimeInfo,   // task time
-    pub cpu_mask: CpuMask,     // cpu mask
-    pub yield_req: bool,       // need yield
+    pub nice: i32,              // nice priority
+    pub sched_prio: SchedPrio,  // scheduling priority
+    pub time_stat: TimeInfo,    // task time
+    pub cpu_mask: CpuMask,      // cpu mask
+    pub yield_req: bool,        // need yield
+    pub last_hart: AtomicUsize, // hart it last ran on, for wakeup placement
+    pub sched_stat: SchedStat,  // run queue statistics
 }
 
 impl SchedEntity {
@@ -27,6 +59,8 @@ impl SchedEntity {
             time_stat: TimeInfo::default(),
             cpu_mask: CpuMask::default(),
             yield_req: false,
+            last_hart: AtomicUsize::new(usize::MAX),
+            sched_stat: SchedStat::default(),
         }
     }
 }
@@ -41,6 +75,14 @@ impl SchedEntity {
     pub fn need_yield(&self) -> bool {
         self.time_stat.is_timeup() || self.yield_req
     }
+    /// hart the task last ran on, if any
+    pub fn last_hart(&self) -> Option<usize> {
+        let hart = self.last_hart.load(Ordering::Relaxed);
+        (hart != usize::MAX).then_some(hart)
+    }
+    pub fn set_last_hart(&self, hart: usize) {
+        self.last_hart.store(hart, Ordering::Relaxed);
+    }
     pub fn try_set_nice(&mut self, new: i32) -> SysResult<()> {
         // user can't dec nice
         if new > 19 || new < -20 {
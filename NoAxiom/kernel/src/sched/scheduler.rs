@@ -1,4 +1,4 @@
-use alloc::collections::vec_deque::VecDeque;
+use alloc::{collections::vec_deque::VecDeque, vec::Vec};
 
 use async_task::Runnable;
 use ksync::cell::SyncUnsafeCell;
@@ -28,6 +28,24 @@ impl Scheduler<Info> for FifoScheduler {
     }
 }
 
+impl FifoScheduler {
+    /// move up to `n` tasks from the back, the ones that would run last,
+    /// to `out`, stops at the first task `accept` refuses
+    fn steal(
+        &mut self,
+        n: usize,
+        accept: &impl Fn(&Runnable<Info>) -> bool,
+        out: &mut Vec<Runnable<Info>>,
+    ) {
+        while out.len() < n {
+            match self.queue.back() {
+                Some(runnable) if accept(runnable) => out.push(self.queue.pop_back().unwrap()),
+                _ => break,
+            }
+        }
+    }
+}
+
 pub struct DualPrioScheduler {
     normal: FifoScheduler,
     idle: FifoScheduler,
@@ -54,6 +72,18 @@ impl Scheduler<Info> for DualPrioScheduler {
     }
 }
 
+impl DualPrioScheduler {
+    fn steal(
+        &mut self,
+        n: usize,
+        accept: &impl Fn(&Runnable<Info>) -> bool,
+        out: &mut Vec<Runnable<Info>>,
+    ) {
+        self.idle.steal(n, accept, out);
+        self.normal.steal(n, accept, out);
+    }
+}
+
 type ExpiredSchedulerInnerImpl = DualPrioScheduler;
 pub struct ExpiredScheduler {
     current: SyncUnsafeCell<ExpiredSchedulerInnerImpl>,
@@ -66,6 +96,19 @@ impl ExpiredScheduler {
     }
 }
 
+impl ExpiredScheduler {
+    /// the expired half runs after the current one, so it goes first
+    fn steal(
+        &mut self,
+        n: usize,
+        accept: &impl Fn(&Runnable<Info>) -> bool,
+        out: &mut Vec<Runnable<Info>>,
+    ) {
+        self.expire.as_ref_mut().steal(n, accept, out);
+        self.current.as_ref_mut().steal(n, accept, out);
+    }
+}
+
 impl Scheduler<Info> for ExpiredScheduler {
     fn new() -> Self {
         Self {
@@ -126,4 +169,24 @@ impl MultiLevelScheduler {
     pub fn pop_realtime(&mut self) -> Option<Runnable<Info>> {
         self.realtime.pop()
     }
+
+    /// take up to `n` normal tasks for another hart, realtime tasks stay
+    pub fn steal(
+        &mut self,
+        n: usize,
+        accept: &impl Fn(&Runnable<Info>) -> bool,
+        out: &mut Vec<Runnable<Info>>,
+    ) {
+        self.normal.steal(n, accept, out);
+    }
+
+    /// queue a task taken from another hart
+    pub fn push_stolen(&mut self, runnable: Runnable<Info>) {
+        self.normal
+            .expire
+            .as_ref_mut()
+            .normal
+            .queue
+            .push_back(runnable);
+    }
 }
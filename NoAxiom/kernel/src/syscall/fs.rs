@@ -2,8 +2,9 @@ use alloc::{
     string::{String, ToString},
     sync::Arc,
 };
-use core::intrinsics::unlikely;
+use core::{future::Future, intrinsics::unlikely, sync::atomic::Ordering};
 
+use config::mm::PAGE_SIZE;
 use include::errno::SysResult;
 use ksync::assert_no_lock;
 
@@ -17,6 +18,7 @@ use crate::{
     fs::{
         path::{get_dentry, get_dentry_parent, kcreate_async, resolve_path2},
         pipe::PipeFile,
+        vfs::basic::file::File,
     },
     include::{
         fs::{
@@ -33,7 +35,7 @@ use crate::{
     signal::interruptable::interruptable,
     time::gettime::get_time_duration,
     utils::{
-        global_alloc,
+        align_offset, global_alloc,
         hack::{switch_into_ltp, switch_outof_ltp},
         log::{switch_log_off, switch_log_on},
     },
@@ -341,10 +343,8 @@ impl Syscall<'_> {
         }
 
         let mut read_size = 0;
-        for i in 0..iovcnt {
-            let iov_ptr = UserPtr::<Iovec>::new(iovp + i * Iovec::size());
-            iov_ptr.as_slice_const_checked(Iovec::size()).await?;
-            let iov = iov_ptr.read().await?;
+        let iovs = UserPtr::<Iovec>::new(iovp).read_vec(iovcnt).await?;
+        for iov in iovs {
             if iov.iov_len == 0 {
                 continue;
             }
@@ -421,9 +421,8 @@ impl Syscall<'_> {
         let mut offset = offset;
         let mut read_size = 0;
         let mut tot_iovlen = 0;
-        for i in 0..iovcnt {
-            let iov_ptr = UserPtr::<Iovec>::new(iovp + i * Iovec::size());
-            let iov = iov_ptr.read().await?;
+        let iovs = UserPtr::<Iovec>::new(iovp).read_vec(iovcnt).await?;
+        for iov in iovs {
             tot_iovlen += iov.iov_len;
             if iov.iov_len == 0 {
                 continue;
@@ -512,11 +511,8 @@ impl Syscall<'_> {
         }
 
         let mut write_size = 0;
-        for i in 0..iovcnt {
-            let iov_ptr = UserPtr::<Iovec>::new(iovp + i * Iovec::size());
-            iov_ptr.as_slice_const_checked(Iovec::size()).await?;
-
-            let iov = iov_ptr.read().await?;
+        let iovs = UserPtr::<Iovec>::new(iovp).read_vec(iovcnt).await?;
+        for iov in iovs {
             if iov.iov_len == 0 {
                 continue;
             }
@@ -592,11 +588,8 @@ impl Syscall<'_> {
         let mut write_size = 0;
         let mut offset = offset;
         let mut tot_iovlen = 0;
-        for i in 0..iovcnt {
-            let iov_ptr = UserPtr::<Iovec>::new(iovp + i * Iovec::size());
-            iov_ptr.as_slice_const_checked(Iovec::size()).await?;
-
-            let iov = iov_ptr.read().await?;
+        let iovs = UserPtr::<Iovec>::new(iovp).read_vec(iovcnt).await?;
+        for iov in iovs {
             tot_iovlen += iov.iov_len;
             if iov.iov_len == 0 {
                 continue;
@@ -1149,10 +1142,8 @@ impl Syscall<'_> {
         if nlink == 0 {
             let parent = dentry.parent().unwrap();
             parent.check_access(self.task, W_OK, true)?;
-            let mut w_guard = crate::fs::pagecache::get_pagecache_wguard();
             let file = dentry.clone().open(&flags)?;
-            w_guard.mark_deleted(&file);
-            drop(w_guard);
+            crate::fs::pagecache::get_pagecache().mark_deleted(&file);
             inode
                 .set_state(crate::fs::vfs::basic::inode::InodeState::Deleted)
                 .await;
@@ -1251,31 +1242,178 @@ impl Syscall<'_> {
         }
 
         let offset_ptr = UserPtr::<usize>::new(offset);
-        let mut buf = vec![0u8; count];
-        let read_len = if !offset_ptr.is_null() {
+        if !offset_ptr.is_null() {
             let offset = offset_ptr.read().await?;
-            let read_fut = in_file.read_at(offset, &mut buf);
-            let read_len = if in_file.is_interruptable() {
-                interruptable(self.task, read_fut, None, None).await?
-            } else {
-                read_fut.await
-            }? as usize;
+            let (read_len, write_len) = self
+                .splice_stream(&in_file, Some(offset), &out_file, None, count)
+                .await?;
             offset_ptr.write(offset + read_len).await?;
-            read_len
+            Ok(write_len as isize)
         } else {
-            let read_fut = in_file.read(&mut buf);
-            if in_file.is_interruptable() {
-                interruptable(self.task, read_fut, None, None).await?
-            } else {
-                read_fut.await
-            }? as usize
-        };
+            let (_, write_len) = self
+                .splice_stream(&in_file, None, &out_file, None, count)
+                .await?;
+            Ok(write_len as isize)
+        }
+    }
 
-        let write_fut = out_file.write(&buf[..read_len]);
-        if out_file.is_interruptable() {
-            interruptable(self.task, write_fut, None, None).await?
+    /// run `fut` on `file`, interruptable by signals if the file asks for it
+    async fn file_io(
+        &self,
+        file: &Arc<dyn File>,
+        fut: impl Future<Output = SyscallResult>,
+    ) -> SyscallResult {
+        if file.is_interruptable() {
+            interruptable(self.task, fut, None, None).await?
         } else {
-            write_fut.await
+            fut.await
+        }
+    }
+
+    /// stream at most `len` bytes from `in_file` to `out_file` in bounded
+    /// chunks, `None` offsets use and advance the file position
+    ///
+    /// a page cache backed source is written out straight from its cached
+    /// pages, which a pipe destination takes by reference, a pipe source is
+    /// written out straight from its pages, other sources go through one
+    /// page sized bounce buffer and stop after the first chunk, so a pipe or
+    /// socket never blocks twice
+    ///
+    /// return (bytes consumed from `in_file`, bytes written to `out_file`)
+    async fn splice_stream(
+        &self,
+        in_file: &Arc<dyn File>,
+        in_off: Option<usize>,
+        out_file: &Arc<dyn File>,
+        out_off: Option<usize>,
+        len: usize,
+    ) -> SysResult<(usize, usize)> {
+        if let Ok(pipe) = in_file.clone().downcast_arc::<PipeFile>() {
+            return self.splice_from_pipe(&pipe, out_file, out_off, len).await;
+        }
+        let out_pipe = out_file.clone().downcast_arc::<PipeFile>().ok();
+        let cached = in_file.page_cache().is_some();
+        let in_start = in_off.unwrap_or_else(|| in_file.pos());
+        let mut bounce = [0u8; PAGE_SIZE];
+        let mut done = 0;
+
+        let res: SysResult<()> = async {
+            while done < len {
+                let remain = len - done;
+                let (page, data) = if cached {
+                    let pos = in_start + done;
+                    let size = in_file.size();
+                    if pos >= size {
+                        break;
+                    }
+                    let (offset_align, offset_in) = align_offset(pos, PAGE_SIZE);
+                    let req = (offset_in + remain).div_ceil(PAGE_SIZE);
+                    let page = in_file.get_cached_page(offset_align, req).await?;
+                    let n = (PAGE_SIZE - offset_in).min(size - pos).min(remain);
+                    if let Some(pipe) = &out_pipe {
+                        let lent = interruptable(
+                            self.task,
+                            pipe.write_page(page.frame(), offset_in, n, done == 0),
+                            None,
+                            None,
+                        )
+                        .await??;
+                        if lent == 0 {
+                            break;
+                        }
+                        done += n;
+                        continue;
+                    }
+                    let data = &page.as_mut_bytes_array()[offset_in..offset_in + n];
+                    (Some(page), data)
+                } else {
+                    let chunk = &mut bounce[..remain.min(PAGE_SIZE)];
+                    let n = match in_off {
+                        Some(off) => {
+                            self.file_io(in_file, in_file.read_at(off + done, chunk))
+                                .await?
+                        }
+                        None => self.file_io(in_file, in_file.read(chunk)).await?,
+                    } as usize;
+                    (None, &bounce[..n])
+                };
+                if data.is_empty() {
+                    break;
+                }
+                let res = match out_off {
+                    Some(off) => {
+                        self.file_io(out_file, out_file.write_at(off + done, data))
+                            .await
+                    }
+                    None => self.file_io(out_file, out_file.write(data)).await,
+                };
+                let written = *res.as_ref().unwrap_or(&0) as usize;
+                // the bytes read past a short or failed write go back to the
+                // source, a positioned read didn't move it
+                if !cached && in_off.is_none() {
+                    in_file
+                        .meta()
+                        .pos
+                        .fetch_sub(data.len() - written, Ordering::AcqRel);
+                }
+                res?;
+                drop(page);
+                done += written;
+                if written < data.len() || !cached {
+                    break;
+                }
+            }
+            Ok(())
+        }
+        .await;
+
+        if cached && in_off.is_none() {
+            in_file.meta().pos.store(in_start + done, Ordering::Release);
+        }
+        match res {
+            Err(e) if done == 0 => Err(e),
+            _ => Ok((done, done)),
+        }
+    }
+
+    /// splice out of `pipe` straight from its pages, only waits for the
+    /// first chunk
+    async fn splice_from_pipe(
+        &self,
+        pipe: &PipeFile,
+        out_file: &Arc<dyn File>,
+        out_off: Option<usize>,
+        len: usize,
+    ) -> SysResult<(usize, usize)> {
+        let mut done = 0;
+        let res: SysResult<()> = async {
+            while done < len {
+                let chunk =
+                    interruptable(self.task, pipe.read_chunk(done == 0), None, None).await??;
+                let Some(chunk) = chunk else {
+                    break;
+                };
+                let data = &chunk.data()[..chunk.data().len().min(len - done)];
+                let expect = data.len();
+                let written = match out_off {
+                    Some(off) => {
+                        self.file_io(out_file, out_file.write_at(off + done, data))
+                            .await?
+                    }
+                    None => self.file_io(out_file, out_file.write(data)).await?,
+                } as usize;
+                chunk.consume(written);
+                done += written;
+                if written < expect {
+                    break;
+                }
+            }
+            Ok(())
+        }
+        .await;
+        match res {
+            Err(e) if done == 0 => Err(e),
+            _ => Ok((done, done)),
         }
     }
 
@@ -1466,7 +1604,7 @@ impl Syscall<'_> {
         // todo: support the real fs rename, mention that ext4_rs doesn't support rename
         let parent = old_dentry.parent().ok_or(Errno::ENOENT)?;
         if let Some(value) = parent.remove_child(old_name) {
-            parent.children().insert(new_name.to_string(), value);
+            parent.insert_child(new_name, value);
         } else {
             unreachable!();
         }
@@ -1601,40 +1739,33 @@ impl Syscall<'_> {
             return Err(Errno::EINVAL);
         }
 
-        let mut buf = vec![0; len];
         let in_offset = if !off_in.is_null() {
             let off_in = off_in.read().await?;
             if off_in < 0 {
                 return Err(Errno::EINVAL);
             }
-            off_in as usize
+            Some(off_in as usize)
         } else {
-            0
+            None
         };
-        let in_len = file_in.read_at(in_offset, &mut buf).await?;
-        if in_len == 0 {
-            return Ok(0);
-        }
-
-        buf.truncate(in_len as usize);
         let out_offset = if !off_out.is_null() {
             let off_out = off_out.read().await?;
             if off_out < 0 {
                 return Err(Errno::EINVAL);
             }
-            off_out as usize
+            Some(off_out as usize)
         } else {
-            0
+            None
         };
-        let out_len = file_out.write_at(out_offset, &buf).await? as usize;
+        let (in_len, out_len) = self
+            .splice_stream(&file_in, in_offset, &file_out, out_offset, len)
+            .await?;
 
-        if !off_in.is_null() {
-            off_in.write(off_in.read().await? + in_len as i64).await?;
+        if let Some(in_offset) = in_offset {
+            off_in.write((in_offset + in_len) as i64).await?;
         }
-        if !off_out.is_null() {
-            off_out
-                .write(off_out.read().await? + out_len as i64)
-                .await?;
+        if let Some(out_offset) = out_offset {
+            off_out.write((out_offset + out_len) as i64).await?;
         }
 
         Ok(out_len as isize)
@@ -1789,23 +1920,16 @@ impl Syscall<'_> {
         };
         let ret_len = ret_len.min(len);
 
-        let mut buf = vec![0u8; ret_len];
-        if off_in.is_none() {
-            in_file.read(&mut buf).await?;
-        } else {
-            in_file
-                .read_at(**(off_in.as_ref().unwrap()) as usize, &mut buf)
-                .await?;
-            *off_in.unwrap() += ret_len as u32;
+        let in_offset = off_in.as_ref().map(|off| **off as usize);
+        let out_offset = off_out.as_ref().map(|off| **off as usize);
+        let (_, ret_len) = self
+            .splice_stream(&in_file, in_offset, &out_file, out_offset, ret_len)
+            .await?;
+        if let Some(off_in) = off_in {
+            *off_in += ret_len as u32;
         }
-
-        if off_out.is_none() {
-            out_file.write(&buf).await?;
-        } else {
-            out_file
-                .write_at(**(off_out.as_ref().unwrap()) as usize, &buf)
-                .await?;
-            *off_out.unwrap() += ret_len as u32;
+        if let Some(off_out) = off_out {
+            *off_out += ret_len as u32;
         }
 
         let current_time = TimeSpec::from(get_time_duration());
@@ -1,18 +1,21 @@
-use alloc::vec::Vec;
+use alloc::{sync::Arc, vec::Vec};
 use core::time::Duration;
 
 use include::errno::Errno;
 use ksync::assert_no_lock;
 
-use super::{Syscall, SyscallResult};
+use super::{SysResult, Syscall, SyscallResult};
 use crate::{
     include::{
-        io::{FdSet, PollEvent, PollFd},
+        fs::{FdFlags, FileFlags},
+        io::{EpollCtlOp, EpollEvent, FdSet, IoUringEnterFlags, IoUringParams, PollEvent, PollFd},
         time::TimeSpec,
     },
     io::{
+        epoll::EpollFile,
         ppoll::{PpollFuture, PpollItem},
         pselect::PselectFuture,
+        uring::IoUringFile,
     },
     mm::user_ptr::UserPtr,
     signal::{interruptable::interruptable, sig_set::SigSet},
@@ -42,14 +45,8 @@ impl Syscall<'_> {
             })
             .transpose()?;
 
-        let mut poll_fds = Vec::new();
-        let mut fd_ptrs = Vec::new();
-        for i in 0..nfds {
-            let fd_ptr = fds_ptr + i * core::mem::size_of::<PollFd>();
-            let fd_ptr = UserPtr::<PollFd>::new(fd_ptr);
-            fd_ptrs.push(fd_ptr);
-            poll_fds.push(fd_ptr.read().await?)
-        }
+        let fds = UserPtr::<PollFd>::new(fds_ptr);
+        let mut poll_fds = fds.read_vec(nfds).await?;
 
         info!(
             "[sys_ppoll]: fds_ptr {:#x}, nfds {}, timeout:{:?}, sigmask:{:?}",
@@ -58,14 +55,12 @@ impl Syscall<'_> {
 
         let fd_table = task.fd_table();
         let mut poll_items = Vec::new();
-        let mut fds = Vec::new();
         for i in 0..nfds {
             let poll_fd = poll_fds[i];
             trace!("[sys_ppoll]: before poll: poll_fd {:#x?}", poll_fd);
             let file = fd_table.get(poll_fd.fd as usize).ok_or(Errno::EBADF)?;
             let events = poll_fd.events;
             poll_items.push(PpollItem::new(i, events, file));
-            fds.push((fd_ptrs[i], poll_fd));
         }
         drop(fd_table);
 
@@ -82,13 +77,11 @@ impl Syscall<'_> {
 
         let res_len = res.len();
         for (id, result) in res {
-            let mut poll_fd = fds[id].1;
-            poll_fd.revents |= result;
-            fds[id].0.try_write(poll_fd).await?;
-            trace!(
-                "[sys_ppoll]: after poll: poll_fd {:#x?}",
-                fds[id].0.try_read().await?
-            );
+            poll_fds[id].revents |= result;
+            trace!("[sys_ppoll]: after poll: poll_fd {:#x?}", poll_fds[id]);
+        }
+        if res_len > 0 {
+            fds.write_slice(&poll_fds).await?;
         }
         Ok(res_len as isize)
     }
@@ -201,4 +194,140 @@ impl Syscall<'_> {
 
         Ok(ret)
     }
+
+    pub fn sys_epoll_create1(&self, flags: i32) -> SyscallResult {
+        let flags = FileFlags::from_bits(flags).ok_or(Errno::EINVAL)?;
+        if !FileFlags::O_CLOEXEC.contains(flags) {
+            return Err(Errno::EINVAL);
+        }
+        let mut fd_table = self.task.fd_table();
+        let fd = fd_table.alloc_fd()?;
+        fd_table.set(fd, EpollFile::new());
+        fd_table.set_fdflag(fd, &FdFlags::from(&flags));
+        info!("[sys_epoll_create1]: fd {}, flags {:?}", fd, flags);
+        Ok(fd as isize)
+    }
+
+    fn epoll_file(&self, epfd: usize) -> SysResult<Arc<EpollFile>> {
+        let file = self.task.fd_table().get(epfd).ok_or(Errno::EBADF)?;
+        file.downcast_arc::<EpollFile>().map_err(|_| Errno::EINVAL)
+    }
+
+    pub async fn sys_epoll_ctl(
+        &self,
+        epfd: usize,
+        op: usize,
+        fd: usize,
+        event_ptr: usize,
+    ) -> SyscallResult {
+        let op = EpollCtlOp::from_repr(op).ok_or(Errno::EINVAL)?;
+        info!("[sys_epoll_ctl]: epfd {}, op {:?}, fd {}", epfd, op, fd);
+        let epoll = self.epoll_file(epfd)?;
+        let file = self.task.fd_table().get(fd).ok_or(Errno::EBADF)?;
+        if epfd == fd || file.clone().downcast_arc::<EpollFile>().is_ok() {
+            // nested epoll isn't supported
+            return Err(Errno::EINVAL);
+        }
+        match op {
+            EpollCtlOp::Add => {
+                let event = UserPtr::<EpollEvent>::new(event_ptr).read().await?;
+                epoll.add(fd, &file, &event)?;
+            }
+            EpollCtlOp::Mod => {
+                let event = UserPtr::<EpollEvent>::new(event_ptr).read().await?;
+                epoll.modify(fd, &event)?;
+            }
+            EpollCtlOp::Del => epoll.delete(fd)?,
+        }
+        Ok(0)
+    }
+
+    pub async fn sys_epoll_pwait(
+        &self,
+        epfd: usize,
+        events_ptr: usize,
+        max_events: i32,
+        timeout_ms: i32,
+        sigmask_ptr: usize,
+    ) -> SyscallResult {
+        if max_events <= 0 {
+            return Err(Errno::EINVAL);
+        }
+        let epoll = self.epoll_file(epfd)?;
+        let sigmask = UserPtr::<SigSet>::new(sigmask_ptr).try_read().await?;
+        let timeout = match timeout_ms {
+            ms if ms < 0 => None,
+            ms => Some(Duration::from_millis(ms as u64)),
+        };
+        debug!(
+            "[sys_epoll_pwait]: epfd {}, max_events {}, timeout {:?}",
+            epfd, max_events, timeout
+        );
+        let events = UserPtr::<EpollEvent>::new(events_ptr)
+            .as_slice_mut_checked(max_events as usize)
+            .await?;
+
+        assert_no_lock!();
+        let fut = TimeLimitedFuture::new(epoll.wait(max_events as usize), timeout);
+        let res = match interruptable(self.task, fut, sigmask, None).await? {
+            TimeLimitedType::Ok(res) => res,
+            TimeLimitedType::TimeOut => return Ok(0),
+        };
+        events[..res.len()].copy_from_slice(&res);
+        Ok(res.len() as isize)
+    }
+
+    pub async fn sys_io_uring_setup(&self, entries: u32, params_ptr: usize) -> SyscallResult {
+        let params_ptr = UserPtr::<IoUringParams>::new(params_ptr);
+        let mut params = params_ptr.read().await?;
+        if params.resv.iter().any(|&resv| resv != 0) {
+            return Err(Errno::EINVAL);
+        }
+        let ring = IoUringFile::new(entries, &mut params)?;
+        params_ptr.write(params).await?;
+        let mut fd_table = self.task.fd_table();
+        let fd = fd_table.alloc_fd()?;
+        fd_table.set(fd, ring);
+        fd_table.set_fdflag(fd, &FdFlags::from(&FileFlags::O_CLOEXEC));
+        info!(
+            "[sys_io_uring_setup]: fd {}, sq_entries {}, cq_entries {}",
+            fd, params.sq_entries, params.cq_entries
+        );
+        Ok(fd as isize)
+    }
+
+    /// submit at most `to_submit` sqes, then wait for `min_complete` cqes if
+    /// IORING_ENTER_GETEVENTS is set
+    pub async fn sys_io_uring_enter(
+        &self,
+        fd: usize,
+        to_submit: u32,
+        min_complete: u32,
+        flags: u32,
+        sigmask_ptr: usize,
+    ) -> SyscallResult {
+        let flags = IoUringEnterFlags::from_bits(flags).ok_or(Errno::EINVAL)?;
+        if flags.contains(IoUringEnterFlags::IORING_ENTER_EXT_ARG) {
+            return Err(Errno::EINVAL);
+        }
+        let ring = self.task.fd_table().get(fd).ok_or(Errno::EBADF)?;
+        let ring = ring
+            .downcast_arc::<IoUringFile>()
+            .map_err(|_| Errno::EOPNOTSUPP)?;
+        let submitted = ring.submit(self.task, to_submit as usize);
+        debug!(
+            "[sys_io_uring_enter]: fd {}, submitted {}, min_complete {}, flags {:?}",
+            fd, submitted, min_complete, flags
+        );
+        if flags.contains(IoUringEnterFlags::IORING_ENTER_GETEVENTS) && min_complete > 0 {
+            let sigmask = UserPtr::<SigSet>::new(sigmask_ptr).try_read().await?;
+            assert_no_lock!();
+            let res = interruptable(self.task, ring.wait(min_complete), sigmask, None).await;
+            // an interrupted wait still reports the sqes it took
+            if submitted == 0 {
+                res?;
+            }
+        }
+        Ok(submitted as isize)
+    }
 }
@@ -1,15 +1,23 @@
+use alloc::{sync::Arc, vec::Vec};
+
 use arch::{Arch, ArchMemory, ArchPageTableEntry, MappingFlags};
 use memory::address::VpnRange;
 
 use super::SyscallResult;
 use crate::{
     config::mm::PAGE_SIZE,
+    fs::{pagecache::get_pagecache, vfs::basic::file::File},
     include::{
         ipc::{IpcCtlCmd, SHM_MAX, SHM_MIN},
-        mm::{Madv, MmapFlags, MmapProts},
+        mm::{Madv, MmapFlags, MmapProts, MsyncFlags},
         result::Errno,
     },
-    mm::{address::VirtAddr, page_table::PageTable, permission::MapPermission, shm::SHM_MANAGER},
+    mm::{
+        address::{VirtAddr, VirtPageNum},
+        page_table::{flags_switch_to_cow, PageTable},
+        permission::MapPermission,
+        shm::SHM_MANAGER,
+    },
     return_errno,
     syscall::Syscall,
     utils::align_ceil,
@@ -61,14 +69,52 @@ impl Syscall<'_> {
     pub fn sys_munmap(&self, start: usize, length: usize) -> SyscallResult {
         warn!("sys_munmap: start: {:#x}, length: {:#x}", start, length);
         let start_va = VirtAddr::from(start);
-        let end_va = VirtAddr::from(start + length);
         let mut ms = self.task.memory_set().lock();
-        ms.mmap_manager.remove(VirtAddr::from(start), length)?;
-        let vpn_range = VpnRange::new_from_va(start_va, end_va)?;
-        for vpn in vpn_range {
-            ms.page_table().unmap(vpn);
+        let ms = &mut *ms;
+        ms.mmap_manager
+            .remove(start_va, length, ms.page_table.as_ref_mut())?;
+        Ok(0)
+    }
+
+    /// the modified pages of the shared file mappings in the range are
+    /// dirtied in the page cache, MS_SYNC also waits for their write back
+    pub async fn sys_msync(&self, addr: usize, length: usize, flags: usize) -> SyscallResult {
+        let flags = MsyncFlags::from_bits(flags).ok_or(Errno::EINVAL)?;
+        if addr % PAGE_SIZE != 0 || flags.contains(MsyncFlags::MS_ASYNC | MsyncFlags::MS_SYNC) {
+            return_errno!(Errno::EINVAL);
+        }
+        let range = VpnRange::new_from_va(VirtAddr::from(addr), VirtAddr::from(addr + length))?;
+        let mut files: Vec<Arc<dyn File>> = Vec::new();
+        {
+            let mut ms = self.task.memory_set().lock();
+            let ms = &mut *ms;
+            if range
+                .into_iter()
+                .any(|vpn| !ms.mmap_manager.is_in_space(vpn))
+            {
+                return_errno!(Errno::ENOMEM);
+            }
+            // a pte cleaned under the tlb of another hart could miss a write
+            let clean = !ms.is_active_elsewhere();
+            let page_table = ms.page_table.as_ref_mut();
+            if ms
+                .mmap_manager
+                .sync_dirty(range.start()..range.end(), page_table, clean)
+            {
+                Arch::tlb_flush();
+            }
+            if flags.contains(MsyncFlags::MS_SYNC) {
+                let pages = ms.mmap_manager.mmap_map.range(range.start()..range.end());
+                for file in pages.filter_map(|(_, page)| page.file.as_ref()) {
+                    if !files.iter().any(|f| Arc::ptr_eq(f, file)) {
+                        files.push(file.clone());
+                    }
+                }
+            }
+        }
+        for file in files {
+            get_pagecache().writeback(&file).await;
         }
-        Arch::tlb_flush();
         Ok(0)
     }
 
@@ -92,30 +138,55 @@ impl Syscall<'_> {
             vpn_range, map_perm, mapping_flags
         );
 
+        // superpages straddling the edges are split so only the range changes
+        if vpn_range.start() < vpn_range.end() {
+            let mut memory_set = self.task.memory_set().lock();
+            memory_set.page_table().split_huge(vpn_range.start());
+            memory_set
+                .page_table()
+                .split_huge(VirtPageNum::from(vpn_range.end().raw() - 1));
+            // unfaulted pages of file-backed areas take the new permission
+            // from their area
+            memory_set.protect_file_areas(&vpn_range, map_perm);
+        }
+
+        let mmap_prots = MmapProts::from_bits(prot).unwrap();
         for vpn in vpn_range {
-            if let Some(pte) = page_table.find_pte(vpn) {
+            let mut memory_set = self.task.memory_set().lock();
+            let memory_set = &mut *memory_set;
+            // mmap pages go through the manager even when mapped, it knows
+            // which frames are still the page cache's
+            if memory_set.mmap_manager.is_in_space(vpn) {
+                let page_table = memory_set.page_table.as_ref_mut();
+                memory_set
+                    .mmap_manager
+                    .mprotect(vpn, mmap_prots, page_table)?;
+            } else if let Some(pte) = page_table.find_pte(vpn) {
                 let old_flags = pte.flags();
-                let flags = pte.flags().union(mapping_flags);
-                pte.set_flags(flags);
+                let mut flags = pte.flags().union(mapping_flags);
+                // a file-backed page mapped without write may be the page
+                // cache frame itself, it's copied on the first write
+                if !old_flags.contains(MappingFlags::W)
+                    && flags.contains(MappingFlags::W)
+                    && memory_set
+                        .find_area(vpn)
+                        .is_some_and(|area| area.file_info.is_some())
+                {
+                    flags = flags_switch_to_cow(&flags);
+                }
+                // written through the owner, the leaf table may be shared since fork
+                memory_set.page_table().set_flags(vpn, flags);
                 debug!(
-                    "[sys_mprotect] set flags in page table, vpn: {:#x}, flags: {:?} => {:?}, pte_raw: {:?}",
-                    vpn.raw(), old_flags, flags, pte.raw_flag()
+                    "[sys_mprotect] set flags in page table, vpn: {:#x}, flags: {:?} => {:?}",
+                    vpn.raw(),
+                    old_flags,
+                    flags
                 );
-            } else {
-                let task = self.task;
-                let mut memory_set = task.memory_set().lock();
-                let page_table = unsafe { &mut *memory_set.page_table.get() };
-                let mmap_start = memory_set.mmap_manager.mmap_start;
-                let mmap_top = memory_set.mmap_manager.mmap_top;
-                let mmap_prots = MmapProts::from_bits(prot).unwrap();
-                let va = VirtAddr::from(vpn);
-                if va >= mmap_start && va < mmap_top {
-                    memory_set
-                        .mmap_manager
-                        .mprotect(vpn, mmap_prots, page_table)?;
-                } else {
-                    return Err(Errno::EINVAL);
-                }
+            } else if !memory_set
+                .find_area(vpn)
+                .is_some_and(|area| area.file_info.is_some())
+            {
+                return Err(Errno::EINVAL);
             }
         }
         Arch::tlb_flush();
@@ -31,7 +31,7 @@ use crate::{
     },
     task::{
         exit::ExitCode,
-        futex::{FutexAddr, FutexFuture, FUTEX_SHARED_QUEUE},
+        futex::{FutexAddr, FutexFuture, FUTEX_TABLE},
         manager::{PROCESS_GROUP_MANAGER, TASK_MANAGER},
     },
     time::timeout::TimeLimitedFuture,
@@ -316,7 +316,7 @@ impl Syscall<'_> {
                     FutexOps::FutexWait => FUTEX_BITSET_MATCH_ANY,
                     _ => unreachable!(),
                 };
-                let faddr = FutexAddr::new(uaddr, flags).await?;
+                let faddr = FutexAddr::new(task, uaddr, flags).await?;
                 let timeout = match val2 {
                     0 => None,
                     val2 => {
@@ -335,31 +335,14 @@ impl Syscall<'_> {
                     "[sys_futex] futex wait, uaddr = {:#x}, faddr = {:x?}, val = {}, bitset = {:#x}, timeout = {:?}",
                     uaddr, faddr, val, bitset, timeout
                 );
-                let res = match faddr {
-                    FutexAddr::Private(faddr) => interruptable(
-                        self.task,
-                        TimeLimitedFuture::new(
-                            FutexFuture::new(uaddr, faddr, val, bitset, task.futex_ref()),
-                            timeout,
-                        ),
-                        None,
-                        None,
-                    )
-                    .await?
-                    .map_timeout(Err(Errno::ETIMEDOUT))?,
-                    FutexAddr::Shared(faddr) => interruptable(
-                        self.task,
-                        TimeLimitedFuture::new(
-                            FutexFuture::new(uaddr, faddr, val, bitset, &FUTEX_SHARED_QUEUE),
-                            timeout,
-                        ),
-                        None,
-                        None,
-                    )
-                    .await?
-                    .map_timeout(Err(Errno::ETIMEDOUT))?,
-                };
-                Ok(res)
+                interruptable(
+                    self.task,
+                    TimeLimitedFuture::new(FutexFuture::new(uaddr, faddr, val, bitset), timeout),
+                    None,
+                    None,
+                )
+                .await?
+                .map_timeout(Err(Errno::ETIMEDOUT))
             }
             FutexOps::FutexWake | FutexOps::FutexWakeBitset => {
                 let bitset = match option {
@@ -370,13 +353,8 @@ impl Syscall<'_> {
                 if bitset == 0 {
                     return_errno!(Errno::EINVAL, "[sys_futex] bitset is 0");
                 }
-                let addr = FutexAddr::new(uaddr, flags).await?;
-                let res = match addr {
-                    FutexAddr::Private(addr) => task.futex().wake_waiter(addr, val, bitset),
-                    FutexAddr::Shared(addr) => {
-                        FUTEX_SHARED_QUEUE.lock().wake_waiter(addr, val, bitset)
-                    }
-                };
+                let addr = FutexAddr::new(task, uaddr, flags).await?;
+                let res = FUTEX_TABLE.wake_waiter(addr, val, bitset);
                 info!(
                     "[sys_futex] futex wake, uaddr = {:#x}, faddr = {:x?}, val = {}, res: {:?}",
                     uaddr, addr, val, res
@@ -396,21 +374,9 @@ impl Syscall<'_> {
                         return_errno!(Errno::EAGAIN);
                     }
                 }
-                match flags.is_private() {
-                    true => {
-                        let old_pa = FutexAddr::new_private(uaddr);
-                        let new_pa = FutexAddr::new_private(uaddr2);
-                        Ok(task.futex().requeue(old_pa, new_pa, val, val2 as u32) as isize)
-                    }
-                    false => {
-                        let old_pa = FutexAddr::new_shared(uaddr).await?;
-                        let new_pa = FutexAddr::new_shared(uaddr2).await?;
-                        Ok(FUTEX_SHARED_QUEUE
-                            .lock()
-                            .requeue(old_pa, new_pa, val, val2 as u32)
-                            as isize)
-                    }
-                }
+                let old_addr = FutexAddr::new(task, uaddr, flags).await?;
+                let new_addr = FutexAddr::new(task, uaddr2, flags).await?;
+                Ok(FUTEX_TABLE.requeue(old_addr, new_addr, val, val2 as u32) as isize)
             }
             _ => return_errno!(Errno::EINVAL),
         }
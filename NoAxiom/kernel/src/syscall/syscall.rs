@@ -7,6 +7,8 @@ use crate::{
     include::{result::Errno, syscall_id::SyscallID},
     syscall::utils::update_current_syscall,
     task::Task,
+    time::gettime::get_time_ns,
+    utils::trace::{record_syscall, TRACE_STAT},
 };
 
 /// system call tracer for a task
@@ -28,7 +30,7 @@ impl<'a> Syscall<'a> {
             SYS_UMASK =>            Self::empty_syscall("umask", 0xfff),
             SYS_SYNC =>             Self::empty_syscall("sync", 0),
             SYS_FSYNC =>            Self::empty_syscall("fsync", 0),
-            SYS_MSYNC =>            unimplemented!("[syscall] SYS_MSYNC is not implemented yet!"),
+            SYS_MSYNC =>            self.sys_msync(args[0], args[1], args[2]).await,
             SYS_READ =>             self.sys_read(args[0], args[1], args[2]).await,
             SYS_READV =>            self.sys_readv(args[0], args[1], args[2]).await,
             SYS_PREAD64 =>          self.sys_pread64(args[0], args[1], args[2], args[3]).await,
@@ -84,6 +86,11 @@ impl<'a> Syscall<'a> {
             // io
             SYS_PPOLL =>    self.sys_ppoll(args[0], args[1], args[2], args[3]).await,
             SYS_PSELECT =>  self.sys_pselect6(args[0], args[1], args[2], args[3], args[4], args[5]).await,
+            SYS_EPOLL_CREATE1 =>    self.sys_epoll_create1(args[0] as i32),
+            SYS_EPOLL_CTL =>        self.sys_epoll_ctl(args[0], args[1], args[2], args[3]).await,
+            SYS_EPOLL_PWAIT =>      self.sys_epoll_pwait(args[0], args[1], args[2] as i32, args[3] as i32, args[4]).await,
+            SYS_IO_URING_SETUP =>   self.sys_io_uring_setup(args[0] as u32, args[1]).await,
+            SYS_IO_URING_ENTER =>   self.sys_io_uring_enter(args[0], args[1] as u32, args[2] as u32, args[3] as u32, args[4]).await,
 
             // net
             SYS_SOCKET =>       self.sys_socket(args[0], args[1], args[2]),
@@ -247,7 +254,15 @@ impl<'a> Syscall<'a> {
                 cx[RA]
             );
         }
-        let res = self.syscall_inner(id, args).await;
+        let res = match TRACE_STAT {
+            true => {
+                let start = get_time_ns();
+                let res = self.syscall_inner(id, args).await;
+                record_syscall(id, (get_time_ns() - start) as u64);
+                res
+            }
+            false => self.syscall_inner(id, args).await,
+        };
         if id.is_debug_on() {
             info!("[syscall(out)] id: {:?}, res: {:x?}", id, res);
         }
@@ -17,6 +17,7 @@ use crate::{
         timeout::sleep_now,
         timer::{ITimer, ITimerID, ITimerReal, Timer, TIMER_MANAGER},
         timex::{adjtimex, LAST_TIMEX},
+        vdso::vdso_set_clock,
     },
 };
 
@@ -128,6 +129,7 @@ impl Syscall<'_> {
                     let dev_time = get_time_duration();
                     let req_time: Duration = time.into();
                     *clock = req_time.saturating_sub(dev_time);
+                    vdso_set_clock(clockid, *clock);
                     info!("[sys_clock_settime] set clock {:?} to {:?}", clockid, clock);
                     Ok(0)
                 }
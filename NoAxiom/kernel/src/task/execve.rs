@@ -5,6 +5,7 @@ use arch::{Arch, ArchInfo, ArchTrapContext, TrapContext};
 use include::errno::SysResult;
 
 use crate::{
+    config::mm::PAGE_SIZE,
     entry::init_proc::INIT_PROC_NAME,
     fs::{
         fdtable::FdTable,
@@ -27,7 +28,6 @@ use crate::{
     signal::{sig_action::SigActionList, sig_manager::SigManager, sig_set::SigSet},
     task::{
         context::TaskTrapContext,
-        futex::FutexQueue,
         manager::{ThreadGroup, PROCESS_GROUP_MANAGER, TASK_MANAGER},
         pcb::PCB,
         task::{Mutable, Shared, ThreadOnly},
@@ -76,7 +76,6 @@ impl Task {
                 sig_mask: SigSet::all(),
                 ..Default::default()
             }),
-            futex: Shared::new(FutexQueue::new()),
             itimer: Shared::new(ITimerManager::new()),
             user_id: Mutable::new(TaskUserId::default()),
             sup_groups: Mutable::new(Vec::new()), // default supplementary groups
@@ -232,12 +231,15 @@ impl Task {
         let mut shebang_header = [0u8; 2];
         elf_file.read_at(0, &mut shebang_header).await?;
         let (elf_file, args) = if unlikely(shebang_header == [35, 33]) {
-            let content = elf_file.read_all().await?;
-            let mut content_str =
-                String::from_utf8(content).map_err(|_| include::errno::Errno::EINVAL)?;
-            while content_str.ends_with('\n') {
-                content_str.pop();
+            // only the interpreter line is needed
+            let mut content = vec![0u8; PAGE_SIZE.min(elf_file.size())];
+            let len = elf_file.read_at(0, &mut content).await? as usize;
+            content.truncate(len);
+            if let Some(end) = content.iter().position(|&c| c == b'\n') {
+                content.truncate(end);
             }
+            let content_str =
+                String::from_utf8(content).map_err(|_| include::errno::Errno::EINVAL)?;
             let tar_path = &content_str[2..];
             debug!("[execve] shebang path: {}", tar_path);
             if !tar_path.starts_with("/") {
@@ -15,7 +15,7 @@ use crate::{
         signal::Signal,
     },
     task::{
-        futex::FUTEX_SHARED_QUEUE,
+        futex::{FutexAddr, FUTEX_TABLE},
         manager::{PROCESS_GROUP_MANAGER, TASK_MANAGER},
         status::TaskStatus,
     },
@@ -76,18 +76,12 @@ impl Task {
             let ptr = UserPtr::<usize>::new(tidaddress);
             assert_no_lock!();
             let _ = ptr.try_write(0).await;
-            let _ = self
-                .futex()
-                .wake_waiter(ptr.va_addr(), 1, FUTEX_BITSET_MATCH_ANY);
-            let _ = ptr
-                .translate_pa()
+            let private = FutexAddr::new_private(self, tidaddress);
+            let _ = FUTEX_TABLE.wake_waiter(private, 1, FUTEX_BITSET_MATCH_ANY);
+            let _ = FutexAddr::new_shared(tidaddress)
                 .await
                 .inspect_err(|err| error!("[exit_handler] clear child tid failed: {}", err))
-                .map(|pa| {
-                    FUTEX_SHARED_QUEUE
-                        .lock()
-                        .wake_waiter(pa, 1, FUTEX_BITSET_MATCH_ANY)
-                });
+                .map(|shared| FUTEX_TABLE.wake_waiter(shared, 1, FUTEX_BITSET_MATCH_ANY));
         }
 
         // send SIGCHLD to parent
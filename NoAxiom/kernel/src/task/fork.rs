@@ -15,7 +15,6 @@ use crate::{
     signal::signal::Signal,
     task::{
         context::TaskTrapContext,
-        futex::FutexQueue,
         manager::{ThreadGroup, PROCESS_GROUP_MANAGER, TASK_MANAGER},
         pcb::PCB,
         task::{Mutable, Shared, ThreadOnly},
@@ -94,7 +93,9 @@ impl Task {
             Shared::new(self.sa_list.lock().clone())
         };
 
-        let memory_set = if flags.contains(CloneFlags::VM) {
+        // vfork: the parent is suspended until the child execs or exits,
+        // so the child borrows its address space instead of copying it
+        let memory_set = if flags.intersects(CloneFlags::VM | CloneFlags::VFORK) {
             self.memory_set().clone()
         } else {
             let new_memory_set = self.memory_set().lock().clone_cow();
@@ -148,7 +149,6 @@ impl Task {
                     cx: TaskTrapContext::new(self.trap_context().clone(), true),
                     ..Default::default()
                 }),
-                futex: self.futex.clone(),
                 itimer: self.itimer.clone(),
                 user_id: Mutable::new(self.user_id.lock().clone()),
                 sup_groups,
@@ -187,7 +187,6 @@ impl Task {
                     cx: TaskTrapContext::new(self.trap_context().clone(), true),
                     ..Default::default()
                 }),
-                futex: Shared::new(FutexQueue::new()),
                 itimer: Shared::new(ITimerManager::new()),
                 user_id: Mutable::new(self.user_id.lock().clone()),
                 sup_groups,
@@ -1,9 +1,9 @@
 use alloc::{
     collections::{btree_map::BTreeMap, vec_deque::VecDeque},
     sync::Arc,
+    vec::Vec,
 };
 use core::{
-    fmt::Debug,
     future::Future,
     ops::{Deref, DerefMut},
     pin::Pin,
@@ -11,11 +11,13 @@ use core::{
     task::{Context, Poll, Waker},
 };
 
+use array_init::array_init;
 use include::errno::{Errno, SysResult};
 use ksync::{cell::SyncUnsafeCell, mutex::SpinLock};
 use lazy_static::lazy_static;
 use memory::address::{PhysAddr, VirtAddr};
 
+use super::Task;
 use crate::{
     cpu::current_task,
     include::futex::{FutexFlags, FUTEX_BITSET_MATCH_ANY},
@@ -23,18 +25,26 @@ use crate::{
     syscall::SyscallResult,
 };
 
+/// wait state shared by a [`FutexFuture`] and its queued waiter
+struct FutexWaitState {
+    done: AtomicBool,
+    /// the key the waiter is queued under, only changed with its bucket
+    /// locked, a requeue may move it
+    addr: SpinLock<FutexAddr>,
+}
+
 pub struct FutexWaiter {
     waker: Waker,
     bitset: u32,
-    done: Arc<AtomicBool>,
+    state: Arc<FutexWaitState>,
 }
 
 impl FutexWaiter {
-    pub fn new(waker: Waker, bitset: u32, done: Arc<AtomicBool>) -> Self {
+    fn new(waker: Waker, bitset: u32, state: Arc<FutexWaitState>) -> Self {
         Self {
             waker,
             bitset,
-            done,
+            state,
         }
     }
 }
@@ -45,6 +55,30 @@ impl WaiterQueue {
     pub fn new() -> Self {
         Self(VecDeque::new())
     }
+
+    /// mark up to `wake_num` waiters matching `bitset` as done and move
+    /// their wakers into `wakers`, return the number of waiters taken
+    fn wake(&mut self, wake_num: u32, bitset: u32, wakers: &mut Vec<Waker>) -> usize {
+        let mut count = 0;
+        let mut tmp_waiters = VecDeque::new();
+        while count < wake_num as usize {
+            let Some(waiter) = self.pop_front() else {
+                break;
+            };
+            if waiter.bitset & bitset == 0 {
+                tmp_waiters.push_back(waiter);
+            } else {
+                waiter.state.done.store(true, Ordering::SeqCst);
+                wakers.push(waiter.waker);
+                count += 1;
+            }
+        }
+        // skipped waiters keep their place in front of the rest
+        while let Some(waiter) = tmp_waiters.pop_back() {
+            self.push_front(waiter);
+        }
+        count
+    }
 }
 impl Deref for WaiterQueue {
     type Target = WaiterQueueInner;
@@ -58,195 +92,198 @@ impl DerefMut for WaiterQueue {
     }
 }
 
+/// futex key, private futexes are told apart by their address space so no
+/// page table walk is needed
 #[derive(Clone, Copy, Debug, Eq, PartialEq, Ord, PartialOrd)]
 pub enum FutexAddr {
-    Private(VirtAddr),
+    Private(usize, VirtAddr),
     Shared(PhysAddr),
 }
 
 impl FutexAddr {
-    pub async fn new(uaddr: usize, flags: FutexFlags) -> SysResult<Self> {
+    pub async fn new(task: &Task, uaddr: usize, flags: FutexFlags) -> SysResult<Self> {
         if flags.is_private() {
-            Ok(FutexAddr::Private(VirtAddr::from(uaddr)))
+            Ok(Self::new_private(task, uaddr))
         } else {
-            let futex_word = UserPtr::<u32>::new(uaddr);
-            let pa = futex_word.translate_pa().await?;
-            Ok(FutexAddr::Shared(pa))
+            Self::new_shared(uaddr).await
         }
     }
-    pub fn new_private(uaddr: usize) -> VirtAddr {
-        VirtAddr::from(uaddr)
+    pub fn new_private(task: &Task, uaddr: usize) -> Self {
+        let mm = Arc::as_ptr(task.memory_set()) as usize;
+        FutexAddr::Private(mm, VirtAddr::from(uaddr))
     }
-    pub async fn new_shared(uaddr: usize) -> SysResult<PhysAddr> {
+    pub async fn new_shared(uaddr: usize) -> SysResult<Self> {
         let futex_word = UserPtr::<u32>::new(uaddr);
         let pa = futex_word.translate_pa().await?;
-        Ok(pa)
+        Ok(FutexAddr::Shared(pa))
     }
-}
 
-/// futex queue: a map of uaddr -> waiter queue
-pub struct FutexQueue<T> {
-    inner: BTreeMap<T, WaiterQueue>,
+    fn hash(&self) -> usize {
+        let (mm, addr) = match self {
+            FutexAddr::Private(mm, va) => (*mm, va.raw()),
+            FutexAddr::Shared(pa) => (0, pa.raw()),
+        };
+        // futex words are 4-byte aligned
+        let key = (addr >> 2) ^ mm.rotate_left(17);
+        key.wrapping_mul(0x9e37_79b9_7f4a_7c15) >> (usize::BITS - FUTEX_HASH_BITS)
+    }
 }
 
-pub type FutexPrivateQueue = FutexQueue<VirtAddr>;
+const FUTEX_HASH_BITS: u32 = 8;
+const FUTEX_BUCKETS: usize = 1 << FUTEX_HASH_BITS;
+
+type FutexBucketInner = BTreeMap<FutexAddr, WaiterQueue>;
+
+#[repr(align(64))]
+struct FutexBucket(SpinLock<FutexBucketInner>);
+
+/// futex hash table, each bucket holds the waiter queues of the keys hashed
+/// to it under its own lock, wakers are only called after it's released
+pub struct FutexTable {
+    buckets: [FutexBucket; FUTEX_BUCKETS],
+}
 
 lazy_static! {
-    pub static ref FUTEX_SHARED_QUEUE: SpinLock<FutexQueue<PhysAddr>> =
-        SpinLock::new(FutexQueue::new());
+    pub static ref FUTEX_TABLE: FutexTable = FutexTable::new();
 }
 
-impl<T> FutexQueue<T>
-where
-    T: Clone + Copy + Debug + Eq + PartialEq + Ord + PartialOrd,
-{
+impl FutexTable {
     pub fn new() -> Self {
         Self {
-            inner: BTreeMap::new(),
+            buckets: array_init(|_| FutexBucket(SpinLock::new(BTreeMap::new()))),
         }
     }
 
-    /// insert a new waiter into the queue
-    pub fn insert_waiter(&mut self, addr: T, waker: Waker, bitset: u32, done: Arc<AtomicBool>) {
-        debug!(
-            "[futex] insert waiter at addr: {:?}, bitset: {:x}",
-            addr, bitset
-        );
-        let waiter = FutexWaiter::new(waker, bitset, done);
-        if let Some(waiters) = self.inner.get_mut(&addr) {
-            debug!(
-                "[futex] found existing waiters at addr: {:?}, adding new waker",
-                addr
-            );
-            waiters.push_back(waiter);
-        } else {
-            debug!(
-                "[futex] no waiters found at addr: {:?}, creating new queue",
-                addr
-            );
-            let mut waiters = WaiterQueue::new();
-            waiters.push_back(waiter);
-            self.inner.insert(addr, waiters);
-        }
+    fn bucket(&self, addr: &FutexAddr) -> &SpinLock<FutexBucketInner> {
+        &self.buckets[addr.hash()].0
     }
 
-    pub fn get_waiter_queue(&mut self, addr: T) -> Option<&mut WaiterQueue> {
-        self.inner.get_mut(&addr)
+    /// take up to `wake_num` waiters off `addr` into `wakers`
+    fn take_waiters(
+        bucket: &mut FutexBucketInner,
+        addr: FutexAddr,
+        wake_num: u32,
+        bitset: u32,
+        wakers: &mut Vec<Waker>,
+    ) -> usize {
+        let Some(waiters) = bucket.get_mut(&addr) else {
+            return 0;
+        };
+        let count = waiters.wake(wake_num, bitset, wakers);
+        if waiters.is_empty() {
+            bucket.remove(&addr);
+        }
+        count
     }
 
     /// wake up all valid waiters, return the number of waiters woken up
-    pub fn wake_waiter(&mut self, addr: T, wake_num: u32, bitset: u32) -> usize {
-        let mut count = 0;
+    pub fn wake_waiter(&self, addr: FutexAddr, wake_num: u32, bitset: u32) -> usize {
         debug!(
             "[futex] wake waiters at addr: {:x?}, bitset: {:x}, wake_num: {}",
             addr, bitset, wake_num
         );
-        for it in self.inner.iter() {
-            debug!("[futex] addr: {:x?}, waiters: {}", it.0, it.1.len());
-        }
-        if let Some(waiters) = self.get_waiter_queue(addr) {
-            debug!("[futex] found {} waiters", waiters.len());
-            debug!("[futex] wake_num: {}, bitset: {:x}", wake_num, bitset);
-            let mut tmp_waiters = VecDeque::new();
-            while let Some(waiter) = waiters.pop_front() {
-                if waiter.bitset & bitset == 0 {
-                    tmp_waiters.push_back(waiter);
-                } else {
-                    if Arc::strong_count(&waiter.done) > 1 {
-                        waiter.done.store(true, Ordering::SeqCst);
-                        waiter.waker.wake();
-                    } else {
-                        warn!("[futex] waker already dropped, wake canceled");
-                    }
-                    count += 1;
-                    if count >= wake_num {
-                        break;
-                    }
-                }
-            }
-            waiters.append(&mut tmp_waiters);
-        }
-        count as usize
+        let mut wakers = Vec::new();
+        let count = Self::take_waiters(
+            &mut self.bucket(&addr).lock(),
+            addr,
+            wake_num,
+            bitset,
+            &mut wakers,
+        );
+        wakers.into_iter().for_each(Waker::wake);
+        count
     }
 
-    /// requeue the waiters from old_pa to new_pa
+    /// requeue the waiters from old_addr to new_addr
     /// n_wake: the max number of waiters to wake up
     /// n_rq: the max number of waiters to requeue
     /// return the sum number of waiters woken up and requeued
-    pub fn requeue(&mut self, old_addr: T, new_addr: T, n_wake: u32, n_rq: u32) -> usize {
-        // first wake up the waiters in old_pa
-        let wake_count = self.wake_waiter(old_addr, n_wake, FUTEX_BITSET_MATCH_ANY);
-        let Some(old_waiters) = self.get_waiter_queue(old_addr) else {
-            return wake_count;
+    pub fn requeue(
+        &self,
+        old_addr: FutexAddr,
+        new_addr: FutexAddr,
+        n_wake: u32,
+        n_rq: u32,
+    ) -> usize {
+        let mut wakers = Vec::new();
+        let (old_idx, new_idx) = (old_addr.hash(), new_addr.hash());
+        // both buckets are locked in index order
+        let (mut old_bucket, mut new_bucket) = match old_idx.cmp(&new_idx) {
+            core::cmp::Ordering::Equal => (self.buckets[old_idx].0.lock(), None),
+            core::cmp::Ordering::Less => {
+                let old_bucket = self.buckets[old_idx].0.lock();
+                (old_bucket, Some(self.buckets[new_idx].0.lock()))
+            }
+            core::cmp::Ordering::Greater => {
+                let new_bucket = self.buckets[new_idx].0.lock();
+                (self.buckets[old_idx].0.lock(), Some(new_bucket))
+            }
         };
 
-        // now try to requeue the waiters from old_pa to new_pa
-        // waiter_vec is a temporary vector to store the waiters
-        if old_addr == new_addr {
-            return 0;
-        }
-        let mut rq_count = 0;
-        let mut waiter_vec = VecDeque::new();
+        // first wake up the waiters in old_addr
+        let wake_count = Self::take_waiters(
+            &mut old_bucket,
+            old_addr,
+            n_wake,
+            FUTEX_BITSET_MATCH_ANY,
+            &mut wakers,
+        );
 
-        // pop the waiters from old_pa and push them to new_pa
-        while let Some(waker) = old_waiters.pop_front() {
-            waiter_vec.push_back(waker);
-            rq_count += 1;
-            if rq_count == n_rq {
-                break;
+        // then move up to n_rq of the rest to new_addr
+        let mut rq_count = 0;
+        if old_addr != new_addr {
+            if let Some(old_waiters) = old_bucket.get_mut(&old_addr) {
+                let n_rq = (n_rq as usize).min(old_waiters.len());
+                let mut waiter_vec: VecDeque<_> = old_waiters.drain(..n_rq).collect();
+                for waiter in waiter_vec.iter() {
+                    *waiter.state.addr.lock() = new_addr;
+                }
+                rq_count = waiter_vec.len();
+                if old_waiters.is_empty() {
+                    old_bucket.remove(&old_addr);
+                }
+                new_bucket
+                    .as_deref_mut()
+                    .unwrap_or(&mut old_bucket)
+                    .entry(new_addr)
+                    .or_insert(WaiterQueue::new())
+                    .append(&mut waiter_vec);
             }
         }
 
-        // now we have the waiters in waiter_vec, we need to insert them into new_pa
-        self.inner
-            .entry(new_addr)
-            .or_insert(WaiterQueue::new())
-            .append(&mut waiter_vec);
-
-        rq_count as usize + wake_count
+        drop(new_bucket);
+        drop(old_bucket);
+        wakers.into_iter().for_each(Waker::wake);
+        rq_count + wake_count
     }
 }
 
-pub struct FutexFuture<'a, T>
-where
-    T: Clone + Copy + Debug + Eq + PartialEq + Ord + PartialOrd,
-{
+pub struct FutexFuture {
     uaddr: usize, // va
-    faddr: T,
-    guard: &'a SpinLock<FutexQueue<T>>,
+    faddr: FutexAddr,
     val: u32,
     bitset: u32, // for bitset futex
     is_in: SyncUnsafeCell<bool>,
-    done: Arc<AtomicBool>,
+    state: Arc<FutexWaitState>,
 }
 
-impl<'a, T> FutexFuture<'a, T>
-where
-    T: Clone + Copy + Debug + Eq + PartialEq + Ord + PartialOrd,
-{
-    pub fn new(
-        uaddr: usize,
-        faddr: T,
-        val: u32,
-        bitset: u32,
-        guard: &'a SpinLock<FutexQueue<T>>,
-    ) -> Self {
+impl FutexFuture {
+    pub fn new(uaddr: usize, faddr: FutexAddr, val: u32, bitset: u32) -> Self {
         Self {
             uaddr,
             faddr,
-            guard,
             val,
             bitset,
             is_in: SyncUnsafeCell::new(false),
-            done: Arc::new(AtomicBool::new(false)),
+            state: Arc::new(FutexWaitState {
+                done: AtomicBool::new(false),
+                addr: SpinLock::new(faddr),
+            }),
         }
     }
 }
 
-impl<'a, T> Future for FutexFuture<'a, T>
-where
-    T: Clone + Copy + Debug + Eq + PartialEq + Ord + PartialOrd,
-{
+impl Future for FutexFuture {
     type Output = SyscallResult;
     fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Self::Output> {
         debug!(
@@ -254,17 +291,19 @@ where
             self.uaddr, self.faddr, self.val, self.bitset
         );
         if !*self.is_in.as_ref() {
-            let mut futex = self.guard.lock();
+            let mut bucket = FUTEX_TABLE.bucket(&self.faddr).lock();
             let cur_val = unsafe { UserPtr::from(self.uaddr as *const u32).atomic_load_acquire() };
             let is_pending = cur_val == self.val;
             if is_pending {
                 *self.is_in.as_ref_mut() = true;
-                futex.insert_waiter(
-                    self.faddr,
-                    cx.waker().clone(),
-                    self.bitset,
-                    self.done.clone(),
-                );
+                bucket
+                    .entry(self.faddr)
+                    .or_insert(WaiterQueue::new())
+                    .push_back(FutexWaiter::new(
+                        cx.waker().clone(),
+                        self.bitset,
+                        self.state.clone(),
+                    ));
                 debug!(
                     "[futex] task {} yield with value = {}",
                     current_task().unwrap().tid(),
@@ -276,10 +315,38 @@ where
                 return Poll::Ready(Err(Errno::EAGAIN));
             };
         } else {
-            match self.done.load(Ordering::SeqCst) {
+            match self.state.done.load(Ordering::SeqCst) {
                 true => Poll::Ready(Ok(0)),
                 false => Poll::Pending,
             }
         }
     }
 }
+
+impl Drop for FutexFuture {
+    /// a wait cut short by timeout or signal leaves the queue, so it can't
+    /// swallow a later wake
+    fn drop(&mut self) {
+        if !*self.is_in.as_ref() {
+            return;
+        }
+        loop {
+            let addr = *self.state.addr.lock();
+            let mut bucket = FUTEX_TABLE.bucket(&addr).lock();
+            if self.state.done.load(Ordering::SeqCst) {
+                return;
+            }
+            // requeued elsewhere before the bucket was locked
+            if *self.state.addr.lock() != addr {
+                continue;
+            }
+            if let Some(waiters) = bucket.get_mut(&addr) {
+                waiters.retain(|waiter| !Arc::ptr_eq(&waiter.state, &self.state));
+                if waiters.is_empty() {
+                    bucket.remove(&addr);
+                }
+            }
+            return;
+        }
+    }
+}
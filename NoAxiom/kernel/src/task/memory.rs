@@ -95,7 +95,9 @@ impl Task {
         }
         if flags.contains(MmapFlags::MAP_FIXED) {
             start_va = VirtAddr::from(addr);
-            memory_set.mmap_manager.remove(start_va, length)?;
+            let ms = &mut *memory_set;
+            ms.mmap_manager
+                .remove(start_va, length, ms.page_table.as_ref_mut())?;
         }
 
         // get target file
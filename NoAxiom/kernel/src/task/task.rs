@@ -26,7 +26,7 @@ use crate::{
     mm::{memory_set::MemorySet, user_ptr::UserPtr},
     sched::sched_entity::{SchedEntity, SchedPrio},
     signal::{sig_action::SigActionList, sig_set::SigMask, sig_stack::UContext},
-    task::{futex::FutexPrivateQueue, taskid::TaskUserId},
+    task::taskid::TaskUserId,
     time::{time_info::TimeInfo, timer::ITimerManager},
 };
 
@@ -102,8 +102,6 @@ pub struct Task {
     pub(super) thread_group: SharedMut<ThreadGroup>,
     /// process group id
     pub(super) pgid: Arc<AtomicUsize>,
-    /// futex wait queue
-    pub(super) futex: SharedMut<FutexPrivateQueue>,
     /// interval timer
     pub(super) itimer: SharedMut<ITimerManager>,
 }
@@ -330,14 +328,6 @@ impl Task {
         self.sched_entity.get()
     }
 
-    /// futex wait queue
-    pub fn futex_ref(&self) -> &SpinLock<FutexPrivateQueue> {
-        self.futex.as_ref()
-    }
-    pub fn futex(&self) -> SpinLockGuard<FutexPrivateQueue> {
-        self.futex.lock()
-    }
-
     /// user context
     pub fn ucx(&self) -> &UserPtr<UContext> {
         &self.tcb().ucx
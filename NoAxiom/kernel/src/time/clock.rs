@@ -4,9 +4,11 @@ use core::time::Duration;
 use ksync::mutex::SpinLock;
 use strum::FromRepr;
 
+use super::vdso::vdso_init;
+
 #[allow(non_camel_case_types)]
 #[repr(usize)]
-#[derive(FromRepr, Debug, PartialEq, Eq, PartialOrd, Ord)]
+#[derive(FromRepr, Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
 pub enum ClockId {
     CLOCK_REALTIME = 0,
     CLOCK_MONOTONIC = 1,
@@ -56,4 +58,6 @@ pub fn ktime_init() {
         .lock()
         .0
         .insert(ClockId::CLOCK_MONOTONIC_COARSE, Duration::ZERO);
+
+    vdso_init();
 }
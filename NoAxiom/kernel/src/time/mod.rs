@@ -5,3 +5,4 @@ pub mod time_slice;
 pub mod timeout;
 pub mod timer;
 pub mod timex;
+pub mod vdso;
@@ -47,3 +47,9 @@ impl TimeSliceInfo {
 pub fn set_next_trigger(info: Option<TimeSliceInfo>) {
     Arch::set_timer(info.unwrap_or_default().ticks() as u64);
 }
+
+/// set a one-shot timer interrupt after `sleep` for an idle hart
+pub fn set_idle_trigger(sleep: Duration) {
+    let ticks = sleep.as_micros() as usize * Arch::get_freq() / 1_000_000;
+    Arch::set_timer(ticks.max(1) as u64);
+}
@@ -13,7 +13,7 @@ use crate::{
     signal::interruptable::interruptable,
     time::{
         gettime::get_time_duration,
-        timer::{Timer, TIMER_MANAGER},
+        timer::{TimerHandle, TIMER_MANAGER},
     },
 };
 
@@ -43,11 +43,11 @@ impl<T> TimeLimitedType<T> {
 /// `timeout`: the timeout duration  
 /// `limit`(don't care): the time limit for the future to finish
 ///
-/// todo: maybe can based on Interrupt, save waker
+/// the timer is cancelled as soon as the future finishes or is dropped
 pub struct TimeLimitedFuture<T: Future> {
     future: Pin<Box<T>>,
     limit: Duration,
-    is_pushed: bool,
+    timer: Option<TimerHandle>,
 }
 
 const TIMEOUT_MIN_US: u64 = 500;
@@ -66,7 +66,7 @@ impl<T: Future> TimeLimitedFuture<T> {
                 Some(t) => t.saturating_add(get_time_duration()),
                 None => Duration::MAX,
             },
-            is_pushed: false,
+            timer: None,
         }
     }
 }
@@ -75,16 +75,24 @@ impl<T: Future> Future for TimeLimitedFuture<T> {
     type Output = TimeLimitedType<T::Output>;
     fn poll(mut self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Self::Output> {
         match self.future.as_mut().poll(cx) {
-            Poll::Ready(res) => return Poll::Ready(TimeLimitedType::Ok(res)),
+            Poll::Ready(res) => {
+                self.timer = None;
+                Poll::Ready(TimeLimitedType::Ok(res))
+            }
             Poll::Pending => {
                 let now = get_time_duration();
                 if now >= self.limit {
+                    self.timer = None;
                     Poll::Ready(TimeLimitedType::TimeOut)
                 } else {
-                    if !self.is_pushed {
-                        TIMER_MANAGER
-                            .add_timer(Timer::new_waker_timer(self.limit, cx.waker().clone()));
-                        self.is_pushed = true;
+                    match &self.timer {
+                        Some(timer) => timer.set_waker(cx.waker()),
+                        None if self.limit != Duration::MAX => {
+                            let timer =
+                                TIMER_MANAGER.add_waker_timer(self.limit, cx.waker().clone());
+                            self.timer = Some(timer);
+                        }
+                        None => {}
                     }
                     Poll::Pending
                 }
@@ -4,20 +4,23 @@
 
 use alloc::{
     boxed::Box,
-    collections::binary_heap::BinaryHeap,
     sync::{Arc, Weak},
+    vec::Vec,
 };
 use core::{
-    cmp::Reverse,
+    mem,
     sync::atomic::{AtomicUsize, Ordering},
     task::Waker,
     time::Duration,
 };
 
+use array_init::array_init;
 use ksync::{mutex::SpinLock, Lazy};
 
 use super::gettime::get_time_duration;
 use crate::{
+    config::cpu::CPU_NUM,
+    cpu::get_hartid,
     include::time::{ITimerType, ITimerVal},
     signal::{
         sig_detail::SigDetail,
@@ -39,6 +42,19 @@ pub trait TimerEvent: Send + Sync {
     fn callback(self: Box<Self>) -> Option<Timer>;
 }
 
+/// waker slot shared between a queued timer and its [`TimerHandle`]
+type SharedWaker = Arc<SpinLock<Option<Waker>>>;
+
+/// What to do when a timer expires.
+enum TimerData {
+    /// wake a task, the common case of sleeps and timeouts
+    Waker(Waker),
+    /// wake a task unless the timer was cancelled through its handle
+    Shared(SharedWaker),
+    /// any other event
+    Event(Box<dyn TimerEvent>),
+}
+
 /// Represents a timer with an expiration time and associated event data.
 /// The Timer structure contains the expiration time and the data required
 /// to handle the event when the timer expires.
@@ -47,97 +63,246 @@ pub struct Timer {
     /// This indicates when the timer is set to trigger.
     pub expire: Duration,
 
-    /// A boxed dynamic trait object that implements the TimerEvent trait.
-    /// This allows different types of events to be associated with the timer.
-    pub data: Box<dyn TimerEvent>,
+    /// The event fired on expiration.
+    data: TimerData,
 }
 
 impl Timer {
     pub fn new(expire: Duration, data: Box<dyn TimerEvent>) -> Self {
-        Self { expire, data }
+        Self {
+            expire,
+            data: TimerData::Event(data),
+        }
     }
 
     pub fn new_waker_timer(expire: Duration, waker: Waker) -> Self {
-        struct WakerData {
-            waker: Waker,
+        Self {
+            expire,
+            data: TimerData::Waker(waker),
         }
-        impl TimerEvent for WakerData {
-            fn callback(self: Box<Self>) -> Option<Timer> {
-                self.waker.wake();
-                None
+    }
+
+    fn callback(self) -> Option<Timer> {
+        match self.data {
+            TimerData::Waker(waker) => waker.wake(),
+            TimerData::Shared(shared) => {
+                if let Some(waker) = shared.lock().take() {
+                    waker.wake();
+                }
             }
+            TimerData::Event(data) => return data.callback(),
         }
-        Self::new(expire, Box::new(WakerData { waker }))
+        None
     }
 
-    fn callback(self) -> Option<Timer> {
-        self.data.callback()
+    /// a cancelled timer waiting in the wheel only to be dropped
+    fn is_cancelled(&self) -> bool {
+        match &self.data {
+            TimerData::Shared(shared) => shared.lock().is_none(),
+            _ => false,
+        }
     }
 }
 
-impl Ord for Timer {
-    fn cmp(&self, other: &Self) -> core::cmp::Ordering {
-        self.expire.cmp(&other.expire)
+/// Cancel handle of a waker timer, see [`TimerManager::add_waker_timer`].
+/// Cancelling, or dropping the handle, releases the waker at once so the
+/// task isn't kept alive by a timer that can no longer matter.
+pub struct TimerHandle(SharedWaker);
+
+impl TimerHandle {
+    /// replace the waker when the owner gets polled by another one
+    pub fn set_waker(&self, waker: &Waker) {
+        let mut slot = self.0.lock();
+        if let Some(old) = slot.as_ref() {
+            if !old.will_wake(waker) {
+                *slot = Some(waker.clone());
+            }
+        }
+    }
+
+    pub fn cancel(&self) {
+        let waker = self.0.lock().take();
+        drop(waker);
     }
 }
 
-impl PartialOrd for Timer {
-    fn partial_cmp(&self, other: &Self) -> Option<core::cmp::Ordering> {
-        Some(self.cmp(other))
+impl Drop for TimerHandle {
+    fn drop(&mut self) {
+        self.cancel();
     }
 }
 
-impl Eq for Timer {}
+/// length of a wheel tick in microseconds
+const WHEEL_TICK_US: u64 = 100;
+/// every level has 64 slots, each slot of a level spans a whole lower level
+const WHEEL_BITS: usize = 6;
+const WHEEL_SLOTS: usize = 1 << WHEEL_BITS;
+/// 64^6 ticks of 100us, about 79 days, farther timers wait in the top level
+const WHEEL_LEVELS: usize = 6;
+
+/// tick a timer can fire at, rounded up so it never fires early
+fn expire_tick(expire: Duration) -> u64 {
+    let us = u64::try_from(expire.as_micros()).unwrap_or(u64::MAX);
+    us.div_ceil(WHEEL_TICK_US)
+}
+
+fn current_tick() -> u64 {
+    get_time_duration().as_micros() as u64 / WHEEL_TICK_US
+}
+
+/// Hierarchical timing wheel of a single hart.
+///
+/// Timers within 64 ticks sit in level 0, one slot per tick. Farther ones
+/// sit in level n keyed by their n-th 6-bit digit, and are moved down a
+/// level each time the lower level wraps around onto their slot. Insertion
+/// is O(1) and every timer cascades at most once per level.
+struct TimerWheel {
+    /// next tick to be processed, every timer before it has fired
+    clk: u64,
+    slots: [[Vec<Timer>; WHEEL_SLOTS]; WHEEL_LEVELS],
+    /// timers queued per level
+    counts: [usize; WHEEL_LEVELS],
+}
+
+impl TimerWheel {
+    fn new() -> Self {
+        Self {
+            clk: current_tick(),
+            slots: array_init(|_| array_init(|_| Vec::new())),
+            counts: [0; WHEEL_LEVELS],
+        }
+    }
+
+    fn insert(&mut self, timer: Timer) {
+        let max_delta = (1u64 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+        let tick = expire_tick(timer.expire).clamp(self.clk, self.clk + max_delta);
+        let delta = tick - self.clk;
+        let level = (0..WHEEL_LEVELS)
+            .find(|&level| delta >> (WHEEL_BITS * (level + 1)) == 0)
+            .unwrap();
+        let slot = (tick >> (WHEEL_BITS * level)) as usize & (WHEEL_SLOTS - 1);
+        self.slots[level][slot].push(timer);
+        self.counts[level] += 1;
+    }
 
-impl PartialEq for Timer {
-    fn eq(&self, other: &Self) -> bool {
-        self.expire == other.expire
+    fn is_empty(&self) -> bool {
+        self.counts.iter().all(|&count| count == 0)
+    }
+
+    /// move the slots the clock has just reached down a level,
+    /// cancelled timers are dropped on the way
+    fn cascade(&mut self) {
+        for level in 1..WHEEL_LEVELS {
+            let idx = (self.clk >> (WHEEL_BITS * level)) as usize & (WHEEL_SLOTS - 1);
+            let timers = mem::take(&mut self.slots[level][idx]);
+            self.counts[level] -= timers.len();
+            for timer in timers {
+                if !timer.is_cancelled() {
+                    self.insert(timer);
+                }
+            }
+            if idx != 0 {
+                break;
+            }
+        }
+    }
+
+    /// run the clock up to `now`, collecting the expired timers so they
+    /// can be fired outside the lock
+    fn advance(&mut self, now: u64, expired: &mut Vec<Timer>) {
+        while self.clk <= now {
+            if self.is_empty() {
+                self.clk = now + 1;
+                break;
+            }
+            let idx = self.clk as usize & (WHEEL_SLOTS - 1);
+            if idx == 0 {
+                self.cascade();
+            } else if self.counts[0] == 0 {
+                // nothing until level 0 wraps around
+                self.clk = (now + 1).min((self.clk | (WHEEL_SLOTS as u64 - 1)) + 1);
+                continue;
+            }
+            let timers = mem::take(&mut self.slots[0][idx]);
+            self.counts[0] -= timers.len();
+            expired.extend(timers);
+            self.clk += 1;
+        }
+    }
+
+    /// earliest tick anything can happen at, a slot above level 0 counts
+    /// at the tick it cascades down
+    fn next_tick(&self) -> Option<u64> {
+        let mut next = None;
+        for level in 0..WHEEL_LEVELS {
+            if self.counts[level] == 0 {
+                continue;
+            }
+            let shift = WHEEL_BITS * level;
+            let cur = self.clk >> shift;
+            // the current slot of an upper level is a whole round ahead
+            let first = match level {
+                0 => 0,
+                _ => 1,
+            };
+            let tick = (first..=WHEEL_SLOTS as u64)
+                .find(|i| !self.slots[level][((cur + i) as usize) & (WHEEL_SLOTS - 1)].is_empty())
+                .map(|i| (cur + i) << shift);
+            next = match (next, tick) {
+                (Some(a), Some(b)) => Some(u64::min(a, b)),
+                (a, b) => a.or(b),
+            };
+        }
+        next
     }
 }
 
-/// `TimerManager` is responsible for managing all the timers in the system.
-/// It uses a thread-safe lock to protect a priority queue (binary heap) that
-/// stores the timers. The timers are stored in a `BinaryHeap` with their
-/// expiration times wrapped in `Reverse` to create a min-heap, ensuring that
-/// the timer with the earliest expiration time is at the top.
+/// `TimerManager` keeps a timing wheel per hart, a timer is queued on the
+/// hart that adds it and fired by that hart's [`timer_handler`], so the
+/// harts never contend on a shared timer queue.
 pub struct TimerManager {
-    /// A priority queue to store the timers. The queue is protected by a spin
-    /// lock to ensure thread-safe access. The timers are wrapped in
-    /// `Reverse` to maintain a min-heap.
-    timers: SpinLock<BinaryHeap<Reverse<Timer>>>,
+    wheels: [SpinLock<TimerWheel>; CPU_NUM],
 }
 
 impl TimerManager {
     fn new() -> Self {
         Self {
-            timers: SpinLock::new(BinaryHeap::new()),
+            wheels: array_init(|_| SpinLock::new(TimerWheel::new())),
         }
     }
 
     pub fn add_timer(&self, timer: Timer) {
         debug!("add new timer, next expiration {:?}", timer.expire);
-        self.timers.lock().push(Reverse(timer));
+        self.wheels[get_hartid()].lock().insert(timer);
+    }
+
+    /// add a waker timer that can be cancelled through the returned handle
+    pub fn add_waker_timer(&self, expire: Duration, waker: Waker) -> TimerHandle {
+        let shared = Arc::new(SpinLock::new(Some(waker)));
+        self.add_timer(Timer {
+            expire,
+            data: TimerData::Shared(shared.clone()),
+        });
+        TimerHandle(shared)
     }
 
     pub fn check(&self) {
-        let mut timers = self.timers.lock();
-        while let Some(timer) = timers.peek() {
-            let current_time = get_time_duration();
-            if current_time >= timer.0.expire {
-                trace!("timers len {}", timers.len());
-                debug!(
-                    "[Timer Manager] there is a timer expired, current:{:?}, expire:{:?}",
-                    current_time, timer.0.expire
-                );
-                let timer = timers.pop().unwrap().0;
-                if let Some(new_timer) = timer.callback() {
-                    timers.push(Reverse(new_timer));
-                }
-            } else {
-                break;
+        let wheel = &self.wheels[get_hartid()];
+        let mut expired = Vec::new();
+        wheel.lock().advance(current_tick(), &mut expired);
+        for timer in expired {
+            trace!("[Timer Manager] timer expired, expire: {:?}", timer.expire);
+            if let Some(new_timer) = timer.callback() {
+                self.add_timer(new_timer);
             }
         }
     }
+
+    /// when the current hart next has a timer to handle, if at all
+    pub fn next_deadline(&self) -> Option<Duration> {
+        let tick = self.wheels[get_hartid()].lock().next_tick()?;
+        Some(Duration::from_micros(tick.saturating_mul(WHEEL_TICK_US)))
+    }
 }
 
 pub static TIMER_MANAGER: Lazy<TimerManager> = Lazy::new(TimerManager::new);
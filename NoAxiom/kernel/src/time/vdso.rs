@@ -0,0 +1,78 @@
+//! vdso data page
+//!
+//! the vdso image of the arch crate serves clock_gettime, gettimeofday and
+//! time in user mode from the timer counter and this page, which is mapped
+//! read-only into every user space, the kernel only writes it when a clock
+//! is set, inside a sequence count the readers retry on
+
+use core::{
+    sync::atomic::{fence, AtomicU32, AtomicU64, Ordering},
+    time::Duration,
+};
+
+use arch::{Arch, ArchTime};
+
+use super::clock::ClockId;
+
+/// clock ids below it can be served by the vdso
+pub const VDSO_CLOCKS: usize = 8;
+
+/// layout shared with `vdso.S` of the arch crate
+#[repr(C, align(4096))]
+pub struct VdsoData {
+    /// odd while the page is being updated
+    seq: AtomicU32,
+    _pad: u32,
+    /// bit i is set if clock i is served by the vdso
+    clock_mask: AtomicU64,
+    /// timer ticks per second
+    freq: AtomicU64,
+    /// added to the time since boot of each clock
+    offset_ns: [AtomicU64; VDSO_CLOCKS],
+}
+
+#[allow(clippy::declare_interior_mutable_const)]
+const ZERO_U64: AtomicU64 = AtomicU64::new(0);
+
+pub static VDSO_DATA_PAGE: VdsoData = VdsoData {
+    seq: AtomicU32::new(0),
+    _pad: 0,
+    clock_mask: ZERO_U64,
+    freq: ZERO_U64,
+    offset_ns: [ZERO_U64; VDSO_CLOCKS],
+};
+
+impl VdsoData {
+    /// writers are serialized by the clock manager lock
+    fn update(&self, f: impl FnOnce(&Self)) {
+        self.seq.fetch_add(1, Ordering::Relaxed);
+        fence(Ordering::Release);
+        f(self);
+        self.seq.fetch_add(1, Ordering::Release);
+    }
+}
+
+/// serve the clocks the kernel keeps as an offset to the time since boot,
+/// cpu time clocks still go through the syscall
+pub fn vdso_init() {
+    VDSO_DATA_PAGE.update(|data| {
+        data.freq.store(Arch::get_freq() as u64, Ordering::Relaxed);
+        let mask = [
+            ClockId::CLOCK_REALTIME,
+            ClockId::CLOCK_MONOTONIC,
+            ClockId::CLOCK_MONOTONIC_RAW,
+            ClockId::CLOCK_REALTIME_COARSE,
+            ClockId::CLOCK_MONOTONIC_COARSE,
+        ]
+        .iter()
+        .fold(0, |mask, &clock| mask | 1 << clock as usize);
+        data.clock_mask.store(mask, Ordering::Relaxed);
+    });
+}
+
+/// publish a new offset of `clock`
+pub fn vdso_set_clock(clock: ClockId, offset: Duration) {
+    VDSO_DATA_PAGE.update(|data| {
+        data.offset_ns[clock as usize].store(offset.as_nanos() as u64, Ordering::Relaxed);
+    });
+}
@@ -5,7 +5,7 @@ use arch::{Arch, ArchTime, ExceptionType, InterruptType, PageFaultType, TrapType
 use kfuture::block::block_on;
 
 use crate::{
-    cpu::{current_cpu, current_task},
+    cpu::{current_cpu, current_task, current_user_task},
     fs::vfs::inc_interrupts_count,
     syscall::utils::current_syscall,
     trap::{ext_int::ext_int_handler, soft_int::soft_int_handler},
@@ -30,8 +30,7 @@ fn kernel_exception_handler(exception: ExceptionType) {
             PageFaultType::StorePageFault(addr)
             | PageFaultType::LoadPageFault(addr)
             | PageFaultType::InstructionPageFault(addr) => {
-                let task = current_cpu().task.as_mut();
-                if let Some(task) = task {
+                if let Some(task) = current_user_task() {
                     // fixme: currently this block_on cannot be canceled
                     warn!(
                         "[kernel] block on memory_validate, addr: {:#x}, syscall: {:?}",
@@ -71,7 +71,6 @@ pub fn send_ipi(to_hartid: usize, ipi_type: IpiType) {
     Arch::send_ipi(to_hartid);
 }
 
-#[allow(unused)]
 fn ipi_handler() {
     let info = current_ipi_info();
     trace!("ipi handler, from_hartid: {}", info.from_hartid);
@@ -81,17 +80,19 @@ fn ipi_handler() {
             Arch::tlb_flush();
         }
         IpiType::LoadBalance => {
-            info!("[IPI] load balance done, current hart is woken!!");
+            trace!("[IPI] woken to look for tasks");
         }
         _ => {
             info!("[IPI] unsupported ipi type");
         }
     }
-    Arch::clear_ipi();
 }
 
+/// the pending bit is cleared before the ipi info is read, an ipi sent
+/// meanwhile raises it again instead of being lost
 pub fn soft_int_handler() {
-    error!("soft int handler is not implemented yet!");
+    Arch::clear_soft_interrupt();
+    ipi_handler();
 }
 
 #[allow(unused)]
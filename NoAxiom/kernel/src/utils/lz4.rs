@@ -0,0 +1,142 @@
+//! lz4 block format
+//!
+//! a greedy single-probe compressor for buffers of at most 64 KiB, enough
+//! for pages, the output is a plain lz4 block any decoder can read
+
+/// shortest match encoded
+const MIN_MATCH: usize = 4;
+/// no match starts in the last bytes of the input
+const MF_LIMIT: usize = 12;
+/// the input always ends with this many literals
+const LAST_LITERALS: usize = 5;
+const HASH_LOG: u32 = 10;
+
+#[inline(always)]
+fn read_u32(buf: &[u8], pos: usize) -> u32 {
+    u32::from_le_bytes(buf[pos..pos + 4].try_into().unwrap())
+}
+
+#[inline(always)]
+fn hash(seq: u32) -> usize {
+    (seq.wrapping_mul(2654435761) >> (u32::BITS - HASH_LOG)) as usize
+}
+
+struct Writer<'a> {
+    dst: &'a mut [u8],
+    pos: usize,
+}
+
+impl Writer<'_> {
+    fn push(&mut self, byte: u8) -> Option<()> {
+        *self.dst.get_mut(self.pos)? = byte;
+        self.pos += 1;
+        Some(())
+    }
+    fn push_slice(&mut self, src: &[u8]) -> Option<()> {
+        self.dst
+            .get_mut(self.pos..self.pos + src.len())?
+            .copy_from_slice(src);
+        self.pos += src.len();
+        Some(())
+    }
+    /// the part of a length that doesn't fit the token nibble
+    fn push_len(&mut self, len: usize) -> Option<()> {
+        if len >= 15 {
+            let mut rest = len - 15;
+            while rest >= 255 {
+                self.push(255)?;
+                rest -= 255;
+            }
+            self.push(rest as u8)?;
+        }
+        Some(())
+    }
+    fn sequence(&mut self, literals: &[u8], offset: usize, match_len: usize) -> Option<()> {
+        let match_len = match_len - MIN_MATCH;
+        self.push((literals.len().min(15) as u8) << 4 | match_len.min(15) as u8)?;
+        self.push_len(literals.len())?;
+        self.push_slice(literals)?;
+        self.push_slice(&(offset as u16).to_le_bytes())?;
+        self.push_len(match_len)
+    }
+    fn last_literals(&mut self, literals: &[u8]) -> Option<()> {
+        self.push((literals.len().min(15) as u8) << 4)?;
+        self.push_len(literals.len())?;
+        self.push_slice(literals)
+    }
+}
+
+/// compress `src` into `dst`, returns the compressed size, or None if it
+/// doesn't fit
+pub fn compress(src: &[u8], dst: &mut [u8]) -> Option<usize> {
+    assert!(src.len() <= u16::MAX as usize);
+    // a stale position is harmless, every candidate is compared first
+    let mut table = [0u16; 1 << HASH_LOG];
+    let mut out = Writer { dst, pos: 0 };
+    let (mut anchor, mut pos) = (0, 0);
+    let limit = src.len().saturating_sub(MF_LIMIT);
+    while pos < limit {
+        let seq = read_u32(src, pos);
+        let slot = &mut table[hash(seq)];
+        let candidate = *slot as usize;
+        *slot = pos as u16;
+        if candidate >= pos || read_u32(src, candidate) != seq {
+            pos += 1;
+            continue;
+        }
+        let max_len = src.len() - LAST_LITERALS - pos;
+        let mut len = MIN_MATCH;
+        while len < max_len && src[candidate + len] == src[pos + len] {
+            len += 1;
+        }
+        out.sequence(&src[anchor..pos], pos - candidate, len)?;
+        pos += len;
+        anchor = pos;
+    }
+    out.last_literals(&src[anchor..])?;
+    Some(out.pos)
+}
+
+fn read_len(src: &[u8], pos: &mut usize, nibble: usize) -> Option<usize> {
+    let mut len = nibble;
+    if nibble == 15 {
+        loop {
+            let byte = *src.get(*pos)?;
+            *pos += 1;
+            len += byte as usize;
+            if byte != 255 {
+                break;
+            }
+        }
+    }
+    Some(len)
+}
+
+/// decompress the block `src` into `dst`, returns the decompressed size, or
+/// None if the block is malformed or doesn't fit
+pub fn decompress(src: &[u8], dst: &mut [u8]) -> Option<usize> {
+    let (mut pos, mut out) = (0, 0);
+    loop {
+        let token = *src.get(pos)? as usize;
+        pos += 1;
+        let literals = read_len(src, &mut pos, token >> 4)?;
+        dst.get_mut(out..out + literals)?
+            .copy_from_slice(src.get(pos..pos + literals)?);
+        pos += literals;
+        out += literals;
+        if pos == src.len() {
+            return Some(out);
+        }
+        let offset = u16::from_le_bytes([*src.get(pos)?, *src.get(pos + 1)?]) as usize;
+        pos += 2;
+        let len = read_len(src, &mut pos, token & 15)? + MIN_MATCH;
+        if offset == 0 || offset > out || out + len > dst.len() {
+            return None;
+        }
+        // the match may overlap its own output
+        for i in out..out + len {
+            dst[i] = dst[i - offset];
+        }
+        out += len;
+    }
+}
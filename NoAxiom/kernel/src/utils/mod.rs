@@ -4,6 +4,8 @@ pub mod crossover;
 pub mod hack;
 pub mod log;
 pub mod loghook;
+pub mod lz4;
+pub mod trace;
 pub mod utils;
 
 #[macro_use]
@@ -0,0 +1,122 @@
+//! kernel tracing counters
+//!
+//! they sit on hot paths, so every hart has its own copy updated with
+//! relaxed atomics only, the harts are summed up when a proc file is read,
+//! syscalls and locks are only timed with the `trace_stat` feature
+
+use core::sync::atomic::{AtomicU32, AtomicU64, Ordering};
+
+use crate::{config::cpu::CPU_NUM, cpu::get_hartid, include::syscall_id::SyscallID};
+
+/// whether syscalls are timed, see also [`ksync::stat::LOCK_STAT`]
+pub const TRACE_STAT: bool = cfg!(feature = "trace_stat");
+
+/// syscall ids from here on share the last slot
+pub const SYSCALL_SLOTS: usize = 512;
+/// bucket 0 is [0, 1us), bucket i is [2^(i-1), 2^i) us, the last one is
+/// open-ended
+pub const LATENCY_BUCKETS: usize = 16;
+
+#[repr(align(64))]
+struct HartSyscallStat {
+    hist: [[AtomicU32; LATENCY_BUCKETS]; SYSCALL_SLOTS],
+    total_ns: [AtomicU64; SYSCALL_SLOTS],
+    max_ns: [AtomicU64; SYSCALL_SLOTS],
+}
+
+// the tables are too large to be built on a stack, so they are static and
+// initialized at compile time
+#[allow(clippy::declare_interior_mutable_const)]
+const ZERO_U32: AtomicU32 = AtomicU32::new(0);
+#[allow(clippy::declare_interior_mutable_const)]
+const ZERO_U64: AtomicU64 = AtomicU64::new(0);
+#[allow(clippy::declare_interior_mutable_const)]
+const ZERO_HIST: [AtomicU32; LATENCY_BUCKETS] = [ZERO_U32; LATENCY_BUCKETS];
+#[allow(clippy::declare_interior_mutable_const)]
+const HART_SYSCALL_STAT_INIT: HartSyscallStat = HartSyscallStat {
+    hist: [ZERO_HIST; SYSCALL_SLOTS],
+    total_ns: [ZERO_U64; SYSCALL_SLOTS],
+    max_ns: [ZERO_U64; SYSCALL_SLOTS],
+};
+
+static SYSCALL_STAT: [HartSyscallStat; CPU_NUM] = [HART_SYSCALL_STAT_INIT; CPU_NUM];
+
+/// latencies of one syscall slot summed over the harts
+pub struct SyscallLatency {
+    pub hist: [u64; LATENCY_BUCKETS],
+    pub count: u64,
+    pub total_ns: u64,
+    pub max_ns: u64,
+}
+
+fn latency_bucket(ns: u64) -> usize {
+    let us = ns / 1000;
+    ((u64::BITS - us.leading_zeros()) as usize).min(LATENCY_BUCKETS - 1)
+}
+
+/// record a syscall that took `ns` from dispatch to return
+pub fn record_syscall(id: SyscallID, ns: u64) {
+    let slot = (id as isize as usize).min(SYSCALL_SLOTS - 1);
+    let stat = &SYSCALL_STAT[get_hartid()];
+    stat.hist[slot][latency_bucket(ns)].fetch_add(1, Ordering::Relaxed);
+    stat.total_ns[slot].fetch_add(ns, Ordering::Relaxed);
+    stat.max_ns[slot].fetch_max(ns, Ordering::Relaxed);
+}
+
+/// latencies of `slot`, None if it was never called
+pub fn syscall_latency(slot: usize) -> Option<SyscallLatency> {
+    let mut res = SyscallLatency {
+        hist: [0; LATENCY_BUCKETS],
+        count: 0,
+        total_ns: 0,
+        max_ns: 0,
+    };
+    for stat in SYSCALL_STAT.iter() {
+        for (sum, count) in res.hist.iter_mut().zip(stat.hist[slot].iter()) {
+            *sum += count.load(Ordering::Relaxed) as u64;
+        }
+        res.total_ns += stat.total_ns[slot].load(Ordering::Relaxed);
+        res.max_ns = res.max_ns.max(stat.max_ns[slot].load(Ordering::Relaxed));
+    }
+    res.count = res.hist.iter().sum();
+    (res.count > 0).then_some(res)
+}
+
+#[repr(align(64))]
+struct HartCacheStat {
+    hits: AtomicU64,
+    misses: AtomicU64,
+}
+
+/// hit and miss counters of a cache
+pub struct CacheStat([HartCacheStat; CPU_NUM]);
+
+#[allow(clippy::declare_interior_mutable_const)]
+const HART_CACHE_STAT_INIT: HartCacheStat = HartCacheStat {
+    hits: ZERO_U64,
+    misses: ZERO_U64,
+};
+
+impl CacheStat {
+    const fn new() -> Self {
+        Self([HART_CACHE_STAT_INIT; CPU_NUM])
+    }
+    pub fn hit(&self) {
+        self.0[get_hartid()].hits.fetch_add(1, Ordering::Relaxed);
+    }
+    pub fn miss(&self) {
+        self.0[get_hartid()].misses.fetch_add(1, Ordering::Relaxed);
+    }
+    /// hits and misses of all harts
+    pub fn sum(&self) -> (u64, u64) {
+        self.0.iter().fold((0, 0), |(hits, misses), stat| {
+            (
+                hits + stat.hits.load(Ordering::Relaxed),
+                misses + stat.misses.load(Ordering::Relaxed),
+            )
+        })
+    }
+}
+
+pub static BLOCK_CACHE_STAT: CacheStat = CacheStat::new();
+pub static PAGE_CACHE_STAT: CacheStat = CacheStat::new();
@@ -17,6 +17,8 @@ macro_rules! mem_const {
 pub const VA_WIDTH: usize = pt_const!(VA_WIDTH);
 /// index level number
 pub const INDEX_LEVELS: usize = pt_const!(INDEX_LEVELS);
+/// superpage support
+pub const SUPERPAGE: bool = pt_const!(SUPERPAGE);
 /// kernel address offset from phys to virt
 pub const KERNEL_ADDR_OFFSET: usize = mem_const!(KERNEL_ADDR_OFFSET);
 /// kernel IO address offset from phys to virt
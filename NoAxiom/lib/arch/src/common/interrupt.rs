@@ -13,6 +13,7 @@ pub trait ArchInt {
     // soft / timer interrupt
     fn enable_software_interrupt();
     fn enable_timer_interrupt();
+    fn clear_soft_interrupt();
 
     // user memory access
     fn enable_user_memory_access();
@@ -36,6 +36,8 @@ pub trait ArchPageTableEntry: Into<usize> + From<usize> + Clone {
     fn reset(&mut self);
     /// is valid dir
     fn is_allocated(&self) -> bool;
+    /// is a directory entry acting as the leaf of a superpage
+    fn is_huge(&self) -> bool;
 }
 
 pub trait ArchPageTable {
@@ -45,6 +47,8 @@ pub trait ArchPageTable {
     const VA_WIDTH: usize;
     /// index level number
     const INDEX_LEVELS: usize;
+    /// whether directory entries can be leaves mapping superpages
+    const SUPERPAGE: bool;
 
     fn root_ppn(&self) -> usize;
     fn new(root_ppn: usize) -> Self;
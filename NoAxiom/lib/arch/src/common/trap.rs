@@ -79,6 +79,10 @@ pub trait ArchTrap {
     fn read_trap_type(cx: &mut <Self as ArchTrap>::TrapContext) -> TrapType;
     fn check_read(addr: usize) -> UserPtrResult;
     fn check_write(addr: usize) -> UserPtrResult;
+    /// copy `len` bytes from `src` to `dst`, either may be a user address,
+    /// the first fault stops the copy and is returned, everything before
+    /// the faulting address has been copied
+    fn copy_user(dst: usize, src: usize, len: usize) -> UserPtrResult;
 }
 
 pub trait ArchTrapContext:
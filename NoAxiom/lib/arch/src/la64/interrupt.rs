@@ -39,6 +39,25 @@ pub(crate) fn enable_software_interrupt() {
     ecfg::set_lie(LineBasedInterrupt::SWI0 | LineBasedInterrupt::SWI1);
 }
 
+/// clear the pending ipi and soft ints, ipi status bits are cleared through
+/// the iocsr ipi clear register, swi bits live in estat.is[1..0]
+#[inline]
+pub(crate) fn clear_soft_interrupt() {
+    const IOCSR_IPI_CLEAR: usize = 0x100c;
+    unsafe {
+        core::arch::asm!(
+            "iocsrwr.w {val}, {addr}",
+            val = in(reg) u32::MAX as usize,
+            addr = in(reg) IOCSR_IPI_CLEAR,
+        );
+        core::arch::asm!(
+            "csrxchg {val}, {mask}, 0x5",
+            val = inout(reg) 0usize => _,
+            mask = in(reg) 0b11usize,
+        );
+    }
+}
+
 pub(crate) fn interrupt_init() {
     let inter = LineBasedInterrupt::TIMER;
     ecfg::set_lie(inter);
@@ -68,6 +87,9 @@ impl ArchInt for LA64 {
     fn enable_timer_interrupt() {
         enable_timer_interrupt();
     }
+    fn clear_soft_interrupt() {
+        clear_soft_interrupt();
+    }
     fn is_external_interrupt_enabled() -> bool {
         // let lie = ecfg::read().lie();
         // const MASK: usize = ((1 << 8) - 1) << 2;
@@ -163,6 +163,10 @@ impl ArchPageTableEntry for PageTableEntry {
     fn is_allocated(&self) -> bool {
         self.0 != 0
     }
+    /// huge pages are not handled by the tlb refill
+    fn is_huge(&self) -> bool {
+        false
+    }
 }
 
 impl PageTableEntry {
@@ -185,6 +189,7 @@ impl ArchPageTable for PageTable {
     type PageTableEntry = PageTableEntry;
     const VA_WIDTH: usize = VA_WIDTH;
     const INDEX_LEVELS: usize = INDEX_LEVELS;
+    const SUPERPAGE: bool = false;
 
     fn new(root_ppn: usize) -> Self {
         Self(root_ppn)
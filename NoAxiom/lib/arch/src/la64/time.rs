@@ -1,3 +1,5 @@
+use core::arch::global_asm;
+
 use loongArch64::{
     register::{tcfg, ticlr},
     time::{get_timer_freq, Time},
@@ -7,6 +9,9 @@ use spin::Lazy;
 use super::LA64;
 use crate::ArchTime;
 
+// rdtime is allowed in user mode, the vdso reads the counter directly
+global_asm!(include_str!("./vdso.S"));
+
 static FREQ: Lazy<usize> = Lazy::new(|| get_timer_freq());
 
 pub fn time_init() {
@@ -63,6 +63,7 @@ struct CheckResult {
 extern "C" {
     fn __try_read_user(ptr: usize) -> CheckResult;
     fn __try_write_user(ptr: usize) -> CheckResult;
+    fn __copy_user(dst: usize, src: usize, len: usize) -> CheckResult;
     fn __user_rw_exception_entry();
 }
 
@@ -108,6 +109,28 @@ unsafe fn check_write(ptr: usize) -> UserPtrResult {
     Ok(())
 }
 
+unsafe fn copy_user(dst: usize, src: usize, len: usize) -> UserPtrResult {
+    before_user_ptr();
+    let res = __copy_user(dst, src, len);
+    let res = match res.flag {
+        0 => Ok(()),
+        _ => {
+            let estat = Estat::from(res.estat);
+            let badv = badv::read().vaddr();
+            let trap_type = get_trap_type(None, estat, badv);
+            if !trap_type.is_pagefault() {
+                log::error!(
+                    "[copy_user] copy user ptr failed with unexpected trap {:?}",
+                    trap_type
+                );
+            }
+            Err(trap_type)
+        }
+    };
+    after_user_ptr();
+    res
+}
+
 #[no_mangle]
 pub unsafe extern "C" fn la_kernel_trap_handler(tf: &mut TrapContext) {
     let estat = estat::read();
@@ -261,4 +284,8 @@ impl ArchTrap for LA64 {
     fn check_write(addr: usize) -> UserPtrResult {
         unsafe { check_write(addr) }
     }
+    /// copy from or to user space
+    fn copy_user(dst: usize, src: usize, len: usize) -> UserPtrResult {
+        unsafe { copy_user(dst, src, len) }
+    }
 }
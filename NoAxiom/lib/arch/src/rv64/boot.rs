@@ -7,7 +7,7 @@ use config::{
 use sbi_rt::hart_start;
 
 use super::{context::freg_init, trap::trap_init, RV64};
-use crate::{rv64::memory::KERNEL_ADDR_OFFSET, ArchBoot};
+use crate::{rv64::memory::KERNEL_ADDR_OFFSET, ArchBoot, ArchTime};
 
 /// temp stack for kernel booting
 #[link_section = ".bss.kstack"]
@@ -132,6 +132,7 @@ impl ArchBoot for RV64 {
     fn arch_init() {
         trap_init();
         freg_init();
+        RV64::time_init();
     }
     // hart start
     fn hart_start(hartid: usize, start_addr: usize) {
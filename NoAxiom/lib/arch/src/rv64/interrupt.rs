@@ -60,6 +60,14 @@ pub fn enable_software_interrupt() {
     }
 }
 
+/// clear pending soft int
+#[inline(always)]
+pub fn clear_soft_interrupt() {
+    unsafe {
+        riscv::register::sip::clear_ssoft();
+    }
+}
+
 /// set supervisor timer int enabled
 #[inline(always)]
 pub fn enable_stimer_interrupt() {
@@ -132,6 +140,10 @@ impl ArchInt for RV64 {
     fn enable_timer_interrupt() {
         enable_stimer_interrupt();
     }
+    #[inline(always)]
+    fn clear_soft_interrupt() {
+        clear_soft_interrupt();
+    }
 
     // user memory access
     #[inline(always)]
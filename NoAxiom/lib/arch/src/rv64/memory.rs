@@ -68,6 +68,11 @@ impl ArchPageTableEntry for PageTableEntry {
     fn is_allocated(&self) -> bool {
         self.0 != 0
     }
+    /// a directory entry with any of R/W/X set is a leaf
+    fn is_huge(&self) -> bool {
+        self.raw_flag()
+            .intersects(PTEFlags::R | PTEFlags::W | PTEFlags::X)
+    }
 }
 
 impl PageTableEntry {
@@ -81,6 +86,7 @@ impl ArchPageTable for PageTable {
     type PageTableEntry = PageTableEntry;
     const VA_WIDTH: usize = VA_WIDTH;
     const INDEX_LEVELS: usize = INDEX_LEVELS;
+    const SUPERPAGE: bool = true;
     fn new(root_ppn: usize) -> Self {
         Self { root_ppn }
     }
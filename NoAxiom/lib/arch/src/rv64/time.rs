@@ -1,3 +1,5 @@
+use core::arch::{asm, global_asm};
+
 use riscv::register::time;
 use sbi_rt::set_timer;
 
@@ -12,8 +14,13 @@ const FREQ: usize = 4000000;
 #[cfg(not(feature = "vf2"))]
 const FREQ: usize = 12500000;
 
+global_asm!(include_str!("./vdso.S"));
+
 impl ArchTime for RV64 {
-    fn time_init() {}
+    /// let user mode read the time csr, the vdso relies on it
+    fn time_init() {
+        unsafe { asm!("csrs scounteren, {}", in(reg) 1 << 1) };
+    }
     fn get_freq() -> usize {
         FREQ
     }
@@ -28,6 +28,7 @@ extern "C" {
     fn __kernel_trapvec();
     fn __try_read_user(ptr: usize) -> CheckResult;
     fn __try_write_user(ptr: usize) -> CheckResult;
+    fn __copy_user(dst: usize, src: usize, len: usize) -> CheckResult;
     fn __kernel_user_ptr_vec();
     fn kernel_trap_handler(trap_type: &TrapType);
 }
@@ -98,6 +99,27 @@ unsafe fn check_write(ptr: usize) -> UserPtrResult {
     Ok(())
 }
 
+unsafe fn copy_user(dst: usize, src: usize, len: usize) -> UserPtrResult {
+    before_user_ptr();
+    let res = __copy_user(dst, src, len);
+    let res = match res.flag {
+        0 => Ok(()),
+        _ => {
+            let scause = MyScause::new(res.scause).bits();
+            let trap_type = get_trap_type(scause, stval::read());
+            if !trap_type.is_pagefault() {
+                log::error!(
+                    "[copy_user] copy user ptr failed with unexpected trap {:?}",
+                    trap_type
+                );
+            }
+            Err(trap_type)
+        }
+    };
+    after_user_ptr();
+    res
+}
+
 pub fn get_trap_type(scause: usize, stval: usize) -> TrapType {
     let scause = MyScause::new(scause);
     match scause.cause() {
@@ -189,4 +211,8 @@ impl ArchTrap for RV64 {
     fn check_write(addr: usize) -> UserPtrResult {
         unsafe { check_write(addr) }
     }
+    /// copy from or to user space
+    fn copy_user(dst: usize, src: usize, len: usize) -> UserPtrResult {
+        unsafe { copy_user(dst, src, len) }
+    }
 }
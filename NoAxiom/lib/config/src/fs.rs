@@ -14,9 +14,37 @@ pub const FAT32_BYTES_PER_CLUSTER_ID: usize = 4;
 
 /// The max LruCache size
 pub const MAX_LRU_CACHE_SIZE: usize = 2 * PAGE_SIZE;
+/// The number of shards of the block cache, sectors are hashed into shards
+pub const BLOCK_CACHE_SHARDS: usize = 16;
+/// The max sectors fetched by one block cache read-ahead or write-back
+pub const BLOCK_CACHE_MAX_BATCH: usize = 64;
+/// The read-ahead streams the block cache tells apart
+pub const BLOCK_CACHE_READ_AHEAD_STREAMS: usize = 32;
+/// The interval of the block cache background flusher in milliseconds
+pub const BLOCK_CACHE_FLUSH_INTERVAL_MS: u64 = 1000;
+/// The max sectors of one merged request of the block queue
+pub const BLOCK_QUEUE_MAX_SECTORS: usize = 256;
+/// The max merged requests the block queue keeps in flight
+pub const BLOCK_QUEUE_DEPTH: usize = 4;
+/// The times an idle block queue yields before dispatching, so that
+/// concurrent submitters can join the batch
+pub const BLOCK_QUEUE_PLUG_YIELDS: usize = 2;
+/// The deadlines of queued block reads and writes in milliseconds
+pub const BLOCK_QUEUE_READ_EXPIRE_MS: usize = 500;
+pub const BLOCK_QUEUE_WRITE_EXPIRE_MS: usize = 5000;
 /// The proportion of pagecache frames in the frame allocator
 /// PAGE_CACHE_SIZE = frame_total / PAGE_CACHE_PROPORTION
 pub const PAGE_CACHE_PROPORTION: usize = 5;
+/// The interval of the page cache background flusher in milliseconds
+pub const PAGE_CACHE_FLUSH_INTERVAL_MS: u64 = 2000;
+/// The max consecutive dirty pages written back with one request
+pub const PAGE_CACHE_WRITEBACK_BATCH: usize = 64;
+/// The initial and max read-ahead window of a file in pages
+pub const READ_AHEAD_MIN_PAGES: usize = 4;
+pub const READ_AHEAD_MAX_PAGES: usize = 128;
+/// The number of buckets of the dentry cache and the max entries per bucket
+pub const DCACHE_BUCKETS: usize = 1024;
+pub const DCACHE_BUCKET_CAP: usize = 8;
 
 pub const IS_DELETED: u8 = 0xe5;
 pub const SPACE: u8 = 0x20;
@@ -36,6 +64,6 @@ pub const ROOT_FAKE_ENTRY: [u8; 32] = {
     entry
 };
 
-pub const PIPE_BUF_SIZE: usize = PAGE_SIZE;
+pub const PIPE_BUF_SIZE: usize = PAGE_SIZE * 16;
 
 use crate::mm::PAGE_SIZE;
@@ -37,3 +37,43 @@ pub const DL_INTERP_OFFSET: usize = USER_MEMORY_END + 0x10_0000_0000;
 
 /// signal trampoline address
 pub const SIG_TRAMPOLINE: usize = USER_MEMORY_END - PAGE_SIZE;
+
+/// vdso image address, right below the signal trampoline
+pub const VDSO_BASE: usize = SIG_TRAMPOLINE - PAGE_SIZE;
+
+/// vdso data page address, the image finds it right below itself
+pub const VDSO_DATA: usize = VDSO_BASE - PAGE_SIZE;
+
+/// max order of physically contiguous frame blocks: 2^10 pages, 4MB
+pub const FRAME_MAX_ORDER: usize = 10;
+/// max frames cached by the per-hart frame magazine
+pub const FRAME_MAGAZINE_SIZE: usize = 64;
+/// frames moved between a magazine and the buddy allocator at once
+pub const FRAME_MAGAZINE_BATCH: usize = 32;
+/// max zeroed frames kept by the per-hart zero pool
+pub const FRAME_ZERO_POOL_SIZE: usize = 64;
+/// frames zeroed into a pool each time its hart goes idle
+pub const FRAME_ZERO_POOL_BATCH: usize = 16;
+
+/// zram swaps anonymous pages out once the free frames fall below
+/// frame_total / ZRAM_LOW_WATERMARK_PROPORTION, until they are above
+/// frame_total / ZRAM_HIGH_WATERMARK_PROPORTION
+pub const ZRAM_LOW_WATERMARK_PROPORTION: usize = 16;
+pub const ZRAM_HIGH_WATERMARK_PROPORTION: usize = 8;
+/// pages compressing to more bytes than this stay in memory
+pub const ZRAM_MAX_COMPRESSED: usize = 3072;
+/// compressed pages are stored in slots of a multiple of this size
+pub const ZRAM_CLASS_ALIGN: usize = 64;
+/// the interval of the zram reclaim task in milliseconds
+pub const ZRAM_RECLAIM_INTERVAL_MS: u64 = 100;
+/// pages swapped out of one address space before moving to the next
+pub const ZRAM_RECLAIM_BATCH: usize = 32;
+
+/// max object size served by the per-hart heap slabs
+pub const HEAP_SLAB_MAX_SIZE: usize = 2048;
+/// bytes taken from the buddy heap and carved into slab objects at once
+pub const HEAP_SLAB_CHUNK_SIZE: usize = 16 * 1024;
+/// max free objects of one size class cached by a hart
+pub const HEAP_SLAB_CACHE_SIZE: usize = 128;
+/// objects moved between a hart cache and the shared depot at once
+pub const HEAP_SLAB_BATCH: usize = 32;
@@ -5,8 +5,8 @@ use arch::consts::KERNEL_ADDR_OFFSET;
 use include::errno::Errno;
 use ksync::cell::SyncUnsafeCell;
 use memory::{
-    address::{PhysAddr, PhysPageNum, StepOne},
-    frame::{frame_alloc_some_zero_inited, frame_dealloc, FrameTracker},
+    address::{PhysAddr, PhysPageNum},
+    frame::{frame_alloc_some_zero_inited, FrameTracker},
 };
 use virtio_drivers::{
     BufferDirection,
@@ -31,12 +31,11 @@ unsafe impl Hal for VirtioHalImpl {
         (paddr.raw(), vaddr)
     }
     unsafe fn dma_dealloc(paddr: VirtioPhysAddr, _vaddr: NonNull<u8>, pages: usize) -> i32 {
-        let pa = PhysAddr::from(paddr);
-        let mut ppn_base: PhysPageNum = pa.into();
-        for _ in 0..pages {
-            frame_dealloc(ppn_base);
-            ppn_base.step();
-        }
+        let ppn_base = PhysPageNum::from(PhysAddr::from(paddr)).raw();
+        // dropping the trackers gives the frames back
+        FRAMES
+            .as_ref_mut()
+            .retain(|frame| !(ppn_base..ppn_base + pages).contains(&frame.ppn().raw()));
         0
     }
     #[inline]
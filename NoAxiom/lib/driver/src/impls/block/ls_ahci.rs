@@ -7,20 +7,179 @@
 //!     interrupts = <0x00000013>;
 //!     dma-mask = <0x00000000 0xffffffff>;
 //! };
+//!
+//! Every command slot of the port is managed by [`AhciEngine`]. A request
+//! takes a free slot, issues the command (FPDMA QUEUED when the disk supports
+//! NCQ) and awaits [`AhciCmdFuture`], which is completed by the port
+//! interrupt. Before any interrupt is observed the future re-polls the port
+//! by yielding, so boards without routed AHCI interrupts still work without
+//! pinning the hart.
+//!
+//! Vectored requests are split into commands whose segments fit the PRDT of
+//! a single command table, so a scatter-gather list usually costs one command.
+
+use alloc::{boxed::Box, collections::vec_deque::VecDeque, vec::Vec};
+use core::{
+    future::Future,
+    pin::Pin,
+    sync::atomic::{AtomicBool, Ordering},
+    task::{Context, Poll, Waker},
+};
 
+use array_init::array_init;
 use config::fs::BLOCK_SIZE;
-use driver_ahci::AhciDevice;
+use driver_ahci::{AhciDevice, AhciIovec};
 use include::errno::Errno;
+use kfuture::block::block_on;
+use ksync::{mutex::SpinLock, AsyncMutex};
 
 use crate::{
     basic::{BlockDeviceType, DevResult, Device, DeviceTreeInfo, DeviceType},
-    block::BlockDevice,
+    block::{BlockDevice, BlockSegment},
     interrupt::InterruptDevice,
     probe::basic::DeviceConfigType,
 };
 
+const AHCI_MAX_SLOTS: usize = 32;
+
+/// reaps a cancelled command waits for before the port is reset
+const AHCI_CANCEL_SPIN_LIMIT: usize = 1 << 20;
+
+const READ_CMD: u32 = 0;
+const WRITE_CMD: u32 = 1;
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum SlotState {
+    Free,
+    Issued,
+    Done,
+    Failed,
+}
+
+struct SlotInfo {
+    state: SlotState,
+    waker: Option<Waker>,
+}
+
+impl SlotInfo {
+    fn new() -> Self {
+        Self {
+            state: SlotState::Free,
+            waker: None,
+        }
+    }
+}
+
+/// command slot bookkeeping of the enabled ahci port
+struct AhciEngine {
+    /// bitmap of slots that can be allocated
+    free: u32,
+    /// bitmap of slots whose command has been issued to the controller
+    issued: u32,
+    slots: [SlotInfo; AHCI_MAX_SLOTS],
+    /// tasks waiting for a free slot, by the ticket of their future
+    slot_waiters: VecDeque<(usize, Waker)>,
+    next_ticket: usize,
+}
+
+impl AhciEngine {
+    fn new(depth: u32) -> Self {
+        let free = match depth as usize {
+            AHCI_MAX_SLOTS => u32::MAX,
+            depth => (1 << depth) - 1,
+        };
+        Self {
+            free,
+            issued: 0,
+            slots: array_init(|_| SlotInfo::new()),
+            slot_waiters: VecDeque::new(),
+            next_ticket: 0,
+        }
+    }
+
+    fn alloc_slot(&mut self) -> Option<u32> {
+        if self.free == 0 {
+            return None;
+        }
+        let slot = self.free.trailing_zeros();
+        self.free &= !(1 << slot);
+        Some(slot)
+    }
+
+    fn release_slot(&mut self, slot: u32, wakers: &mut Vec<Waker>) {
+        let info = &mut self.slots[slot as usize];
+        info.state = SlotState::Free;
+        info.waker = None;
+        self.free |= 1 << slot;
+        if let Some((_, waker)) = self.slot_waiters.pop_front() {
+            wakers.push(waker);
+        }
+    }
+
+    /// queue the waiter `ticket`, or refresh its waker if already queued
+    fn wait_slot(&mut self, ticket: usize, waker: &Waker) {
+        match self.slot_waiters.iter_mut().find(|(t, _)| *t == ticket) {
+            Some((_, queued)) if queued.will_wake(waker) => {}
+            Some((_, queued)) => *queued = waker.clone(),
+            None => self.slot_waiters.push_back((ticket, waker.clone())),
+        }
+    }
+
+    /// dequeue the waiter `ticket`, returns whether it was still queued
+    fn cancel_wait(&mut self, ticket: usize) -> bool {
+        let len = self.slot_waiters.len();
+        self.slot_waiters.retain(|(t, _)| *t != ticket);
+        self.slot_waiters.len() != len
+    }
+
+    /// collect completed commands, wakers of finished slots are pushed into
+    /// `wakers` and should be woken after the engine lock is released
+    fn reap(&mut self, dev: &AhciDevice, wakers: &mut Vec<Waker>) {
+        if self.issued == 0 {
+            return;
+        }
+        let mut active: u32 = 0;
+        match dev.ahci_port_poll(&mut active) {
+            0 => self.finish(self.issued & !active, SlotState::Done, wakers),
+            _ => self.abort(dev, wakers),
+        }
+    }
+
+    /// reset the port, which aborts every outstanding command on it
+    fn abort(&mut self, dev: &AhciDevice, wakers: &mut Vec<Waker>) {
+        dev.ahci_port_recover();
+        self.finish(self.issued, SlotState::Failed, wakers);
+    }
+
+    /// end the commands of the `finished` slots with `state`
+    fn finish(&mut self, finished: u32, state: SlotState, wakers: &mut Vec<Waker>) {
+        self.issued &= !finished;
+        let mut bits = finished;
+        while bits != 0 {
+            let slot = bits.trailing_zeros() as usize;
+            bits &= !(1 << slot);
+            let info = &mut self.slots[slot];
+            info.state = state;
+            if let Some(waker) = info.waker.take() {
+                wakers.push(waker);
+            }
+        }
+    }
+}
+
+fn wake_all(wakers: Vec<Waker>) {
+    for waker in wakers {
+        waker.wake();
+    }
+}
+
 pub struct LsAhciDevice {
     device: AhciDevice,
+    engine: SpinLock<AhciEngine>,
+    /// whether the port interrupt has ever been delivered to us
+    irq_seen: AtomicBool,
+    /// flush must run with no other command in flight
+    flush_lock: AsyncMutex<()>,
 }
 
 const DEVICE_TYPE: DeviceType = DeviceType::Block(BlockDeviceType::LS2k1000Ahci);
@@ -45,51 +204,298 @@ impl LsAhciDevice {
         const BASE_ADDR: usize = 0x400e0000;
         assert!(BASE_ADDR == base_addr);
         let device = AhciDevice::new(base_addr)?;
-        Ok(LsAhciDevice { device })
+        let depth = device.ahci_sata_queue_depth();
+        log::info!("[ls-ahci] command engine with {} slots", depth);
+        Ok(LsAhciDevice {
+            device,
+            engine: SpinLock::new(AhciEngine::new(depth)),
+            irq_seen: AtomicBool::new(false),
+            flush_lock: AsyncMutex::new(()),
+        })
+    }
+
+    fn queue_depth(&self) -> u32 {
+        self.device.ahci_sata_queue_depth()
+    }
+
+    fn release_slot(&self, slot: u32) {
+        let mut wakers = Vec::new();
+        self.engine.lock().release_slot(slot, &mut wakers);
+        wake_all(wakers);
+    }
+
+    /// issue the command on `slot`, the slot is marked as issued under the
+    /// engine lock so that a concurrent reap never treats it as finished
+    fn submit(&self, slot: u32, issue: impl FnOnce(&AhciDevice) -> i32) -> DevResult<()> {
+        let mut engine = self.engine.lock();
+        match issue(&self.device) {
+            0 => {
+                let info = &mut engine.slots[slot as usize];
+                info.state = SlotState::Issued;
+                info.waker = None;
+                engine.issued |= 1 << slot;
+                Ok(())
+            }
+            _ => Err(Errno::EIO),
+        }
+    }
+
+    /// run one read/write command on a free slot and wait for its completion
+    async fn rw_once(&self, blknr: usize, iov: &[AhciIovec], is_write: u32) -> DevResult<()> {
+        let slot = AhciSlotFuture::new(self).await;
+        if let Err(err) = self.submit(slot, |dev| {
+            dev.ahci_sata_issue_rw_iov(slot, blknr as u64, iov.as_ptr(), iov.len() as u32, is_write)
+        }) {
+            self.release_slot(slot);
+            return Err(err);
+        }
+        AhciCmdFuture::new(self, slot).await
+    }
+
+    async fn rw_flush(&self, blknr: usize, iov: &[AhciIovec], is_write: u32) -> DevResult<()> {
+        self.rw_once(blknr, iov, is_write).await.inspect_err(|_| {
+            log::error!(
+                "ls-ahci {} error, blknr: {}, segments: {:x?}",
+                if is_write != 0 { "write" } else { "read" },
+                blknr,
+                iov
+            );
+        })
+    }
+
+    /// split the segments into commands limited by the prdt length and the
+    /// max transfer blocks, commands of one request are issued in order
+    async fn rw(&self, id: usize, segs: &[BlockSegment], is_write: u32) -> DevResult<usize> {
+        let max_blks = self.device.ahci_sata_max_blocks() as usize;
+        let max_sg = self.device.ahci_sata_max_segments() as usize;
+        let sg_size = self.device.ahci_sata_max_segment_size() as usize;
+        let mut blknr = id;
+        let mut blks = 0;
+        let mut iov = Vec::with_capacity(segs.len().min(max_sg));
+        for seg in segs {
+            if seg.len % BLOCK_SIZE != 0 {
+                return Err(Errno::EINVAL);
+            }
+            let mut paddr = seg.paddr;
+            let mut len = seg.len;
+            while len != 0 {
+                if blks == max_blks || iov.len() == max_sg {
+                    self.rw_flush(blknr, &iov, is_write).await?;
+                    blknr += blks;
+                    blks = 0;
+                    iov.clear();
+                }
+                let n = len.min(sg_size).min((max_blks - blks) * BLOCK_SIZE);
+                iov.push(AhciIovec {
+                    addr: paddr as u64,
+                    len: n as u64,
+                });
+                blks += n / BLOCK_SIZE;
+                paddr += n;
+                len -= n;
+            }
+        }
+        if blks != 0 {
+            self.rw_flush(blknr, &iov, is_write).await?;
+        }
+        Ok(segs.iter().map(|seg| seg.len).sum())
+    }
+
+    /// flush the disk write cache, all slots are drained during the flush
+    async fn flush(&self) -> DevResult<()> {
+        if !self.device.ahci_sata_need_flush() {
+            return Ok(());
+        }
+        let _guard = self.flush_lock.lock().await;
+        let mut slots = Vec::with_capacity(self.queue_depth() as usize);
+        for _ in 0..self.queue_depth() {
+            slots.push(AhciSlotFuture::new(self).await);
+        }
+        let slot = slots.pop().unwrap();
+        let res = match self.submit(slot, |dev| dev.ahci_sata_issue_flush(slot)) {
+            Ok(()) => AhciCmdFuture::new(self, slot).await,
+            Err(err) => {
+                self.release_slot(slot);
+                Err(err)
+            }
+        };
+        for slot in slots {
+            self.release_slot(slot);
+        }
+        res
+    }
+}
+
+/// future to acquire a free command slot, it's queued as one waiter however
+/// often it's polled and leaves the queue once done or dropped
+struct AhciSlotFuture<'a> {
+    dev: &'a LsAhciDevice,
+    /// set once it went pending
+    ticket: Option<usize>,
+}
+
+impl<'a> AhciSlotFuture<'a> {
+    fn new(dev: &'a LsAhciDevice) -> Self {
+        Self { dev, ticket: None }
+    }
+}
+
+impl Future for AhciSlotFuture<'_> {
+    type Output = u32;
+    fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Self::Output> {
+        let this = self.get_mut();
+        let mut engine = this.dev.engine.lock();
+        match engine.alloc_slot() {
+            Some(slot) => {
+                if let Some(ticket) = this.ticket.take() {
+                    engine.cancel_wait(ticket);
+                }
+                Poll::Ready(slot)
+            }
+            None => {
+                let ticket = *this.ticket.get_or_insert_with(|| {
+                    engine.next_ticket += 1;
+                    engine.next_ticket
+                });
+                engine.wait_slot(ticket, cx.waker());
+                Poll::Pending
+            }
+        }
+    }
+}
+
+impl Drop for AhciSlotFuture<'_> {
+    fn drop(&mut self) {
+        let Some(ticket) = self.ticket else {
+            return;
+        };
+        let mut engine = self.dev.engine.lock();
+        // a wakeup for a released slot that came too late is passed on
+        if !engine.cancel_wait(ticket) && engine.free != 0 {
+            if let Some((_, waker)) = engine.slot_waiters.pop_front() {
+                drop(engine);
+                waker.wake();
+            }
+        }
+    }
+}
+
+/// future of an issued command, it owns the slot until completion
+struct AhciCmdFuture<'a> {
+    dev: &'a LsAhciDevice,
+    slot: u32,
+    finished: bool,
+}
+
+impl<'a> AhciCmdFuture<'a> {
+    fn new(dev: &'a LsAhciDevice, slot: u32) -> Self {
+        Self {
+            dev,
+            slot,
+            finished: false,
+        }
+    }
+
+    /// reap the port and release the slot once its command has finished
+    fn try_complete(&mut self, waker: Option<&Waker>) -> Option<DevResult<()>> {
+        let mut wakers = Vec::new();
+        let res = {
+            let mut engine = self.dev.engine.lock();
+            engine.reap(&self.dev.device, &mut wakers);
+            match engine.slots[self.slot as usize].state {
+                SlotState::Issued => {
+                    engine.slots[self.slot as usize].waker = waker.cloned();
+                    None
+                }
+                state => {
+                    engine.release_slot(self.slot, &mut wakers);
+                    match state {
+                        SlotState::Done => Some(Ok(())),
+                        _ => Some(Err(Errno::EIO)),
+                    }
+                }
+            }
+        };
+        wake_all(wakers);
+        if res.is_some() {
+            self.finished = true;
+        }
+        res
+    }
+}
+
+impl Future for AhciCmdFuture<'_> {
+    type Output = DevResult<()>;
+    fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Self::Output> {
+        let this = self.get_mut();
+        match this.try_complete(Some(cx.waker())) {
+            Some(res) => Poll::Ready(res),
+            None => {
+                if !this.dev.irq_seen.load(Ordering::Acquire) {
+                    // no interrupt is routed to us yet, poll again later
+                    cx.waker().wake_by_ref();
+                }
+                Poll::Pending
+            }
+        }
+    }
+}
+
+impl Drop for AhciCmdFuture<'_> {
+    /// the controller may still dma into the caller's buffer, so a cancelled
+    /// command must be waited out before returning, this spins only when
+    /// the caller gives up on a command in flight, and a command that
+    /// doesn't finish within [`AHCI_CANCEL_SPIN_LIMIT`] reaps is aborted by
+    /// resetting the port, which also fails the other commands in flight
+    fn drop(&mut self) {
+        let mut spins = 0;
+        while !self.finished {
+            if spins == AHCI_CANCEL_SPIN_LIMIT {
+                log::error!("[ls-ahci] cancelled command on slot {} hangs", self.slot);
+                let mut wakers = Vec::new();
+                self.dev.engine.lock().abort(&self.dev.device, &mut wakers);
+                wake_all(wakers);
+            }
+            spins += 1;
+            core::hint::spin_loop();
+            self.try_complete(None);
+        }
     }
 }
 
 impl InterruptDevice for LsAhciDevice {
     fn handle_irq(&self) -> DevResult<()> {
-        unimplemented!()
+        self.irq_seen.store(true, Ordering::Release);
+        let mut wakers = Vec::new();
+        self.engine.lock().reap(&self.device, &mut wakers);
+        wake_all(wakers);
+        Ok(())
     }
 }
 
+#[async_trait::async_trait]
 impl BlockDevice for LsAhciDevice {
     fn sync_read(&self, id: usize, buf: &mut [u8]) -> DevResult<usize> {
-        let blknr = id as u64;
-        let blkcnt = (buf.len() / BLOCK_SIZE) as u32;
-        let buffer = buf.as_ptr() as *mut u8;
-        let res = self.device.ahci_sata_read_common(blknr, blkcnt, buffer);
-        match res {
-            0 => {
-                log::error!(
-                    "ls-ahci read error, blknr: {}, blkcnt: {}, buf: {:p}",
-                    blknr,
-                    blkcnt,
-                    buffer
-                );
-                Err(Errno::EIO)
-            }
-            _ => Ok(buf.len()),
-        }
+        block_on(self.rw(id, &[BlockSegment::from_kernel_buf_mut(buf)], READ_CMD))
     }
     fn sync_write(&self, id: usize, buf: &[u8]) -> DevResult<usize> {
-        let blknr = id as u64;
-        let blkcnt = (buf.len() / BLOCK_SIZE) as u32;
-        let buffer = buf.as_ptr() as *mut u8;
-        let res = self.device.ahci_sata_write_common(blknr, blkcnt, buffer);
-        match res {
-            0 => {
-                log::error!(
-                    "ls-ahci write error, blknr: {}, blkcnt: {}, buf: {:p}",
-                    blknr,
-                    blkcnt,
-                    buffer
-                );
-                Err(Errno::EIO)
-            }
-            _ => Ok(buf.len()),
-        }
+        block_on(self.rw(id, &[BlockSegment::from_kernel_buf(buf)], WRITE_CMD))
+    }
+    async fn read(&self, id: usize, buf: &mut [u8]) -> DevResult<usize> {
+        self.rw(id, &[BlockSegment::from_kernel_buf_mut(buf)], READ_CMD)
+            .await
+    }
+    async fn write(&self, id: usize, buf: &[u8]) -> DevResult<usize> {
+        self.rw(id, &[BlockSegment::from_kernel_buf(buf)], WRITE_CMD)
+            .await
+    }
+    async fn read_vectored(&self, id: usize, segs: &[BlockSegment]) -> DevResult<usize> {
+        self.rw(id, segs, READ_CMD).await
+    }
+    async fn write_vectored(&self, id: usize, segs: &[BlockSegment]) -> DevResult<usize> {
+        self.rw(id, segs, WRITE_CMD).await
+    }
+    async fn sync_all(&self) -> DevResult<()> {
+        self.flush().await
     }
 }
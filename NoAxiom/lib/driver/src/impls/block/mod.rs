@@ -2,12 +2,61 @@ pub mod ls_ahci;
 pub mod vf2_sdcard;
 pub mod virtio_block;
 use alloc::boxed::Box;
+use core::slice;
+
+use arch::consts::KERNEL_ADDR_OFFSET;
+use config::fs::BLOCK_SIZE;
+use include::errno::Errno;
+use memory::utils::kernel_va_to_pa;
 
 use crate::{
     basic::{DevResult, Device},
     interrupt::InterruptDevice,
 };
 
+/// a physically contiguous piece of memory used by vectored block io,
+/// the length should be a multiple of [`BLOCK_SIZE`]
+///
+/// segments only describe kernel memory, user buffers reach the disk through
+/// the page cache, whose pages map onto one segment each
+#[derive(Debug, Clone, Copy)]
+pub struct BlockSegment {
+    pub paddr: usize,
+    pub len: usize,
+}
+
+impl BlockSegment {
+    pub fn new(paddr: usize, len: usize) -> Self {
+        Self { paddr, len }
+    }
+
+    /// build a segment from a buffer in the kernel linear mapping, only for
+    /// the device to read from, see [`Self::from_kernel_buf_mut`]
+    pub fn from_kernel_buf(buf: &[u8]) -> Self {
+        Self::new(kernel_va_to_pa(buf.as_ptr() as usize), buf.len())
+    }
+
+    /// build a segment the device may write into, e.g. the target of a read
+    pub fn from_kernel_buf_mut(buf: &mut [u8]) -> Self {
+        Self::new(kernel_va_to_pa(buf.as_mut_ptr() as usize), buf.len())
+    }
+
+    /// access the segment through the kernel linear mapping
+    ///
+    /// # Safety
+    /// the caller should own the memory described by the segment
+    pub unsafe fn as_kernel_buf(&self) -> &'static mut [u8] {
+        slice::from_raw_parts_mut((self.paddr | KERNEL_ADDR_OFFSET) as *mut u8, self.len)
+    }
+
+    fn blocks(&self) -> DevResult<usize> {
+        match self.len % BLOCK_SIZE {
+            0 => Ok(self.len / BLOCK_SIZE),
+            _ => Err(Errno::EINVAL),
+        }
+    }
+}
+
 #[async_trait::async_trait]
 #[allow(unused_variables)]
 pub trait BlockDevice: Send + Sync + Device + InterruptDevice {
@@ -23,7 +72,34 @@ pub trait BlockDevice: Send + Sync + Device + InterruptDevice {
     async fn write(&self, id: usize, buf: &[u8]) -> DevResult<usize> {
         self.sync_write(id, buf)
     }
+    /// read consecutive blocks starting from `id` into `segs` in order,
+    /// devices supporting scatter-gather dma should override this
+    async fn read_vectored(&self, id: usize, segs: &[BlockSegment]) -> DevResult<usize> {
+        let mut id = id;
+        let mut total = 0;
+        for seg in segs {
+            let blocks = seg.blocks()?;
+            self.read(id, unsafe { seg.as_kernel_buf() }).await?;
+            id += blocks;
+            total += seg.len;
+        }
+        Ok(total)
+    }
+    /// write `segs` in order to consecutive blocks starting from `id`
+    async fn write_vectored(&self, id: usize, segs: &[BlockSegment]) -> DevResult<usize> {
+        let mut id = id;
+        let mut total = 0;
+        for seg in segs {
+            let blocks = seg.blocks()?;
+            self.write(id, unsafe { seg.as_kernel_buf() }).await?;
+            id += blocks;
+            total += seg.len;
+        }
+        Ok(total)
+    }
+    /// make the completed writes durable, devices with a volatile write
+    /// cache should override this
     async fn sync_all(&self) -> DevResult<()> {
-        unimplemented!("{} not implement sync_all!", self.device_name())
+        Ok(())
     }
 }
@@ -1,113 +1,243 @@
-use alloc::boxed::Box;
+use alloc::{
+    boxed::Box,
+    collections::{BTreeMap, VecDeque},
+    vec::Vec,
+};
 use core::{
     future::Future,
-    task::{Poll, Waker},
+    hint::spin_loop,
+    marker::PhantomData,
+    pin::Pin,
+    slice,
+    task::{Context, Poll, Waker},
 };
 
-use arch::{Arch, ArchInt};
 use async_trait::async_trait;
-use ksync::{
-    async_mutex::{AsyncMutex, AsyncMutexGuard},
-    cell::SyncUnsafeCell,
-};
+use include::errno::Errno;
+use ksync::mutex::SpinLock;
 use virtio_drivers::{
     device::blk::{BlkReq, BlkResp, RespStatus, VirtIOBlk},
     transport::Transport,
+    Error,
 };
 
 use crate::{
     basic::{DevResult, Device},
-    block::BlockDevice,
+    block::{BlockDevice, BlockSegment},
     hal::{dev_err, VirtioHalImpl},
     interrupt::InterruptDevice,
 };
 
+/// whether the device interrupt is routed to us, otherwise requests are
+/// completed by the submitters polling the used ring
+const IRQ_COMPLETION: bool = cfg!(feature = "intable");
+
+/// a request handed to the device, the header, status and data buffer
+/// must stay in place until the device returns the descriptor chain
+struct InflightRequest {
+    id: u64,
+    request: Box<BlkReq>,
+    response: Box<BlkResp>,
+    buf: *mut u8,
+    len: usize,
+    is_write: bool,
+}
+
+// the data buffer is borrowed by the submitter until the request completes
+unsafe impl Send for InflightRequest {}
+
+enum RequestState {
+    Waiting(Option<Waker>),
+    Done(DevResult<()>),
+}
+
 struct VirioBlkInner<T: Transport> {
     blk: VirtIOBlk<VirtioHalImpl, T>,
+    /// requests on the virtqueue, keyed by descriptor token
+    inflight: BTreeMap<u16, InflightRequest>,
+    /// requests not yet collected by the submitter, keyed by request id,
+    /// tokens are reused by the device so they can't identify a request
+    states: BTreeMap<u64, RequestState>,
+    /// submitters waiting for free descriptors
+    queue_waiters: VecDeque<Waker>,
+    next_id: u64,
 }
 
 impl<T: Transport> VirioBlkInner<T> {
-    fn sync_read(&mut self, id: usize, buf: &mut [u8]) -> DevResult<usize> {
-        self.blk.read_blocks(id, buf).map_err(dev_err)?;
-        Ok(buf.len())
-    }
-    fn sync_write(&mut self, id: usize, buf: &[u8]) -> DevResult<usize> {
-        self.blk.write_blocks(id, buf).map_err(dev_err)?;
-        Ok(buf.len())
-    }
-    fn read_req(
+    /// put a request onto the virtqueue, return None if the queue is full
+    fn submit(
         &mut self,
-        id: usize,
-        request: &mut BlkReq,
-        buffer: &mut [u8],
-        response: &mut BlkResp,
-    ) -> DevResult<u16> {
-        unsafe { self.blk.read_blocks_nb(id, request, buffer, response) }.map_err(dev_err)
+        block_id: usize,
+        buf: *mut u8,
+        len: usize,
+        is_write: bool,
+    ) -> DevResult<Option<u64>> {
+        let mut request = Box::new(BlkReq::default());
+        let mut response = Box::new(BlkResp::default());
+        let res = unsafe {
+            match is_write {
+                true => self.blk.write_blocks_nb(
+                    block_id,
+                    &mut request,
+                    slice::from_raw_parts(buf, len),
+                    &mut response,
+                ),
+                false => self.blk.read_blocks_nb(
+                    block_id,
+                    &mut request,
+                    slice::from_raw_parts_mut(buf, len),
+                    &mut response,
+                ),
+            }
+        };
+        let token = match res {
+            Ok(token) => token,
+            Err(Error::QueueFull) => return Ok(None),
+            Err(err) => return Err(dev_err(err)),
+        };
+        let id = self.next_id;
+        self.next_id += 1;
+        self.inflight.insert(
+            token,
+            InflightRequest {
+                id,
+                request,
+                response,
+                buf,
+                len,
+                is_write,
+            },
+        );
+        self.states.insert(id, RequestState::Waiting(None));
+        Ok(Some(id))
     }
-    fn read_response(
-        &mut self,
-        token: u16,
-        request: &BlkReq,
-        buffer: &mut [u8],
-        response: &mut BlkResp,
-    ) -> DevResult<()> {
-        unsafe {
-            self.blk
-                .complete_read_blocks(token, request, buffer, response)
+
+    /// collect every request the device has finished and wake its owner
+    fn reap(&mut self) {
+        let mut reaped = false;
+        while let Some(token) = self.blk.peek_used() {
+            let Some(mut req) = self.inflight.remove(&token) else {
+                log::error!("[virtio_blk] used token {} is not in flight", token);
+                break;
+            };
+            let res = unsafe {
+                match req.is_write {
+                    true => self.blk.complete_write_blocks(
+                        token,
+                        &req.request,
+                        slice::from_raw_parts(req.buf, req.len),
+                        &mut req.response,
+                    ),
+                    false => self.blk.complete_read_blocks(
+                        token,
+                        &req.request,
+                        slice::from_raw_parts_mut(req.buf, req.len),
+                        &mut req.response,
+                    ),
+                }
+            }
+            .map_err(dev_err)
+            .and_then(|_| match req.response.status() {
+                RespStatus::OK => Ok(()),
+                _ => Err(Errno::EIO),
+            });
+            if let Some(RequestState::Waiting(Some(waker))) =
+                self.states.insert(req.id, RequestState::Done(res))
+            {
+                waker.wake();
+            }
+            reaped = true;
+        }
+        if reaped {
+            while let Some(waker) = self.queue_waiters.pop_front() {
+                waker.wake();
+            }
         }
-        .map_err(dev_err)?;
-        assert_eq!(response.status(), RespStatus::OK);
-        Ok(())
-    }
-    fn write_req(
-        &mut self,
-        id: usize,
-        request: &mut BlkReq,
-        buffer: &[u8],
-        response: &mut BlkResp,
-    ) -> DevResult<u16> {
-        unsafe { self.blk.write_blocks_nb(id, request, buffer, response) }.map_err(dev_err)
     }
-    fn write_response(
-        &mut self,
-        token: u16,
-        request: &BlkReq,
-        buffer: &[u8],
-        response: &mut BlkResp,
-    ) -> DevResult<()> {
-        unsafe {
-            self.blk
-                .complete_write_blocks(token, request, buffer, response)
+
+    /// take the result of a finished request
+    fn take_result(&mut self, id: u64) -> Option<DevResult<()>> {
+        match self.states.get(&id) {
+            Some(RequestState::Waiting(_)) => None,
+            Some(RequestState::Done(_)) => match self.states.remove(&id) {
+                Some(RequestState::Done(res)) => Some(res),
+                _ => unreachable!(),
+            },
+            None => Some(Err(Errno::EIO)),
         }
-        .map_err(dev_err)?;
-        assert_eq!(response.status(), RespStatus::OK);
-        Ok(())
     }
 }
 
 pub struct VirtioBlockDevice<T: Transport> {
-    inner: AsyncMutex<VirioBlkInner<T>>,
-    waker: SyncUnsafeCell<Option<Waker>>,
+    inner: SpinLock<VirioBlkInner<T>>,
 }
 
 impl<T: Transport> VirtioBlockDevice<T> {
     /// Initializes the VirtIO block device.
     pub fn new(transport: T) -> Self {
         Self {
-            inner: AsyncMutex::new(VirioBlkInner {
+            inner: SpinLock::new(VirioBlkInner {
                 blk: VirtIOBlk::new(transport).expect("Failed to create VirtIOBlk"),
+                inflight: BTreeMap::new(),
+                states: BTreeMap::new(),
+                queue_waiters: VecDeque::new(),
+                next_id: 0,
             }),
-            waker: SyncUnsafeCell::new(None),
         }
     }
-    fn wake(&self) {
-        if let Some(waker) = self.waker.as_ref_mut().take() {
-            log::error!("wake waker");
-            waker.wake();
-        } else {
-            log::error!("No waker to wake up!");
+
+    /// submit and spin until the request completes, other requests in
+    /// flight are completed on the way
+    fn sync_rw(
+        &self,
+        block_id: usize,
+        buf: *mut u8,
+        len: usize,
+        is_write: bool,
+    ) -> DevResult<usize> {
+        let id = loop {
+            let mut inner = self.inner.lock();
+            inner.reap();
+            if let Some(id) = inner.submit(block_id, buf, len, is_write)? {
+                break id;
+            }
+            drop(inner);
+            spin_loop();
+        };
+        loop {
+            let mut inner = self.inner.lock();
+            inner.reap();
+            if let Some(res) = inner.take_result(id) {
+                return res.map(|_| len);
+            }
+            drop(inner);
+            spin_loop();
         }
     }
+
+    /// put every segment onto the virtqueue at once and wait for all of them
+    async fn rw_vectored(
+        &self,
+        id: usize,
+        segs: &[BlockSegment],
+        is_write: bool,
+    ) -> DevResult<usize> {
+        let mut block_id = id;
+        let mut reqs = Vec::with_capacity(segs.len());
+        for seg in segs {
+            let blocks = seg.blocks()?;
+            let buf = unsafe { seg.as_kernel_buf() };
+            reqs.push(Some(BlkRequestFuture::new(
+                self,
+                block_id,
+                buf.as_mut_ptr(),
+                buf.len(),
+                is_write,
+            )));
+            block_id += blocks;
+        }
+        BlkBatchFuture { reqs, total: 0 }.await
+    }
 }
 
 impl<T: Transport> Device for VirtioBlockDevice<T> {
@@ -121,7 +251,9 @@ impl<T: Transport> Device for VirtioBlockDevice<T> {
 
 impl<T: Transport> InterruptDevice for VirtioBlockDevice<T> {
     fn handle_irq(&self) -> DevResult<()> {
-        self.wake();
+        let mut inner = self.inner.lock();
+        let _ = inner.blk.ack_interrupt();
+        inner.reap();
         Ok(())
     }
 }
@@ -129,162 +261,153 @@ impl<T: Transport> InterruptDevice for VirtioBlockDevice<T> {
 #[async_trait]
 impl<T: Transport + Send> BlockDevice for VirtioBlockDevice<T> {
     fn sync_read(&self, id: usize, buf: &mut [u8]) -> DevResult<usize> {
-        let mut inner = self.inner.spin_lock();
-        let res = inner.sync_read(id, buf);
-        res
+        self.sync_rw(id, buf.as_mut_ptr(), buf.len(), false)
     }
     fn sync_write(&self, id: usize, buf: &[u8]) -> DevResult<usize> {
-        let mut inner = self.inner.spin_lock();
-        let res = inner.sync_write(id, buf);
-        res
+        self.sync_rw(id, buf.as_ptr() as *mut u8, buf.len(), true)
     }
     async fn read(&self, id: usize, buf: &mut [u8]) -> DevResult<usize> {
-        if buf.len() <= 2048 {
-            return self.sync_read(id, buf);
-        }
-        let inner = self.inner.lock().await;
-        let request = BlkReq::default();
-        let response = BlkResp::default();
-
-        ReadFuture::new(id, request, buf, response, inner, self.waker.as_ref_mut()).await
+        BlkRequestFuture::new(self, id, buf.as_mut_ptr(), buf.len(), false).await
     }
     async fn write(&self, id: usize, buf: &[u8]) -> DevResult<usize> {
-        if buf.len() <= 2048 {
-            return self.sync_write(id, buf);
-        }
-        let inner = self.inner.lock().await;
-        let request = BlkReq::default();
-        let response = BlkResp::default();
-
-        WriteFuture::new(id, request, buf, response, inner, self.waker.as_ref_mut()).await
+        BlkRequestFuture::new(self, id, buf.as_ptr() as *mut u8, buf.len(), true).await
+    }
+    async fn read_vectored(&self, id: usize, segs: &[BlockSegment]) -> DevResult<usize> {
+        self.rw_vectored(id, segs, false).await
+    }
+    async fn write_vectored(&self, id: usize, segs: &[BlockSegment]) -> DevResult<usize> {
+        self.rw_vectored(id, segs, true).await
     }
 }
 
-struct ReadFuture<'a, T: Transport> {
-    id: usize,
-    request: BlkReq,
-    buffer: &'a mut [u8],
-    response: BlkResp,
-    sent: bool,
-    token: u16,
-    guard: AsyncMutexGuard<'a, VirioBlkInner<T>>,
-    waker: &'a mut Option<Waker>,
+/// a single request, submitted on first poll and completed by the
+/// interrupt handler or by any poller reaping the used ring
+struct BlkRequestFuture<'a, T: Transport> {
+    dev: &'a VirtioBlockDevice<T>,
+    block_id: usize,
+    buf: *mut u8,
+    len: usize,
+    is_write: bool,
+    id: Option<u64>,
+    done: bool,
+    _buf: PhantomData<&'a mut [u8]>,
 }
 
-impl<'a, T: Transport> ReadFuture<'a, T> {
+// the buffer is exclusively borrowed for the lifetime of the future
+unsafe impl<'a, T: Transport> Send for BlkRequestFuture<'a, T> {}
+
+impl<'a, T: Transport> BlkRequestFuture<'a, T> {
     fn new(
-        id: usize,
-        request: BlkReq,
-        buffer: &'a mut [u8],
-        response: BlkResp,
-        guard: AsyncMutexGuard<'a, VirioBlkInner<T>>,
-        waker: &'a mut Option<Waker>,
+        dev: &'a VirtioBlockDevice<T>,
+        block_id: usize,
+        buf: *mut u8,
+        len: usize,
+        is_write: bool,
     ) -> Self {
         Self {
-            id,
-            request,
-            buffer,
-            response,
-            sent: false,
-            token: 0,
-            guard,
-            waker,
+            dev,
+            block_id,
+            buf,
+            len,
+            is_write,
+            id: None,
+            done: false,
+            _buf: PhantomData,
+        }
+    }
+
+    fn pending(cx: &mut Context<'_>) -> Poll<DevResult<usize>> {
+        if !IRQ_COMPLETION {
+            cx.waker().wake_by_ref();
         }
+        Poll::Pending
     }
 }
 
-impl<'a, T: Transport> Future for ReadFuture<'a, T> {
+impl<'a, T: Transport> Future for BlkRequestFuture<'a, T> {
     type Output = DevResult<usize>;
 
-    fn poll(
-        self: core::pin::Pin<&mut Self>,
-        cx: &mut core::task::Context<'_>,
-    ) -> core::task::Poll<Self::Output> {
+    fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Self::Output> {
         let this = self.get_mut();
-        if !this.sent {
-            this.sent = true;
-            *this.waker = Some(cx.waker().clone());
-            Arch::disable_external_interrupt();
-            this.token = this
-                .guard
-                .read_req(this.id, &mut this.request, this.buffer, &mut this.response)
-                .unwrap();
-            return Poll::Pending;
-        }
-
-        if let Ok(_) =
-            this.guard
-                .read_response(this.token, &this.request, this.buffer, &mut this.response)
-        {
-            Poll::Ready(Ok(this.buffer.len()))
-        } else {
-            *this.waker = Some(cx.waker().clone());
-            Poll::Pending
+        let mut inner = this.dev.inner.lock();
+        inner.reap();
+        let id = match this.id {
+            Some(id) => id,
+            None => match inner.submit(this.block_id, this.buf, this.len, this.is_write) {
+                Ok(Some(id)) => {
+                    this.id = Some(id);
+                    id
+                }
+                Ok(None) => {
+                    inner.queue_waiters.push_back(cx.waker().clone());
+                    return Self::pending(cx);
+                }
+                Err(err) => {
+                    this.done = true;
+                    return Poll::Ready(Err(err));
+                }
+            },
+        };
+        match inner.take_result(id) {
+            Some(res) => {
+                this.done = true;
+                Poll::Ready(res.map(|_| this.len))
+            }
+            None => {
+                inner
+                    .states
+                    .insert(id, RequestState::Waiting(Some(cx.waker().clone())));
+                Self::pending(cx)
+            }
         }
     }
 }
 
-struct WriteFuture<'a, T: Transport> {
-    id: usize,
-    request: BlkReq,
-    buffer: &'a [u8],
-    response: BlkResp,
-    sent: bool,
-    token: u16,
-    guard: AsyncMutexGuard<'a, VirioBlkInner<T>>,
-    waker: &'a mut Option<Waker>,
-}
-
-impl<'a, T: Transport> WriteFuture<'a, T> {
-    fn new(
-        id: usize,
-        request: BlkReq,
-        buffer: &'a [u8],
-        response: BlkResp,
-        guard: AsyncMutexGuard<'a, VirioBlkInner<T>>,
-        waker: &'a mut Option<Waker>,
-    ) -> Self {
-        Self {
-            id,
-            request,
-            buffer,
-            response,
-            sent: false,
-            token: 0,
-            guard,
-            waker,
+impl<'a, T: Transport> Drop for BlkRequestFuture<'a, T> {
+    /// the device may still be writing the buffer, wait for it
+    fn drop(&mut self) {
+        let Some(id) = self.id else { return };
+        if self.done {
+            return;
+        }
+        loop {
+            let mut inner = self.dev.inner.lock();
+            inner.reap();
+            if inner.take_result(id).is_some() {
+                return;
+            }
+            drop(inner);
+            spin_loop();
         }
     }
 }
 
-impl<'a, T: Transport> Future for WriteFuture<'a, T> {
+/// wait for a batch of requests that are all in flight together
+struct BlkBatchFuture<'a, T: Transport> {
+    reqs: Vec<Option<BlkRequestFuture<'a, T>>>,
+    total: usize,
+}
+
+impl<'a, T: Transport> Future for BlkBatchFuture<'a, T> {
     type Output = DevResult<usize>;
 
-    fn poll(
-        self: core::pin::Pin<&mut Self>,
-        cx: &mut core::task::Context<'_>,
-    ) -> core::task::Poll<Self::Output> {
+    fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Self::Output> {
         let this = self.get_mut();
-        if !this.sent {
-            this.sent = true;
-            *this.waker = Some(cx.waker().clone());
-            Arch::disable_external_interrupt();
-            this.token = this
-                .guard
-                .write_req(this.id, &mut this.request, this.buffer, &mut this.response)
-                .unwrap();
-            // HERE cannot receive the interrupt
-            return Poll::Pending;
+        let mut pending = false;
+        for slot in this.reqs.iter_mut() {
+            let Some(req) = slot else { continue };
+            match Pin::new(req).poll(cx) {
+                Poll::Ready(Ok(len)) => {
+                    this.total += len;
+                    *slot = None;
+                }
+                Poll::Ready(Err(err)) => return Poll::Ready(Err(err)),
+                Poll::Pending => pending = true,
+            }
         }
-
-        if let Ok(_) =
-            this.guard
-                .write_response(this.token, &this.request, this.buffer, &mut this.response)
-        {
-            Poll::Ready(Ok(this.buffer.len()))
-        } else {
-            *this.waker = Some(cx.waker().clone());
-            Poll::Pending
+        match pending {
+            true => Poll::Pending,
+            false => Poll::Ready(Ok(this.total)),
         }
     }
 }
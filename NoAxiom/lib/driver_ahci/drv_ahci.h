@@ -19,6 +19,11 @@ typedef struct ahci_sg {
   uint32_t flags_size;
 } ahci_sg;
 
+typedef struct ahci_iovec {
+  uint64_t addr;
+  uint64_t len;
+} ahci_iovec;
+
 typedef struct ahci_ioport {
   uint64_t port_mmio;
   struct ahci_cmd_hdr *cmd_slot;
@@ -28,6 +33,8 @@ typedef struct ahci_ioport {
   uint64_t cmd_tbl;
   uint64_t cmd_tbl_dma;
   struct ahci_sg *cmd_tbl_sg;
+  uint64_t slot_tbl[32];
+  uint64_t slot_tbl_dma[32];
 } ahci_ioport;
 
 typedef struct ahci_blk_dev {
@@ -66,6 +73,36 @@ extern int32_t ahci_printf(const char *fmt, ...);
 
 extern int32_t ahci_init(struct ahci_device *ahci_dev);
 
+extern void ahci_port_recover(const struct ahci_device *ahci_dev);
+
+extern int32_t ahci_port_poll(const struct ahci_device *ahci_dev, uint32_t *active);
+
+extern int32_t ahci_sata_issue_flush(const struct ahci_device *ahci_dev, uint32_t slot);
+
+extern int32_t ahci_sata_issue_rw(const struct ahci_device *ahci_dev,
+                                  uint32_t slot,
+                                  uint64_t blknr,
+                                  uint32_t blkcnt,
+                                  void *buffer,
+                                  uint32_t is_write);
+
+extern int32_t ahci_sata_issue_rw_iov(const struct ahci_device *ahci_dev,
+                                      uint32_t slot,
+                                      uint64_t blknr,
+                                      const struct ahci_iovec *iov,
+                                      uint32_t iovcnt,
+                                      uint32_t is_write);
+
+extern uint32_t ahci_sata_max_blocks(const struct ahci_device *ahci_dev);
+
+extern uint32_t ahci_sata_max_segment_size(const struct ahci_device *ahci_dev);
+
+extern uint32_t ahci_sata_max_segments(const struct ahci_device *ahci_dev);
+
+extern bool ahci_sata_need_flush(const struct ahci_device *ahci_dev);
+
+extern uint32_t ahci_sata_queue_depth(const struct ahci_device *ahci_dev);
+
 extern uint64_t ahci_sata_read_common(const struct ahci_device *ahci_dev,
                                     uint64_t blknr,
                                     uint32_t blkcnt,
@@ -1,6 +1,8 @@
 #![allow(dead_code, unused_assignments, unused_mut, non_upper_case_globals)]
 
-use core::ptr::{null_mut, read_volatile, write_volatile};
+use core::ptr::{null, null_mut, read_volatile, write_volatile};
+
+use config::mm::PAGE_SIZE;
 
 use crate::{libahci::*, libata::*, platform::*};
 
@@ -262,45 +264,93 @@ fn ahci_host_init(ahci_dev: &mut AhciDevice) -> i32 {
 }
 
 // ahci填充sgdma
-fn ahci_fill_sg(ahci_dev: &AhciDevice, port: u8, buf: *mut u8, mut buf_len: u32) -> u32 {
+fn ahci_fill_sg(ahci_dev: &AhciDevice, port: u8, buf: *mut u8, buf_len: u32) -> u32 {
     let pp: &AhciIoport = &ahci_dev.port[port as usize];
-    let mut ahci_sg: *mut AhciSg = pp.cmd_tbl_sg;
+    ahci_fill_sg_at(pp.cmd_tbl_sg, buf, buf_len)
+}
 
-    let max_bytes: u32 = AHCI_MAX_BYTES_PER_SG;
-    let sg_count: u32 = ((buf_len - 1) / max_bytes) + 1;
+// 将一段连续缓冲区填入指定的prdt
+fn ahci_fill_sg_at(ahci_sg: *mut AhciSg, buf: *mut u8, buf_len: u32) -> u32 {
+    let iov: AhciIovec = AhciIovec {
+        addr: ahci_virt_to_phys(buf as u64),
+        len: buf_len as u64,
+    };
+    ahci_fill_sg_iov(ahci_sg, &iov, 1)
+}
 
-    if sg_count > AHCI_MAX_SG {
+fn ahci_put_sg(ahci_sg: *mut AhciSg, idx: u32, addr: u64, len: u64) -> i32 {
+    if idx >= AHCI_MAX_SG {
         log::debug!("too much sg");
-        return 0;
+        return -1;
     }
+    unsafe {
+        let sg: *mut AhciSg = ahci_sg.offset(idx as isize);
+        (*sg).addr_lo = (addr & 0xffffffff) as u32;
+        (*sg).addr_hi = (addr >> 32) as u32;
+        (*sg).flags_size = 0x3fffff & (len - 1) as u32;
+    }
+    return 0;
+}
 
-    for i in 0..sg_count {
-        let size: u32 = buf_len.min(max_bytes) - 1;
-        let offset: isize = (i * max_bytes) as isize;
-
-        unsafe {
-            let buf_dma: u64 = ahci_virt_to_phys(buf.offset(offset) as u64);
-            (*ahci_sg).addr_lo = (buf_dma & 0xffffffff) as u32;
-            (*ahci_sg).addr_hi = (buf_dma >> 32) as u32;
-            (*ahci_sg).flags_size = 0x3fffff & size;
-            ahci_sg = ahci_sg.offset(1);
+// 将物理地址段列表填入指定的prdt
+// 物理上相邻的段会合并为一个表项, 每个表项最多AHCI_MAX_BYTES_PER_SG字节
+// 返回使用的表项数, 0表示表项不足
+fn ahci_fill_sg_iov(ahci_sg: *mut AhciSg, iov: *const AhciIovec, iovcnt: u32) -> u32 {
+    let max_bytes: u64 = AHCI_MAX_BYTES_PER_SG as u64;
+    let mut sg_count: u32 = 0;
+    let mut cur_addr: u64 = 0;
+    let mut cur_len: u64 = 0;
+
+    for i in 0..iovcnt {
+        let vec: AhciIovec = unsafe { *iov.offset(i as isize) };
+        let mut addr: u64 = vec.addr;
+        let mut len: u64 = vec.len;
+
+        while len != 0 {
+            if cur_len != 0 && cur_addr + cur_len == addr && cur_len < max_bytes {
+                let n: u64 = len.min(max_bytes - cur_len);
+                cur_len += n;
+                addr += n;
+                len -= n;
+                continue;
+            }
+            if cur_len != 0 {
+                if ahci_put_sg(ahci_sg, sg_count, cur_addr, cur_len) != 0 {
+                    return 0;
+                }
+                sg_count += 1;
+            }
+            let n: u64 = len.min(max_bytes);
+            cur_addr = addr;
+            cur_len = n;
+            addr += n;
+            len -= n;
         }
+    }
 
-        buf_len -= max_bytes;
+    if cur_len != 0 {
+        if ahci_put_sg(ahci_sg, sg_count, cur_addr, cur_len) != 0 {
+            return 0;
+        }
+        sg_count += 1;
     }
 
     return sg_count;
 }
 
 fn ahci_fill_cmd_slot(pp: &AhciIoport, cmd_slot: u32, opts: u32) {
-    let mut cmd_hdr: *mut AhciCmdHdr =
-        unsafe { (pp.cmd_slot).offset((AHCI_CMD_SZ * cmd_slot) as isize) };
+    ahci_fill_cmd_slot_tbl(pp, cmd_slot, opts, pp.cmd_tbl_dma);
+}
+
+fn ahci_fill_cmd_slot_tbl(pp: &AhciIoport, cmd_slot: u32, opts: u32, tbl_dma: u64) {
+    // the command header array is indexed by slot, each header is 32 bytes
+    let mut cmd_hdr: *mut AhciCmdHdr = unsafe { (pp.cmd_slot).offset(cmd_slot as isize) };
 
     unsafe {
         (*cmd_hdr).opts = opts;
         (*cmd_hdr).status = 0;
-        (*cmd_hdr).tbl_addr_lo = (pp.cmd_tbl_dma & 0xffffffff) as u32;
-        (*cmd_hdr).tbl_addr_hi = (pp.cmd_tbl_dma >> 32) as u32;
+        (*cmd_hdr).tbl_addr_lo = (tbl_dma & 0xffffffff) as u32;
+        (*cmd_hdr).tbl_addr_hi = (tbl_dma >> 32) as u32;
     }
 }
 
@@ -358,6 +408,55 @@ fn ahci_exec_ata_cmd(
     return buf_len;
 }
 
+// 在指定命令槽上发出命令, 不等待完成
+// queued为真时同时置位SActive, 用于ncq命令
+fn ahci_issue_on_slot(
+    ahci_dev: &AhciDevice,
+    slot: u32,
+    cfis: *const SataFisH2d,
+    iov: *const AhciIovec,
+    iovcnt: u32,
+    is_write: u32,
+    queued: bool,
+) -> i32 {
+    let pp: &AhciIoport = &ahci_dev.port[ahci_dev.port_idx as usize];
+    let port_mmio: u64 = pp.port_mmio;
+    let mut sg_count: u32 = 0;
+
+    if slot >= AHCI_MAX_CMDS {
+        log::debug!("invalid command slot {}", slot);
+        return -1;
+    }
+
+    let tbl: u64 = pp.slot_tbl[slot as usize];
+    unsafe {
+        (tbl as *mut SataFisH2d).write_volatile(*cfis);
+    }
+
+    if !iov.is_null() && iovcnt != 0 {
+        let sg: *mut AhciSg = (tbl + AHCI_CMD_TBL_HDR_SZ as u64) as *mut AhciSg;
+        sg_count = ahci_fill_sg_iov(sg, iov, iovcnt);
+        if sg_count == 0 {
+            return -1;
+        }
+    }
+
+    let opts: u32 = (core::mem::size_of::<SataFisH2d>() as u64 >> 2
+        | (sg_count << 16) as u64
+        | (is_write << 6) as u64) as u32;
+
+    ahci_fill_cmd_slot_tbl(pp, slot, opts, pp.slot_tbl_dma[slot as usize]);
+
+    ahci_sync_dcache();
+
+    if queued {
+        ahci_writel(1 << slot, port_mmio + PORT_SCR_ACT);
+    }
+    ahci_writel(1 << slot, port_mmio + PORT_CMD_ISSUE);
+
+    return 0;
+}
+
 fn ahci_set_feature(ahci_dev: &AhciDevice, subcmd: u8, action: u8) {
     let port: u8 = ahci_dev.port_idx;
     let cfis: SataFisH2d = SataFisH2d {
@@ -417,6 +516,8 @@ fn ahci_port_start(ahci_dev: &mut AhciDevice, port: u8) -> i32 {
 
     pp.cmd_tbl_sg = mem as *mut AhciSg;
 
+    ahci_port_alloc_slot_tbl(pp);
+
     ahci_writel(
         (pp.cmd_slot_dma & 0xffffffff) as u32,
         port_mmio + PORT_LST_ADDR,
@@ -456,6 +557,24 @@ fn ahci_port_start(ahci_dev: &mut AhciDevice, port: u8) -> i32 {
     return 0;
 }
 
+// 为每个命令槽分配独立的命令表, 使多个命令可以同时在途
+// 每个命令表1KiB, 一页可以容纳4个
+fn ahci_port_alloc_slot_tbl(pp: &mut AhciIoport) {
+    let mut mem: u64 = 0;
+    for slot in 0..AHCI_MAX_CMDS {
+        let idx: u32 = slot % AHCI_CMD_TBL_PER_PAGE;
+        if idx == 0 {
+            mem = ahci_malloc_align(PAGE_SIZE as u64, 1024);
+            unsafe {
+                (mem as *mut u8).write_bytes(0, PAGE_SIZE);
+            }
+        }
+        let tbl: u64 = mem + (idx * AHCI_CMD_TBL_SZ) as u64;
+        pp.slot_tbl[slot as usize] = tbl;
+        pp.slot_tbl_dma[slot as usize] = ahci_virt_to_phys(tbl);
+    }
+}
+
 fn ahci_sata_identify(ahci_dev: &AhciDevice, id: &mut [u16]) {
     let port: u8 = ahci_dev.port_idx;
     let buf_len: u32 = ATA_ID_WORDS * 2;
@@ -489,17 +608,9 @@ fn ahci_sata_identify(ahci_dev: &AhciDevice, id: &mut [u16]) {
     );
 }
 
-fn ahci_sata_rw_cmd(
-    ahci_dev: &AhciDevice,
-    start: u32,
-    blkcnt: u32,
-    buffer: *mut u8,
-    is_write: u32,
-) -> u32 {
-    let port: u8 = ahci_dev.port_idx;
+fn ahci_sata_rw_fis(start: u32, blkcnt: u32, is_write: u32) -> SataFisH2d {
     let block: u32 = start;
-    let buf_len: u32 = ATA_SECT_SIZE * blkcnt;
-    let cfis: SataFisH2d = SataFisH2d {
+    SataFisH2d {
         fis_type: SATA_FIS_TYPE_REGISTER_H2D,
         pm_port_c: 0x80,
         command: if is_write != 0 {
@@ -521,7 +632,19 @@ fn ahci_sata_rw_cmd(
         res1: 0,
         control: 0,
         res2: [0; 4],
-    };
+    }
+}
+
+fn ahci_sata_rw_cmd(
+    ahci_dev: &AhciDevice,
+    start: u32,
+    blkcnt: u32,
+    buffer: *mut u8,
+    is_write: u32,
+) -> u32 {
+    let port: u8 = ahci_dev.port_idx;
+    let buf_len: u32 = ATA_SECT_SIZE * blkcnt;
+    let cfis: SataFisH2d = ahci_sata_rw_fis(start, blkcnt, is_write);
 
     if ahci_exec_ata_cmd(ahci_dev, port, &cfis, buffer, buf_len, is_write) > 0 {
         return blkcnt;
@@ -589,17 +712,9 @@ fn ata_low_level_rw_lba28(
     return blkcnt;
 }
 
-fn ahci_sata_rw_cmd_ext(
-    ahci_dev: &AhciDevice,
-    start: u64,
-    blkcnt: u32,
-    buffer: *mut u8,
-    is_write: u32,
-) -> u32 {
-    let port: u8 = ahci_dev.port_idx;
+fn ahci_sata_rw_fis_ext(start: u64, blkcnt: u32, is_write: u32) -> SataFisH2d {
     let block: u64 = start;
-    let buf_len: u32 = ATA_SECT_SIZE * blkcnt;
-    let cfis: SataFisH2d = SataFisH2d {
+    SataFisH2d {
         fis_type: SATA_FIS_TYPE_REGISTER_H2D,
         pm_port_c: 0x80,
         command: if is_write != 0 {
@@ -621,7 +736,48 @@ fn ahci_sata_rw_cmd_ext(
         res1: 0,
         control: 0,
         res2: [0; 4],
-    };
+    }
+}
+
+// fpdma queued(ncq)命令
+// sector数放在features中, tag放在sector_count的高5位
+fn ahci_sata_ncq_fis(start: u64, blkcnt: u32, tag: u32, is_write: u32) -> SataFisH2d {
+    let block: u64 = start;
+    SataFisH2d {
+        fis_type: SATA_FIS_TYPE_REGISTER_H2D,
+        pm_port_c: 0x80,
+        command: if is_write != 0 {
+            ATA_CMD_FPDMA_WRITE
+        } else {
+            ATA_CMD_FPDMA_READ
+        },
+        features: (blkcnt & 0xff) as u8,
+        lba_low: (block & 0xff) as u8,
+        lba_mid: (block >> 8 & 0xff) as u8,
+        lba_high: (block >> 16 & 0xff) as u8,
+        device: ATA_LBA,
+        lba_low_exp: (block >> 24 & 0xff) as u8,
+        lba_mid_exp: (block >> 32 & 0xff) as u8,
+        lba_high_exp: (block >> 40 & 0xff) as u8,
+        features_exp: (blkcnt >> 8 & 0xff) as u8,
+        sector_count: ((tag & 0x1f) << 3) as u8,
+        sector_count_exp: 0,
+        res1: 0,
+        control: 0,
+        res2: [0; 4],
+    }
+}
+
+fn ahci_sata_rw_cmd_ext(
+    ahci_dev: &AhciDevice,
+    start: u64,
+    blkcnt: u32,
+    buffer: *mut u8,
+    is_write: u32,
+) -> u32 {
+    let port: u8 = ahci_dev.port_idx;
+    let buf_len: u32 = ATA_SECT_SIZE * blkcnt;
+    let cfis: SataFisH2d = ahci_sata_rw_fis_ext(start, blkcnt, is_write);
 
     if ahci_exec_ata_cmd(ahci_dev, port, &cfis, buffer, buf_len, is_write) > 0 {
         return blkcnt;
@@ -749,6 +905,12 @@ fn ahci_sata_scan(ahci_dev: &mut AhciDevice) {
     pdev.lba48 = ata_id_has_lba48(&id);
     pdev.queue_depth = ata_id_queue_depth(&id);
 
+    // ncq需要控制器与硬盘同时支持, 且fpdma命令总是使用48位lba
+    if ahci_dev.cap & HOST_CAP_NCQ != 0 && ata_id_has_ncq(&id) && pdev.lba48 && pdev.queue_depth > 1
+    {
+        ahci_dev.flags |= SATA_FLAG_NCQ;
+    }
+
     log::debug!(
         "sata device lba: {}, blksz: {}, lba48: {}, queue_depth: {}",
         pdev.lba,
@@ -810,6 +972,189 @@ impl AhciDevice {
         return rc as u64;
     }
 
+    // ahci sata命令队列深度, 即可以同时在途的命令槽数
+    // 不支持ncq时同一时刻只能有一条命令
+    pub fn ahci_sata_queue_depth(&self) -> u32 {
+        if self.flags & SATA_FLAG_NCQ == 0 {
+            return 1;
+        }
+        let hba_slots: u32 = (self.cap >> 8 & 0x1f) + 1;
+        return hba_slots.min(self.blk_dev.queue_depth).min(AHCI_MAX_CMDS);
+    }
+
+    // 单条读写命令最多传输的sector/block数
+    pub fn ahci_sata_max_blocks(&self) -> u32 {
+        let max_blks: u32 = if self.blk_dev.lba48 {
+            ATA_MAX_SECTORS_LBA48
+        } else {
+            ATA_MAX_SECTORS
+        };
+        return max_blks.min(AHCI_MAX_BYTES_PER_TRANS / ATA_SECT_SIZE);
+    }
+
+    // 单条命令最多可使用的prdt表项数, 每项最多AHCI_MAX_BYTES_PER_SG字节
+    pub fn ahci_sata_max_segments(&self) -> u32 {
+        return AHCI_MAX_SG;
+    }
+
+    // 单个prdt表项最多可描述的字节数
+    pub fn ahci_sata_max_segment_size(&self) -> u32 {
+        return AHCI_MAX_BYTES_PER_SG;
+    }
+
+    // 写入后是否需要刷新硬盘写缓存
+    pub fn ahci_sata_need_flush(&self) -> bool {
+        let flags: u32 = self.flags;
+        flags & SATA_FLAG_WCACHE != 0 && flags & (SATA_FLAG_FLUSH | SATA_FLAG_FLUSH_EXT) != 0
+    }
+
+    // 在命令槽slot上发出读写命令, 立即返回
+    // 支持ncq时使用fpdma queued命令, tag即为slot
+    // 返回0表示已发出, -1表示参数错误
+    pub fn ahci_sata_issue_rw(
+        &self,
+        slot: u32,
+        blknr: u64,
+        blkcnt: u32,
+        buffer: *mut u8,
+        is_write: u32,
+    ) -> i32 {
+        let iov: AhciIovec = AhciIovec {
+            addr: ahci_virt_to_phys(buffer as u64),
+            len: (ATA_SECT_SIZE * blkcnt) as u64,
+        };
+        return self.ahci_sata_issue_rw_iov(slot, blknr, &iov, 1, is_write);
+    }
+
+    // 在命令槽slot上发出分散/聚集读写命令, 立即返回
+    // iov为物理地址段列表, 总长度需为sector大小的整数倍
+    // 各段合并拆分后不能超过AHCI_MAX_SG个prdt表项
+    pub fn ahci_sata_issue_rw_iov(
+        &self,
+        slot: u32,
+        blknr: u64,
+        iov: *const AhciIovec,
+        iovcnt: u32,
+        is_write: u32,
+    ) -> i32 {
+        let mut total: u64 = 0;
+        for i in 0..iovcnt {
+            total += unsafe { (*iov.offset(i as isize)).len };
+        }
+        if total == 0 || total % ATA_SECT_SIZE as u64 != 0 {
+            return -1;
+        }
+        let blkcnt: u64 = total / ATA_SECT_SIZE as u64;
+        if blkcnt > self.ahci_sata_max_blocks() as u64 {
+            return -1;
+        }
+        let blkcnt: u32 = blkcnt as u32;
+        let queued: bool = self.flags & SATA_FLAG_NCQ != 0;
+        let cfis: SataFisH2d = if queued {
+            ahci_sata_ncq_fis(blknr, blkcnt, slot, is_write)
+        } else if self.blk_dev.lba48 {
+            ahci_sata_rw_fis_ext(blknr, blkcnt, is_write)
+        } else {
+            ahci_sata_rw_fis(blknr as u32, blkcnt, is_write)
+        };
+        return ahci_issue_on_slot(self, slot, &cfis, iov, iovcnt, is_write, queued);
+    }
+
+    // 在命令槽slot上发出刷新写缓存命令, 立即返回
+    // 刷新命令不能与ncq命令并发, 调用者需保证端口上没有其他在途命令
+    pub fn ahci_sata_issue_flush(&self, slot: u32) -> i32 {
+        let command: u8 = if self.blk_dev.lba48 && self.flags & SATA_FLAG_FLUSH_EXT != 0 {
+            ATA_CMD_FLUSH_EXT
+        } else {
+            ATA_CMD_FLUSH
+        };
+        let cfis: SataFisH2d = SataFisH2d {
+            fis_type: SATA_FIS_TYPE_REGISTER_H2D,
+            pm_port_c: 0x80,
+            command,
+            features: 0,
+            lba_low: 0,
+            lba_mid: 0,
+            lba_high: 0,
+            device: 0,
+            lba_low_exp: 0,
+            lba_mid_exp: 0,
+            lba_high_exp: 0,
+            features_exp: 0,
+            sector_count: 0,
+            sector_count_exp: 0,
+            res1: 0,
+            control: 0,
+            res2: [0; 4],
+        };
+        return ahci_issue_on_slot(self, slot, &cfis, null(), 0, READ_CMD, false);
+    }
+
+    // 应答端口中断, 并在active中返回仍在执行的命令槽位图
+    // 返回-1表示端口报告了错误, 此时所有在途命令均已中止
+    pub fn ahci_port_poll(&self, active: &mut u32) -> i32 {
+        let port: u8 = self.port_idx;
+        let port_mmio: u64 = self.port[port as usize].port_mmio;
+
+        let stat: u32 = ahci_readl(port_mmio + PORT_IRQ_STAT);
+        ahci_writel(stat, port_mmio + PORT_IRQ_STAT);
+        ahci_writel(0x1 << port, self.mmio_base + HOST_IRQ_STAT);
+
+        *active = ahci_readl(port_mmio + PORT_SCR_ACT) | ahci_readl(port_mmio + PORT_CMD_ISSUE);
+
+        // make dma data of completed commands visible
+        ahci_sync_dcache();
+
+        let tfd: u32 = ahci_readl(port_mmio + PORT_TFDATA);
+        if stat & PORT_IRQ_ERROR != 0 || tfd & ATA_ERR as u32 != 0 {
+            log::error!(
+                "[ahci] port {} error, irq stat: {:#x}, tfd: {:#x}",
+                port as u32,
+                stat,
+                tfd
+            );
+            return -1;
+        }
+        return 0;
+    }
+
+    // 端口出错后的恢复: 停止命令引擎, 清除错误, 重新启动
+    pub fn ahci_port_recover(&self) {
+        let port: u8 = self.port_idx;
+        let port_mmio: u64 = self.port[port as usize].port_mmio;
+        let mut tmp: u32 = 0;
+        let mut timeout: u32 = 0;
+
+        tmp = ahci_readl(port_mmio + PORT_CMD);
+        ahci_writel(tmp & !PORT_CMD_START, port_mmio + PORT_CMD);
+        timeout = 500;
+        while ahci_readl(port_mmio + PORT_CMD) & PORT_CMD_LIST_ON != 0 && timeout != 0 {
+            ahci_mdelay(1);
+            timeout -= 1;
+        }
+
+        tmp = ahci_readl(port_mmio + PORT_SCR_ERR);
+        ahci_writel(tmp, port_mmio + PORT_SCR_ERR);
+        tmp = ahci_readl(port_mmio + PORT_IRQ_STAT);
+        ahci_writel(tmp, port_mmio + PORT_IRQ_STAT);
+
+        // the device is still busy, use command list override to reset the task file
+        tmp = ahci_readl(port_mmio + PORT_TFDATA);
+        if tmp & (ATA_BUSY | ATA_DRQ) as u32 != 0 && self.cap & HOST_CAP_CLO != 0 {
+            tmp = ahci_readl(port_mmio + PORT_CMD);
+            ahci_writel(tmp | PORT_CMD_CLO, port_mmio + PORT_CMD);
+            timeout = 500;
+            while ahci_readl(port_mmio + PORT_CMD) & PORT_CMD_CLO != 0 && timeout != 0 {
+                ahci_mdelay(1);
+                timeout -= 1;
+            }
+        }
+
+        tmp = ahci_readl(port_mmio + PORT_CMD);
+        ahci_writel(tmp | PORT_CMD_START, port_mmio + PORT_CMD);
+        log::warn!("[ahci] port {} restarted after error", port as u32);
+    }
+
     // ahci初始化函数
     pub fn new(base_pa: usize) -> Result<Self, ()> {
         let mut dev = Self::new_bare();
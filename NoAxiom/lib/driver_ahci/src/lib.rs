@@ -6,4 +6,4 @@ mod libahci;
 mod libata;
 mod platform;
 
-pub use libahci::AhciDevice;
+pub use libahci::{AhciDevice, AhciIovec};
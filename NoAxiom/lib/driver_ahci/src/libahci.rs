@@ -1,5 +1,7 @@
 #![allow(dead_code, unused_assignments, unused_mut, non_upper_case_globals)]
 
+use config::mm::PAGE_SIZE;
+
 use crate::libata::*;
 
 pub const PORT_CMD_ICC_MASK: u32 = 0xf << 28;
@@ -130,7 +132,9 @@ pub const AHCI_PORT_PRIV_FBS_DMA_SZ: u32 =
     AHCI_CMD_SLOT_SZ + AHCI_CMD_TBL_AR_SZ + (AHCI_RX_FIS_SZ * 16);
 pub const AHCI_MAX_BYTES_PER_SG: u32 = 4 * 1024 * 1024; // 4 MiB
 pub const AHCI_MAX_BYTES_PER_TRANS: u32 = AHCI_MAX_SG * AHCI_MAX_BYTES_PER_SG;
+pub const AHCI_CMD_TBL_PER_PAGE: u32 = PAGE_SIZE as u32 / AHCI_CMD_TBL_SZ;
 
+pub const SATA_FLAG_NCQ: u32 = 2048;
 pub const SATA_FLAG_FLUSH_EXT: u32 = 1024;
 pub const SATA_FLAG_FLUSH: u32 = 512;
 pub const SATA_FLAG_WCACHE: u32 = 256;
@@ -155,6 +159,14 @@ pub struct AhciSg {
     pub flags_size: u32,
 }
 
+// 物理地址连续的一段dma缓冲区
+#[repr(C)]
+#[derive(Clone, Copy, Debug)]
+pub struct AhciIovec {
+    pub addr: u64,
+    pub len: u64,
+}
+
 #[repr(C)]
 pub struct AhciIoport {
     pub port_mmio: u64,
@@ -165,6 +177,8 @@ pub struct AhciIoport {
     pub cmd_tbl: u64,
     pub cmd_tbl_dma: u64,
     pub cmd_tbl_sg: *mut AhciSg,
+    pub slot_tbl: [u64; AHCI_MAX_CMDS as usize], // per-slot command table
+    pub slot_tbl_dma: [u64; AHCI_MAX_CMDS as usize],
 }
 
 unsafe impl Sync for AhciIoport {}
@@ -254,7 +254,11 @@ pub fn ata_id_has_lba(id: &[u16]) -> bool {
 }
 
 pub fn ata_id_queue_depth(id: &[u16]) -> u32 {
-    return (id[ATA_ID_QUEUE_DEPTH as usize] & 0x1f + 1) as u32;
+    return ((id[ATA_ID_QUEUE_DEPTH as usize] & 0x1f) + 1) as u32;
+}
+
+pub fn ata_id_has_ncq(id: &[u16]) -> bool {
+    return (id[ATA_ID_SATA_CAPABILITY as usize] & (1 << 8)) != 0;
 }
 
 pub fn ata_id_u32(id: &[u16], n: u32) -> u32 {
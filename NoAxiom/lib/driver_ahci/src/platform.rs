@@ -34,7 +34,7 @@ pub fn ahci_sync_dcache() {
 pub fn ahci_malloc_align(size: u64, align: u32) -> u64 {
     extern crate alloc;
     use alloc::boxed::Box;
-    assert!(size < PAGE_SIZE as u64);
+    assert!(size <= PAGE_SIZE as u64);
     assert!(align.is_power_of_two() && (PAGE_SIZE & (align - 1) as usize) == 0);
     let frame = memory::frame::frame_alloc().unwrap();
     let frame = Box::leak(Box::new(frame));
@@ -77,7 +77,8 @@ impl<IO: ReadWriteSeek + Send, TP, OCC> File<IO, TP, OCC> {
         if let Some(current_cluster) = self.current_cluster {
             // current cluster is none only if offset is 0
             debug_assert!(self.offset > 0);
-            self.fs.truncate_cluster_chain(current_cluster).await
+            let first_cluster = self.first_cluster.unwrap_or(current_cluster);
+            self.fs.truncate_cluster_chain(first_cluster, current_cluster).await
         } else {
             debug_assert!(self.offset == 0);
             if let Some(n) = self.first_cluster {
@@ -216,6 +217,16 @@ impl<IO: ReadWriteSeek + Send, TP, OCC> File<IO, TP, OCC> {
         self.first_cluster
     }
 
+    // Returns the cluster following the current one, the position must be at a cluster boundary
+    fn next_cluster(&self) -> Result<Option<u32>, Error<IO::Error>> {
+        let (Some(first_cluster), Some(_)) = (self.first_cluster, self.current_cluster) else {
+            return Ok(self.first_cluster);
+        };
+        let index = self.offset / self.fs.cluster_size();
+        let (cluster, found_index) = self.fs.cluster_at(first_cluster, index)?;
+        Ok((found_index == index).then_some(cluster))
+    }
+
     async fn flush(&mut self) -> Result<(), Error<IO::Error>> {
         self.flush_dir_entry().await?;
         let mut disk = self.fs.disk.lock();
@@ -273,17 +284,7 @@ impl<IO: ReadWriteSeek + Send, TP: TimeProvider, OCC> Read for File<IO, TP, OCC>
         let cluster_size = self.fs.cluster_size();
         let current_cluster_opt = if self.offset % cluster_size == 0 {
             // next cluster
-            match self.current_cluster {
-                None => self.first_cluster,
-                Some(n) => {
-                    let r = self.fs.cluster_iter(n).next();
-                    match r {
-                        Some(Err(err)) => return Err(err),
-                        Some(Ok(n)) => Some(n),
-                        None => None,
-                    }
-                }
-            }
+            self.next_cluster()?
         } else {
             self.current_cluster
         };
@@ -348,17 +349,7 @@ impl<IO: ReadWriteSeek + Send, TP: TimeProvider, OCC> Write for File<IO, TP, OCC
         // Get cluster for write possibly allocating new one
         let current_cluster = if self.offset % cluster_size == 0 {
             // next cluster
-            let next_cluster = match self.current_cluster {
-                None => self.first_cluster,
-                Some(n) => {
-                    let r = self.fs.cluster_iter(n).next();
-                    match r {
-                        Some(Err(err)) => return Err(err),
-                        Some(Ok(n)) => Some(n),
-                        None => None,
-                    }
-                }
-            };
+            let next_cluster = self.next_cluster()?;
             if let Some(n) = next_cluster {
                 n
             } else {
@@ -368,6 +359,13 @@ impl<IO: ReadWriteSeek + Send, TP: TimeProvider, OCC> Write for File<IO, TP, OCC
                 if self.first_cluster.is_none() {
                     self.set_first_cluster(new_cluster);
                 }
+                let index = match self.current_cluster {
+                    Some(_) => self.offset / cluster_size,
+                    None => 0,
+                };
+                if let Some(first_cluster) = self.first_cluster {
+                    self.fs.extend_cluster_chain(first_cluster, index, new_cluster);
+                }
                 new_cluster
             }
         } else {
@@ -457,16 +455,10 @@ impl<IO: ReadWriteSeek + Send, TP, OCC> Seek for File<IO, TP, OCC> {
             // Note: new_offset_in_clusters cannot be 0 here because new_offset is not 0
             debug_assert!(new_offset_in_clusters > 0);
             let clusters_to_skip = new_offset_in_clusters - 1;
-            let mut cluster = first_cluster;
-            let mut iter = self.fs.cluster_iter(first_cluster);
-            for i in 0..clusters_to_skip {
-                cluster = if let Some(r) = iter.next() {
-                    r?
-                } else {
-                    // cluster chain ends before the new position - seek to the end of the last cluster
-                    new_offset = self.fs.bytes_from_clusters(i + 1) as u32;
-                    break;
-                };
+            let (cluster, index) = self.fs.cluster_at(first_cluster, clusters_to_skip)?;
+            if index < clusters_to_skip {
+                // cluster chain ends before the new position - seek to the end of the last cluster
+                new_offset = self.fs.bytes_from_clusters(index + 1) as u32;
             }
             Some(cluster)
         } else {
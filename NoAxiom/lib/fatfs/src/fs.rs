@@ -2,7 +2,9 @@
 use alloc::string::String;
 
 use alloc::boxed::Box;
+use alloc::collections::BTreeMap;
 use alloc::sync::Arc;
+use alloc::vec::Vec;
 use async_trait::async_trait;
 use spin::Mutex;
 
@@ -19,7 +21,8 @@ use crate::error::Error;
 use crate::file::File;
 use crate::io::{self, IoBase, Read, ReadLeExt, Seek, SeekFrom, Write, WriteLeExt};
 use crate::table::{
-    alloc_cluster, count_free_clusters, format_fat, read_fat_flags, ClusterIterator, RESERVED_FAT_ENTRIES,
+    alloc_cluster, format_fat, link_cluster, read_fat_flags, read_free_bitmap, ClusterExtents, ClusterIterator,
+    FreeClusterBitmap, RESERVED_FAT_ENTRIES,
 };
 use crate::time::{DefaultTimeProvider, TimeProvider};
 
@@ -312,6 +315,9 @@ impl FileSystemStats {
     }
 }
 
+// Upper bound of cluster chains kept in `FileSystem::extents`
+const MAX_CACHED_CHAINS: usize = 1024;
+
 /// A FAT filesystem object.
 ///
 /// `FileSystem` struct is representing a state of a mounted FAT volume.
@@ -325,6 +331,10 @@ pub struct FileSystem<IO: ReadWriteSeek + Send, TP = DefaultTimeProvider, OCC =
     total_clusters: u32,
     fs_info: Arc<Mutex<FsInfoSector>>,
     current_status_flags: Arc<Mutex<FsStatusFlags>>,
+    // built on first allocation or stats call
+    free_bitmap: Mutex<Option<FreeClusterBitmap>>,
+    // cluster chains of recently used files, keyed by their first cluster
+    extents: Mutex<BTreeMap<u32, ClusterExtents>>,
 }
 
 unsafe impl<IO: ReadWriteSeek + Send, TP, OCC> Send for FileSystem<IO, TP, OCC> {}
@@ -415,6 +425,8 @@ impl<IO: Read + Write + Seek + Send, TP, OCC> FileSystem<IO, TP, OCC> {
             total_clusters,
             fs_info: Arc::new(Mutex::new(fs_info)),
             current_status_flags: Arc::new(Mutex::new(status_flags)),
+            free_bitmap: Mutex::new(None),
+            extents: Mutex::new(BTreeMap::new()),
         })
     }
 
@@ -479,33 +491,75 @@ impl<IO: Read + Write + Seek + Send, TP, OCC> FileSystem<IO, TP, OCC> {
         ClusterIterator::new(disk_slice, self.fat_type, cluster)
     }
 
-    pub(crate) async fn truncate_cluster_chain(self: &Arc<Self>, cluster: u32) -> Result<(), Error<IO::Error>> {
+    pub(crate) async fn truncate_cluster_chain(
+        self: &Arc<Self>,
+        first_cluster: u32,
+        cluster: u32,
+    ) -> Result<(), Error<IO::Error>> {
+        self.extents.lock().remove(&first_cluster);
         let mut iter = self.cluster_iter(cluster);
-        let num_free = iter.truncate().await?;
+        let num_free = iter.truncate(|n| self.mark_cluster_free(n)).await?;
         let mut fs_info = self.fs_info.lock();
         fs_info.map_free_clusters(|n| n + num_free);
         Ok(())
     }
 
     pub(crate) async fn free_cluster_chain(self: &Arc<Self>, cluster: u32) -> Result<(), Error<IO::Error>> {
+        self.extents.lock().remove(&cluster);
         let mut iter = self.cluster_iter(cluster);
-        let num_free = iter.free().await?;
+        let num_free = iter.free(|n| self.mark_cluster_free(n)).await?;
         let mut fs_info = self.fs_info.lock();
         fs_info.map_free_clusters(|n| n + num_free);
         Ok(())
     }
 
+    fn mark_cluster_free(&self, cluster: u32) {
+        if let Some(bitmap) = self.free_bitmap.lock().as_mut() {
+            bitmap.mark_free(cluster);
+        }
+    }
+
+    /// Builds the free cluster bitmap if this is the first use.
+    async fn load_free_bitmap(self: &Arc<Self>) -> Result<(), Error<IO::Error>> {
+        if self.free_bitmap.lock().is_some() {
+            return Ok(());
+        }
+        let hint = self.fs_info.lock().next_free_cluster;
+        let bitmap = read_free_bitmap(&mut self.fat_slice(), self.fat_type, self.total_clusters, hint).await?;
+        let free_cluster_count = bitmap.free_count();
+        let mut guard = self.free_bitmap.lock();
+        if guard.is_none() {
+            *guard = Some(bitmap);
+            drop(guard);
+            let mut fs_info = self.fs_info.lock();
+            if fs_info.free_cluster_count != Some(free_cluster_count) {
+                fs_info.set_free_cluster_count(free_cluster_count);
+            }
+        }
+        Ok(())
+    }
+
     pub(crate) async fn alloc_cluster(
         self: &Arc<Self>,
         prev_cluster: Option<u32>,
         zero: bool,
     ) -> Result<u32, Error<IO::Error>> {
         trace!("alloc_cluster");
-        let hint = self.fs_info.lock().next_free_cluster;
-        let cluster = {
+        self.load_free_bitmap().await?;
+        let cluster = self
+            .free_bitmap
+            .lock()
+            .as_mut()
+            .and_then(FreeClusterBitmap::alloc)
+            .ok_or(Error::NotEnoughSpace)?;
+        let linked = {
             let mut fat = self.fat_slice();
-            alloc_cluster(&mut fat, self.fat_type, prev_cluster, hint, self.total_clusters).await?
+            link_cluster(&mut fat, self.fat_type, prev_cluster, cluster).await
         };
+        if let Err(err) = linked {
+            self.mark_cluster_free(cluster);
+            return Err(err);
+        }
         if zero {
             let mut disk = self.disk.lock();
             disk.seek(SeekFrom::Start(self.offset_from_cluster(cluster)))?;
@@ -517,6 +571,66 @@ impl<IO: Read + Write + Seek + Send, TP, OCC> FileSystem<IO, TP, OCC> {
         Ok(cluster)
     }
 
+    /// Returns the cluster at `index` in the chain starting at `first_cluster` together with `index`, or the last
+    /// cluster and its index if the chain is shorter than that.
+    pub(crate) fn cluster_at(self: &Arc<Self>, first_cluster: u32, index: u32) -> Result<(u32, u32), Error<IO::Error>> {
+        loop {
+            let (known, last_cluster) = {
+                let mut extents = self.extents.lock();
+                if !extents.contains_key(&first_cluster) && extents.len() >= MAX_CACHED_CHAINS {
+                    extents.pop_first();
+                }
+                let chain = extents
+                    .entry(first_cluster)
+                    .or_insert_with(|| ClusterExtents::new(first_cluster, false));
+                if let Some(cluster) = chain.get(index) {
+                    return Ok((cluster, index));
+                }
+                if chain.is_complete() {
+                    return Ok((chain.last_cluster(), chain.len() - 1));
+                }
+                (chain.len(), chain.last_cluster())
+            };
+            // walk the unknown part of the chain without holding the lock
+            let mut walked = Vec::new();
+            let mut reached_end = false;
+            let mut iter = self.cluster_iter(last_cluster);
+            while known + walked.len() as u32 <= index {
+                match iter.next() {
+                    Some(r) => walked.push(r?),
+                    None => {
+                        reached_end = true;
+                        break;
+                    }
+                }
+            }
+            let mut extents = self.extents.lock();
+            if let Some(chain) = extents.get_mut(&first_cluster) {
+                // drop the result if the chain changed meanwhile
+                if !chain.is_complete() && chain.len() == known {
+                    walked.into_iter().for_each(|cluster| chain.push(cluster));
+                    if reached_end {
+                        chain.set_complete();
+                    }
+                }
+            }
+        }
+    }
+
+    /// Records a cluster appended at `index` to the chain starting at `first_cluster`.
+    pub(crate) fn extend_cluster_chain(&self, first_cluster: u32, index: u32, cluster: u32) {
+        let mut extents = self.extents.lock();
+        if index == 0 {
+            extents.insert(first_cluster, ClusterExtents::new(first_cluster, true));
+        } else if let Some(chain) = extents.get_mut(&first_cluster) {
+            if chain.is_complete() && chain.len() == index {
+                chain.push(cluster);
+            } else {
+                extents.remove(&first_cluster);
+            }
+        }
+    }
+
     /// Returns status flags for this volume.
     ///
     /// # Errors
@@ -533,14 +647,16 @@ impl<IO: Read + Write + Seek + Send, TP, OCC> FileSystem<IO, TP, OCC> {
 
     /// Returns filesystem statistics like number of total and free clusters.
     ///
-    /// For FAT32 volumes number of free clusters from the FS Information Sector is returned (may be incorrect).
-    /// For other FAT variants number is computed on the first call to this method and cached for later use.
+    /// Once the free cluster bitmap is built, the exact number kept in it is returned.
+    /// Before that, for FAT32 volumes number of free clusters from the FS Information Sector is returned (may be
+    /// incorrect). For other FAT variants the bitmap is built on the first call to this method.
     ///
     /// # Errors
     ///
     /// `Error::Io` will be returned if the underlying storage object returned an I/O error.
     pub async fn stats(self: &Arc<Self>) -> Result<FileSystemStats, Error<IO::Error>> {
-        let free_clusters_option = self.fs_info.lock().free_cluster_count;
+        let bitmap_free_clusters = self.free_bitmap.lock().as_ref().map(FreeClusterBitmap::free_count);
+        let free_clusters_option = bitmap_free_clusters.or(self.fs_info.lock().free_cluster_count);
         let free_clusters = if let Some(n) = free_clusters_option {
             n
         } else {
@@ -555,10 +671,12 @@ impl<IO: Read + Write + Seek + Send, TP, OCC> FileSystem<IO, TP, OCC> {
 
     /// Forces free clusters recalculation.
     async fn recalc_free_clusters(self: &Arc<Self>) -> Result<u32, Error<IO::Error>> {
-        let mut fat = self.fat_slice();
-        let free_cluster_count = count_free_clusters(&mut fat, self.fat_type, self.total_clusters).await?;
-        self.fs_info.lock().set_free_cluster_count(free_cluster_count);
-        Ok(free_cluster_count)
+        self.load_free_bitmap().await?;
+        Ok(self
+            .free_bitmap
+            .lock()
+            .as_ref()
+            .map_or(0, FreeClusterBitmap::free_count))
     }
 
     /// Unmounts the filesystem.
@@ -2,6 +2,8 @@ use core::borrow::BorrowMut;
 use core::marker::PhantomData;
 
 use alloc::boxed::Box;
+use alloc::vec;
+use alloc::vec::Vec;
 use async_trait::async_trait;
 
 use crate::async_utils::block_on;
@@ -58,12 +60,6 @@ trait FatTrait {
         S: Read + Seek + Send,
         E: IoError,
         Error<E>: From<S::Error>;
-
-    async fn count_free<S, E>(fat: &mut S, end_cluster: u32) -> Result<u32, Error<E>>
-    where
-        S: Read + Seek + Send,
-        E: IoError,
-        Error<E>: From<S::Error>;
 }
 
 async fn read_fat<S, E>(fat: &mut S, fat_type: FatType, cluster: u32) -> Result<FatValue, Error<E>>
@@ -148,12 +144,28 @@ where
         }
         Err(e) => return Err(e),
     };
+    link_cluster(fat, fat_type, prev_cluster, new_cluster).await?;
+    Ok(new_cluster)
+}
+
+/// Marks a free cluster as the new end of the chain ending at `prev_cluster`.
+pub(crate) async fn link_cluster<S, E>(
+    fat: &mut S,
+    fat_type: FatType,
+    prev_cluster: Option<u32>,
+    new_cluster: u32,
+) -> Result<(), Error<E>>
+where
+    S: Read + Write + Seek + Send,
+    E: IoError,
+    Error<E>: From<S::Error>,
+{
     write_fat(fat, fat_type, new_cluster, FatValue::EndOfChain).await?;
     if let Some(n) = prev_cluster {
         write_fat(fat, fat_type, n, FatValue::Data(new_cluster)).await?;
     }
     trace!("allocated cluster {}", new_cluster);
-    Ok(new_cluster)
+    Ok(())
 }
 
 pub(crate) async fn read_fat_flags<S, E>(fat: &mut S, fat_type: FatType) -> Result<FsStatusFlags, Error<E>>
@@ -181,22 +193,64 @@ where
     Ok(FsStatusFlags { dirty, io_error })
 }
 
-pub(crate) async fn count_free_clusters<S, E>(
+/// Reads the whole FAT once and returns the set of free clusters.
+pub(crate) async fn read_free_bitmap<S, E>(
     fat: &mut S,
     fat_type: FatType,
     total_clusters: u32,
-) -> Result<u32, Error<E>>
+    hint: Option<u32>,
+) -> Result<FreeClusterBitmap, Error<E>>
 where
     S: Read + Seek + Send,
     E: IoError,
     Error<E>: From<S::Error>,
 {
+    // multiple of 3 and 4 so that every chunk holds whole entries of any FAT type
+    const CHUNK_SIZE: usize = 3 * 1024;
     let end_cluster = total_clusters + RESERVED_FAT_ENTRIES;
-    match fat_type {
-        FatType::Fat12 => Fat12::count_free(fat, end_cluster).await,
-        FatType::Fat16 => Fat16::count_free(fat, end_cluster).await,
-        FatType::Fat32 => Fat32::count_free(fat, end_cluster).await,
+    let fat_bytes = (u64::from(end_cluster) * u64::from(fat_type.bits_per_fat_entry())).div_ceil(8) as usize;
+    let mut bitmap = FreeClusterBitmap::new(end_cluster, hint);
+    let mut buf = vec![0_u8; CHUNK_SIZE.min(fat_bytes)];
+    fat.seek(io::SeekFrom::Start(0))?;
+    let mut cluster = 0;
+    let mut pos = 0;
+    while pos < fat_bytes {
+        let chunk = &mut buf[..CHUNK_SIZE.min(fat_bytes - pos)];
+        fat.read_exact(chunk).await?;
+        pos += chunk.len();
+        match fat_type {
+            FatType::Fat12 => {
+                for packed in chunk.chunks(3) {
+                    if packed.len() >= 2 && u16::from(packed[0]) | (u16::from(packed[1] & 0x0F) << 8) == 0 {
+                        bitmap.set_free(cluster);
+                    }
+                    if packed.len() == 3 && (u16::from(packed[1]) >> 4) | (u16::from(packed[2]) << 4) == 0 {
+                        bitmap.set_free(cluster + 1);
+                    }
+                    cluster += 2;
+                }
+            }
+            FatType::Fat16 => {
+                for entry in chunk.chunks_exact(2) {
+                    if u16::from_le_bytes([entry[0], entry[1]]) == 0 {
+                        bitmap.set_free(cluster);
+                    }
+                    cluster += 1;
+                }
+            }
+            FatType::Fat32 => {
+                for entry in chunk.chunks_exact(4) {
+                    let val = u32::from_le_bytes([entry[0], entry[1], entry[2], entry[3]]) & 0x0FFF_FFFF;
+                    // special cluster numbers are never free, see `Fat32::get`
+                    if val == 0 && !(0x0FFF_FFF7..=0x0FFF_FFFF).contains(&cluster) {
+                        bitmap.set_free(cluster);
+                    }
+                    cluster += 1;
+                }
+            }
+        }
     }
+    Ok(bitmap)
 }
 
 pub(crate) async fn format_fat<S: Send, E>(
@@ -338,38 +392,6 @@ impl FatTrait for Fat12 {
             };
         }
     }
-
-    async fn count_free<S, E>(fat: &mut S, end_cluster: u32) -> Result<u32, Error<E>>
-    where
-        S: Read + Seek + Send,
-        E: IoError,
-        Error<E>: From<S::Error>,
-    {
-        let mut count = 0;
-        let mut cluster = RESERVED_FAT_ENTRIES;
-        fat.seek(io::SeekFrom::Start(u64::from(cluster * 3 / 2)))?;
-        let mut prev_packed_val = 0_u16;
-        while cluster < end_cluster {
-            let res = match cluster & 1 {
-                0 => fat.read_u16_le().await,
-                _ => fat.read_u8().await.map(u16::from),
-            };
-            let packed_val = match res {
-                Err(err) => return Err(err.into()),
-                Ok(n) => n,
-            };
-            let val = match cluster & 1 {
-                0 => packed_val & 0x0FFF,
-                _ => (packed_val << 8) | (prev_packed_val >> 12),
-            };
-            prev_packed_val = packed_val;
-            if val == 0 {
-                count += 1;
-            }
-            cluster += 1;
-        }
-        Ok(count)
-    }
 }
 
 #[async_trait]
@@ -442,25 +464,6 @@ impl FatTrait for Fat16 {
         }
         Err(Error::NotEnoughSpace)
     }
-
-    async fn count_free<S, E>(fat: &mut S, end_cluster: u32) -> Result<u32, Error<E>>
-    where
-        S: Read + Seek + Send,
-        E: IoError,
-        Error<E>: From<S::Error>,
-    {
-        let mut count = 0;
-        let mut cluster = RESERVED_FAT_ENTRIES;
-        fat.seek(io::SeekFrom::Start(u64::from(cluster * 2)))?;
-        while cluster < end_cluster {
-            let val = fat.read_u16_le().await?;
-            if val == 0 {
-                count += 1;
-            }
-            cluster += 1;
-        }
-        Ok(count)
-    }
 }
 
 #[async_trait]
@@ -571,25 +574,6 @@ impl FatTrait for Fat32 {
         }
         Err(Error::NotEnoughSpace)
     }
-
-    async fn count_free<S, E>(fat: &mut S, end_cluster: u32) -> Result<u32, Error<E>>
-    where
-        S: Read + Seek + Send,
-        E: IoError,
-        Error<E>: From<S::Error>,
-    {
-        let mut count = 0;
-        let mut cluster = RESERVED_FAT_ENTRIES;
-        fat.seek(io::SeekFrom::Start(u64::from(cluster * 4)))?;
-        while cluster < end_cluster {
-            let val = fat.read_u32_le().await? & 0x0FFF_FFFF;
-            if val == 0 {
-                count += 1;
-            }
-            cluster += 1;
-        }
-        Ok(count)
-    }
 }
 
 pub(crate) struct ClusterIterator<B, E, S = B> {
@@ -620,24 +604,27 @@ where
         }
     }
 
-    pub(crate) async fn truncate(&mut self) -> Result<u32, Error<E>> {
+    /// Cuts the chain after the current cluster, `on_free` is called for every freed cluster.
+    pub(crate) async fn truncate(&mut self, on_free: impl FnMut(u32) + Send) -> Result<u32, Error<E>> {
         if let Some(n) = self.cluster {
             // Move to the next cluster
             self.next();
             // Mark previous cluster as end of chain
             write_fat(self.fat.borrow_mut(), self.fat_type, n, FatValue::EndOfChain).await?;
             // Free rest of chain
-            self.free().await
+            self.free(on_free).await
         } else {
             Ok(0)
         }
     }
 
-    pub(crate) async fn free(&mut self) -> Result<u32, Error<E>> {
+    /// Frees the chain from the current cluster on, `on_free` is called for every freed cluster.
+    pub(crate) async fn free(&mut self, mut on_free: impl FnMut(u32) + Send) -> Result<u32, Error<E>> {
         let mut num_free = 0;
         while let Some(n) = self.cluster {
             self.next();
             write_fat(self.fat.borrow_mut(), self.fat_type, n, FatValue::Free).await?;
+            on_free(n);
             num_free += 1;
         }
         Ok(num_free)
@@ -670,6 +657,146 @@ where
     }
 }
 
+/// In-memory copy of the free state of every cluster.
+///
+/// It is built by a single scan of the FAT on first use and kept in sync on every allocation and free afterwards,
+/// so finding a free cluster no longer reads the table.
+pub(crate) struct FreeClusterBitmap {
+    // bit set means the cluster is free
+    words: Vec<u64>,
+    end_cluster: u32,
+    free_count: u32,
+    // where the search for the next free cluster starts
+    next_free: u32,
+}
+
+impl FreeClusterBitmap {
+    const WORD_BITS: u32 = u64::BITS;
+
+    fn new(end_cluster: u32, hint: Option<u32>) -> Self {
+        let next_free = match hint {
+            Some(n) if (RESERVED_FAT_ENTRIES..end_cluster).contains(&n) => n,
+            _ => RESERVED_FAT_ENTRIES,
+        };
+        Self {
+            words: vec![0; end_cluster.div_ceil(Self::WORD_BITS) as usize],
+            end_cluster,
+            free_count: 0,
+            next_free,
+        }
+    }
+
+    fn set_free(&mut self, cluster: u32) {
+        if !(RESERVED_FAT_ENTRIES..self.end_cluster).contains(&cluster) {
+            return;
+        }
+        let word = &mut self.words[(cluster / Self::WORD_BITS) as usize];
+        let bit = 1 << (cluster % Self::WORD_BITS);
+        if *word & bit == 0 {
+            *word |= bit;
+            self.free_count += 1;
+        }
+    }
+
+    pub(crate) fn free_count(&self) -> u32 {
+        self.free_count
+    }
+
+    /// Records a cluster freed in the FAT.
+    pub(crate) fn mark_free(&mut self, cluster: u32) {
+        self.set_free(cluster);
+    }
+
+    fn find_free(&self, start_cluster: u32, end_cluster: u32) -> Option<u32> {
+        let mut cluster = start_cluster;
+        while cluster < end_cluster {
+            let index = (cluster / Self::WORD_BITS) as usize;
+            let word = self.words[index] >> (cluster % Self::WORD_BITS);
+            if word != 0 {
+                let found = cluster + word.trailing_zeros();
+                return (found < end_cluster).then_some(found);
+            }
+            cluster = (index as u32 + 1) * Self::WORD_BITS;
+        }
+        None
+    }
+
+    /// Takes a free cluster, searching from the last allocation on and wrapping around once.
+    pub(crate) fn alloc(&mut self) -> Option<u32> {
+        let cluster = self
+            .find_free(self.next_free, self.end_cluster)
+            .or_else(|| self.find_free(RESERVED_FAT_ENTRIES, self.next_free))?;
+        self.words[(cluster / Self::WORD_BITS) as usize] &= !(1 << (cluster % Self::WORD_BITS));
+        self.free_count -= 1;
+        self.next_free = cluster + 1;
+        Some(cluster)
+    }
+}
+
+#[derive(Clone, Copy, Debug, Eq, PartialEq)]
+struct ClusterRun {
+    // position of the first cluster of the run in the chain
+    index: u32,
+    cluster: u32,
+    len: u32,
+}
+
+/// A cluster chain kept as runs of clusters contiguous on disk.
+///
+/// The runs are filled in lazily while the chain is walked, so finding the cluster at a given position of an already
+/// walked chain is a binary search instead of a walk.
+pub(crate) struct ClusterExtents {
+    runs: Vec<ClusterRun>,
+    // the end of the chain was reached, `runs` covers all of it
+    complete: bool,
+}
+
+impl ClusterExtents {
+    pub(crate) fn new(first_cluster: u32, complete: bool) -> Self {
+        Self {
+            runs: vec![ClusterRun {
+                index: 0,
+                cluster: first_cluster,
+                len: 1,
+            }],
+            complete,
+        }
+    }
+
+    /// Number of known clusters of the chain.
+    pub(crate) fn len(&self) -> u32 {
+        self.runs.last().map_or(0, |r| r.index + r.len)
+    }
+
+    pub(crate) fn last_cluster(&self) -> u32 {
+        self.runs.last().map_or(0, |r| r.cluster + r.len - 1)
+    }
+
+    pub(crate) fn is_complete(&self) -> bool {
+        self.complete
+    }
+
+    pub(crate) fn set_complete(&mut self) {
+        self.complete = true;
+    }
+
+    /// Returns the cluster at `index` in the chain if it is known.
+    pub(crate) fn get(&self, index: u32) -> Option<u32> {
+        let pos = self.runs.partition_point(|r| r.index + r.len <= index);
+        let run = self.runs.get(pos)?;
+        Some(run.cluster + (index - run.index))
+    }
+
+    /// Appends the next cluster of the chain.
+    pub(crate) fn push(&mut self, cluster: u32) {
+        let index = self.len();
+        match self.runs.last_mut() {
+            Some(run) if run.cluster + run.len == cluster => run.len += 1,
+            _ => self.runs.push(ClusterRun { index, cluster, len: 1 }),
+        }
+    }
+}
+
 #[cfg(feature = "std")]
 #[cfg(test)]
 mod tests {
@@ -696,7 +823,12 @@ mod tests {
         assert_eq!(find_free_cluster(&mut cur, fat_type, 0x13, 0x20).ok(), Some(0x1B));
         assert!(find_free_cluster(&mut cur, fat_type, 0x13, 0x14).is_err());
 
-        assert_eq!(count_free_clusters(&mut cur, fat_type, 0x1E).ok(), Some(5));
+        assert_eq!(
+            read_free_bitmap(&mut cur, fat_type, 0x1E, None)
+                .ok()
+                .map(|b| b.free_count()),
+            Some(5)
+        );
 
         // test allocation
         assert_eq!(
@@ -710,7 +842,12 @@ mod tests {
         );
         assert_eq!(read_fat(&mut cur, fat_type, 0x1B).ok(), Some(FatValue::Data(0x12)));
         assert_eq!(read_fat(&mut cur, fat_type, 0x12).ok(), Some(FatValue::EndOfChain));
-        assert_eq!(count_free_clusters(&mut cur, fat_type, 0x1E).ok(), Some(3));
+        assert_eq!(
+            read_free_bitmap(&mut cur, fat_type, 0x1E, None)
+                .ok()
+                .map(|b| b.free_count()),
+            Some(3)
+        );
         // test reading from iterator
         {
             let iter = ClusterIterator::<&mut S, S::Error, S>::new(&mut cur, fat_type, 0x9);
@@ -726,7 +863,7 @@ mod tests {
         {
             let mut iter = ClusterIterator::<&mut S, S::Error, S>::new(&mut cur, fat_type, 0x9);
             assert_eq!(iter.nth(3).map(Result::ok), Some(Some(0x16)));
-            assert!(iter.truncate().is_ok());
+            assert!(iter.truncate(|_| {}).is_ok());
         }
         assert_eq!(read_fat(&mut cur, fat_type, 0x16).ok(), Some(FatValue::EndOfChain));
         assert_eq!(read_fat(&mut cur, fat_type, 0x19).ok(), Some(FatValue::Free));
@@ -734,7 +871,7 @@ mod tests {
         // test freeing a chain
         {
             let mut iter = ClusterIterator::<&mut S, S::Error, S>::new(&mut cur, fat_type, 0x9);
-            assert!(iter.free().is_ok());
+            assert!(iter.free(|_| {}).is_ok());
         }
         assert_eq!(read_fat(&mut cur, fat_type, 0x9).ok(), Some(FatValue::Free));
         assert_eq!(read_fat(&mut cur, fat_type, 0xA).ok(), Some(FatValue::Free));
@@ -778,4 +915,40 @@ mod tests {
         ];
         test_fat(FatType::Fat32, StdIoWrapper::new(Cursor::<Vec<u8>>::new(fat)));
     }
+
+    #[test]
+    fn test_free_cluster_bitmap() {
+        let mut bitmap = FreeClusterBitmap::new(200, Some(150));
+        for cluster in [0, 1, 3, 70, 71, 150, 199, 200] {
+            bitmap.set_free(cluster);
+        }
+        assert_eq!(bitmap.free_count(), 5);
+        assert_eq!(bitmap.alloc(), Some(150));
+        assert_eq!(bitmap.alloc(), Some(199));
+        // wraps around to the start of the table
+        assert_eq!(bitmap.alloc(), Some(3));
+        assert_eq!(bitmap.alloc(), Some(70));
+        bitmap.mark_free(150);
+        assert_eq!(bitmap.alloc(), Some(71));
+        assert_eq!(bitmap.alloc(), Some(150));
+        assert_eq!(bitmap.alloc(), None);
+        assert_eq!(bitmap.free_count(), 0);
+    }
+
+    #[test]
+    fn test_cluster_extents() {
+        let mut extents = ClusterExtents::new(10, false);
+        for cluster in [11, 12, 40, 41, 7] {
+            extents.push(cluster);
+        }
+        assert_eq!(extents.runs.len(), 3);
+        assert_eq!(extents.len(), 6);
+        assert_eq!(extents.last_cluster(), 7);
+        let clusters = (0..7).map(|i| extents.get(i)).collect::<Vec<_>>();
+        assert_eq!(
+            clusters,
+            [Some(10), Some(11), Some(12), Some(40), Some(41), Some(7), None]
+        );
+        assert!(!extents.is_complete());
+    }
 }
@@ -6,9 +6,16 @@ use core::{
     task::Waker,
 };
 
+use arch::{Arch, ArchTime};
 use kfuture::{suspend::SuspendFuture, take_waker::TakeWakerFuture};
 
-use crate::mutex::SpinLock;
+use crate::{
+    mutex::SpinLock,
+    stat::{HartLockStat, LOCK_STAT},
+};
+
+/// statistics of all the async mutexes
+pub static ASYNC_MUTEX_STAT: HartLockStat = HartLockStat::new();
 
 /// Async Mutex implemented with `AtomicBool`
 ///
@@ -44,6 +51,10 @@ impl<T> AsyncMutex<T> {
                 data: unsafe { &mut *self.data.get() },
                 lock: &self.locked,
                 waiters: &self.waiters,
+                acquired_at: match LOCK_STAT {
+                    true => Arch::get_time(),
+                    false => 0,
+                },
             }),
             false => None,
         }
@@ -53,14 +64,25 @@ impl<T> AsyncMutex<T> {
     ///
     /// This will return a [`Future`] that can be awaited.
     pub async fn lock(&self) -> AsyncMutexGuard<'_, T> {
+        let mut wait_start = None;
         loop {
             match self.try_lock() {
                 // Some(guard) => return guard,
                 // None => {
                 //     kfuture::yield_fut::YieldFuture::new().await;
                 // }
-                Some(guard) => return guard,
+                Some(guard) => {
+                    if let Some(start) = wait_start {
+                        ASYNC_MUTEX_STAT
+                            .current()
+                            .record_wait(Arch::get_time() - start);
+                    }
+                    return guard;
+                }
                 None => {
+                    if LOCK_STAT {
+                        wait_start.get_or_insert_with(Arch::get_time);
+                    }
                     self.waiters.lock().push_back(TakeWakerFuture.await);
                     SuspendFuture::new().await;
                 }
@@ -69,10 +91,19 @@ impl<T> AsyncMutex<T> {
     }
 
     pub fn spin_lock(&self) -> AsyncMutexGuard<'_, T> {
+        let mut wait_start = None;
         loop {
             if let Some(guard) = self.try_lock() {
+                if let Some(start) = wait_start {
+                    ASYNC_MUTEX_STAT
+                        .current()
+                        .record_wait(Arch::get_time() - start);
+                }
                 return guard;
             }
+            if LOCK_STAT {
+                wait_start.get_or_insert_with(Arch::get_time);
+            }
             // Spin until we can get the lock
             while self.locked.load(Ordering::Relaxed) {}
         }
@@ -83,6 +114,7 @@ pub struct AsyncMutexGuard<'a, T> {
     data: &'a mut T,
     lock: &'a AtomicBool,
     waiters: &'a SpinLock<VecDeque<Waker>>,
+    acquired_at: usize,
 }
 
 impl<T> Deref for AsyncMutexGuard<'_, T> {
@@ -100,6 +132,11 @@ impl<T> DerefMut for AsyncMutexGuard<'_, T> {
 
 impl<T> Drop for AsyncMutexGuard<'_, T> {
     fn drop(&mut self) {
+        if LOCK_STAT {
+            ASYNC_MUTEX_STAT
+                .current()
+                .record_hold(Arch::get_time() - self.acquired_at);
+        }
         self.waiters.lock().pop_front().map(|waker| waker.wake());
         self.lock.store(false, Ordering::Release);
     }
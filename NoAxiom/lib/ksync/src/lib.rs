@@ -3,6 +3,7 @@ pub mod async_lock;
 pub mod async_mutex;
 pub mod cell;
 pub mod mutex;
+pub mod stat;
 
 pub use spin::{Lazy, Once};
 
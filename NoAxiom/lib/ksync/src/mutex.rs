@@ -1,9 +1,12 @@
 //! spin mutex for riscv kernel
 
-use arch::{Arch, ArchAsm, ArchInt};
+use arch::{Arch, ArchAsm, ArchInt, ArchTime};
 use config::cpu::CPU_NUM;
 
-use crate::cell::SyncUnsafeCell;
+use crate::{
+    cell::SyncUnsafeCell,
+    stat::{HartLockStat, LOCK_STAT},
+};
 
 type LockActionPolicy = NoIrqLockAction;
 pub type SpinLock<T> = kernel_sync::spin::SpinMutex<T, LockActionPolicy>;
@@ -23,12 +26,15 @@ pub use kernel_sync::LockAction;
 struct MutexTracer {
     pub depth: i32,
     pub int_record: bool,
+    /// when the outermost lock of the hart was taken
+    pub section_start: usize,
 }
 impl MutexTracer {
     const fn new() -> Self {
         Self {
             depth: 0,
             int_record: false,
+            section_start: 0,
         }
     }
 }
@@ -47,6 +53,11 @@ pub fn check_no_lock() -> bool {
     current_mutex_tracer().depth == 0
 }
 
+/// spin lock sections, i.e. from taking the outermost lock of a hart to
+/// releasing it with interrupts off all along, spinning included, the lock
+/// itself has no hook to tell a contended acquire apart
+pub static SPIN_LOCK_STAT: HartLockStat = HartLockStat::new();
+
 #[macro_export]
 macro_rules! assert_no_lock {
     () => {
@@ -68,12 +79,20 @@ impl LockAction for NoIrqLockAction {
         let cpu = current_mutex_tracer();
         if cpu.depth == 0 {
             cpu.int_record = old;
+            if LOCK_STAT {
+                cpu.section_start = Arch::get_time();
+            }
         }
         cpu.depth += 1;
     }
     fn after_lock() {
         let cpu = current_mutex_tracer();
         cpu.depth -= 1;
+        if LOCK_STAT && cpu.depth == 0 {
+            SPIN_LOCK_STAT
+                .current()
+                .record_hold(Arch::get_time() - cpu.section_start);
+        }
         let should_enable = cpu.depth == 0 && cpu.int_record;
         if should_enable {
             Arch::enable_interrupt();
@@ -0,0 +1,89 @@
+//! lock statistics
+//!
+//! the counters are kept per hart and only updated with relaxed atomics,
+//! times are in arch timer ticks, nothing is timed without the `lock_stat`
+//! feature
+
+use core::sync::atomic::{AtomicUsize, Ordering};
+
+use arch::{Arch, ArchAsm};
+use config::cpu::CPU_NUM;
+
+/// whether lock sections and waits are timed, every lock and unlock reads
+/// the timer twice then
+pub const LOCK_STAT: bool = cfg!(feature = "lock_stat");
+
+#[repr(align(64))]
+pub struct LockStat {
+    acquired: AtomicUsize,
+    contended: AtomicUsize,
+    wait_ticks: AtomicUsize,
+    hold_ticks: AtomicUsize,
+    max_hold_ticks: AtomicUsize,
+}
+
+impl LockStat {
+    pub const fn new() -> Self {
+        Self {
+            acquired: AtomicUsize::new(0),
+            contended: AtomicUsize::new(0),
+            wait_ticks: AtomicUsize::new(0),
+            hold_ticks: AtomicUsize::new(0),
+            max_hold_ticks: AtomicUsize::new(0),
+        }
+    }
+
+    /// the lock was busy and got acquired after `ticks`
+    pub fn record_wait(&self, ticks: usize) {
+        self.contended.fetch_add(1, Ordering::Relaxed);
+        self.wait_ticks.fetch_add(ticks, Ordering::Relaxed);
+    }
+
+    /// the lock got released after being held for `ticks`
+    pub fn record_hold(&self, ticks: usize) {
+        self.acquired.fetch_add(1, Ordering::Relaxed);
+        self.hold_ticks.fetch_add(ticks, Ordering::Relaxed);
+        self.max_hold_ticks.fetch_max(ticks, Ordering::Relaxed);
+    }
+}
+
+#[derive(Debug, Default, Clone, Copy)]
+pub struct LockStatSnapshot {
+    pub acquired: usize,
+    pub contended: usize,
+    pub wait_ticks: usize,
+    pub hold_ticks: usize,
+    pub max_hold_ticks: usize,
+}
+
+#[allow(clippy::declare_interior_mutable_const)]
+const LOCK_STAT_INIT: LockStat = LockStat::new();
+
+/// per hart lock statistics of one kind of lock
+pub struct HartLockStat([LockStat; CPU_NUM]);
+
+impl HartLockStat {
+    pub const fn new() -> Self {
+        Self([LOCK_STAT_INIT; CPU_NUM])
+    }
+
+    pub fn current(&self) -> &LockStat {
+        &self.0[Arch::get_hartid()]
+    }
+
+    /// sum of all harts
+    pub fn snapshot(&self) -> LockStatSnapshot {
+        self.0
+            .iter()
+            .fold(LockStatSnapshot::default(), |mut res, stat| {
+                res.acquired += stat.acquired.load(Ordering::Relaxed);
+                res.contended += stat.contended.load(Ordering::Relaxed);
+                res.wait_ticks += stat.wait_ticks.load(Ordering::Relaxed);
+                res.hold_ticks += stat.hold_ticks.load(Ordering::Relaxed);
+                res.max_hold_ticks = res
+                    .max_hold_ticks
+                    .max(stat.max_hold_ticks.load(Ordering::Relaxed));
+                res
+            })
+    }
+}
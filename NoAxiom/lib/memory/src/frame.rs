@@ -1,68 +1,90 @@
-use alloc::{
-    collections::btree_map::BTreeMap,
-    sync::{Arc, Weak},
-    vec::Vec,
+//! physical frame allocator
+//!
+//! Free frames are kept by a buddy allocator in blocks of 2^order pages.
+//! Single frames go through a per-hart magazine which is refilled from and
+//! drained to the buddy allocator in batches, so the global lock is only
+//! taken once every [`FRAME_MAGAZINE_BATCH`] frames. Every hart also keeps
+//! a pool of frames zeroed while it was idle, so [`frame_alloc`] doesn't
+//! have to clear a page on the fault path. The reference count of every
+//! frame lives in a flat table indexed by ppn.
+
+use alloc::{collections::BTreeSet, vec::Vec};
+use core::{
+    fmt::{self, Debug, Formatter},
+    sync::atomic::{fence, AtomicU32, AtomicUsize, Ordering},
 };
-use core::fmt::{self, Debug, Formatter};
 
-use ksync::mutex::SpinLock;
-use lazy_static::lazy_static;
+use arch::{Arch, ArchAsm};
+use config::{
+    cpu::CPU_NUM,
+    mm::{
+        FRAME_MAGAZINE_BATCH, FRAME_MAGAZINE_SIZE, FRAME_MAX_ORDER, FRAME_ZERO_POOL_BATCH,
+        FRAME_ZERO_POOL_SIZE,
+    },
+};
+use ksync::{mutex::SpinLock, Once};
 
 use super::address::{PhysPageNum, VirtPageNum};
 use crate::{address::PhysAddr, utils::kernel_ppn_to_vpn};
 
-/// frame tracker inner
-pub struct FrameTrackerInner {
-    ppn: PhysPageNum,
-}
-impl FrameTrackerInner {
-    #[inline]
-    fn new_uninit(ppn: PhysPageNum) -> Self {
-        Self { ppn }
-    }
-}
-impl Debug for FrameTrackerInner {
-    fn fmt(&self, f: &mut Formatter<'_>) -> fmt::Result {
-        f.write_fmt(format_args!("FrameTrackerInner:PPN={:#x}", self.ppn.0))
-    }
+const FRAME_ORDERS: usize = FRAME_MAX_ORDER + 1;
+
+/// reference counts of the allocatable frames, indexed by `ppn - start`
+struct FrameRefs {
+    start: usize,
+    refs: Vec<AtomicU32>,
 }
-impl Drop for FrameTrackerInner {
-    fn drop(&mut self) {
-        frame_dealloc(self.ppn);
-    }
+
+static FRAME_REFS: Once<FrameRefs> = Once::new();
+
+#[inline]
+fn frame_ref(ppn: PhysPageNum) -> &'static AtomicU32 {
+    let table = FRAME_REFS.get().unwrap();
+    &table.refs[ppn.0 - table.start]
 }
 
 /// frame tracker, with ref count
-#[derive(Debug)]
 pub struct FrameTracker {
-    inner: Arc<FrameTrackerInner>,
+    ppn: PhysPageNum,
 }
 impl FrameTracker {
-    fn new(inner: FrameTrackerInner) -> Self {
-        let inner = Arc::new(inner);
-        Self { inner }
+    fn new(ppn: PhysPageNum) -> Self {
+        frame_ref(ppn).store(1, Ordering::Relaxed);
+        Self { ppn }
     }
     #[inline]
     pub fn fill_zero(&self) {
-        self.inner.ppn.get_bytes_array().fill(0);
+        self.ppn.get_bytes_array().fill(0);
     }
     #[inline]
     pub fn fill_data(&self, src: &[u8]) {
-        self.inner.ppn.get_bytes_array().copy_from_slice(src);
+        self.ppn.get_bytes_array().copy_from_slice(src);
     }
     #[inline(always)]
     pub fn ppn(&self) -> PhysPageNum {
-        self.inner.ppn
+        self.ppn
     }
     #[inline(always)]
     pub fn kernel_vpn(&self) -> VirtPageNum {
-        VirtPageNum::from(kernel_ppn_to_vpn(self.inner.ppn.0))
+        VirtPageNum::from(kernel_ppn_to_vpn(self.ppn.0))
+    }
+}
+impl Debug for FrameTracker {
+    fn fmt(&self, f: &mut Formatter<'_>) -> fmt::Result {
+        f.write_fmt(format_args!("FrameTracker:PPN={:#x}", self.ppn.0))
     }
 }
 impl Clone for FrameTracker {
     fn clone(&self) -> Self {
-        Self {
-            inner: self.inner.clone(),
+        frame_ref(self.ppn).fetch_add(1, Ordering::Relaxed);
+        Self { ppn: self.ppn }
+    }
+}
+impl Drop for FrameTracker {
+    fn drop(&mut self) {
+        if frame_ref(self.ppn).fetch_sub(1, Ordering::Release) == 1 {
+            fence(Ordering::Acquire);
+            frame_dealloc(self.ppn);
         }
     }
 }
@@ -70,7 +92,7 @@ impl Clone for FrameTracker {
 pub struct FrameTrackerRaw(FrameTracker);
 impl FrameTrackerRaw {
     pub fn new(ppn: PhysPageNum) -> Self {
-        Self(FrameTracker::new(FrameTrackerInner::new_uninit(ppn)))
+        Self(FrameTracker::new(ppn))
     }
     pub fn zero_inited(self) -> FrameTracker {
         self.0.fill_zero();
@@ -85,24 +107,32 @@ impl FrameTrackerRaw {
     }
 }
 
-trait FrameAllocator {
-    fn new() -> Self;
-    fn alloc_one(&mut self) -> Option<PhysPageNum>;
-    fn dealloc_one(&mut self, ppn: PhysPageNum);
-    fn alloc_some(&mut self, size: usize) -> Option<Vec<PhysPageNum>>;
-}
-pub struct StackFrameAllocator {
+/// buddy allocator of physical frames
+pub struct BuddyFrameAllocator {
     start: usize,
-    current: usize,
     end: usize,
-    recycled: Vec<usize>,
-    frame_map: BTreeMap<usize, Weak<FrameTrackerInner>>,
+    /// start ppn of the free blocks of each order
+    free: [BTreeSet<usize>; FRAME_ORDERS],
+    /// frames in the free blocks
+    free_frames: usize,
+    peak: usize,
 }
-impl StackFrameAllocator {
+impl BuddyFrameAllocator {
+    const fn new() -> Self {
+        const EMPTY: BTreeSet<usize> = BTreeSet::new();
+        Self {
+            start: 0,
+            end: 0,
+            free: [EMPTY; FRAME_ORDERS],
+            free_frames: 0,
+            peak: 0,
+        }
+    }
+
     pub fn init(&mut self, l: PhysPageNum, r: PhysPageNum) {
         self.start = l.0;
-        self.current = l.0;
         self.end = r.0;
+        self.free_range(l.0, r.0 - l.0);
         log::info!(
             "[kernel] FRAME: init {} physical frames, range: [{:#x}, {:#x}]",
             (self.end - self.start) as isize,
@@ -110,73 +140,94 @@ impl StackFrameAllocator {
             self.end
         );
     }
-}
-impl FrameAllocator for StackFrameAllocator {
-    fn new() -> Self {
-        Self {
-            start: 0,
-            current: 0,
-            end: 0,
-            recycled: Vec::new(),
-            frame_map: BTreeMap::new(),
+
+    /// free a block of 2^order frames, merging it with its free buddies
+    fn free_block(&mut self, mut ppn: usize, mut order: usize) {
+        self.free_frames += 1 << order;
+        while order < FRAME_MAX_ORDER {
+            let buddy = ppn ^ (1 << order);
+            if !self.free[order].remove(&buddy) {
+                break;
+            }
+            ppn = ppn.min(buddy);
+            order += 1;
         }
+        self.free[order].insert(ppn);
     }
-    fn alloc_one(&mut self) -> Option<PhysPageNum> {
-        if let Some(ppn) = self.recycled.pop() {
-            // trace!("[frame] recycled use: frame ppn={:#x}", self.current);
-            Some(ppn.into())
-        } else if self.current == self.end {
-            error!("[frame] out of memory!");
-            None
-        } else {
-            // trace!("[frame] alloc frame ppn={:#x}", self.current);
-            self.current += 1;
-            Some((self.current - 1).into())
+
+    /// free `count` frames from `ppn` as the largest aligned blocks
+    fn free_range(&mut self, mut ppn: usize, count: usize) {
+        let end = ppn + count;
+        while ppn < end {
+            let mut order = (ppn.trailing_zeros() as usize).min(FRAME_MAX_ORDER);
+            while ppn + (1 << order) > end {
+                order -= 1;
+            }
+            self.free_block(ppn, order);
+            ppn += 1 << order;
         }
     }
-    /// dealloc frame
-    /// SAFETY: check if the satp is correctly switched to other before dealloc
-    /// NOTE THAT the deallocation won't clear the data in
-    /// corrisponding frame, so the processor can run on a deallocated
-    /// page, which can possibly cause pagefault after the page being
-    /// allocated again.
-    fn dealloc_one(&mut self, ppn: PhysPageNum) {
-        let ppn = ppn.0;
-        // validity check
-        // FIXME: only for debug, remove it in release
-        // if ppn >= self.current || self.recycled.iter().any(|&v| v == ppn) {
-        //     panic!("Frame ppn={:#x} has not been allocated!", ppn);
-        // }
-        // recycle
-        self.recycled.push(ppn);
-    }
-    fn alloc_some(&mut self, size: usize) -> Option<Vec<PhysPageNum>> {
-        let mut frames = Vec::with_capacity(size);
-        for _ in 0..size {
-            if let Some(ppn) = self.alloc_one() {
-                frames.push(ppn);
-            } else {
-                break;
-            }
+
+    /// allocate a block of 2^order frames, splitting a larger one if needed
+    fn alloc_block(&mut self, order: usize) -> Option<usize> {
+        let mut cur = (order..FRAME_ORDERS).find(|&o| !self.free[o].is_empty())?;
+        let ppn = self.free[cur].pop_first().unwrap();
+        while cur > order {
+            cur -= 1;
+            self.free[cur].insert(ppn + (1 << cur));
         }
-        if frames.len() != size {
-            for ppn in frames {
-                self.dealloc_one(ppn);
-            }
+        self.free_frames -= 1 << order;
+        self.update_peak();
+        Some(ppn)
+    }
+
+    /// allocate `count` physically contiguous frames, the tail of the block
+    /// beyond `count` is freed again
+    fn alloc_contiguous(&mut self, count: usize) -> Option<usize> {
+        let order = count.next_power_of_two().trailing_zeros() as usize;
+        if order > FRAME_MAX_ORDER {
+            error!(
+                "[frame] contiguous request of {} frames is too large",
+                count
+            );
             return None;
         }
-        Some(frames)
+        let ppn = self.alloc_block(order)?;
+        self.free_range(ppn + count, (1 << order) - count);
+        Some(ppn)
+    }
+
+    /// move up to a batch of frames into a magazine
+    fn refill(&mut self, frames: &mut Vec<usize>) {
+        for _ in 0..FRAME_MAGAZINE_BATCH {
+            match self.alloc_block(0) {
+                Some(ppn) => frames.push(ppn),
+                None => break,
+            }
+        }
+    }
+
+    /// give back a batch of the coldest frames of a magazine
+    fn drain(&mut self, frames: &mut Vec<usize>, count: usize) {
+        let count = count.min(frames.len());
+        for ppn in frames.drain(..count) {
+            self.free_block(ppn, 0);
+        }
+    }
+
+    fn update_peak(&mut self) {
+        self.peak = self.peak.max(self.stat_total() - self.free_frames);
     }
 }
 
-impl StackFrameAllocator {
+impl BuddyFrameAllocator {
     #[inline]
     pub fn stat_peak(&self) -> usize {
-        self.current - self.start
+        self.peak
     }
     #[inline]
     pub fn stat_allocated(&self) -> usize {
-        self.stat_peak() - self.recycled.len()
+        (self.stat_total() - self.free_frames).saturating_sub(stat_cached())
     }
     #[inline]
     pub fn stat_total(&self) -> usize {
@@ -186,6 +237,20 @@ impl StackFrameAllocator {
     pub fn stat_remain(&self) -> usize {
         self.stat_total() - self.stat_allocated()
     }
+    /// free blocks of `order`
+    #[inline]
+    pub fn stat_free_blocks(&self, order: usize) -> usize {
+        self.free[order].len()
+    }
+    /// percentage of the free frames that can't serve a contiguous request
+    /// of `order`, 0 means no fragmentation
+    pub fn stat_fragmentation(&self, order: usize) -> usize {
+        if self.free_frames == 0 {
+            return 0;
+        }
+        let usable: usize = (order..FRAME_ORDERS).map(|o| self.free[o].len() << o).sum();
+        (self.free_frames - usable) * 100 / self.free_frames
+    }
 
     pub fn can_alloc(&self, req_num: usize) -> bool {
         // self.debug();
@@ -205,10 +270,9 @@ impl StackFrameAllocator {
         let peak_ratio = peak * 100 / total;
         let remained_ratio = remained * 100 / total;
         log::debug!(
-            "[frame] current: {:#x}, end: {:#x}, recycled: {} frames",
-            self.current,
-            self.end,
-            self.recycled.len()
+            "[frame] free: {} frames, cached by magazines: {} frames",
+            self.free_frames,
+            stat_cached(),
         );
         log::debug!(
             "[frame] peak: {}, now: {}, total: {}, peak ratio: {}%, current ratio: {}%",
@@ -218,6 +282,14 @@ impl StackFrameAllocator {
             peak_ratio,
             remained_ratio
         );
+        for order in 0..FRAME_ORDERS {
+            log::debug!(
+                "[frame] order {}: {} free blocks, fragmentation: {}%",
+                order,
+                self.stat_free_blocks(order),
+                self.stat_fragmentation(order)
+            );
+        }
     }
 }
 
@@ -238,11 +310,127 @@ pub fn print_frame_info_simple() {
     }
 }
 
-type FrameAllocatorImpl = StackFrameAllocator;
+pub static FRAME_ALLOCATOR: SpinLock<BuddyFrameAllocator> =
+    SpinLock::new(BuddyFrameAllocator::new());
+
+/// per-hart cache of single free frames, lock order: magazine -> buddy
+struct Magazine {
+    frames: SpinLock<Vec<usize>>,
+    /// length of `frames`, read by the statistics without the lock
+    len: AtomicUsize,
+}
+
+impl Magazine {
+    fn update_len(&self, frames: &Vec<usize>) {
+        self.len.store(frames.len(), Ordering::Relaxed);
+    }
+}
+
+#[allow(clippy::declare_interior_mutable_const)]
+const EMPTY_MAGAZINE: Magazine = Magazine {
+    frames: SpinLock::new(Vec::new()),
+    len: AtomicUsize::new(0),
+};
+
+static MAGAZINES: [Magazine; CPU_NUM] = [EMPTY_MAGAZINE; CPU_NUM];
+
+/// per-hart frames that are already zeroed, filled by
+/// [`frame_zero_pool_refill`], never locked together with a magazine
+static ZERO_POOLS: [Magazine; CPU_NUM] = [EMPTY_MAGAZINE; CPU_NUM];
+
+fn magazine() -> &'static Magazine {
+    &MAGAZINES[Arch::get_hartid()]
+}
+
+fn zero_pool() -> &'static Magazine {
+    &ZERO_POOLS[Arch::get_hartid()]
+}
+
+/// frames cached by the magazines and zero pools of all harts
+fn stat_cached() -> usize {
+    MAGAZINES
+        .iter()
+        .chain(ZERO_POOLS.iter())
+        .map(|mag| mag.len.load(Ordering::Relaxed))
+        .sum()
+}
+
+/// pop a frame cached by any hart in `mags`
+fn steal_one(mags: &[Magazine]) -> Option<PhysPageNum> {
+    for mag in mags.iter() {
+        let mut frames = mag.frames.lock();
+        if let Some(ppn) = frames.pop() {
+            mag.update_len(&frames);
+            return Some(ppn.into());
+        }
+    }
+    None
+}
+
+fn alloc_one() -> Option<PhysPageNum> {
+    let mag = magazine();
+    let mut frames = mag.frames.lock();
+    if frames.is_empty() {
+        FRAME_ALLOCATOR.lock().refill(&mut frames);
+    }
+    let ppn = frames.pop();
+    mag.update_len(&frames);
+    drop(frames);
+    if let Some(ppn) = ppn {
+        return Some(ppn.into());
+    }
+    // the buddy allocator is empty, take the frames cached by other harts
+    let ppn = steal_one(&MAGAZINES).or_else(|| steal_one(&ZERO_POOLS));
+    if ppn.is_none() {
+        error!("[frame] out of memory!");
+    }
+    ppn
+}
 
-lazy_static! {
-    pub static ref FRAME_ALLOCATOR: SpinLock<FrameAllocatorImpl> =
-        SpinLock::new(FrameAllocatorImpl::new());
+/// zero up to a batch of frames into the pool of the current hart, called
+/// when the hart has nothing to run, returns the frames added
+pub fn frame_zero_pool_refill() -> usize {
+    let pool = zero_pool();
+    let want = FRAME_ZERO_POOL_SIZE
+        .saturating_sub(pool.len.load(Ordering::Relaxed))
+        .min(FRAME_ZERO_POOL_BATCH);
+    // the pool must not hold back frames the tasks are short of
+    if want == 0 || !can_frame_alloc_loosely(want) {
+        return 0;
+    }
+    let mut zeroed = Vec::with_capacity(want);
+    for _ in 0..want {
+        match alloc_one() {
+            Some(ppn) => {
+                ppn.get_bytes_array().fill(0);
+                zeroed.push(ppn.0);
+            }
+            None => break,
+        }
+    }
+    let count = zeroed.len();
+    let mut frames = pool.frames.lock();
+    frames.append(&mut zeroed);
+    pool.update_len(&frames);
+    count
+}
+
+/// dealloc frame
+/// SAFETY: check if the satp is correctly switched to other before dealloc
+/// NOTE THAT the deallocation won't clear the data in
+/// corrisponding frame, so the processor can run on a deallocated
+/// page, which can possibly cause pagefault after the page being
+/// allocated again.
+fn frame_dealloc(ppn: PhysPageNum) {
+    let mag = magazine();
+    let mut frames = mag.frames.lock();
+    frames.push(ppn.0);
+    if frames.len() > FRAME_MAGAZINE_SIZE {
+        FRAME_ALLOCATOR
+            .lock()
+            .drain(&mut frames, FRAME_MAGAZINE_BATCH);
+    }
+    mag.update_len(&frames);
 }
 
 pub fn can_frame_alloc(req_num: usize) -> bool {
@@ -253,73 +441,68 @@ pub fn can_frame_alloc_loosely(req_num: usize) -> bool {
     FRAME_ALLOCATOR.lock().can_alloc_loosely(req_num)
 }
 
+/// allocate a zeroed frame, from the zero pool of the current hart if it
+/// has one
 pub fn frame_alloc() -> Option<FrameTracker> {
-    let mut guard = FRAME_ALLOCATOR.lock();
-    guard.alloc_one().map(|ppn| {
-        let frame = FrameTrackerRaw::new(ppn).zero_inited();
-        guard.frame_map.insert(ppn.0, Arc::downgrade(&frame.inner));
-        frame
-    })
+    let pool = zero_pool();
+    let mut frames = pool.frames.lock();
+    let ppn = frames.pop();
+    pool.update_len(&frames);
+    drop(frames);
+    match ppn {
+        Some(ppn) => Some(FrameTracker::new(ppn.into())),
+        None => alloc_one().map(|ppn| FrameTrackerRaw::new(ppn).zero_inited()),
+    }
 }
 
+/// allocate `size` physically contiguous frames in ascending order, every
+/// frame is tracked and freed on its own
+fn frame_alloc_contiguous(size: usize) -> Option<Vec<FrameTrackerRaw>> {
+    let start = FRAME_ALLOCATOR.lock().alloc_contiguous(size)?;
+    Some(
+        (start..start + size)
+            .map(|ppn| FrameTrackerRaw::new(ppn.into()))
+            .collect(),
+    )
+}
+
+/// allocate `size` physically contiguous zeroed frames, e.g. for dma
 pub fn frame_alloc_some_zero_inited(size: usize) -> Option<Vec<FrameTracker>> {
-    let mut guard = FRAME_ALLOCATOR.lock();
-    guard.alloc_some(size).map(|ppns: Vec<PhysPageNum>| {
-        ppns.into_iter()
-            .map(|ppn| {
-                let frame = FrameTrackerRaw::new(ppn).zero_inited();
-                guard.frame_map.insert(ppn.0, Arc::downgrade(&frame.inner));
-                frame
-            })
+    frame_alloc_contiguous(size).map(|frames| {
+        frames
+            .into_iter()
+            .map(|frame| frame.zero_inited())
             .collect()
     })
 }
 
+/// allocate `size` physically contiguous frames, e.g. for huge pages
 pub fn frame_alloc_some_uninited(size: usize) -> Option<Vec<FrameTracker>> {
-    let mut guard = FRAME_ALLOCATOR.lock();
-    guard.alloc_some(size).map(|ppns: Vec<PhysPageNum>| {
-        ppns.into_iter()
-            .map(|ppn| {
-                let frame = unsafe { FrameTrackerRaw::new(ppn).keep_uninited() };
-                guard.frame_map.insert(ppn.0, Arc::downgrade(&frame.inner));
-                frame
-            })
+    frame_alloc_contiguous(size).map(|frames| {
+        frames
+            .into_iter()
+            .map(|frame| unsafe { frame.keep_uninited() })
             .collect()
     })
 }
 
-#[allow(unused)]
 pub fn frame_alloc_raw() -> FrameTrackerRaw {
-    let mut guard = FRAME_ALLOCATOR.lock();
-    let ppn = guard.alloc_one().unwrap();
-    let frame = FrameTrackerRaw::new(ppn);
-    guard
-        .frame_map
-        .insert(ppn.0, Arc::downgrade(&frame.0.inner));
-    frame
-}
-
-pub fn frame_dealloc(ppn: PhysPageNum) {
-    let mut guard = FRAME_ALLOCATOR.lock();
-    guard.dealloc_one(ppn);
-    // FIXME: only for debug, remove it in release
-    // assert!(guard.frame_map.contains_key(&ppn.0));
-    guard.frame_map.remove(&ppn.0);
+    FrameTrackerRaw::new(alloc_one().unwrap())
 }
 
 pub fn frame_refcount(ppn: PhysPageNum) -> usize {
-    FRAME_ALLOCATOR
-        .lock()
-        .frame_map
-        .get(&ppn.0)
-        .map_or(0, |x| x.strong_count())
+    frame_ref(ppn).load(Ordering::Acquire) as usize
 }
 
 /// init frame allocator
 pub fn global_frame_init(start: usize, end: usize) {
-    FRAME_ALLOCATOR
-        .lock()
-        .init(PhysAddr::from(start).ceil(), PhysAddr::from(end).floor());
+    let (l, r): (PhysPageNum, PhysPageNum) =
+        (PhysAddr::from(start).ceil(), PhysAddr::from(end).floor());
+    FRAME_REFS.call_once(|| FrameRefs {
+        start: l.0,
+        refs: (l.0..r.0).map(|_| AtomicU32::new(0)).collect(),
+    });
+    FRAME_ALLOCATOR.lock().init(l, r);
     info!("[frame_init] frame allocator init success.");
 }
 
@@ -338,5 +521,10 @@ pub fn frame_allocator_test() {
         v.push(frame);
     }
     drop(v);
+    let run = frame_alloc_some_zero_inited(5).unwrap();
+    for (i, frame) in run.iter().enumerate() {
+        assert_eq!(frame.ppn().0, run[0].ppn().0 + i);
+    }
+    drop(run);
     debug!("frame_allocator_test passed!");
 }
@@ -1,39 +1,223 @@
 //! The global heap allocator
+//!
+//! Small requests are served by per-hart free lists of power-of-two size
+//! classes, refilled from and drained to a shared depot per class in
+//! batches; the depot carves new objects from chunks of the buddy heap.
+//! Large or over-aligned requests go to the buddy heap directly. Slab
+//! chunks are never given back to the buddy heap.
 
 use core::{
     alloc::{GlobalAlloc, Layout},
-    ptr::NonNull,
+    ptr::{null_mut, NonNull},
 };
 
+use arch::{Arch, ArchAsm};
 use buddy_system_allocator::Heap;
+use config::{
+    cpu::CPU_NUM,
+    mm::{HEAP_SLAB_BATCH, HEAP_SLAB_CACHE_SIZE, HEAP_SLAB_CHUNK_SIZE, HEAP_SLAB_MAX_SIZE},
+};
 use ksync::mutex::SpinLock;
 use platform::memory::KERNEL_HEAP_SIZE;
 
 #[global_allocator]
 static HEAP_ALLOCATOR: HeapAllocator = HeapAllocator::empty();
 
-struct HeapAllocator(SpinLock<Heap<32>>);
+const SLAB_MIN_WIDTH: usize = 4;
+const SLAB_MIN_SIZE: usize = 1 << SLAB_MIN_WIDTH;
+const SLAB_CLASSES: usize = (HEAP_SLAB_MAX_SIZE / SLAB_MIN_SIZE).trailing_zeros() as usize + 1;
+
+#[inline]
+const fn slab_class_size(class: usize) -> usize {
+    SLAB_MIN_SIZE << class
+}
+
+/// the size class of `layout`, objects of a class are aligned to its size
+#[inline]
+fn slab_class(layout: &Layout) -> Option<usize> {
+    let size = layout.size().max(layout.align()).max(SLAB_MIN_SIZE);
+    match size <= HEAP_SLAB_MAX_SIZE {
+        true => Some(size.next_power_of_two().trailing_zeros() as usize - SLAB_MIN_WIDTH),
+        false => None,
+    }
+}
+
+/// free objects linked through their first word
+#[derive(Clone, Copy)]
+struct FreeList {
+    head: usize,
+    len: usize,
+}
+
+impl FreeList {
+    const fn new() -> Self {
+        Self { head: 0, len: 0 }
+    }
+    unsafe fn push(&mut self, ptr: usize) {
+        *(ptr as *mut usize) = self.head;
+        self.head = ptr;
+        self.len += 1;
+    }
+    unsafe fn pop(&mut self) -> Option<usize> {
+        if self.head == 0 {
+            return None;
+        }
+        let ptr = self.head;
+        self.head = *(ptr as *const usize);
+        self.len -= 1;
+        Some(ptr)
+    }
+    /// move up to `count` objects to `other`
+    unsafe fn move_to(&mut self, other: &mut FreeList, count: usize) {
+        for _ in 0..count {
+            match self.pop() {
+                Some(ptr) => other.push(ptr),
+                None => break,
+            }
+        }
+    }
+}
+
+/// usage of one size class
+#[derive(Clone, Copy)]
+struct SlabStat {
+    allocs: usize,
+    frees: usize,
+    /// bytes of the chunks carved for the class
+    slab_bytes: usize,
+}
+
+/// free objects and statistics of one hart, lock order: hart -> depot -> buddy
+struct SlabCache {
+    lists: [FreeList; SLAB_CLASSES],
+    stats: [SlabStat; SLAB_CLASSES],
+}
+
+impl SlabCache {
+    const fn new() -> Self {
+        const STAT: SlabStat = SlabStat {
+            allocs: 0,
+            frees: 0,
+            slab_bytes: 0,
+        };
+        Self {
+            lists: [FreeList::new(); SLAB_CLASSES],
+            stats: [STAT; SLAB_CLASSES],
+        }
+    }
+}
+
+struct HeapAllocator {
+    buddy: SpinLock<Heap<32>>,
+    caches: [SpinLock<SlabCache>; CPU_NUM],
+    depots: [SpinLock<FreeList>; SLAB_CLASSES],
+}
 
 impl HeapAllocator {
     const fn empty() -> Self {
-        Self(SpinLock::new(Heap::empty()))
+        const CACHE: SpinLock<SlabCache> = SpinLock::new(SlabCache::new());
+        const DEPOT: SpinLock<FreeList> = SpinLock::new(FreeList::new());
+        Self {
+            buddy: SpinLock::new(Heap::empty()),
+            caches: [CACHE; CPU_NUM],
+            depots: [DEPOT; SLAB_CLASSES],
+        }
     }
-}
-unsafe impl GlobalAlloc for HeapAllocator {
-    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
-        self.0
+
+    unsafe fn buddy_alloc(&self, layout: Layout) -> *mut u8 {
+        self.buddy
             .lock()
             .alloc(layout)
             .ok()
-            .map_or(0 as *mut u8, |allocation| allocation.as_ptr())
+            .map_or(null_mut(), |allocation| allocation.as_ptr())
+    }
+
+    /// refill an empty hart list from the depot, or from a new chunk
+    unsafe fn refill(&self, class: usize, cache: &mut SlabCache) {
+        let list = &mut cache.lists[class];
+        self.depots[class].lock().move_to(list, HEAP_SLAB_BATCH);
+        if list.len != 0 {
+            return;
+        }
+        let size = slab_class_size(class);
+        let layout = Layout::from_size_align_unchecked(HEAP_SLAB_CHUNK_SIZE, size);
+        let chunk = self.buddy_alloc(layout) as usize;
+        if chunk == 0 {
+            return;
+        }
+        for ptr in (chunk..chunk + HEAP_SLAB_CHUNK_SIZE).step_by(size).rev() {
+            list.push(ptr);
+        }
+        cache.stats[class].slab_bytes += HEAP_SLAB_CHUNK_SIZE;
+    }
+}
+
+unsafe impl GlobalAlloc for HeapAllocator {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        let Some(class) = slab_class(&layout) else {
+            return self.buddy_alloc(layout);
+        };
+        let mut cache = self.caches[Arch::get_hartid()].lock();
+        if cache.lists[class].len == 0 {
+            self.refill(class, &mut cache);
+        }
+        match cache.lists[class].pop() {
+            Some(ptr) => {
+                cache.stats[class].allocs += 1;
+                ptr as *mut u8
+            }
+            None => null_mut(),
+        }
     }
     unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
-        self.0.lock().dealloc(NonNull::new_unchecked(ptr), layout)
+        let Some(class) = slab_class(&layout) else {
+            return self
+                .buddy
+                .lock()
+                .dealloc(NonNull::new_unchecked(ptr), layout);
+        };
+        let mut cache = self.caches[Arch::get_hartid()].lock();
+        let cache = &mut *cache;
+        cache.lists[class].push(ptr as usize);
+        cache.stats[class].frees += 1;
+        if cache.lists[class].len > HEAP_SLAB_CACHE_SIZE {
+            let mut depot = self.depots[class].lock();
+            cache.lists[class].move_to(&mut depot, HEAP_SLAB_BATCH);
+        }
+    }
+}
+
+/// print the objects in use, cached and carved of every size class
+fn print_slab_info() {
+    let mut stats = [(0isize, 0usize, 0usize); SLAB_CLASSES];
+    for cache in HEAP_ALLOCATOR.caches.iter() {
+        let Some(cache) = cache.try_lock() else {
+            log::debug!("[heap] slab cache is already locked");
+            return;
+        };
+        for (class, stat) in stats.iter_mut().enumerate() {
+            let slab = &cache.stats[class];
+            stat.0 += slab.allocs as isize - slab.frees as isize;
+            stat.1 += cache.lists[class].len;
+            stat.2 += slab.slab_bytes;
+        }
+    }
+    for (class, (in_use, cached, slab_bytes)) in stats.iter().enumerate() {
+        let depot = HEAP_ALLOCATOR.depots[class]
+            .try_lock()
+            .map_or(0, |depot| depot.len);
+        log::debug!(
+            "[heap] slab {}B: in use: {}, cached: {}, slab: {}KB",
+            slab_class_size(class),
+            in_use,
+            cached + depot,
+            slab_bytes / 1024,
+        );
     }
 }
 
 pub fn print_heap_info() {
-    if let Some(heap) = HEAP_ALLOCATOR.0.try_lock() {
+    if let Some(heap) = HEAP_ALLOCATOR.buddy.try_lock() {
         let user = heap.stats_alloc_user();
         let actual = heap.stats_alloc_actual();
         let total = heap.stats_total_bytes();
@@ -48,10 +232,11 @@ pub fn print_heap_info() {
     } else {
         log::debug!("[heap] HEAP_ALLOCATOR is already locked");
     }
+    print_slab_info();
 }
 
 pub fn print_heap_info_simple() {
-    if let Some(heap) = HEAP_ALLOCATOR.0.try_lock() {
+    if let Some(heap) = HEAP_ALLOCATOR.buddy.try_lock() {
         let user = heap.stats_alloc_user();
         let actual = heap.stats_alloc_actual();
         let total = heap.stats_total_bytes();
@@ -78,7 +263,7 @@ static mut HEAP_SPACE: [u8; KERNEL_HEAP_SIZE] = [0; KERNEL_HEAP_SIZE];
 pub fn heap_init() {
     unsafe {
         HEAP_ALLOCATOR
-            .0
+            .buddy
             .lock()
             .init(HEAP_SPACE.as_ptr() as usize, KERNEL_HEAP_SIZE);
     }
@@ -0,0 +1,480 @@
+/*
+ * NoAxiom microbenchmarks
+ *
+ * built as the `run_bench` init process by `make bench`, every result goes
+ * to the console as one JSON object per line:
+ *
+ *   {"bench":"null_syscall","value":412.000,"unit":"ns/op"}
+ *   {"bench":"tcp_loopback","error":"connect: Connection refused"}
+ *
+ * the Makefile collects the lines starting with {"bench" into
+ * log/bench-<arch>.json, see compare.py for diffing two runs
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* the init process is written here by the kernel */
+#define SELF_PATH "/run_bench"
+#define FILE_PATH "/bench.dat"
+
+#define MB (1024.0 * 1024.0)
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static double elapsed_s(uint64_t start)
+{
+    return (double)(now_ns() - start) / 1e9;
+}
+
+static void report(const char *bench, double value, const char *unit)
+{
+    printf("{\"bench\":\"%s\",\"value\":%.3f,\"unit\":\"%s\"}\n", bench, value, unit);
+    fflush(stdout);
+}
+
+static void report_error(const char *bench, const char *what)
+{
+    printf("{\"bench\":\"%s\",\"error\":\"%s: %s\"}\n", bench, what, strerror(errno));
+    fflush(stdout);
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void bench_null_syscall(void)
+{
+    const long iters = 200000;
+    uint64_t start = now_ns();
+    for (long i = 0; i < iters; i++)
+        syscall(SYS_getppid);
+    report("null_syscall", (double)(now_ns() - start) / iters, "ns/op");
+}
+
+static void bench_fork_exec_wait(void)
+{
+    const long iters = 100;
+    uint64_t start = now_ns();
+    for (long i = 0; i < iters; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            report_error("fork_exec_wait", "fork");
+            return;
+        }
+        if (pid == 0) {
+            execl(SELF_PATH, SELF_PATH, "--exit", (char *)NULL);
+            _exit(127);
+        }
+        int status;
+        if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            report_error("fork_exec_wait", "child");
+            return;
+        }
+    }
+    report("fork_exec_wait", (double)(now_ns() - start) / iters / 1000.0, "us/op");
+}
+
+static void bench_pipe_latency(void)
+{
+    const long iters = 20000;
+    int ping[2], pong[2];
+    if (pipe(ping) < 0 || pipe(pong) < 0) {
+        report_error("pipe_latency", "pipe");
+        return;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        report_error("pipe_latency", "fork");
+        return;
+    }
+    if (pid == 0) {
+        char c;
+        close(ping[1]);
+        close(pong[0]);
+        while (read(ping[0], &c, 1) == 1)
+            write(pong[1], &c, 1);
+        _exit(0);
+    }
+    close(ping[0]);
+    close(pong[1]);
+    char c = 'x';
+    uint64_t start = now_ns();
+    for (long i = 0; i < iters; i++) {
+        if (write(ping[1], &c, 1) != 1 || read(pong[0], &c, 1) != 1) {
+            report_error("pipe_latency", "round trip");
+            break;
+        }
+    }
+    double ns = (double)(now_ns() - start) / iters;
+    close(ping[1]);
+    close(pong[0]);
+    waitpid(pid, NULL, 0);
+    report("pipe_latency", ns, "ns/roundtrip");
+}
+
+static void bench_pipe_bandwidth(void)
+{
+    const size_t total = 64 << 20, chunk = 64 << 10;
+    int fds[2];
+    if (pipe(fds) < 0) {
+        report_error("pipe_bandwidth", "pipe");
+        return;
+    }
+    char *buf = malloc(chunk);
+    memset(buf, 'p', chunk);
+    uint64_t start = now_ns();
+    pid_t pid = fork();
+    if (pid < 0) {
+        report_error("pipe_bandwidth", "fork");
+        free(buf);
+        return;
+    }
+    if (pid == 0) {
+        close(fds[1]);
+        while (read(fds[0], buf, chunk) > 0)
+            ;
+        _exit(0);
+    }
+    close(fds[0]);
+    for (size_t done = 0; done < total; done += chunk) {
+        if (write_all(fds[1], buf, chunk) < 0) {
+            report_error("pipe_bandwidth", "write");
+            break;
+        }
+    }
+    close(fds[1]);
+    waitpid(pid, NULL, 0);
+    report("pipe_bandwidth", total / MB / elapsed_s(start), "MB/s");
+    free(buf);
+}
+
+static atomic_int futex_word;
+
+static void futex_wait(atomic_int *addr, int val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(atomic_int *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/* answers every ping: waits for 1, then sets 0 */
+static void *futex_partner(void *arg)
+{
+    long iters = (long)arg;
+    for (long i = 0; i < iters; i++) {
+        while (atomic_load(&futex_word) != 1)
+            futex_wait(&futex_word, 0);
+        atomic_store(&futex_word, 0);
+        futex_wake(&futex_word);
+    }
+    return NULL;
+}
+
+static void bench_futex_pingpong(void)
+{
+    const long iters = 20000;
+    pthread_t partner;
+    atomic_store(&futex_word, 0);
+    if (pthread_create(&partner, NULL, futex_partner, (void *)iters) != 0) {
+        report_error("futex_pingpong", "pthread_create");
+        return;
+    }
+    uint64_t start = now_ns();
+    for (long i = 0; i < iters; i++) {
+        atomic_store(&futex_word, 1);
+        futex_wake(&futex_word);
+        while (atomic_load(&futex_word) != 0)
+            futex_wait(&futex_word, 1);
+    }
+    double ns = (double)(now_ns() - start) / iters;
+    pthread_join(partner, NULL);
+    report("futex_pingpong", ns, "ns/roundtrip");
+}
+
+static void bench_file(void)
+{
+    const size_t total = 16 << 20, chunk = 64 << 10, block = 4096;
+    const long rand_ops = 4096;
+    char *buf = malloc(chunk);
+    memset(buf, 'f', chunk);
+
+    int fd = open(FILE_PATH, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        report_error("file_write", "open");
+        free(buf);
+        return;
+    }
+    uint64_t start = now_ns();
+    for (size_t done = 0; done < total; done += chunk) {
+        if (write_all(fd, buf, chunk) < 0) {
+            report_error("file_write", "write");
+            goto out;
+        }
+    }
+    fsync(fd);
+    report("file_write", total / MB / elapsed_s(start), "MB/s");
+
+    start = now_ns();
+    for (size_t done = 0; done < total; done += chunk) {
+        if (pread(fd, buf, chunk, done) != (ssize_t)chunk) {
+            report_error("file_seq_read", "pread");
+            goto out;
+        }
+    }
+    report("file_seq_read", total / MB / elapsed_s(start), "MB/s");
+
+    uint64_t seed = 0x2545f4914f6cdd1dull;
+    start = now_ns();
+    for (long i = 0; i < rand_ops; i++) {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        off_t off = (off_t)((seed >> 33) % (total / block)) * block;
+        if (pread(fd, buf, block, off) != (ssize_t)block) {
+            report_error("file_rand_read", "pread");
+            goto out;
+        }
+    }
+    report("file_rand_read", rand_ops / elapsed_s(start), "ops/s");
+
+out:
+    close(fd);
+    unlink(FILE_PATH);
+    free(buf);
+}
+
+static void bench_mmap_fault(void)
+{
+    const size_t len = 32 << 20;
+    long page = sysconf(_SC_PAGESIZE);
+    uint64_t start = now_ns();
+    char *mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        report_error("mmap_fault", "mmap");
+        return;
+    }
+    for (size_t off = 0; off < len; off += page)
+        mem[off] = 1;
+    double s = elapsed_s(start);
+    munmap(mem, len);
+    report("mmap_fault", (double)(len / page) / s, "faults/s");
+}
+
+/*
+ * a private read-only file mapping made writable by mprotect has to copy the
+ * page cache page on the first write, the file must read back unchanged
+ */
+static void bench_mprotect_cow(void)
+{
+    const size_t len = 1 << 20;
+    long page = sysconf(_SC_PAGESIZE);
+    char *buf = malloc(len);
+    memset(buf, 'c', len);
+
+    int fd = open(FILE_PATH, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        report_error("mprotect_cow", "open");
+        free(buf);
+        return;
+    }
+    if (write_all(fd, buf, len) < 0) {
+        report_error("mprotect_cow", "write");
+        goto out;
+    }
+    char *mem = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mem == MAP_FAILED) {
+        report_error("mprotect_cow", "mmap");
+        goto out;
+    }
+    volatile char sum = 0;
+    for (size_t off = 0; off < len; off += page)
+        sum += mem[off];
+    uint64_t start = now_ns();
+    if (mprotect(mem, len, PROT_READ | PROT_WRITE) < 0) {
+        report_error("mprotect_cow", "mprotect");
+        munmap(mem, len);
+        goto out;
+    }
+    for (size_t off = 0; off < len; off += page)
+        mem[off] = 'm';
+    double s = elapsed_s(start);
+    int lost = mem[len - page] != 'm';
+    munmap(mem, len);
+    if (lost) {
+        errno = EFAULT;
+        report_error("mprotect_cow", "write to the mapping lost");
+        goto out;
+    }
+
+    if (pread(fd, buf, len, 0) != (ssize_t)len) {
+        report_error("mprotect_cow", "pread");
+        goto out;
+    }
+    for (size_t off = 0; off < len; off++) {
+        if (buf[off] != 'c') {
+            errno = EFAULT;
+            report_error("mprotect_cow", "private write reached the file");
+            goto out;
+        }
+    }
+    report("mprotect_cow", s * 1e9 / (double)(len / page), "ns/page");
+
+out:
+    close(fd);
+    unlink(FILE_PATH);
+    free(buf);
+}
+
+static void bench_tcp_loopback(void)
+{
+    const size_t total = 16 << 20, chunk = 16 << 10;
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(5601),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lfd, 1) < 0) {
+        report_error("tcp_loopback", "listen");
+        if (lfd >= 0)
+            close(lfd);
+        return;
+    }
+    char *buf = malloc(chunk);
+    memset(buf, 't', chunk);
+    uint64_t start = now_ns();
+    pid_t pid = fork();
+    if (pid < 0) {
+        report_error("tcp_loopback", "fork");
+        goto out;
+    }
+    if (pid == 0) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+            _exit(1);
+        for (size_t done = 0; done < total; done += chunk)
+            if (write_all(fd, buf, chunk) < 0)
+                _exit(1);
+        close(fd);
+        _exit(0);
+    }
+    struct pollfd pfd = { .fd = lfd, .events = POLLIN };
+    if (poll(&pfd, 1, 5000) <= 0) {
+        errno = ETIMEDOUT;
+        report_error("tcp_loopback", "accept");
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        goto out;
+    }
+    int cfd = accept(lfd, NULL, NULL);
+    size_t received = 0;
+    ssize_t n;
+    while (cfd >= 0 && (n = read(cfd, buf, chunk)) > 0)
+        received += n;
+    double s = elapsed_s(start);
+    if (cfd >= 0)
+        close(cfd);
+    waitpid(pid, NULL, 0);
+    if (received != total) {
+        errno = EIO;
+        report_error("tcp_loopback", "short read");
+    } else {
+        report("tcp_loopback", total / MB / s, "MB/s");
+    }
+out:
+    close(lfd);
+    free(buf);
+}
+
+static void bench_udp_loopback(void)
+{
+    const long iters = 20000;
+    const size_t len = 1024;
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(5602),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    int rfd = socket(AF_INET, SOCK_DGRAM, 0);
+    int sfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (rfd < 0 || sfd < 0 || bind(rfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        report_error("udp_loopback", "socket");
+        goto out;
+    }
+    char buf[1024];
+    memset(buf, 'u', len);
+    long dropped = 0;
+    uint64_t start = now_ns();
+    for (long i = 0; i < iters; i++) {
+        if (sendto(sfd, buf, len, 0, (struct sockaddr *)&addr, sizeof(addr)) != (ssize_t)len) {
+            report_error("udp_loopback", "sendto");
+            goto out;
+        }
+        struct pollfd pfd = { .fd = rfd, .events = POLLIN };
+        if (poll(&pfd, 1, 1000) <= 0 || recv(rfd, buf, len, 0) != (ssize_t)len)
+            dropped++;
+    }
+    report("udp_loopback", (iters - dropped) * len / MB / elapsed_s(start), "MB/s");
+    if (dropped)
+        report("udp_loopback_dropped", dropped, "packets");
+out:
+    if (rfd >= 0)
+        close(rfd);
+    if (sfd >= 0)
+        close(sfd);
+}
+
+int main(int argc, char **argv)
+{
+    /* the exec target of fork_exec_wait */
+    if (argc > 1 && strcmp(argv[1], "--exit") == 0)
+        return 0;
+
+    bench_null_syscall();
+    bench_fork_exec_wait();
+    bench_pipe_latency();
+    bench_pipe_bandwidth();
+    bench_futex_pingpong();
+    bench_file();
+    bench_mmap_fault();
+    bench_mprotect_cow();
+    bench_tcp_loopback();
+    bench_udp_loopback();
+    return 0;
+}
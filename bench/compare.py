@@ -0,0 +1,60 @@
+#!/usr/bin/env python3
+"""compare two benchmark results from `make bench`
+
+usage: compare.py <baseline.json> <result.json> [threshold]
+
+both files hold one JSON object per line, a benchmark regresses when it
+gets worse than the baseline by more than `threshold` (default 0.1), times
+are better when lower and everything else when higher, exits 1 if any
+benchmark regressed, failed or disappeared
+"""
+
+import json
+import sys
+
+
+def load(path):
+    results = {}
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if line:
+                entry = json.loads(line)
+                results[entry["bench"]] = entry
+    return results
+
+
+def lower_is_better(unit):
+    return unit.split("/")[0] in ("ns", "us", "ms", "s", "packets")
+
+
+def main():
+    if len(sys.argv) < 3:
+        print(__doc__.strip())
+        return 2
+    baseline, result = load(sys.argv[1]), load(sys.argv[2])
+    threshold = float(sys.argv[3]) if len(sys.argv) > 3 else 0.1
+    failed = False
+    for name, base in baseline.items():
+        cur = result.get(name)
+        if cur is None or "error" in cur:
+            reason = cur["error"] if cur else "missing"
+            print(f"{name:<24} FAIL {reason}")
+            failed = True
+            continue
+        if "error" in base or base["value"] == 0:
+            print(f"{name:<24} {cur['value']:>14.3f} {cur['unit']} (no baseline)")
+            continue
+        change = (cur["value"] - base["value"]) / base["value"]
+        worse = change > threshold if lower_is_better(cur["unit"]) else change < -threshold
+        mark = "REGRESSED" if worse else "ok"
+        print(f"{name:<24} {base['value']:>14.3f} -> {cur['value']:>14.3f} "
+              f"{cur['unit']:<14} {change:+7.1%} {mark}")
+        failed |= worse
+    for name in result.keys() - baseline.keys():
+        print(f"{name:<24} {result[name].get('value', 0):>14.3f} (new)")
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())